@@ -0,0 +1,168 @@
+/*
+ * Timings of the interpreter and shell hot paths; hosted only. Each
+ * workload runs until it has taken BENCH_MIN_NS, doubling its rounds,
+ * and reports ns and heap allocations per operation. Allocations are
+ * counted by linking with -Wl,--wrap=malloc, as make bench does.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include "shell.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_MIN_NS    200000000ULL
+#define BENCH_LOOP      1000            /* Iterations per script run */
+#define BENCH_LINE      1024
+
+typedef void (*bench_func)(void);
+
+static uint64_t bench_allocs;
+static script_context_t *bench_ctx;
+static const char *bench_text;
+
+void* __real_malloc(size_t size);
+
+void* __wrap_malloc(size_t size) {
+    bench_allocs++;
+    return __real_malloc(size);
+}
+
+static uint64_t bench_clock(void) {
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* Time func, which does ops operations a call, and print the result */
+static void bench_run(const char *name, bench_func func, uint32_t ops) {
+    uint64_t rounds = 1, start, spent, allocs;
+    uint64_t i;
+    
+    func();
+    for (;;) {
+        allocs = bench_allocs;
+        start = bench_clock();
+        for (i = 0; i < rounds; i++) {
+            func();
+        }
+        spent = bench_clock() - start;
+        allocs = bench_allocs - allocs;
+        if (spent >= BENCH_MIN_NS) {
+            break;
+        }
+        rounds *= 2;
+    }
+    
+    printf("%-32s %12.1f ns/op %10.2f allocs/op\n", name,
+           (double)spent / (double)(rounds * ops),
+           (double)allocs / (double)(rounds * ops));
+}
+
+/* script_execute(): a while loop, and a loop of function calls */
+static void bench_script(void) {
+    script_execute(bench_ctx, bench_text);
+}
+
+/* script_set_var() and script_get_var() among other variables */
+static void bench_set_var(void) {
+    int32_t value = 7;
+    
+    script_set_var(bench_ctx, "probe", VAR_TYPE_INT, &value);
+}
+
+static void bench_get_var(void) {
+    var_type_t type;
+    int32_t value;
+    
+    script_get_var(bench_ctx, "probe", &type, &value, sizeof(value));
+}
+
+static void bench_glob(void) {
+    expr_match_glob(bench_text, "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa");
+}
+
+/* shell_parse_line() and shell_expand() on a long quoted line */
+static void bench_parse(void) {
+    char line[BENCH_LINE];
+    char *argv[SHELL_MAX_ARGS];
+    
+    strcpy(line, bench_text);
+    shell_parse_line(line, argv, SHELL_MAX_ARGS);
+}
+
+static void bench_expand(void) {
+    char out[BENCH_LINE];
+    
+    shell_expand(bench_text, out, sizeof(out));
+}
+
+/* shell_execute() on a command that does nothing */
+static int cmd_nop(int argc, char **argv) {
+    return SHELL_OK;
+}
+
+static void bench_execute(void) {
+    shell_execute("nop one two three");
+}
+
+static void bench_vars_at(int count) {
+    char name[32];
+    int32_t i;
+    
+    bench_ctx = script_create_context();
+    for (i = 0; i < count; i++) {
+        snprintf(name, sizeof(name), "v%d", i);
+        script_set_var(bench_ctx, name, VAR_TYPE_INT, &i);
+    }
+    
+    snprintf(name, sizeof(name), "set_var (%d vars)", count);
+    bench_run(name, bench_set_var, 1);
+    snprintf(name, sizeof(name), "get_var (%d vars)", count);
+    bench_run(name, bench_get_var, 1);
+    script_destroy_context(bench_ctx);
+}
+
+int main(void) {
+    static char loop[128], calls[128];
+    
+    bench_ctx = script_create_context();
+    snprintf(loop, sizeof(loop),
+             "i = 0\nwhile $i < %d\ni = $i + 1\nend\nreturn 0", BENCH_LOOP);
+    bench_text = loop;
+    bench_run("script_execute loop (per iter)", bench_script, BENCH_LOOP);
+    
+    script_define_func(bench_ctx, "inc", "return $arg0 + 1", 1);
+    snprintf(calls, sizeof(calls),
+             "i = 0\nwhile $i < %d\ni = inc($i)\nend\nreturn 0", BENCH_LOOP);
+    bench_text = calls;
+    bench_run("script_execute calls (per call)", bench_script, BENCH_LOOP);
+    script_destroy_context(bench_ctx);
+    
+    bench_vars_at(10);
+    bench_vars_at(100);
+    bench_vars_at(1000);
+    
+    /* Stars that each could take any run of a, then a b that never comes */
+    bench_text = "a*a*a*a*a*a*a*a*b";
+    bench_run("expr_match_glob a*...*b", bench_glob, 1);
+    bench_text = "*?*?*?*?*?*?*?*?*b";
+    bench_run("expr_match_glob *?*...*b", bench_glob, 1);
+    
+    shell_init();
+    shell_setenv("HOME", "/home/user");
+    shell_setenv("NAME", "bench");
+    bench_text = "echo \"a long quoted argument with spaces in it\" 'and another "
+                 "one in single quotes' plain words \"$HOME/dir with space\" "
+                 "'x' \"y\" z \"one more quoted argument to finish the line\"";
+    bench_run("shell_parse_line long quoted", bench_parse, 1);
+    bench_text = "$HOME/$NAME \"$HOME and $NAME\" ${NAME}s $HOME/$NAME/$NAME "
+                 "text between the variables $UNSET $HOME $NAME $HOME $NAME";
+    bench_run("shell_expand long line", bench_expand, 1);
+    
+    shell_register_command("nop", "Do nothing", cmd_nop);
+    bench_run("shell_execute dispatch", bench_execute, 1);
+    
+    return 0;
+}
@@ -15,13 +15,30 @@ typedef int32_t     status;
 #define SYSERR      -1
 #endif
 
+/*
+ * Storage private to each thread, for caches that would otherwise need
+ * locks. Xinu has no threads beyond its processes, so it gets plain
+ * statics there.
+ */
+#if defined(XINU_KERNEL)
+#define SCRIPT_THREAD_LOCAL
+#elif defined(_MSC_VER)
+#define SCRIPT_THREAD_LOCAL __declspec(thread)
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define SCRIPT_THREAD_LOCAL _Thread_local
+#else
+#define SCRIPT_THREAD_LOCAL __thread
+#endif
 
-#define SHELL_MAX_LINE      256 
+
+#define SHELL_MAX_LINE      256     /* Typed at the prompt; lines run may be longer */
 #define SHELL_MAX_ARGS      32 
 #define SHELL_MAX_CMD       64
 #define SHELL_MAX_PATH      256 
-#define SHELL_HISTORY_SIZE  50 
-#define SHELL_MAX_ALIAS     32
+#define SHELL_HISTORY_SIZE  64      /* Entries the history starts with room for */
+#ifndef SHELL_HISTORY_FILE
+#define SHELL_HISTORY_FILE  ".xsh_history"  /* Log shell_run() keeps; "" for none */
+#endif
 
 
 #define SHELL_PROMPT        "xinu$ "
@@ -52,27 +69,12 @@ typedef struct shell_alias {
 } shell_alias_t;
 
 
-typedef struct history_entry {
-    char        command[SHELL_MAX_LINE];
-    int32_t     number;
-    uint32_t    timestamp;
-} history_entry_t;
-
-
 typedef struct shell_state {
     char            cwd[SHELL_MAX_PATH];
     int32_t         last_exit;
     pid32           pid;                    
     bool            interactive;            
     bool            running;                
-    /* History */
-    history_entry_t history[SHELL_HISTORY_SIZE];
-    int32_t         history_count;
-    int32_t         history_index;
-    
-    /* Aliases */
-    shell_alias_t   aliases[SHELL_MAX_ALIAS];
-    int32_t         alias_count;
     
     /* Environment */
     char            **env;
@@ -84,9 +86,49 @@ typedef struct shell_state {
 #define SCRIPT_MAX_FUNCS    64
 #define SCRIPT_MAX_STACK    256
 #define SCRIPT_VAR_NAME_LEN 64
-#define SCRIPT_VAR_VAL_LEN  256
+#define SCRIPT_VAR_VAL_LEN  256     /* A usual string buffer for script_get_var() */
 #define SCRIPT_MAX_LINE     512
 #define SCRIPT_MAX_LABELS   64
+#define SCRIPT_EXPR_STACK   32
+#define SCRIPT_MAX_NEST     32
+#define SCRIPT_MAX_LOCALS   32      /* Parameters and locals per call */
+#define SCRIPT_FILE_CHUNK   512
+
+/* Compiled file cache; bump the version whenever the bytecode changes */
+#define SCRIPT_CODE_VERSION 5
+#define SCRIPT_CACHE_SIZE   16
+#define SCRIPT_CACHE_SUFFIX ".sc"
+#define SCRIPT_CACHE_MEMORY 0x01    /* Reuse compiled files across calls */
+#define SCRIPT_CACHE_DISK   0x02    /* Persist them next to the script */
+
+/* Hash index sizes; powers of two, twice the table capacity */
+#define SCRIPT_VAR_BUCKETS  256
+#define SCRIPT_FUNC_BUCKETS 128
+#define SCRIPT_LABEL_BUCKETS 128
+
+/* Strings shorter than this are stored inside the variable */
+#define SCRIPT_STR_INLINE   16
+
+/* Elements in one array or map */
+#define SCRIPT_ARRAY_MAX    (1 << 20)
+
+/* Compiled globs: characters matched outside stars, and patterns cached */
+#define SCRIPT_GLOB_MAX     64
+#define SCRIPT_GLOB_CACHE   8
+
+/* Regex limits: NFA states, lazily built DFA states, patterns cached */
+#define SCRIPT_REGEX_STATES 256
+#define SCRIPT_REGEX_DFA    64
+#define SCRIPT_REGEX_CACHE  8
+
+/* Worker pool: threads per pool, and jobs queued at once (a power of two) */
+#define SCRIPT_POOL_MAX     64
+#define SCRIPT_POOL_QUEUE   1024
+
+/* Context arena: chunk size and power-of-two size classes from 16 bytes */
+#define SCRIPT_ARENA_CHUNK  4096
+#define SCRIPT_ARENA_MIN    16
+#define SCRIPT_ARENA_CLASSES 26
 
 typedef enum {
     VAR_TYPE_INT,
@@ -96,32 +138,206 @@ typedef enum {
     VAR_TYPE_UNDEFINED
 } var_type_t;
 
+typedef struct script_array script_array_t;
+
+/* String value; cap is 0 while the text is inline */
+typedef struct script_str {
+    uint32_t    len;
+    uint32_t    cap;
+    union {
+        char    buf[SCRIPT_STR_INLINE];
+        char    *ptr;
+    } data;
+} script_str_t;
+
 typedef struct script_var {
     char        name[SCRIPT_VAR_NAME_LEN];
+    uint32_t    hash;
     var_type_t  type;
     union {
         int32_t     int_val;
         double      float_val;
-        char        str_val[SCRIPT_VAR_VAL_LEN];
-        void        *array_val;
+        script_str_t str_val;
+        script_array_t *array_val;
     } value;
     bool        readonly;
-    bool        exported;
     bool        defined;
 } script_var_t;
 
+/* Typed expression value; strings are borrowed unless owned is set */
+typedef struct script_value {
+    uint8_t     type;           /* var_type_t */
+    bool        owned;
+    uint32_t    len;            /* String length */
+    uint32_t    cap;            /* Bytes owned */
+    union {
+        int32_t     int_val;
+        double      float_val;
+        const char  *str_val;
+        script_array_t *array_val;
+    } v;
+} script_value_t;
+
+/*
+ * Growable list, or map with keys kept in insertion order. Elements are
+ * owned by the array, which is owned by the variable or value holding it.
+ */
+struct script_array {
+    bool        map;
+    int32_t     count;
+    int32_t     cap;
+    script_value_t *items;      /* Elements, or map values */
+    script_value_t *keys;       /* Map: string keys, parallel to items */
+    uint32_t    *hashes;        /* Map: hash of each key */
+    int32_t     *index;         /* Map: 2 * cap buckets of item numbers */
+};
+
+
+/* Bytecode opcodes produced by script_compile() */
+typedef enum {
+    OP_NOP,
+    OP_SET_INT,         /* a: var name, imm: folded value */
+    OP_SET_EXPR,        /* a: var name, expr: value */
+    OP_SET_STR,         /* a: var name, b: string value */
+    OP_SET_LOCAL,       /* target: frame slot, expr, b: string, else imm */
+    OP_SET_INDEX,       /* a: var name or -1 for target's slot, expr: key,
+                           b: first op of the value */
+    OP_IF,              /* expr: condition, target: pc if false */
+    OP_WHILE,           /* expr: condition, target: pc past the loop */
+    OP_JUMP,            /* target: pc */
+    OP_BREAK,           /* Outside any loop; defers to script_break() */
+    OP_CONTINUE,        /* Outside any loop; defers to script_continue() */
+    OP_RETURN,          /* expr: value, or imm if expr < 0 */
+    OP_GOTO,            /* a: label name, target: resolved pc */
+    OP_EVAL             /* expr: expression */
+} script_op_t;
+
+/* Expression opcodes; operands are taken from the evaluation stack */
+typedef enum {
+    EOP_END,
+    EOP_PUSH,           /* imm: constant */
+    EOP_PUSHF,          /* imm, name: low and high bits of a double */
+    EOP_PUSHS,          /* name: pool offset of a string, imm: length */
+    EOP_LOAD,           /* name: var, ref: cached slot */
+    EOP_LOCAL,          /* imm: frame slot */
+    EOP_LIST,           /* Push an empty list */
+    EOP_MAP,            /* Push an empty map */
+    EOP_APPEND,         /* Pop a value and append it to the list below */
+    EOP_INSERT,         /* Pop a key and value and add them to the map below */
+    EOP_INDEX,          /* Pop a key and replace the container with its element */
+    EOP_CALL,           /* name: function, imm: argc */
+    EOP_NEG,
+    EOP_NOT,
+    EOP_BNOT,
+    EOP_MUL,
+    EOP_DIV,
+    EOP_MOD,
+    EOP_ADD,
+    EOP_SUB,
+    EOP_SHL,
+    EOP_SHR,
+    EOP_LT,
+    EOP_LE,
+    EOP_GT,
+    EOP_GE,
+    EOP_EQ,
+    EOP_NE,
+    EOP_BAND,
+    EOP_BXOR,
+    EOP_BOR,
+    EOP_AND,            /* imm: skip if top is false, else pop */
+    EOP_OR,             /* imm: skip if top is true, else pop */
+    EOP_BOOL
+} script_eop_code_t;
+
+/*
+ * Name reference. cache holds epoch << 32 | slot, valid while the epoch
+ * matches the context's; one word, so contexts on other threads sharing
+ * the code never see a torn pair.
+ */
+typedef struct script_ref {
+    uint64_t    cache;
+    uint32_t    hash;
+} script_ref_t;
+
+typedef struct script_eop {
+    uint8_t     op;
+    int32_t     imm;
+    int32_t     name;       /* Pool offset of the name, -1 if none */
+    script_ref_t ref;
+} script_eop_t;
+
+typedef struct script_insn {
+    uint8_t     op;
+    int32_t     line_num;
+    int32_t     a;          /* Pool offset of first operand, -1 if none */
+    int32_t     b;          /* Pool offset of second operand, -1 if none */
+    int32_t     expr;       /* First expression op, -1 if none */
+    int32_t     imm;        /* Constant folded at compile time */
+    int32_t     target;     /* Jump target pc, -1 if unresolved */
+    script_ref_t dst;       /* Name in a */
+} script_insn_t;
+
+/* Label defined in compiled code */
+typedef struct script_code_label {
+    int32_t     name;       /* Pool offset */
+    uint32_t    hash;
+    int32_t     pc;
+    int32_t     line_num;
+} script_code_label_t;
+
+/* Bump region obtained from getmem; chunks are only freed in bulk */
+typedef struct script_chunk {
+    struct script_chunk *next;
+    uint32_t    size;
+    uint32_t    used;
+} script_chunk_t;
+
+/* Per-context allocator; freed blocks are recycled by size class */
+typedef struct script_arena {
+    script_chunk_t  *chunks;
+    void            *free_list[SCRIPT_ARENA_CLASSES];
+    uint32_t        reserved;       /* Bytes held from getmem */
+} script_arena_t;
+
+/* Compiled script: instructions, expressions and pool in one allocation */
+typedef struct script_code {
+    script_insn_t   *insns;
+    int32_t         insn_count;
+    script_eop_t    *ops;
+    int32_t         op_count;
+    script_code_label_t *labels;
+    int32_t         label_count;
+    int32_t         *lines;         /* First pc at or after each line */
+    int32_t         line_count;
+    int32_t         first_line;     /* Line number of lines[1] */
+    int32_t         local_count;    /* Frame slots a call needs */
+    char            *pool;
+    uint32_t        size;
+    script_arena_t  *arena;         /* Owner, NULL if from getmem */
+} script_code_t;
 
 typedef struct script_func {
     char        name[SCRIPT_VAR_NAME_LEN];
+    uint32_t    hash;
     char        *body;
     int32_t     body_len;
     int32_t     num_params;
+    script_code_t *code;
     bool        defined;
+    bool        shared;     /* Body and code belong to a snapshot */
 } script_func_t;
 
 
+/* Active call; its locals are locals[base] up to the next frame's base */
+typedef struct script_frame {
+    int32_t     ret_line;
+    int32_t     base;
+} script_frame_t;
+
 typedef struct script_label {
     char        name[SCRIPT_VAR_NAME_LEN];
+    uint32_t    hash;
     int32_t     line_num;
     bool        defined;
 } script_label_t;
@@ -131,6 +347,16 @@ typedef struct script_context {
     script_func_t   funcs[SCRIPT_MAX_FUNCS];
     script_label_t  labels[SCRIPT_MAX_LABELS];
     
+    /* Open-addressing indexes into the tables above */
+    int16_t         var_index[SCRIPT_VAR_BUCKETS];
+    int16_t         func_index[SCRIPT_FUNC_BUCKETS];
+    int16_t         label_index[SCRIPT_LABEL_BUCKETS];
+    uint32_t        var_epoch;      /* Changes when var slots are freed */
+    int32_t         var_free;       /* Lowest var slot that may be free */
+    
+    /* Backs function bodies, compiled code and long strings */
+    script_arena_t  arena;
+    
     int32_t         var_count;
     int32_t         func_count;
     int32_t         label_count;
@@ -141,14 +367,99 @@ typedef struct script_context {
     int32_t         exit_code;
     int32_t         loop_stack[SCRIPT_MAX_STACK];
     int32_t         loop_sp;
-    int32_t         call_stack[SCRIPT_MAX_STACK];
+    script_frame_t  frames[SCRIPT_MAX_STACK];
     int32_t         call_sp;
     int32_t         stdin_fd;
     int32_t         stdout_fd;
     int32_t         stderr_fd;
+    
+    /* Expression values, shared by nested calls; grows in the arena */
+    script_value_t  *stack;
+    int32_t         stack_cap;
+    int32_t         stack_sp;
+    script_value_t  ret;            /* Value of the last return */
+    
+    /* Frame slots of active calls, owning their strings */
+    script_value_t  *locals;
+    int32_t         local_cap;
+    int32_t         local_sp;
+    
+    /* Counters while profiling, else NULL; see script_profile_start() */
+    struct script_profile *profile;
+    
+    /* Read for names the context has no variable of; see script_attach_env() */
+    struct script_env *env;
 } script_context_t;
 
+/* What one context holds, from script_mem_stats(); sizes in bytes */
+typedef struct script_mem {
+    uint32_t    context;        /* The context and its fixed tables */
+    uint32_t    reserved;       /* Arena chunks held from getmem */
+    uint32_t    used;           /* Handed out from them, idle included */
+    uint32_t    idle;           /* Freed blocks waiting for reuse */
+    uint32_t    var_bytes;      /* Long strings and arrays of variables */
+    uint32_t    func_bytes;     /* Bodies and compiled code of functions */
+    uint32_t    shared_bytes;   /* Same, but borrowed from a snapshot */
+    uint32_t    stack_bytes;    /* Expression stack and call locals */
+    int32_t     vars;
+    int32_t     funcs;
+    int32_t     labels;
+} script_mem_t;
+
+/*
+ * Compiled glob. Stars split the pattern into segments of single-character
+ * tokens; bit i of masks[c] is set when token i accepts c.
+ */
+typedef struct script_glob {
+    uint64_t    masks[256];
+    int32_t     count;                          /* Tokens */
+    int32_t     seg_count;
+    uint8_t     seg_start[SCRIPT_GLOB_MAX + 2];
+    uint8_t     seg_len[SCRIPT_GLOB_MAX + 2];
+} script_glob_t;
+
+/*
+ * Compiled regular expression; see expr_regex_compile(). Matching fills in
+ * its DFA cache, so a handle is used by one thread at a time.
+ */
+typedef struct script_regex script_regex_t;
+
+/*
+ * Frozen copy of an initialized context that new contexts start from; see
+ * script_snapshot_create()
+ */
+typedef struct script_snapshot script_snapshot_t;
+
+/* Per-line and per-function counters of a profiled context */
+typedef struct script_profile script_profile_t;
+
+/*
+ * Variables shared by a shell and the contexts attached to it; see
+ * script_env_create(). Not locked, so writers must not run alongside
+ * readers.
+ */
+typedef struct script_env script_env_t;
+
+/*
+ * Pool of worker threads, each with its own context, and the handle of a
+ * job submitted to it. Hosted POSIX builds only.
+ */
+typedef struct script_pool script_pool_t;
+typedef struct script_future script_future_t;
+
+/* Prepares each worker's context, e.g. defines functions; OK or SYSERR */
+typedef int (*script_init_func)(script_context_t *ctx, void *arg);
+
+/*
+ * Shell instance: state, commands, jobs and environment. Each thread runs
+ * the context bound to it, or a default one until it binds its own.
+ */
+typedef struct shell_context shell_context_t;
+
 /* Shell lifecycle */
+extern shell_context_t* shell_create_context(void);
+extern void     shell_destroy_context(shell_context_t *sh);
+extern shell_context_t* shell_bind_context(shell_context_t *sh);
 extern void     shell_init(void);
 extern void     shell_run(void);
 extern void     shell_exit(int status);
@@ -168,6 +479,10 @@ extern void     shell_history_add(const char *cmd);
 extern char*    shell_history_get(int index);
 extern void     shell_history_clear(void);
 extern void     shell_history_list(void);
+extern int      shell_history_open(const char *path);
+extern int      shell_history_count(void);
+extern uint32_t shell_history_time(int index);
+extern int      shell_history_search(const char *text, int before, bool prefix);
 
 /* Aliases */
 extern int      shell_alias_set(const char *name, const char *value);
@@ -179,6 +494,7 @@ extern void     shell_alias_list(void);
 extern char*    shell_getenv(const char *name);
 extern int      shell_setenv(const char *name, const char *value);
 extern int      shell_unsetenv(const char *name);
+extern script_env_t* shell_env(void);
 
 /* I/O redirection */
 extern int      shell_redirect_input(const char *filename);
@@ -198,23 +514,78 @@ extern script_context_t* script_create_context(void);
 extern void     script_destroy_context(script_context_t *ctx);
 extern void     script_reset_context(script_context_t *ctx);
 
+/* Snapshots */
+extern script_snapshot_t* script_snapshot_create(script_context_t *ctx);
+extern void     script_snapshot_free(script_snapshot_t *snap);
+extern script_context_t* script_clone_context(const script_snapshot_t *snap);
+extern int      script_restore_context(script_context_t *ctx, const script_snapshot_t *snap);
+
+/* Profiling */
+extern int      script_profile_start(script_context_t *ctx);
+extern int      script_profile_stop(script_context_t *ctx);
+extern int      script_profile_func(script_context_t *ctx, const char *name, uint64_t *calls, uint64_t *ns);
+extern int      script_profile_line(script_context_t *ctx, const char *name, int32_t line, uint64_t *hits, uint64_t *ns);
+extern int32_t  script_profile_dump(script_context_t *ctx, char *buf, uint32_t size);
+
+/* Memory accounting */
+extern void     script_mem_stats(const script_context_t *ctx, script_mem_t *mem);
+extern void     script_mem_totals(int32_t *contexts, uint32_t *bytes);
+
 /* Execution */
 extern int      script_execute(script_context_t *ctx, const char *script);
 extern int      script_execute_file(script_context_t *ctx, const char *filename);
 extern int      script_execute_line(script_context_t *ctx, const char *line);
 
+/* Compilation */
+extern script_code_t* script_compile(const char *script);
+extern void     script_free_code(script_code_t *code);
+extern int      script_run(script_context_t *ctx, script_code_t *code);
+extern void     script_cache_set_flags(uint32_t flags);
+extern void     script_cache_clear(void);
+
+/* Worker pool */
+extern script_pool_t* script_pool_create(int workers, script_init_func init, void *arg);
+extern void     script_pool_destroy(script_pool_t *pool);
+extern script_future_t* script_pool_submit(script_pool_t *pool, const char *script);
+extern script_future_t* script_pool_call(script_pool_t *pool, const char *name, int argc, char **argv);
+extern bool     script_future_done(script_future_t *future);
+extern int      script_future_wait(script_future_t *future);
+extern void     script_future_free(script_future_t *future);
+
 /* Variables */
 extern int      script_set_var(script_context_t *ctx, const char *name, var_type_t type, void *value);
-extern int      script_get_var(script_context_t *ctx, const char *name, var_type_t *type, void *value);
+extern int      script_get_var(script_context_t *ctx, const char *name, var_type_t *type, void *value, uint32_t size);
 extern int      script_unset_var(script_context_t *ctx, const char *name);
 extern bool     script_var_exists(script_context_t *ctx, const char *name);
+extern const char* script_get_str(script_context_t *ctx, const char *name);
+
+/* Shared variables */
+extern script_env_t* script_env_create(void);
+extern void     script_env_destroy(script_env_t *env);
+extern script_env_t* script_env_copy(const script_env_t *env);
+extern const char* script_env_get(const script_env_t *env, const char *name);
+extern int      script_env_set(script_env_t *env, const char *name, const char *value);
+extern int      script_env_unset(script_env_t *env, const char *name);
+extern int      script_env_export(script_env_t *env, const char *name, bool exported);
+extern int32_t  script_env_next(const script_env_t *env, int32_t index, const char **name, const char **value, bool *exported);
+extern void     script_env_stats(const script_env_t *env, int32_t *vars, uint32_t *bytes);
+extern void     script_attach_env(script_context_t *ctx, script_env_t *env);
+
+/* Arrays and maps */
+extern int      script_array_create(script_context_t *ctx, const char *name, bool map);
+extern int32_t  script_array_len(script_context_t *ctx, const char *name);
+extern int      script_array_set(script_context_t *ctx, const char *name, int32_t index, var_type_t type, void *value);
+extern int      script_array_get(script_context_t *ctx, const char *name, int32_t index, var_type_t *type, void *value, uint32_t size);
+extern int      script_map_set(script_context_t *ctx, const char *name, const char *key, var_type_t type, void *value);
+extern int      script_map_get(script_context_t *ctx, const char *name, const char *key, var_type_t *type, void *value, uint32_t size);
+extern const char* script_map_key(script_context_t *ctx, const char *name, int32_t index);
 
 /* Functions */
 extern int      script_define_func(script_context_t *ctx, const char *name, const char *body, int num_params);
 extern int      script_call_func(script_context_t *ctx, const char *name, int argc, char **argv);
 extern int32_t  script_eval_int(script_context_t *ctx, const char *expr);
 extern double   script_eval_float(script_context_t *ctx, const char *expr);
-extern char*    script_eval_string(script_context_t *ctx, const char *expr);
+extern char*    script_eval_string(script_context_t *ctx, const char *expr, char *buf, uint32_t size);
 extern bool     script_eval_bool(script_context_t *ctx, const char *expr);
 extern int      script_goto_label(script_context_t *ctx, const char *label);
 extern int      script_break(script_context_t *ctx);
@@ -222,9 +593,16 @@ extern int      script_continue(script_context_t *ctx);
 extern int      script_return(script_context_t *ctx, int value);
 extern int32_t  expr_eval_arithmetic(const char *expr);
 extern double   expr_eval_float(const char *expr);
-extern char*    expr_eval_string_expr(const char *expr);
+extern char*    expr_eval_string_expr(const char *expr, char *buf, uint32_t size);
 extern bool     expr_eval_condition(const char *expr);
 extern bool     expr_match_glob(const char *pattern, const char *string);
+extern script_glob_t* expr_glob_compile(const char *pattern);
+extern bool     expr_glob_match(const script_glob_t *glob, const char *string);
+extern void     expr_glob_free(script_glob_t *glob);
 extern bool     expr_match_regex(const char *pattern, const char *string);
+extern script_regex_t* expr_regex_compile(const char *pattern);
+extern bool     expr_regex_match(script_regex_t *re, const char *string);
+extern bool     expr_regex_search(script_regex_t *re, const char *text, uint32_t len);
+extern void     expr_regex_free(script_regex_t *re);
 
 #endif
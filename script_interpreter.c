@@ -13,757 +13,7454 @@
 #include "../include/kernel.h"
 #include "../include/memory.h"
 #include "../include/types.h"
+#include "../include/clock.h"
 
 
 #else
 
+#include <time.h>
+
 #define getmem(size)        malloc(size)
 #define freemem(ptr, size)  free(ptr)
 #endif
 
+/* Hosted builds map script files; the rest stream them in chunks */
+#if defined(XINU_KERNEL) || defined(_WIN32)
+#define SCRIPT_STREAM_FILES
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/* Worker pools need POSIX threads */
+#if !defined(XINU_KERNEL) && !defined(_WIN32)
+#define SCRIPT_POOL_THREADS
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 #ifdef _WIN32
 #ifndef strtok_r
 #define strtok_r(str, delim, saveptr) strtok_s(str, delim, saveptr)
 #endif
 #endif
 
+static int exec_code(script_context_t *ctx, script_code_t *code);
+static script_code_t* compile_code(script_arena_t *arena, const char *script);
+static script_code_t* compile_func(script_arena_t *arena, const char *body,
+                                   int32_t params);
+static void arr_free(script_context_t *ctx, script_array_t *arr);
+static script_array_t* arr_copy(script_context_t *ctx,
+                                const script_array_t *arr);
+static void pattern_cache_clear(void);
+static void prof_free(script_context_t *ctx);
 
-script_context_t* script_create_context(void) {
-    script_context_t *ctx = (script_context_t*)getmem(sizeof(script_context_t));
+
+#define INDEX_EMPTY     (-1)
+#define INDEX_DELETED   (-2)
+
+/* Source of var epochs; unique across contexts so refs never alias */
+static uint32_t script_epoch = 0;
+
+static uint32_t next_epoch(void) {
+#if defined(__GNUC__) && !defined(XINU_KERNEL)
+    return __atomic_add_fetch(&script_epoch, 1, __ATOMIC_RELAXED);
+#else
+    return ++script_epoch;
+#endif
+}
+
+/* Live contexts, and bytes held by them, snapshots and their arenas */
+static int32_t script_live = 0;
+static uint32_t script_held = 0;
+
+static void mem_track(int32_t contexts, int32_t bytes) {
+#if defined(__GNUC__) && !defined(XINU_KERNEL)
+    __atomic_add_fetch(&script_live, contexts, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&script_held, (uint32_t)bytes, __ATOMIC_RELAXED);
+#else
+    script_live += contexts;
+    script_held += (uint32_t)bytes;
+#endif
+}
+
+/* FNV-1a over the name */
+static uint32_t name_hash(const char *name) {
+    uint32_t h = 2166136261u;
     
-    if (ctx == NULL) {
-        return NULL;
+    while (*name != '\0') {
+        h ^= (uint8_t)*name++;
+        h *= 16777619u;
     }
     
-    script_reset_context(ctx);
+    return h;
+}
+
+static void index_clear(int16_t *index, uint32_t buckets) {
+    uint32_t i;
     
-    return ctx;
+    for (i = 0; i < buckets; i++) {
+        index[i] = INDEX_EMPTY;
+    }
 }
 
-void script_destroy_context(script_context_t *ctx) {
-    int i;
+static void index_insert(int16_t *index, uint32_t mask, uint32_t hash,
+                         int16_t slot) {
+    uint32_t b = hash & mask;
     
-    if (ctx == NULL) {
-        return;
+    /* Tables hold at most half as many entries as buckets */
+    while (index[b] >= 0) {
+        b = (b + 1) & mask;
+    }
+    index[b] = slot;
+}
+
+static void index_remove(int16_t *index, uint32_t mask, uint32_t b) {
+    /* No probe runs past an empty successor, so no tombstone is needed */
+    if (index[(b + 1) & mask] == INDEX_EMPTY) {
+        index[b] = INDEX_EMPTY;
+    } else {
+        index[b] = INDEX_DELETED;
     }
+}
+
+
+/* Sizes past the largest class give SCRIPT_ARENA_CLASSES, which no list holds */
+static uint32_t arena_class(uint32_t size, uint32_t *rounded) {
+    uint32_t cls = 0;
+    uint32_t n = SCRIPT_ARENA_MIN;
     
-    /* Free function bodies */
-    for (i = 0; i < ctx->func_count; i++) {
-        if (ctx->funcs[i].body != NULL) {
-            freemem(ctx->funcs[i].body, ctx->funcs[i].body_len);
-        }
+    while (n < size && cls < SCRIPT_ARENA_CLASSES) {
+        n <<= 1;
+        cls++;
     }
     
-    freemem(ctx, sizeof(script_context_t));
+    *rounded = n;
+    return cls;
 }
 
-void script_reset_context(script_context_t *ctx) {
-    int i;
+/* Allocate from the arena; blocks are rounded to their size class */
+static void* arena_alloc(script_arena_t *arena, uint32_t size) {
+    script_chunk_t *chunk;
+    uint32_t rounded, chunk_size;
+    uint32_t cls = arena_class(size, &rounded);
+    void *block;
     
-    if (ctx == NULL) {
-        return;
+    if (cls >= SCRIPT_ARENA_CLASSES) {
+        return NULL;
     }
     
-    /* Reset variables */
-    for (i = 0; i < SCRIPT_MAX_VARS; i++) {
-        ctx->vars[i].defined = false;
-        ctx->vars[i].type = VAR_TYPE_UNDEFINED;
-        ctx->vars[i].readonly = false;
-        ctx->vars[i].exported = false;
+    /* Recycle a freed block of the same class */
+    block = arena->free_list[cls];
+    if (block != NULL) {
+        arena->free_list[cls] = *(void**)block;
+        return block;
     }
-    ctx->var_count = 0;
     
-    /* Reset functions */
-    for (i = 0; i < SCRIPT_MAX_FUNCS; i++) {
-        if (ctx->funcs[i].body != NULL) {
-            freemem(ctx->funcs[i].body, ctx->funcs[i].body_len);
-        }
-        ctx->funcs[i].defined = false;
-        ctx->funcs[i].body = NULL;
+    /* Bump from the current chunk */
+    chunk = arena->chunks;
+    if (chunk != NULL && chunk->size - chunk->used >= rounded) {
+        block = (char*)chunk + chunk->used;
+        chunk->used += rounded;
+        return block;
     }
-    ctx->func_count = 0;
     
-    /* Reset labels */
-    for (i = 0; i < SCRIPT_MAX_LABELS; i++) {
-        ctx->labels[i].defined = false;
+    /* Blocks too large to share a chunk get one to themselves */
+    chunk_size = SCRIPT_ARENA_CHUNK;
+    if (rounded > SCRIPT_ARENA_CHUNK / 2) {
+        chunk_size = rounded + SCRIPT_ARENA_MIN;
     }
-    ctx->label_count = 0;
-    
-    /* Reset execution state */
-    ctx->line_num = 0;
-    ctx->running = false;
-    ctx->exit_code = 0;
-    ctx->loop_sp = 0;
-    ctx->call_sp = 0;
     
-    /* Set default I/O */
-    ctx->stdin_fd = 0;
-    ctx->stdout_fd = 1;
-    ctx->stderr_fd = 2;
-}
-
-
-static script_var_t* find_var(script_context_t *ctx, const char *name) {
-    int i;
+    chunk = (script_chunk_t*)getmem(chunk_size);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    chunk->size = chunk_size;
+    chunk->used = SCRIPT_ARENA_MIN;     /* Header, rounded for alignment */
+    arena->reserved += chunk_size;
+    mem_track(0, (int32_t)chunk_size);
     
-    for (i = 0; i < SCRIPT_MAX_VARS; i++) {
-        if (ctx->vars[i].defined && 
-            strcmp(ctx->vars[i].name, name) == 0) {
-            return &ctx->vars[i];
-        }
+    /* Keep the partly used chunk in front for later bumps */
+    if (rounded > SCRIPT_ARENA_CHUNK / 2 && arena->chunks != NULL) {
+        chunk->next = arena->chunks->next;
+        arena->chunks->next = chunk;
+    } else {
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
     }
     
-    return NULL;
+    block = (char*)chunk + chunk->used;
+    chunk->used += rounded;
+    
+    return block;
 }
 
-static script_var_t* create_var(script_context_t *ctx, const char *name) {
-    int i;
-    
-    /* Check if already exists */
-    script_var_t *var = find_var(ctx, name);
-    if (var != NULL) {
-        return var;
-    }
+/* Return a block for reuse; the size must match the allocation */
+static void arena_free(script_arena_t *arena, void *block, uint32_t size) {
+    uint32_t rounded;
+    uint32_t cls = arena_class(size, &rounded);
     
-    /* Find empty slot */
-    for (i = 0; i < SCRIPT_MAX_VARS; i++) {
-        if (!ctx->vars[i].defined) {
-            ctx->vars[i].defined = true;
-            strncpy(ctx->vars[i].name, name, SCRIPT_VAR_NAME_LEN - 1);
-            ctx->vars[i].name[SCRIPT_VAR_NAME_LEN - 1] = '\0';
-            ctx->vars[i].type = VAR_TYPE_UNDEFINED;
-            ctx->vars[i].readonly = false;
-            ctx->vars[i].exported = false;
-            ctx->var_count++;
-            return &ctx->vars[i];
-        }
+    if (block == NULL || cls >= SCRIPT_ARENA_CLASSES) {
+        return;
     }
     
-    return NULL;
+    *(void**)block = arena->free_list[cls];
+    arena->free_list[cls] = block;
 }
 
-int script_set_var(script_context_t *ctx, const char *name,
-                   var_type_t type, void *value) {
-    script_var_t *var;
+/* Drop every allocation, keeping one chunk for the next run */
+static void arena_reset(script_arena_t *arena) {
+    script_chunk_t *chunk = arena->chunks;
+    script_chunk_t *next;
     
-    if (ctx == NULL || name == NULL || value == NULL) {
-        return SYSERR;
+    memset(arena->free_list, 0, sizeof(arena->free_list));
+    
+    if (chunk == NULL) {
+        return;
     }
     
-    var = create_var(ctx, name);
-    if (var == NULL) {
-        return SYSERR;
+    for (next = chunk->next; next != NULL; ) {
+        script_chunk_t *victim = next;
+        next = next->next;
+        arena->reserved -= victim->size;
+        mem_track(0, -(int32_t)victim->size);
+        freemem(victim, victim->size);
     }
     
-    if (var->readonly) {
-        return SYSERR;  /* Cannot modify readonly variable */
+    if (chunk->size != SCRIPT_ARENA_CHUNK) {
+        arena->reserved -= chunk->size;
+        mem_track(0, -(int32_t)chunk->size);
+        freemem(chunk, chunk->size);
+        arena->chunks = NULL;
+        return;
     }
     
-    var->type = type;
+    chunk->next = NULL;
+    chunk->used = SCRIPT_ARENA_MIN;
+}
+
+static void arena_destroy(script_arena_t *arena) {
+    script_chunk_t *chunk = arena->chunks;
     
-    switch (type) {
-        case VAR_TYPE_INT:
-            var->value.int_val = *(int32_t*)value;
-            break;
-            
-        case VAR_TYPE_FLOAT:
-            var->value.float_val = *(double*)value;
-            break;
-            
-        case VAR_TYPE_STRING:
-            strncpy(var->value.str_val, (char*)value, SCRIPT_VAR_VAL_LEN - 1);
-            var->value.str_val[SCRIPT_VAR_VAL_LEN - 1] = '\0';
-            break;
-            
-        case VAR_TYPE_ARRAY:
-            var->value.array_val = value;
-            break;
-            
-        default:
-            return SYSERR;
+    mem_track(0, -(int32_t)arena->reserved);
+    while (chunk != NULL) {
+        script_chunk_t *next = chunk->next;
+        freemem(chunk, chunk->size);
+        chunk = next;
     }
     
-    return OK;
+    arena->chunks = NULL;
+    arena->reserved = 0;
+    memset(arena->free_list, 0, sizeof(arena->free_list));
 }
 
-int script_get_var(script_context_t *ctx, const char *name,
-                   var_type_t *type, void *value) {
-    script_var_t *var;
+
+static const char* str_data(const script_str_t *str) {
+    return str->cap != 0 ? str->data.ptr : str->data.buf;
+}
+
+static void str_free(script_arena_t *arena, script_str_t *str) {
+    if (str->cap != 0) {
+        arena_free(arena, str->data.ptr, str->cap);
+    }
+    str->len = 0;
+    str->cap = 0;
+    str->data.buf[0] = '\0';
+}
+
+/* Store text inline when short, otherwise in the context arena */
+static int str_assign(script_arena_t *arena, script_str_t *str,
+                      const char *text) {
+    uint32_t len = strlen(text);
+    uint32_t cap;
+    char *block;
     
-    if (ctx == NULL || name == NULL) {
-        return SYSERR;
+    if (len < SCRIPT_STR_INLINE) {
+        if (str->cap != 0) {
+            block = str->data.ptr;
+            memcpy(str->data.buf, text, len + 1);
+            arena_free(arena, block, str->cap);
+            str->cap = 0;
+        } else {
+            memmove(str->data.buf, text, len + 1);
+        }
+        str->len = len;
+        return OK;
     }
     
-    var = find_var(ctx, name);
-    if (var == NULL) {
-        return SYSERR;
+    if (len < str->cap) {
+        memmove(str->data.ptr, text, len + 1);
+        str->len = len;
+        return OK;
     }
     
-    if (type != NULL) {
-        *type = var->type;
+    arena_class(len + 1, &cap);
+    block = (char*)arena_alloc(arena, cap);
+    if (block == NULL) {
+        return SYSERR;
     }
+    memcpy(block, text, len + 1);
     
-    if (value != NULL) {
-        switch (var->type) {
-            case VAR_TYPE_INT:
-                *(int32_t*)value = var->value.int_val;
-                break;
-                
-            case VAR_TYPE_FLOAT:
-                *(double*)value = var->value.float_val;
-                break;
-                
-            case VAR_TYPE_STRING:
-                strcpy((char*)value, var->value.str_val);
-                break;
-                
-            case VAR_TYPE_ARRAY:
-                *(void**)value = var->value.array_val;
-                break;
-                
-            default:
-                return SYSERR;
-        }
+    if (str->cap != 0) {
+        arena_free(arena, str->data.ptr, str->cap);
     }
+    str->data.ptr = block;
+    str->cap = cap;
+    str->len = len;
     
     return OK;
 }
 
-int script_unset_var(script_context_t *ctx, const char *name) {
-    script_var_t *var;
-    
-    if (ctx == NULL || name == NULL) {
-        return SYSERR;
+static void clear_value(script_context_t *ctx, script_var_t *var) {
+    if (var->type == VAR_TYPE_STRING) {
+        str_free(&ctx->arena, &var->value.str_val);
+    } else if (var->type == VAR_TYPE_ARRAY) {
+        arr_free(ctx, var->value.array_val);
     }
-    
-    var = find_var(ctx, name);
-    if (var == NULL) {
-        return SYSERR;
+    var->type = VAR_TYPE_UNDEFINED;
+}
+
+
+static void val_int(script_value_t *v, int32_t i) {
+    v->type = VAR_TYPE_INT;
+    v->owned = false;
+    v->v.int_val = i;
+}
+
+static void val_float(script_value_t *v, double f) {
+    v->type = VAR_TYPE_FLOAT;
+    v->owned = false;
+    v->v.float_val = f;
+}
+
+/* Borrowed string; s must stay valid and NUL-terminated while in use */
+static void val_str(script_value_t *v, const char *s, uint32_t len) {
+    v->type = VAR_TYPE_STRING;
+    v->owned = false;
+    v->len = len;
+    v->v.str_val = s;
+}
+
+/* Storage comes from the arena, or from getmem without a context */
+static void* ctx_alloc(script_context_t *ctx, uint32_t size) {
+    return ctx != NULL ? arena_alloc(&ctx->arena, size) : (void*)getmem(size);
+}
+
+static void ctx_free(script_context_t *ctx, void *block, uint32_t size) {
+    if (ctx != NULL) {
+        arena_free(&ctx->arena, block, size);
+    } else {
+        freemem(block, size);
     }
+}
+
+static char* val_alloc(script_context_t *ctx, script_value_t *v,
+                       uint32_t len) {
+    char *buf = (char*)ctx_alloc(ctx, len + 1);
     
-    if (var->readonly) {
-        return SYSERR;
+    if (buf == NULL) {
+        return NULL;
     }
     
-    var->defined = false;
-    ctx->var_count--;
+    v->type = VAR_TYPE_STRING;
+    v->owned = true;
+    v->len = len;
+    v->cap = len + 1;
+    v->v.str_val = buf;
     
-    return OK;
+    return buf;
 }
 
-bool script_var_exists(script_context_t *ctx, const char *name) {
-    return find_var(ctx, name) != NULL;
+static void val_array(script_value_t *v, script_array_t *arr, bool owned) {
+    v->type = VAR_TYPE_ARRAY;
+    v->owned = owned;
+    v->v.array_val = arr;
 }
 
-
-static script_func_t* find_func(script_context_t *ctx, const char *name) {
-    int i;
-    
-    for (i = 0; i < SCRIPT_MAX_FUNCS; i++) {
-        if (ctx->funcs[i].defined && 
-            strcmp(ctx->funcs[i].name, name) == 0) {
-            return &ctx->funcs[i];
-        }
+static void val_release(script_context_t *ctx, script_value_t *v) {
+    if (!v->owned) {
+        return;
     }
     
-    return NULL;
+    if (v->type == VAR_TYPE_ARRAY) {
+        arr_free(ctx, v->v.array_val);
+    } else {
+        ctx_free(ctx, (void*)v->v.str_val, v->cap);
+    }
+    v->owned = false;
 }
 
-int script_define_func(script_context_t *ctx, const char *name,
-                       const char *body, int num_params) {
-    int i;
-    script_func_t *func;
+/* Copy a borrowed string or array so it outlives its source */
+static int val_own(script_context_t *ctx, script_value_t *v) {
+    const char *s = v->v.str_val;
+    script_array_t *arr;
+    char *buf;
     
-    if (ctx == NULL || name == NULL || body == NULL) {
-        return SYSERR;
+    if (v->owned) {
+        return OK;
     }
     
-    /* Check if already exists */
-    func = find_func(ctx, name);
-    if (func != NULL) {
-        /* Free old body */
-        if (func->body != NULL) {
-            freemem(func->body, func->body_len);
-        }
-    } else {
-        /* Find empty slot */
-        for (i = 0; i < SCRIPT_MAX_FUNCS; i++) {
-            if (!ctx->funcs[i].defined) {
-                func = &ctx->funcs[i];
-                func->defined = true;
-                strncpy(func->name, name, SCRIPT_VAR_NAME_LEN - 1);
-                func->name[SCRIPT_VAR_NAME_LEN - 1] = '\0';
-                ctx->func_count++;
-                break;
-            }
-        }
-        
-        if (func == NULL) {
+    if (v->type == VAR_TYPE_ARRAY) {
+        arr = arr_copy(ctx, v->v.array_val);
+        if (arr == NULL) {
             return SYSERR;
         }
+        val_array(v, arr, true);
+        return OK;
     }
     
-    /* Allocate and copy body */
-    func->body_len = strlen(body) + 1;
-    func->body = (char*)getmem(func->body_len);
-    if (func->body == NULL) {
-        func->defined = false;
-        return SYSERR;
+    if (v->type != VAR_TYPE_STRING) {
+        return OK;
     }
     
-    strcpy(func->body, body);
-    func->num_params = num_params;
+    buf = val_alloc(ctx, v, v->len);
+    if (buf == NULL) {
+        return SYSERR;
+    }
+    memcpy(buf, s, v->len + 1);
     
     return OK;
 }
 
-int script_call_func(script_context_t *ctx, const char *name,
-                     int argc, char **argv) {
-    script_func_t *func;
-    int i;
-    char param_name[32];
-    
-    if (ctx == NULL || name == NULL) {
-        return SYSERR;
+/* Saturating, with NaN as 0 */
+static int32_t float_to_int(double d) {
+    if (d > -2147483649.0 && d < 2147483648.0) {
+        return (int32_t)d;
     }
     
-    func = find_func(ctx, name);
-    if (func == NULL) {
-        return SYSERR;
+    return d > 0 ? INT32_MAX : (d < 0 ? INT32_MIN : 0);
+}
+
+/*
+ * Leading number of a string: an integer unless it has a fraction or
+ * exponent. Returns the end of the number, or s if there is none.
+ */
+static const char* str_number(const char *s, script_value_t *out) {
+    const char *p = s;
+    char *iend, *fend;
+    long l;
+    double d;
+    
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p == '-' || *p == '+') p++;
+    if (!isdigit((unsigned char)*p) &&
+        !(*p == '.' && isdigit((unsigned char)p[1]))) {
+        val_int(out, 0);
+        return s;
+    }
+    
+    l = strtol(s, &iend, 10);
+    d = strtod(s, &fend);
+    if (fend > iend) {
+        val_float(out, d);
+        return fend;
+    }
+    
+    val_int(out, (int32_t)(uint32_t)(unsigned long)l);
+    return iend;
+}
+
+/* Strings convert by their leading number; anything else reads as 0 */
+static void val_number(const script_value_t *v, script_value_t *out) {
+    switch (v->type) {
+        case VAR_TYPE_INT:
+        case VAR_TYPE_FLOAT:
+            *out = *v;
+            out->owned = false;
+            break;
+        case VAR_TYPE_STRING:
+            str_number(v->v.str_val, out);
+            break;
+        default:
+            val_int(out, 0);
+            break;
+    }
+}
+
+static int32_t val_to_int(const script_value_t *v) {
+    script_value_t n;
+    
+    val_number(v, &n);
+    return n.type == VAR_TYPE_INT ? n.v.int_val : float_to_int(n.v.float_val);
+}
+
+static double val_to_float(const script_value_t *v) {
+    script_value_t n;
+    
+    val_number(v, &n);
+    return n.type == VAR_TYPE_INT ? (double)n.v.int_val : n.v.float_val;
+}
+
+/* Strings are true unless empty or "0", as in the legacy conditions */
+static bool val_truth(const script_value_t *v) {
+    switch (v->type) {
+        case VAR_TYPE_INT:
+            return v->v.int_val != 0;
+        case VAR_TYPE_FLOAT:
+            return v->v.float_val != 0.0;
+        case VAR_TYPE_STRING:
+            return v->len > 0 && !(v->len == 1 && v->v.str_val[0] == '0');
+        case VAR_TYPE_ARRAY:
+            return v->v.array_val->count > 0;
+        default:
+            return false;
+    }
+}
+
+/* Numbers that fill the whole text become numbers, the rest strings */
+static void val_parse(const char *text, script_value_t *v) {
+    const char *end = str_number(text, v);
+    
+    if (end == text || *end != '\0') {
+        val_str(v, text, strlen(text));
+    }
+}
+
+static void val_format(const script_value_t *v, char *buf, uint32_t size) {
+    switch (v->type) {
+        case VAR_TYPE_INT:
+            snprintf(buf, size, "%d", (int)v->v.int_val);
+            break;
+        case VAR_TYPE_FLOAT:
+            snprintf(buf, size, "%g", v->v.float_val);
+            break;
+        case VAR_TYPE_STRING:
+            snprintf(buf, size, "%s", v->v.str_val);
+            break;
+        default:
+            buf[0] = '\0';
+            break;
+    }
+}
+
+
+static uint32_t map_buckets(int32_t cap) {
+    return (uint32_t)cap * 2;
+}
+
+static script_array_t* arr_new(script_context_t *ctx, bool map) {
+    script_array_t *arr = (script_array_t*)ctx_alloc(ctx,
+                                                     sizeof(script_array_t));
+    
+    if (arr != NULL) {
+        memset(arr, 0, sizeof(script_array_t));
+        arr->map = map;
+    }
+    
+    return arr;
+}
+
+static void arr_free(script_context_t *ctx, script_array_t *arr) {
+    int32_t i;
+    
+    for (i = 0; i < arr->count; i++) {
+        val_release(ctx, &arr->items[i]);
+        if (arr->map) {
+            val_release(ctx, &arr->keys[i]);
+        }
+    }
+    
+    if (arr->cap > 0) {
+        ctx_free(ctx, arr->items, arr->cap * sizeof(script_value_t));
+        if (arr->map) {
+            ctx_free(ctx, arr->keys, arr->cap * sizeof(script_value_t));
+            ctx_free(ctx, arr->hashes, arr->cap * sizeof(uint32_t));
+            ctx_free(ctx, arr->index, map_buckets(arr->cap) * sizeof(int32_t));
+        }
+    }
+    ctx_free(ctx, arr, sizeof(script_array_t));
+}
+
+/* Rebuild a map's buckets from its keys */
+static void map_rehash(script_array_t *arr) {
+    uint32_t mask = map_buckets(arr->cap) - 1;
+    uint32_t b;
+    int32_t i;
+    
+    for (b = 0; b <= mask; b++) {
+        arr->index[b] = INDEX_EMPTY;
+    }
+    for (i = 0; i < arr->count; i++) {
+        for (b = arr->hashes[i] & mask; arr->index[b] != INDEX_EMPTY;
+             b = (b + 1) & mask) {
+            ;
+        }
+        arr->index[b] = i;
+    }
+}
+
+/* Make room for count elements; capacities stay powers of two */
+static int arr_reserve(script_context_t *ctx, script_array_t *arr,
+                       int32_t count) {
+    script_value_t *items, *keys = NULL;
+    uint32_t *hashes = NULL;
+    int32_t *index = NULL;
+    int32_t cap;
+    
+    if (count <= arr->cap) {
+        return OK;
+    }
+    if (count > SCRIPT_ARRAY_MAX) {
+        return SYSERR;
+    }
+    
+    for (cap = arr->cap == 0 ? 4 : 2 * arr->cap; cap < count; cap *= 2) {
+        ;
+    }
+    
+    items = (script_value_t*)ctx_alloc(ctx, cap * sizeof(script_value_t));
+    if (arr->map) {
+        keys = (script_value_t*)ctx_alloc(ctx, cap * sizeof(script_value_t));
+        hashes = (uint32_t*)ctx_alloc(ctx, cap * sizeof(uint32_t));
+        index = (int32_t*)ctx_alloc(ctx, map_buckets(cap) * sizeof(int32_t));
+    }
+    if (items == NULL ||
+        (arr->map && (keys == NULL || hashes == NULL || index == NULL))) {
+        if (items != NULL) {
+            ctx_free(ctx, items, cap * sizeof(script_value_t));
+        }
+        if (keys != NULL) {
+            ctx_free(ctx, keys, cap * sizeof(script_value_t));
+        }
+        if (hashes != NULL) {
+            ctx_free(ctx, hashes, cap * sizeof(uint32_t));
+        }
+        if (index != NULL) {
+            ctx_free(ctx, index, map_buckets(cap) * sizeof(int32_t));
+        }
+        return SYSERR;
+    }
+    
+    /* Owned element storage is separate, so elements move as they are */
+    if (arr->count > 0) {
+        memcpy(items, arr->items, arr->count * sizeof(script_value_t));
+        if (arr->map) {
+            memcpy(keys, arr->keys, arr->count * sizeof(script_value_t));
+            memcpy(hashes, arr->hashes, arr->count * sizeof(uint32_t));
+        }
+    }
+    if (arr->cap > 0) {
+        ctx_free(ctx, arr->items, arr->cap * sizeof(script_value_t));
+        if (arr->map) {
+            ctx_free(ctx, arr->keys, arr->cap * sizeof(script_value_t));
+            ctx_free(ctx, arr->hashes, arr->cap * sizeof(uint32_t));
+            ctx_free(ctx, arr->index, map_buckets(arr->cap) * sizeof(int32_t));
+        }
+    }
+    
+    arr->items = items;
+    arr->keys = keys;
+    arr->hashes = hashes;
+    arr->index = index;
+    arr->cap = cap;
+    if (arr->map) {
+        map_rehash(arr);
+    }
+    
+    return OK;
+}
+
+/* Owned copy of v for storing in an array; owned temporaries are moved */
+static int val_store(script_context_t *ctx, script_value_t *dst,
+                     script_value_t *v) {
+    *dst = *v;
+    if (v->owned) {
+        v->owned = false;
+        return OK;
+    }
+    
+    return val_own(ctx, dst);
+}
+
+/* Store at index; one past the end appends */
+static int arr_set(script_context_t *ctx, script_array_t *arr, int32_t index,
+                   script_value_t *v) {
+    script_value_t copy;
+    
+    if (arr->map || index < 0 || index > arr->count) {
+        return SYSERR;
+    }
+    
+    /* Copy first; v may be borrowed from this very array */
+    if (val_store(ctx, &copy, v) != OK) {
+        return SYSERR;
+    }
+    
+    if (index == arr->count) {
+        if (arr_reserve(ctx, arr, arr->count + 1) != OK) {
+            val_release(ctx, &copy);
+            return SYSERR;
+        }
+        arr->count++;
+    } else {
+        val_release(ctx, &arr->items[index]);
+    }
+    arr->items[index] = copy;
+    
+    return OK;
+}
+
+static script_value_t* arr_get(const script_array_t *arr, int32_t index) {
+    if (arr->map || index < 0 || index >= arr->count) {
+        return NULL;
+    }
+    
+    return &arr->items[index];
+}
+
+static int32_t map_find(const script_array_t *arr, const char *key,
+                        uint32_t hash) {
+    uint32_t mask, b;
+    int32_t i;
+    
+    if (arr->cap == 0) {
+        return -1;
+    }
+    
+    mask = map_buckets(arr->cap) - 1;
+    for (b = hash & mask; (i = arr->index[b]) != INDEX_EMPTY;
+         b = (b + 1) & mask) {
+        if (arr->hashes[i] == hash && strcmp(arr->keys[i].v.str_val, key) == 0) {
+            return i;
+        }
+    }
+    
+    return -1;
+}
+
+static int map_set(script_context_t *ctx, script_array_t *arr,
+                   const char *key, script_value_t *v) {
+    uint32_t hash = name_hash(key);
+    script_value_t copy, k;
+    int32_t i = map_find(arr, key, hash);
+    uint32_t mask, b;
+    
+    if (val_store(ctx, &copy, v) != OK) {
+        return SYSERR;
+    }
+    
+    if (i >= 0) {
+        val_release(ctx, &arr->items[i]);
+        arr->items[i] = copy;
+        return OK;
+    }
+    
+    val_str(&k, key, strlen(key));
+    if (val_own(ctx, &k) != OK ||
+        arr_reserve(ctx, arr, arr->count + 1) != OK) {
+        val_release(ctx, &k);
+        val_release(ctx, &copy);
+        return SYSERR;
+    }
+    
+    i = arr->count++;
+    arr->items[i] = copy;
+    arr->keys[i] = k;
+    arr->hashes[i] = hash;
+    mask = map_buckets(arr->cap) - 1;
+    for (b = hash & mask; arr->index[b] != INDEX_EMPTY; b = (b + 1) & mask) {
+        ;
+    }
+    arr->index[b] = i;
+    
+    return OK;
+}
+
+static script_value_t* map_get(const script_array_t *arr, const char *key) {
+    int32_t i = map_find(arr, key, name_hash(key));
+    
+    return i >= 0 ? &arr->items[i] : NULL;
+}
+
+static script_array_t* arr_copy(script_context_t *ctx,
+                                const script_array_t *arr) {
+    script_array_t *copy = arr_new(ctx, arr->map);
+    int32_t i;
+    
+    if (copy == NULL) {
+        return NULL;
+    }
+    
+    if (arr_reserve(ctx, copy, arr->count) != OK) {
+        arr_free(ctx, copy);
+        return NULL;
+    }
+    
+    /* Stored elements are owned, so borrowed views copy cleanly */
+    for (i = 0; i < arr->count; i++) {
+        copy->items[i] = arr->items[i];
+        copy->items[i].owned = false;
+        if (val_own(ctx, &copy->items[i]) != OK) {
+            copy->count = i;
+            arr_free(ctx, copy);
+            return NULL;
+        }
+        if (arr->map) {
+            copy->keys[i] = arr->keys[i];
+            copy->keys[i].owned = false;
+            copy->hashes[i] = arr->hashes[i];
+            if (val_own(ctx, &copy->keys[i]) != OK) {
+                val_release(ctx, &copy->items[i]);
+                copy->count = i;
+                arr_free(ctx, copy);
+                return NULL;
+            }
+        }
+    }
+    copy->count = arr->count;
+    if (copy->map && copy->cap > 0) {
+        map_rehash(copy);
+    }
+    
+    return copy;
+}
+
+/* Map key text for a value; numbers are formatted */
+static const char* key_text(const script_value_t *key, char *buf,
+                            uint32_t size) {
+    if (key->type == VAR_TYPE_STRING) {
+        return key->v.str_val;
+    }
+    
+    val_format(key, buf, size);
+    return buf;
+}
+
+/* Element of a list, map or string; missing elements read as 0 */
+static int index_value(script_context_t *ctx, const script_value_t *c,
+                       const script_value_t *key, script_value_t *out) {
+    char buf[32];
+    script_value_t *item = NULL;
+    int32_t i;
+    char *s;
+    
+    if (c->type == VAR_TYPE_STRING) {
+        i = val_to_int(key);
+        if (i < 0 || (uint32_t)i >= c->len) {
+            val_str(out, "", 0);
+            return OK;
+        }
+        s = val_alloc(ctx, out, 1);
+        if (s == NULL) {
+            return SYSERR;
+        }
+        s[0] = c->v.str_val[i];
+        s[1] = '\0';
+        return OK;
+    }
+    
+    if (c->type == VAR_TYPE_ARRAY) {
+        if (c->v.array_val->map) {
+            item = map_get(c->v.array_val, key_text(key, buf, sizeof(buf)));
+        } else {
+            item = arr_get(c->v.array_val, val_to_int(key));
+        }
+    }
+    
+    if (item == NULL) {
+        val_int(out, 0);
+        return OK;
+    }
+    
+    /* Borrowed from the container; copy it if the container goes away */
+    *out = *item;
+    out->owned = false;
+    
+    return c->owned ? val_own(ctx, out) : OK;
+}
+
+/* Store into a container that a variable or slot owns */
+static int index_store(script_context_t *ctx, script_array_t *arr,
+                       const script_value_t *key, script_value_t *v) {
+    char buf[32];
+    
+    if (arr->map) {
+        return map_set(ctx, arr, key_text(key, buf, sizeof(buf)), v);
+    }
+    
+    return arr_set(ctx, arr, val_to_int(key), v);
+}
+
+script_context_t* script_create_context(void) {
+    script_context_t *ctx = (script_context_t*)getmem(sizeof(script_context_t));
+    
+    if (ctx == NULL) {
+        return NULL;
+    }
+    mem_track(1, sizeof(script_context_t));
+    
+    memset(ctx, 0, sizeof(script_context_t));
+    script_reset_context(ctx);
+    
+    return ctx;
+}
+
+void script_destroy_context(script_context_t *ctx) {
+    if (ctx == NULL) {
+        return;
+    }
+    
+    /* Bodies, code and long strings all live in the arena */
+    arena_destroy(&ctx->arena);
+    prof_free(ctx);
+    
+    mem_track(-1, -(int32_t)sizeof(script_context_t));
+    freemem(ctx, sizeof(script_context_t));
+}
+
+void script_reset_context(script_context_t *ctx) {
+    int i;
+    
+    if (ctx == NULL) {
+        return;
+    }
+    
+    /* Reset variables */
+    for (i = 0; i < SCRIPT_MAX_VARS; i++) {
+        ctx->vars[i].defined = false;
+        ctx->vars[i].type = VAR_TYPE_UNDEFINED;
+        ctx->vars[i].readonly = false;
+    }
+    ctx->var_count = 0;
+    ctx->var_free = 0;
+    ctx->var_epoch = next_epoch();
+    index_clear(ctx->var_index, SCRIPT_VAR_BUCKETS);
+    
+    /* Reset functions */
+    for (i = 0; i < SCRIPT_MAX_FUNCS; i++) {
+        ctx->funcs[i].defined = false;
+        ctx->funcs[i].shared = false;
+        ctx->funcs[i].body = NULL;
+        ctx->funcs[i].code = NULL;
+    }
+    ctx->func_count = 0;
+    index_clear(ctx->func_index, SCRIPT_FUNC_BUCKETS);
+    
+    /* Reset labels */
+    for (i = 0; i < SCRIPT_MAX_LABELS; i++) {
+        ctx->labels[i].defined = false;
+    }
+    ctx->label_count = 0;
+    index_clear(ctx->label_index, SCRIPT_LABEL_BUCKETS);
+    
+    /* Release strings, bodies and code in one go */
+    arena_reset(&ctx->arena);
+    ctx->stack = NULL;
+    ctx->stack_cap = 0;
+    ctx->stack_sp = 0;
+    val_int(&ctx->ret, 0);
+    ctx->locals = NULL;
+    ctx->local_cap = 0;
+    ctx->local_sp = 0;
+    
+    /* Reset execution state */
+    ctx->line_num = 0;
+    ctx->running = false;
+    ctx->exit_code = 0;
+    ctx->loop_sp = 0;
+    ctx->call_sp = 0;
+    
+    /* Set default I/O */
+    ctx->stdin_fd = 0;
+    ctx->stdout_fd = 1;
+    ctx->stderr_fd = 2;
+}
+
+
+struct script_snapshot {
+    script_context_t    ctx;
+};
+
+/*
+ * Make dst an image of src in one copy, then move what src keeps in its
+ * arena into dst's: long strings, arrays, and function bodies and code
+ * unless share is set, in which case they stay with src read-only.
+ */
+static int ctx_copy(script_context_t *dst, const script_context_t *src,
+                    bool share) {
+    script_arena_t arena = dst->arena;
+    script_profile_t *profile = dst->profile;
+    script_var_t *var;
+    script_func_t *func;
+    const char *text;
+    int i;
+    
+    arena_reset(&arena);
+    memcpy(dst, src, sizeof(script_context_t));
+    dst->arena = arena;
+    dst->profile = profile;
+    dst->var_epoch = next_epoch();
+    
+    /* Nothing is running in the copy */
+    dst->stack = NULL;
+    dst->stack_cap = 0;
+    dst->stack_sp = 0;
+    val_int(&dst->ret, 0);
+    dst->locals = NULL;
+    dst->local_cap = 0;
+    dst->local_sp = 0;
+    dst->line_num = 0;
+    dst->running = false;
+    dst->exit_code = 0;
+    dst->loop_sp = 0;
+    dst->call_sp = 0;
+    
+    for (i = 0; i < SCRIPT_MAX_VARS; i++) {
+        var = &dst->vars[i];
+        if (!var->defined) {
+            continue;
+        }
+        if (var->type == VAR_TYPE_STRING && var->value.str_val.cap != 0) {
+            text = var->value.str_val.data.ptr;
+            var->value.str_val.cap = 0;
+            if (str_assign(&dst->arena, &var->value.str_val, text) != OK) {
+                return SYSERR;
+            }
+        } else if (var->type == VAR_TYPE_ARRAY) {
+            var->value.array_val = arr_copy(dst, var->value.array_val);
+            if (var->value.array_val == NULL) {
+                var->type = VAR_TYPE_UNDEFINED;
+                return SYSERR;
+            }
+        }
+    }
+    
+    for (i = 0; i < SCRIPT_MAX_FUNCS; i++) {
+        func = &dst->funcs[i];
+        if (!func->defined) {
+            continue;
+        }
+        if (share) {
+            func->shared = true;
+            continue;
+        }
+        
+        func->shared = false;
+        text = func->body;
+        func->body = NULL;
+        func->code = NULL;
+        func->body = (char*)arena_alloc(&dst->arena, func->body_len);
+        if (func->body == NULL) {
+            return SYSERR;
+        }
+        memcpy(func->body, text, func->body_len);
+        func->code = compile_func(&dst->arena, func->body, func->num_params);
+        if (func->code == NULL) {
+            return SYSERR;
+        }
+    }
+    
+    return OK;
+}
+
+/*
+ * Freeze ctx as it is now. The snapshot owns copies of everything, so ctx
+ * may change or go away; contexts made from it must go before it does.
+ */
+script_snapshot_t* script_snapshot_create(script_context_t *ctx) {
+    script_snapshot_t *snap;
+    
+    if (ctx == NULL || ctx->running) {
+        return NULL;
+    }
+    
+    snap = (script_snapshot_t*)getmem(sizeof(script_snapshot_t));
+    if (snap == NULL) {
+        return NULL;
+    }
+    mem_track(0, sizeof(script_snapshot_t));
+    memset(snap, 0, sizeof(script_snapshot_t));
+    
+    if (ctx_copy(&snap->ctx, ctx, false) != OK) {
+        script_snapshot_free(snap);
+        return NULL;
+    }
+    
+    return snap;
+}
+
+void script_snapshot_free(script_snapshot_t *snap) {
+    if (snap == NULL) {
+        return;
+    }
+    
+    arena_destroy(&snap->ctx.arena);
+    mem_track(0, -(int32_t)sizeof(script_snapshot_t));
+    freemem(snap, sizeof(script_snapshot_t));
+}
+
+/* A new context in the snapshot's state; functions are shared, not copied */
+script_context_t* script_clone_context(const script_snapshot_t *snap) {
+    script_context_t *ctx;
+    
+    if (snap == NULL) {
+        return NULL;
+    }
+    
+    ctx = (script_context_t*)getmem(sizeof(script_context_t));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    mem_track(1, sizeof(script_context_t));
+    memset(&ctx->arena, 0, sizeof(script_arena_t));
+    ctx->profile = NULL;
+    
+    if (ctx_copy(ctx, &snap->ctx, true) != OK) {
+        script_destroy_context(ctx);
+        return NULL;
+    }
+    
+    return ctx;
+}
+
+/* Put ctx back into the snapshot's state, reusing its memory */
+int script_restore_context(script_context_t *ctx,
+                           const script_snapshot_t *snap) {
+    if (ctx == NULL || snap == NULL || ctx->running) {
+        return SYSERR;
+    }
+    
+    if (ctx_copy(ctx, &snap->ctx, true) != OK) {
+        script_reset_context(ctx);
+        return SYSERR;
+    }
+    
+    return OK;
+}
+
+
+/* Arena bytes behind a request of size, its class rounded up */
+static uint32_t arena_size(uint32_t size) {
+    uint32_t rounded;
+    
+    arena_class(size, &rounded);
+    return rounded;
+}
+
+static uint32_t arr_bytes(const script_array_t *arr);
+
+static uint32_t val_bytes(const script_value_t *v) {
+    if (!v->owned) {
+        return 0;
+    }
+    
+    return v->type == VAR_TYPE_ARRAY ? arr_bytes(v->v.array_val) :
+           v->type == VAR_TYPE_STRING ? arena_size(v->cap) : 0;
+}
+
+/* An array's storage, its elements' and any nested array's */
+static uint32_t arr_bytes(const script_array_t *arr) {
+    uint32_t bytes = arena_size(sizeof(script_array_t));
+    int32_t i;
+    
+    if (arr->cap > 0) {
+        bytes += arena_size(arr->cap * sizeof(script_value_t));
+        if (arr->map) {
+            bytes += arena_size(arr->cap * sizeof(script_value_t)) +
+                     arena_size(arr->cap * sizeof(uint32_t)) +
+                     arena_size(map_buckets(arr->cap) * sizeof(int32_t));
+        }
+    }
+    for (i = 0; i < arr->count; i++) {
+        bytes += val_bytes(&arr->items[i]);
+        if (arr->map) {
+            bytes += val_bytes(&arr->keys[i]);
+        }
+    }
+    
+    return bytes;
+}
+
+/*
+ * Count what ctx holds by walking its tables and arena. Costs a pass
+ * over every variable, array element and free block, so it is meant
+ * for reports rather than hot paths.
+ */
+void script_mem_stats(const script_context_t *ctx, script_mem_t *mem) {
+    const script_chunk_t *chunk;
+    const script_var_t *var;
+    const script_func_t *func;
+    void *block;
+    uint32_t bytes;
+    int32_t i;
+    
+    memset(mem, 0, sizeof(script_mem_t));
+    if (ctx == NULL) {
+        return;
+    }
+    
+    mem->context = sizeof(script_context_t);
+    mem->reserved = ctx->arena.reserved;
+    for (chunk = ctx->arena.chunks; chunk != NULL; chunk = chunk->next) {
+        mem->used += chunk->used - SCRIPT_ARENA_MIN;
+    }
+    for (i = 0; i < SCRIPT_ARENA_CLASSES; i++) {
+        for (block = ctx->arena.free_list[i]; block != NULL;
+             block = *(void**)block) {
+            mem->idle += (uint32_t)SCRIPT_ARENA_MIN << i;
+        }
+    }
+    
+    for (i = 0; i < SCRIPT_MAX_VARS; i++) {
+        var = &ctx->vars[i];
+        if (!var->defined) {
+            continue;
+        }
+        mem->vars++;
+        if (var->type == VAR_TYPE_STRING) {
+            mem->var_bytes += var->value.str_val.cap;
+        } else if (var->type == VAR_TYPE_ARRAY) {
+            mem->var_bytes += arr_bytes(var->value.array_val);
+        }
+    }
+    
+    for (i = 0; i < SCRIPT_MAX_FUNCS; i++) {
+        func = &ctx->funcs[i];
+        if (!func->defined) {
+            continue;
+        }
+        mem->funcs++;
+        bytes = func->body != NULL ? arena_size(func->body_len) : 0;
+        if (func->code != NULL) {
+            bytes += arena_size(func->code->size);
+        }
+        if (func->shared) {
+            mem->shared_bytes += bytes;
+        } else {
+            mem->func_bytes += bytes;
+        }
+    }
+    mem->labels = ctx->label_count;
+    
+    if (ctx->stack_cap > 0) {
+        mem->stack_bytes += arena_size(ctx->stack_cap *
+                                       sizeof(script_value_t));
+    }
+    if (ctx->local_cap > 0) {
+        mem->stack_bytes += arena_size(ctx->local_cap *
+                                       sizeof(script_value_t));
+    }
+    for (i = 0; i < ctx->stack_sp; i++) {
+        mem->stack_bytes += val_bytes(&ctx->stack[i]);
+    }
+    for (i = 0; i < ctx->local_sp; i++) {
+        mem->stack_bytes += val_bytes(&ctx->locals[i]);
+    }
+}
+
+/* Contexts alive in the process, and all bytes the interpreter holds */
+void script_mem_totals(int32_t *contexts, uint32_t *bytes) {
+#if defined(__GNUC__) && !defined(XINU_KERNEL)
+    *contexts = __atomic_load_n(&script_live, __ATOMIC_RELAXED);
+    *bytes = __atomic_load_n(&script_held, __ATOMIC_RELAXED);
+#else
+    *contexts = script_live;
+    *bytes = script_held;
+#endif
+}
+
+/*
+ * Shared variables: strings by name in a table that grows, all held in
+ * the table's own arena. Each entry is a block that starts with its
+ * name, so pointers survive growth; removed ones leave a NULL until the
+ * next compaction. Exporting only sets a flag, and attached contexts
+ * see the exported entries in place.
+ */
+#define SCRIPT_ENV_MIN  16
+
+typedef struct script_env_var {
+    char        name[SCRIPT_VAR_NAME_LEN];
+    script_str_t value;
+    bool        exported;
+} script_env_var_t;
+
+struct script_env {
+    script_env_var_t **items;       /* In definition order */
+    uint32_t    *hashes;
+    int32_t     *index;             /* 2 * cap buckets of item slots */
+    int32_t     count;              /* Slots used, removed ones included */
+    int32_t     live;
+    int32_t     cap;
+    script_arena_t arena;           /* Entries, the tables and long values */
+};
+
+static void env_rehash(script_env_t *env) {
+    uint32_t mask = 2 * env->cap - 1;
+    uint32_t b;
+    int32_t i;
+    
+    for (i = 0; i < 2 * env->cap; i++) {
+        env->index[i] = INDEX_EMPTY;
+    }
+    for (i = 0; i < env->count; i++) {
+        for (b = env->hashes[i] & mask; env->index[b] != INDEX_EMPTY;
+             b = (b + 1) & mask) {
+            ;
+        }
+        env->index[b] = i;
+    }
+}
+
+/* Room for one more slot: squeeze out removed entries, or double */
+static int env_reserve(script_env_t *env) {
+    script_env_var_t **items;
+    uint32_t *hashes;
+    int32_t *index;
+    int32_t cap, i, n;
+    
+    if (env->count < env->cap) {
+        return OK;
+    }
+    
+    if (env->live < env->cap / 2) {
+        for (i = 0, n = 0; i < env->count; i++) {
+            if (env->items[i] != NULL) {
+                env->items[n] = env->items[i];
+                env->hashes[n++] = env->hashes[i];
+            }
+        }
+        env->count = n;
+        env_rehash(env);
+        return OK;
+    }
+    
+    cap = env->cap > 0 ? 2 * env->cap : SCRIPT_ENV_MIN;
+    items = (script_env_var_t**)arena_alloc(&env->arena,
+                                            cap * sizeof(script_env_var_t*));
+    hashes = (uint32_t*)arena_alloc(&env->arena, cap * sizeof(uint32_t));
+    index = (int32_t*)arena_alloc(&env->arena, 2 * cap * sizeof(int32_t));
+    if (items == NULL || hashes == NULL || index == NULL) {
+        arena_free(&env->arena, items, cap * sizeof(script_env_var_t*));
+        arena_free(&env->arena, hashes, cap * sizeof(uint32_t));
+        arena_free(&env->arena, index, 2 * cap * sizeof(int32_t));
+        return SYSERR;
+    }
+    
+    if (env->cap > 0) {
+        memcpy(items, env->items, env->count * sizeof(script_env_var_t*));
+        memcpy(hashes, env->hashes, env->count * sizeof(uint32_t));
+        arena_free(&env->arena, env->items,
+                   env->cap * sizeof(script_env_var_t*));
+        arena_free(&env->arena, env->hashes, env->cap * sizeof(uint32_t));
+        arena_free(&env->arena, env->index, 2 * env->cap * sizeof(int32_t));
+    }
+    env->items = items;
+    env->hashes = hashes;
+    env->index = index;
+    env->cap = cap;
+    env_rehash(env);
+    
+    return OK;
+}
+
+/* Bucket holding name, or INDEX_EMPTY */
+static int32_t env_bucket(const script_env_t *env, const char *name,
+                          uint32_t hash) {
+    uint32_t mask = 2 * env->cap - 1;
+    uint32_t b;
+    int32_t slot;
+    
+    if (env->cap == 0) {
+        return INDEX_EMPTY;
+    }
+    
+    for (b = hash & mask; (slot = env->index[b]) != INDEX_EMPTY;
+         b = (b + 1) & mask) {
+        if (slot >= 0 && env->hashes[slot] == hash &&
+            strcmp(env->items[slot]->name, name) == 0) {
+            return b;
+        }
+    }
+    
+    return INDEX_EMPTY;
+}
+
+static script_env_var_t* env_find(const script_env_t *env, const char *name,
+                                  uint32_t hash) {
+    int32_t b;
+    
+    if (env == NULL) {
+        return NULL;
+    }
+    b = env_bucket(env, name, hash);
+    
+    return b == INDEX_EMPTY ? NULL : env->items[env->index[b]];
+}
+
+/* What an attached context sees of name: an exported entry, or NULL */
+static script_env_var_t* env_visible(const script_context_t *ctx,
+                                     const char *name, uint32_t hash) {
+    script_env_var_t *var = env_find(ctx->env, name, hash);
+    
+    return var != NULL && var->exported ? var : NULL;
+}
+
+script_env_t* script_env_create(void) {
+    script_env_t *env = (script_env_t*)getmem(sizeof(script_env_t));
+    
+    if (env == NULL) {
+        return NULL;
+    }
+    mem_track(0, sizeof(script_env_t));
+    memset(env, 0, sizeof(script_env_t));
+    
+    return env;
+}
+
+/* Contexts attached to env must be detached or gone first */
+void script_env_destroy(script_env_t *env) {
+    if (env == NULL) {
+        return;
+    }
+    
+    arena_destroy(&env->arena);
+    mem_track(0, -(int32_t)sizeof(script_env_t));
+    freemem(env, sizeof(script_env_t));
+}
+
+/*
+ * A separate table holding what env holds, flags included, for a copy of
+ * the shell that runs alongside the original; NULL if env is NULL or
+ * memory runs out.
+ */
+script_env_t* script_env_copy(const script_env_t *env) {
+    script_env_t *copy;
+    const char *name, *value;
+    bool exported;
+    int32_t i = 0;
+    
+    if (env == NULL || (copy = script_env_create()) == NULL) {
+        return NULL;
+    }
+    while ((i = script_env_next(env, i, &name, &value, &exported)) != SYSERR) {
+        if (script_env_set(copy, name, value) != OK ||
+            script_env_export(copy, name, exported) != OK) {
+            script_env_destroy(copy);
+            return NULL;
+        }
+    }
+    
+    return copy;
+}
+
+/* Borrowed value of name, valid until it is set or unset; NULL if unset */
+const char* script_env_get(const script_env_t *env, const char *name) {
+    script_env_var_t *var;
+    
+    if (name == NULL) {
+        return NULL;
+    }
+    var = env_find(env, name, name_hash(name));
+    
+    return var != NULL ? str_data(&var->value) : NULL;
+}
+
+/* Names are stored cut to fit, and looked up as stored */
+int script_env_set(script_env_t *env, const char *name, const char *value) {
+    char key[SCRIPT_VAR_NAME_LEN];
+    script_env_var_t *var;
+    uint32_t hash, mask, b;
+    
+    if (env == NULL || name == NULL || value == NULL) {
+        return SYSERR;
+    }
+    strncpy(key, name, SCRIPT_VAR_NAME_LEN - 1);
+    key[SCRIPT_VAR_NAME_LEN - 1] = '\0';
+    hash = name_hash(key);
+    
+    var = env_find(env, key, hash);
+    if (var != NULL) {
+        return str_assign(&env->arena, &var->value, value);
+    }
+    
+    if (env_reserve(env) != OK) {
+        return SYSERR;
+    }
+    var = (script_env_var_t*)arena_alloc(&env->arena,
+                                         sizeof(script_env_var_t));
+    if (var == NULL) {
+        return SYSERR;
+    }
+    memset(var, 0, sizeof(script_env_var_t));
+    strcpy(var->name, key);
+    if (str_assign(&env->arena, &var->value, value) != OK) {
+        arena_free(&env->arena, var, sizeof(script_env_var_t));
+        return SYSERR;
+    }
+    
+    mask = 2 * env->cap - 1;
+    for (b = hash & mask; env->index[b] >= 0; b = (b + 1) & mask) {
+        ;
+    }
+    env->index[b] = env->count;
+    env->items[env->count] = var;
+    env->hashes[env->count] = hash;
+    env->count++;
+    env->live++;
+    
+    return OK;
+}
+
+int script_env_unset(script_env_t *env, const char *name) {
+    script_env_var_t *var;
+    int32_t b;
+    
+    if (env == NULL || name == NULL) {
+        return SYSERR;
+    }
+    b = env_bucket(env, name, name_hash(name));
+    if (b == INDEX_EMPTY) {
+        return SYSERR;
+    }
+    
+    var = env->items[env->index[b]];
+    str_free(&env->arena, &var->value);
+    arena_free(&env->arena, var, sizeof(script_env_var_t));
+    env->items[env->index[b]] = NULL;
+    env->index[b] = INDEX_DELETED;
+    env->live--;
+    
+    return OK;
+}
+
+/* Show name to attached contexts, or hide it; SYSERR if it is unset */
+int script_env_export(script_env_t *env, const char *name, bool exported) {
+    script_env_var_t *var;
+    
+    if (name == NULL) {
+        return SYSERR;
+    }
+    var = env_find(env, name, name_hash(name));
+    if (var == NULL) {
+        return SYSERR;
+    }
+    var->exported = exported;
+    
+    return OK;
+}
+
+/*
+ * The first entry at slot index or after, in definition order. Returns
+ * the index to pass for the one after it, or SYSERR when there is none.
+ */
+int32_t script_env_next(const script_env_t *env, int32_t index,
+                        const char **name, const char **value,
+                        bool *exported) {
+    script_env_var_t *var;
+    
+    if (env == NULL || index < 0) {
+        return SYSERR;
+    }
+    for (; index < env->count; index++) {
+        if ((var = env->items[index]) == NULL) {
+            continue;
+        }
+        if (name != NULL) {
+            *name = var->name;
+        }
+        if (value != NULL) {
+            *value = str_data(&var->value);
+        }
+        if (exported != NULL) {
+            *exported = var->exported;
+        }
+        return index + 1;
+    }
+    
+    return SYSERR;
+}
+
+/* Entries set, and the bytes the table holds, itself included */
+void script_env_stats(const script_env_t *env, int32_t *vars,
+                      uint32_t *bytes) {
+    *vars = env != NULL ? env->live : 0;
+    *bytes = env != NULL ? sizeof(script_env_t) + env->arena.reserved : 0;
+}
+
+/*
+ * Let ctx read env's exported variables wherever it has none of its own
+ * by the name; NULL detaches it. Assignments stay in ctx, shadowing the
+ * shared value. Copies and clones of ctx stay attached.
+ */
+void script_attach_env(script_context_t *ctx, script_env_t *env) {
+    if (ctx != NULL) {
+        ctx->env = env;
+    }
+}
+
+static script_var_t* find_var_hashed(script_context_t *ctx, const char *name,
+                                     uint32_t hash, uint32_t *bucket) {
+    uint32_t mask = SCRIPT_VAR_BUCKETS - 1;
+    uint32_t b = hash & mask;
+    uint32_t n;
+    
+    for (n = 0; n <= mask; n++, b = (b + 1) & mask) {
+        int16_t slot = ctx->var_index[b];
+        
+        if (slot == INDEX_EMPTY) {
+            break;
+        }
+        if (slot >= 0 && ctx->vars[slot].hash == hash &&
+            strcmp(ctx->vars[slot].name, name) == 0) {
+            if (bucket != NULL) {
+                *bucket = b;
+            }
+            return &ctx->vars[slot];
+        }
+    }
+    
+    return NULL;
+}
+
+static script_var_t* find_var(script_context_t *ctx, const char *name) {
+    return find_var_hashed(ctx, name, name_hash(name), NULL);
+}
+
+static script_var_t* create_var_hashed(script_context_t *ctx, const char *name,
+                                       uint32_t hash) {
+    int i;
+    
+    /* Check if already exists */
+    script_var_t *var = find_var_hashed(ctx, name, hash, NULL);
+    if (var != NULL) {
+        return var;
+    }
+    
+    /* Find empty slot */
+    for (i = ctx->var_free; i < SCRIPT_MAX_VARS; i++) {
+        if (!ctx->vars[i].defined) {
+            ctx->vars[i].defined = true;
+            strncpy(ctx->vars[i].name, name, SCRIPT_VAR_NAME_LEN - 1);
+            ctx->vars[i].name[SCRIPT_VAR_NAME_LEN - 1] = '\0';
+            ctx->vars[i].hash = hash;
+            ctx->vars[i].type = VAR_TYPE_UNDEFINED;
+            ctx->vars[i].readonly = false;
+            ctx->var_count++;
+            ctx->var_free = i + 1;
+            index_insert(ctx->var_index, SCRIPT_VAR_BUCKETS - 1, hash, i);
+            return &ctx->vars[i];
+        }
+    }
+    
+    return NULL;
+}
+
+static script_var_t* create_var(script_context_t *ctx, const char *name) {
+    return create_var_hashed(ctx, name, name_hash(name));
+}
+
+/* Epochs start at 1, so a zero cache never matches */
+static uint64_t ref_load(const script_ref_t *ref) {
+#if defined(__GNUC__)
+    return __atomic_load_n(&ref->cache, __ATOMIC_RELAXED);
+#else
+    return ref->cache;
+#endif
+}
+
+static void ref_store(script_ref_t *ref, uint32_t epoch, int32_t slot) {
+    uint64_t cache = (uint64_t)epoch << 32 | (uint32_t)slot;
+    
+#if defined(__GNUC__)
+    __atomic_store_n(&ref->cache, cache, __ATOMIC_RELAXED);
+#else
+    ref->cache = cache;
+#endif
+}
+
+/* Resolve a compiled reference, caching the slot on success */
+static script_var_t* ref_var(script_context_t *ctx, script_ref_t *ref,
+                             const char *name, bool create) {
+    script_var_t *var;
+    uint64_t cache = ref_load(ref);
+    
+    if ((uint32_t)(cache >> 32) == ctx->var_epoch) {
+        return &ctx->vars[(uint32_t)cache];
+    }
+    
+    if (create) {
+        var = create_var_hashed(ctx, name, ref->hash);
+    } else {
+        var = find_var_hashed(ctx, name, ref->hash, NULL);
+    }
+    
+    if (var != NULL) {
+        ref_store(ref, ctx->var_epoch, var - ctx->vars);
+    }
+    
+    return var;
+}
+
+/* Typed read of a compiled variable; strings are borrowed */
+static void ref_value(script_context_t *ctx, script_ref_t *ref,
+                      const char *name, script_value_t *out) {
+    script_var_t *var = ref_var(ctx, ref, name, false);
+    script_env_var_t *shared;
+    
+    if (var == NULL) {
+        shared = env_visible(ctx, name, ref->hash);
+        if (shared != NULL) {
+            val_str(out, str_data(&shared->value), shared->value.len);
+        } else {
+            val_int(out, 0);
+        }
+        return;
+    }
+    
+    switch (var->type) {
+        case VAR_TYPE_INT:
+            val_int(out, var->value.int_val);
+            break;
+        case VAR_TYPE_FLOAT:
+            val_float(out, var->value.float_val);
+            break;
+        case VAR_TYPE_STRING:
+            val_str(out, str_data(&var->value.str_val),
+                    var->value.str_val.len);
+            break;
+        case VAR_TYPE_ARRAY:
+            val_array(out, var->value.array_val, false);
+            break;
+        default:
+            val_int(out, 0);
+            break;
+    }
+}
+
+/*
+ * Store a C value; strings and arrays are copied. The old value is freed
+ * only after the copy, since the new one may be borrowed from it.
+ */
+static int set_value(script_context_t *ctx, script_var_t *var,
+                     var_type_t type, void *value) {
+    script_array_t *old = NULL;
+    script_array_t *arr;
+    int result;
+    
+    if (var->readonly) {
+        return SYSERR;  /* Cannot modify readonly variable */
+    }
+    
+    if (type == VAR_TYPE_STRING) {
+        if (var->type == VAR_TYPE_ARRAY) {
+            old = var->value.array_val;
+        }
+        if (var->type != VAR_TYPE_STRING) {
+            var->value.str_val.cap = 0;
+            var->value.str_val.len = 0;
+        }
+        result = str_assign(&ctx->arena, &var->value.str_val, (char*)value);
+        var->type = result == OK ? VAR_TYPE_STRING : VAR_TYPE_UNDEFINED;
+        if (old != NULL) {
+            arr_free(ctx, old);
+        }
+        return result;
+    }
+    
+    if (type == VAR_TYPE_ARRAY) {
+        arr = value != NULL ? arr_copy(ctx, (script_array_t*)value) : NULL;
+        if (arr == NULL) {
+            return SYSERR;
+        }
+        clear_value(ctx, var);
+        var->type = type;
+        var->value.array_val = arr;
+        return OK;
+    }
+    
+    clear_value(ctx, var);
+    var->type = type;
+    
+    switch (type) {
+        case VAR_TYPE_INT:
+            var->value.int_val = *(int32_t*)value;
+            break;
+            
+        case VAR_TYPE_FLOAT:
+            var->value.float_val = *(double*)value;
+            break;
+            
+        default:
+            var->type = VAR_TYPE_UNDEFINED;
+            return SYSERR;
+    }
+    
+    return OK;
+}
+
+/* Store a typed value; owned arrays move into the variable */
+static int assign_value(script_context_t *ctx, script_var_t *var,
+                        script_value_t *v) {
+    if (v->type == VAR_TYPE_ARRAY && v->owned) {
+        if (var->readonly) {
+            return SYSERR;
+        }
+        clear_value(ctx, var);
+        var->type = VAR_TYPE_ARRAY;
+        var->value.array_val = v->v.array_val;
+        v->owned = false;
+        return OK;
+    }
+    
+    switch (v->type) {
+        case VAR_TYPE_INT:
+            return set_value(ctx, var, VAR_TYPE_INT, (void*)&v->v.int_val);
+        case VAR_TYPE_FLOAT:
+            return set_value(ctx, var, VAR_TYPE_FLOAT,
+                             (void*)&v->v.float_val);
+        case VAR_TYPE_STRING:
+            return set_value(ctx, var, VAR_TYPE_STRING, (void*)v->v.str_val);
+        case VAR_TYPE_ARRAY:
+            return set_value(ctx, var, VAR_TYPE_ARRAY, v->v.array_val);
+        default:
+            return SYSERR;
+    }
+}
+
+int script_set_var(script_context_t *ctx, const char *name,
+                   var_type_t type, void *value) {
+    script_var_t *var;
+    
+    if (ctx == NULL || name == NULL || value == NULL) {
+        return SYSERR;
+    }
+    
+    var = create_var(ctx, name);
+    if (var == NULL) {
+        return SYSERR;
+    }
+    
+    return set_value(ctx, var, type, value);
+}
+
+/*
+ * Copy the len-byte string s to value, which has room for size bytes,
+ * cut to fit and NUL-terminated. Returns the bytes the whole string
+ * needs, so more than size means it was cut.
+ */
+static int str_out(const char *s, uint32_t len, void *value, uint32_t size) {
+    uint32_t n;
+    
+    if (value != NULL && size > 0) {
+        n = len < size ? len : size - 1;
+        memcpy(value, s, n);
+        ((char*)value)[n] = '\0';
+    }
+    
+    return (int)(len + 1);
+}
+
+/*
+ * The variable's type and value, copied to value, which has room for
+ * size bytes: an int32_t, a double, a string cut to fit, or the
+ * array's pointer. Returns the bytes the value needs, so more than size
+ * means it was cut (or, for a number, not stored); SYSERR if unset.
+ * script_get_str() borrows a string instead.
+ */
+int script_get_var(script_context_t *ctx, const char *name,
+                   var_type_t *type, void *value, uint32_t size) {
+    script_env_var_t *shared;
+    script_var_t *var;
+    
+    if (ctx == NULL || name == NULL) {
+        return SYSERR;
+    }
+    
+    var = find_var(ctx, name);
+    if (var == NULL) {
+        /* Shared variables are strings, read where they are kept */
+        shared = env_visible(ctx, name, name_hash(name));
+        if (shared == NULL) {
+            return SYSERR;
+        }
+        if (type != NULL) {
+            *type = VAR_TYPE_STRING;
+        }
+        return str_out(str_data(&shared->value), shared->value.len,
+                       value, size);
+    }
+    
+    if (type != NULL) {
+        *type = var->type;
+    }
+    
+    switch (var->type) {
+        case VAR_TYPE_INT:
+            if (value != NULL && size >= sizeof(int32_t)) {
+                *(int32_t*)value = var->value.int_val;
+            }
+            return (int)sizeof(int32_t);
+            
+        case VAR_TYPE_FLOAT:
+            if (value != NULL && size >= sizeof(double)) {
+                *(double*)value = var->value.float_val;
+            }
+            return (int)sizeof(double);
+            
+        case VAR_TYPE_STRING:
+            return str_out(str_data(&var->value.str_val),
+                           var->value.str_val.len, value, size);
+            
+        case VAR_TYPE_ARRAY:
+            if (value != NULL && size >= sizeof(void*)) {
+                *(void**)value = var->value.array_val;
+            }
+            return (int)sizeof(void*);
+            
+        default:
+            return SYSERR;
+    }
+}
+
+int script_unset_var(script_context_t *ctx, const char *name) {
+    script_var_t *var;
+    uint32_t bucket;
+    
+    if (ctx == NULL || name == NULL) {
+        return SYSERR;
+    }
+    
+    var = find_var_hashed(ctx, name, name_hash(name), &bucket);
+    if (var == NULL) {
+        return SYSERR;
+    }
+    
+    if (var->readonly) {
+        return SYSERR;
+    }
+    
+    clear_value(ctx, var);
+    var->defined = false;
+    ctx->var_count--;
+    index_remove(ctx->var_index, SCRIPT_VAR_BUCKETS - 1, bucket);
+    
+    /* The slot may be reused, so drop every cached reference to it */
+    if (var - ctx->vars < ctx->var_free) {
+        ctx->var_free = var - ctx->vars;
+    }
+    ctx->var_epoch = next_epoch();
+    
+    return OK;
+}
+
+bool script_var_exists(script_context_t *ctx, const char *name) {
+    return find_var(ctx, name) != NULL ||
+           env_visible(ctx, name, name_hash(name)) != NULL;
+}
+
+/* Borrowed pointer to a string variable, valid until it is modified */
+const char* script_get_str(script_context_t *ctx, const char *name) {
+    script_env_var_t *shared;
+    script_var_t *var;
+    
+    if (ctx == NULL || name == NULL) {
+        return NULL;
+    }
+    
+    var = find_var(ctx, name);
+    if (var == NULL) {
+        shared = env_visible(ctx, name, name_hash(name));
+        return shared != NULL ? str_data(&shared->value) : NULL;
+    }
+    if (var->type != VAR_TYPE_STRING) {
+        return NULL;
+    }
+    
+    return str_data(&var->value.str_val);
+}
+
+
+/* View of a C value; strings and arrays are borrowed */
+static int val_from(var_type_t type, void *value, script_value_t *out) {
+    if (value == NULL) {
+        return SYSERR;
+    }
+    
+    switch (type) {
+        case VAR_TYPE_INT:
+            val_int(out, *(int32_t*)value);
+            return OK;
+        case VAR_TYPE_FLOAT:
+            val_float(out, *(double*)value);
+            return OK;
+        case VAR_TYPE_STRING:
+            val_str(out, (const char*)value, strlen((const char*)value));
+            return OK;
+        case VAR_TYPE_ARRAY:
+            val_array(out, (script_array_t*)value, false);
+            return OK;
+        default:
+            return SYSERR;
+    }
+}
+
+/* Same conventions as script_get_var() */
+static int val_out(const script_value_t *v, var_type_t *type, void *value,
+                   uint32_t size) {
+    if (type != NULL) {
+        *type = (var_type_t)v->type;
+    }
+    
+    switch (v->type) {
+        case VAR_TYPE_INT:
+            if (value != NULL && size >= sizeof(int32_t)) {
+                *(int32_t*)value = v->v.int_val;
+            }
+            return (int)sizeof(int32_t);
+        case VAR_TYPE_FLOAT:
+            if (value != NULL && size >= sizeof(double)) {
+                *(double*)value = v->v.float_val;
+            }
+            return (int)sizeof(double);
+        case VAR_TYPE_STRING:
+            return str_out(v->v.str_val, v->len, value, size);
+        case VAR_TYPE_ARRAY:
+            if (value != NULL && size >= sizeof(script_array_t*)) {
+                *(script_array_t**)value = v->v.array_val;
+            }
+            return (int)sizeof(script_array_t*);
+        default:
+            return SYSERR;
+    }
+}
+
+/* The list or map held by a variable */
+static script_array_t* find_array(script_context_t *ctx, const char *name,
+                                  bool map) {
+    script_var_t *var;
+    
+    if (ctx == NULL || name == NULL) {
+        return NULL;
+    }
+    
+    var = find_var(ctx, name);
+    if (var == NULL || var->type != VAR_TYPE_ARRAY ||
+        var->value.array_val->map != map) {
+        return NULL;
+    }
+    
+    return var->value.array_val;
+}
+
+int script_array_create(script_context_t *ctx, const char *name, bool map) {
+    script_var_t *var;
+    script_array_t *arr;
+    
+    if (ctx == NULL || name == NULL) {
+        return SYSERR;
+    }
+    
+    var = create_var(ctx, name);
+    if (var == NULL || var->readonly) {
+        return SYSERR;
+    }
+    
+    arr = arr_new(ctx, map);
+    if (arr == NULL) {
+        return SYSERR;
+    }
+    
+    clear_value(ctx, var);
+    var->type = VAR_TYPE_ARRAY;
+    var->value.array_val = arr;
+    
+    return OK;
+}
+
+/* Elements of a list or entries of a map */
+int32_t script_array_len(script_context_t *ctx, const char *name) {
+    script_var_t *var;
+    
+    if (ctx == NULL || name == NULL) {
+        return SYSERR;
+    }
+    
+    var = find_var(ctx, name);
+    if (var == NULL || var->type != VAR_TYPE_ARRAY) {
+        return SYSERR;
+    }
+    
+    return var->value.array_val->count;
+}
+
+/* Index len appends */
+int script_array_set(script_context_t *ctx, const char *name, int32_t index,
+                     var_type_t type, void *value) {
+    script_array_t *arr = find_array(ctx, name, false);
+    script_value_t v;
+    
+    if (arr == NULL || val_from(type, value, &v) != OK) {
+        return SYSERR;
+    }
+    
+    return arr_set(ctx, arr, index, &v);
+}
+
+int script_array_get(script_context_t *ctx, const char *name, int32_t index,
+                     var_type_t *type, void *value, uint32_t size) {
+    script_array_t *arr = find_array(ctx, name, false);
+    script_value_t *v;
+    
+    if (arr == NULL || (v = arr_get(arr, index)) == NULL) {
+        return SYSERR;
+    }
+    
+    return val_out(v, type, value, size);
+}
+
+int script_map_set(script_context_t *ctx, const char *name, const char *key,
+                   var_type_t type, void *value) {
+    script_array_t *arr = find_array(ctx, name, true);
+    script_value_t v;
+    
+    if (arr == NULL || key == NULL || val_from(type, value, &v) != OK) {
+        return SYSERR;
+    }
+    
+    return map_set(ctx, arr, key, &v);
+}
+
+int script_map_get(script_context_t *ctx, const char *name, const char *key,
+                   var_type_t *type, void *value, uint32_t size) {
+    script_array_t *arr = find_array(ctx, name, true);
+    script_value_t *v;
+    
+    if (arr == NULL || key == NULL || (v = map_get(arr, key)) == NULL) {
+        return SYSERR;
+    }
+    
+    return val_out(v, type, value, size);
+}
+
+/* Key of entry index in insertion order, for iterating a map */
+const char* script_map_key(script_context_t *ctx, const char *name,
+                           int32_t index) {
+    script_array_t *arr = find_array(ctx, name, true);
+    
+    if (arr == NULL || index < 0 || index >= arr->count) {
+        return NULL;
+    }
+    
+    return arr->keys[index].v.str_val;
+}
+
+
+static script_func_t* find_func_hashed(script_context_t *ctx, const char *name,
+                                       uint32_t hash, uint32_t *bucket) {
+    uint32_t mask = SCRIPT_FUNC_BUCKETS - 1;
+    uint32_t b = hash & mask;
+    uint32_t n;
+    
+    for (n = 0; n <= mask; n++, b = (b + 1) & mask) {
+        int16_t slot = ctx->func_index[b];
+        
+        if (slot == INDEX_EMPTY) {
+            break;
+        }
+        if (slot >= 0 && ctx->funcs[slot].hash == hash &&
+            strcmp(ctx->funcs[slot].name, name) == 0) {
+            if (bucket != NULL) {
+                *bucket = b;
+            }
+            return &ctx->funcs[slot];
+        }
+    }
+    
+    return NULL;
+}
+
+static script_func_t* find_func(script_context_t *ctx, const char *name) {
+    return find_func_hashed(ctx, name, name_hash(name), NULL);
+}
+
+static void remove_func(script_context_t *ctx, script_func_t *func) {
+    uint32_t bucket;
+    
+    if (find_func_hashed(ctx, func->name, func->hash, &bucket) != NULL) {
+        index_remove(ctx->func_index, SCRIPT_FUNC_BUCKETS - 1, bucket);
+    }
+    func->defined = false;
+    ctx->func_count--;
+}
+
+int script_define_func(script_context_t *ctx, const char *name,
+                       const char *body, int num_params) {
+    int i;
+    script_func_t *func;
+    
+    if (ctx == NULL || name == NULL || body == NULL ||
+        num_params < 0 || num_params > SCRIPT_MAX_LOCALS) {
+        return SYSERR;
+    }
+    
+    /* Check if already exists */
+    uint32_t hash = name_hash(name);
+    func = find_func_hashed(ctx, name, hash, NULL);
+    if (func != NULL) {
+        /* Free old body; a snapshot's is only let go */
+        if (!func->shared) {
+            if (func->body != NULL) {
+                arena_free(&ctx->arena, func->body, func->body_len);
+            }
+            script_free_code(func->code);
+        }
+        func->shared = false;
+        func->body = NULL;
+        func->code = NULL;
+    } else {
+        /* Find empty slot */
+        for (i = 0; i < SCRIPT_MAX_FUNCS; i++) {
+            if (!ctx->funcs[i].defined) {
+                func = &ctx->funcs[i];
+                func->defined = true;
+                strncpy(func->name, name, SCRIPT_VAR_NAME_LEN - 1);
+                func->name[SCRIPT_VAR_NAME_LEN - 1] = '\0';
+                func->hash = hash;
+                ctx->func_count++;
+                index_insert(ctx->func_index, SCRIPT_FUNC_BUCKETS - 1,
+                             hash, i);
+                break;
+            }
+        }
+        
+        if (func == NULL) {
+            return SYSERR;
+        }
+    }
+    
+    /* Allocate and copy body */
+    func->body_len = strlen(body) + 1;
+    func->body = (char*)arena_alloc(&ctx->arena, func->body_len);
+    if (func->body == NULL) {
+        remove_func(ctx, func);
+        return SYSERR;
+    }
+    
+    strcpy(func->body, body);
+    func->num_params = num_params;
+    
+    /* Compile once so calls skip parsing */
+    func->code = compile_func(&ctx->arena, body, num_params);
+    if (func->code == NULL) {
+        arena_free(&ctx->arena, func->body, func->body_len);
+        func->body = NULL;
+        remove_func(ctx, func);
+        return SYSERR;
+    }
+    
+    return OK;
+}
+
+/* Reserve a frame for code; its slots start out as 0 */
+static int push_frame(script_context_t *ctx, script_code_t *code) {
+    script_value_t *locals;
+    int32_t cap, i;
+    
+    if (ctx->call_sp >= SCRIPT_MAX_STACK) {
+        return SYSERR;  /* Stack overflow */
+    }
+    
+    if (ctx->local_sp + code->local_count > ctx->local_cap) {
+        cap = ctx->local_cap == 0 ? SCRIPT_MAX_LOCALS : 2 * ctx->local_cap;
+        while (cap < ctx->local_sp + code->local_count) cap *= 2;
+        
+        locals = (script_value_t*)arena_alloc(&ctx->arena,
+                                              cap * sizeof(script_value_t));
+        if (locals == NULL) {
+            return SYSERR;
+        }
+        
+        /* Strings are separate blocks, so the slots move as they are */
+        if (ctx->local_sp > 0) {
+            memcpy(locals, ctx->locals, ctx->local_sp * sizeof(script_value_t));
+        }
+        if (ctx->locals != NULL) {
+            arena_free(&ctx->arena, ctx->locals,
+                       ctx->local_cap * sizeof(script_value_t));
+        }
+        ctx->locals = locals;
+        ctx->local_cap = cap;
+    }
+    
+    ctx->frames[ctx->call_sp].ret_line = ctx->line_num;
+    ctx->frames[ctx->call_sp].base = ctx->local_sp;
+    ctx->call_sp++;
+    
+    for (i = 0; i < code->local_count; i++) {
+        val_int(&ctx->locals[ctx->local_sp++], 0);
+    }
+    
+    return OK;
+}
+
+static void pop_frame(script_context_t *ctx) {
+    script_frame_t *frame = &ctx->frames[--ctx->call_sp];
+    
+    while (ctx->local_sp > frame->base) {
+        val_release(ctx, &ctx->locals[--ctx->local_sp]);
+    }
+    ctx->line_num = frame->ret_line;
+}
+
+/* Slot of the innermost frame */
+static script_value_t* frame_slot(script_context_t *ctx, int32_t slot) {
+    return &ctx->locals[ctx->frames[ctx->call_sp - 1].base + slot];
+}
+
+/* Store a value in a slot of the innermost frame; see val_store() */
+static int set_local(script_context_t *ctx, int32_t slot, script_value_t *v) {
+    script_value_t *local;
+    script_value_t copy;
+    
+    if (val_store(ctx, &copy, v) != OK) {
+        return SYSERR;
+    }
+    
+    local = frame_slot(ctx, slot);
+    val_release(ctx, local);
+    *local = copy;
+    
+    return OK;
+}
+
+/* Unit for code outside any function, named main in dumps */
+#define PROF_TOP        SCRIPT_MAX_FUNCS
+
+/* Counters of one function, or of the top level; lines by number */
+typedef struct prof_unit {
+    char        name[SCRIPT_VAR_NAME_LEN];
+    uint32_t    hash;
+    uint64_t    calls;
+    uint64_t    ns;             /* Inclusive; each level of recursion */
+    uint64_t    *hits;
+    uint64_t    *line_ns;
+    int32_t     line_cap;
+} prof_unit_t;
+
+/* One distinct call stack: a unit called from its parent's stack */
+typedef struct prof_node {
+    int32_t     unit;
+    int32_t     parent;
+    int32_t     child;          /* First callee, -1 if none */
+    int32_t     sibling;        /* Next callee of the parent */
+    uint64_t    ns;             /* Self time */
+} prof_node_t;
+
+/*
+ * Profile of one context. Time is charged at each instruction to the
+ * line and call stack it ran in, so a line's time includes any builtin
+ * it calls but not script functions, which have their own nodes.
+ */
+struct script_profile {
+    prof_unit_t units[SCRIPT_MAX_FUNCS + 1];
+    prof_node_t *nodes;
+    int32_t     node_count;
+    int32_t     node_cap;
+    int32_t     node;           /* Stack being charged */
+    int32_t     line;           /* Line being charged, 0 if none */
+    uint64_t    mark;           /* When the charge started */
+};
+
+/* Where a call left off in its caller */
+typedef struct prof_frame {
+    int32_t     node;
+    int32_t     line;
+    uint64_t    start;
+} prof_frame_t;
+
+/* Nanoseconds on a clock that never steps back */
+static uint64_t prof_clock(void) {
+#if defined(XINU_KERNEL)
+    return (uint64_t)ctr1000 * 1000000ULL;
+#elif defined(_WIN32)
+    return (uint64_t)clock() * (1000000000ULL / CLOCKS_PER_SEC);
+#else
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static void prof_unit_clear(prof_unit_t *unit) {
+    if (unit->line_cap > 0) {
+        freemem(unit->hits, unit->line_cap * sizeof(uint64_t));
+        freemem(unit->line_ns, unit->line_cap * sizeof(uint64_t));
+    }
+    memset(unit, 0, sizeof(prof_unit_t));
+}
+
+/* Room for counters of line; false if memory ran out */
+static bool prof_unit_reserve(prof_unit_t *unit, int32_t line) {
+    uint64_t *hits, *line_ns;
+    int32_t cap;
+    
+    if (line < unit->line_cap) {
+        return true;
+    }
+    
+    for (cap = unit->line_cap == 0 ? 64 : 2 * unit->line_cap; cap <= line;
+         cap *= 2) {
+        ;
+    }
+    hits = (uint64_t*)getmem(cap * sizeof(uint64_t));
+    line_ns = (uint64_t*)getmem(cap * sizeof(uint64_t));
+    if (hits == NULL || line_ns == NULL) {
+        if (hits != NULL) {
+            freemem(hits, cap * sizeof(uint64_t));
+        }
+        if (line_ns != NULL) {
+            freemem(line_ns, cap * sizeof(uint64_t));
+        }
+        return false;
+    }
+    memset(hits, 0, cap * sizeof(uint64_t));
+    memset(line_ns, 0, cap * sizeof(uint64_t));
+    if (unit->line_cap > 0) {
+        memcpy(hits, unit->hits, unit->line_cap * sizeof(uint64_t));
+        memcpy(line_ns, unit->line_ns, unit->line_cap * sizeof(uint64_t));
+        freemem(unit->hits, unit->line_cap * sizeof(uint64_t));
+        freemem(unit->line_ns, unit->line_cap * sizeof(uint64_t));
+    }
+    unit->hits = hits;
+    unit->line_ns = line_ns;
+    unit->line_cap = cap;
+    
+    return true;
+}
+
+/* Charge the time since the last mark to the current line and stack */
+static void prof_charge(script_profile_t *p, uint64_t now) {
+    prof_unit_t *unit = &p->units[p->nodes[p->node].unit];
+    uint64_t spent = now - p->mark;
+    
+    p->nodes[p->node].ns += spent;
+    if (p->line > 0 && p->line < unit->line_cap) {
+        unit->line_ns[p->line] += spent;
+    }
+    p->mark = now;
+}
+
+/* An instruction of line is about to run; first if it starts the line */
+static void prof_line(script_profile_t *p, int32_t line, bool first) {
+    prof_unit_t *unit = &p->units[p->nodes[p->node].unit];
+    
+    prof_charge(p, prof_clock());
+    p->line = line;
+    if (first && line > 0 && prof_unit_reserve(unit, line)) {
+        unit->hits[line]++;
+    }
+}
+
+/* Callee of the current stack running func, made on first call */
+static int32_t prof_node_for(script_profile_t *p, int32_t unit) {
+    prof_node_t *nodes;
+    int32_t i, cap;
+    
+    for (i = p->nodes[p->node].child; i >= 0; i = p->nodes[i].sibling) {
+        if (p->nodes[i].unit == unit) {
+            return i;
+        }
+    }
+    
+    if (p->node_count == p->node_cap) {
+        cap = 2 * p->node_cap;
+        nodes = (prof_node_t*)getmem(cap * sizeof(prof_node_t));
+        if (nodes == NULL) {
+            return SYSERR;
+        }
+        memcpy(nodes, p->nodes, p->node_count * sizeof(prof_node_t));
+        freemem(p->nodes, p->node_cap * sizeof(prof_node_t));
+        p->nodes = nodes;
+        p->node_cap = cap;
+    }
+    
+    i = p->node_count++;
+    p->nodes[i].unit = unit;
+    p->nodes[i].parent = p->node;
+    p->nodes[i].child = -1;
+    p->nodes[i].sibling = p->nodes[p->node].child;
+    p->nodes[i].ns = 0;
+    p->nodes[p->node].child = i;
+    
+    return i;
+}
+
+/*
+ * Enter func: settle the caller's time and switch to the callee's stack.
+ * A call from outside any run starts the clock afresh, so the time
+ * between runs is charged to nothing.
+ */
+static void prof_enter(script_context_t *ctx, script_func_t *func,
+                       prof_frame_t *frame) {
+    script_profile_t *p = ctx->profile;
+    int32_t slot = (int32_t)(func - ctx->funcs);
+    prof_unit_t *unit = &p->units[slot];
+    uint64_t now = prof_clock();
+    int32_t node;
+    
+    if (ctx->running) {
+        prof_charge(p, now);
+    }
+    frame->node = p->node;
+    frame->line = p->line;
+    frame->start = now;
+    
+    /* The slot may have been reused by a different function */
+    if (unit->hash != func->hash || strcmp(unit->name, func->name) != 0) {
+        prof_unit_clear(unit);
+        strcpy(unit->name, func->name);
+        unit->hash = func->hash;
+    }
+    unit->calls++;
+    
+    node = prof_node_for(p, slot);
+    if (node != SYSERR) {
+        p->node = node;
+    }
+    p->line = 0;
+    p->mark = now;
+}
+
+static void prof_leave(script_context_t *ctx, script_func_t *func,
+                       const prof_frame_t *frame) {
+    script_profile_t *p = ctx->profile;
+    uint64_t now = prof_clock();
+    
+    prof_charge(p, now);
+    p->units[func - ctx->funcs].ns += now - frame->start;
+    p->node = frame->node;
+    p->line = frame->line;
+}
+
+static void prof_free(script_context_t *ctx) {
+    script_profile_t *p = ctx->profile;
+    int32_t i;
+    
+    if (p == NULL) {
+        return;
+    }
+    for (i = 0; i <= PROF_TOP; i++) {
+        prof_unit_clear(&p->units[i]);
+    }
+    freemem(p->nodes, p->node_cap * sizeof(prof_node_t));
+    freemem(p, sizeof(script_profile_t));
+    ctx->profile = NULL;
+}
+
+/*
+ * Count executions and time of every line and function ctx runs from
+ * now on. Off by default; when off the only cost is a NULL test per
+ * instruction and call. Not while ctx is running.
+ */
+int script_profile_start(script_context_t *ctx) {
+    script_profile_t *p;
+    
+    if (ctx == NULL || ctx->running) {
+        return SYSERR;
+    }
+    if (ctx->profile != NULL) {
+        return OK;
+    }
+    
+    p = (script_profile_t*)getmem(sizeof(script_profile_t));
+    if (p == NULL) {
+        return SYSERR;
+    }
+    memset(p, 0, sizeof(script_profile_t));
+    p->node_cap = 64;
+    p->nodes = (prof_node_t*)getmem(p->node_cap * sizeof(prof_node_t));
+    if (p->nodes == NULL) {
+        freemem(p, sizeof(script_profile_t));
+        return SYSERR;
+    }
+    
+    /* The root stands for the top level */
+    strcpy(p->units[PROF_TOP].name, "main");
+    p->nodes[0].unit = PROF_TOP;
+    p->nodes[0].parent = -1;
+    p->nodes[0].child = -1;
+    p->nodes[0].sibling = -1;
+    p->nodes[0].ns = 0;
+    p->node_count = 1;
+    p->mark = prof_clock();
+    ctx->profile = p;
+    
+    return OK;
+}
+
+/* Stop profiling and drop the counters; dump them first to keep them */
+int script_profile_stop(script_context_t *ctx) {
+    if (ctx == NULL || ctx->running) {
+        return SYSERR;
+    }
+    
+    prof_free(ctx);
+    return OK;
+}
+
+/* Unit of the function called name, or of the top level for NULL */
+static prof_unit_t* prof_find_unit(script_context_t *ctx, const char *name) {
+    script_profile_t *p = ctx != NULL ? ctx->profile : NULL;
+    int32_t i;
+    
+    if (p == NULL) {
+        return NULL;
+    }
+    if (name == NULL) {
+        return &p->units[PROF_TOP];
+    }
+    for (i = 0; i < PROF_TOP; i++) {
+        if (p->units[i].calls > 0 && strcmp(p->units[i].name, name) == 0) {
+            return &p->units[i];
+        }
+    }
+    
+    return NULL;
+}
+
+/* Calls of a function and their time, recursion counted at each level */
+int script_profile_func(script_context_t *ctx, const char *name,
+                        uint64_t *calls, uint64_t *ns) {
+    prof_unit_t *unit = prof_find_unit(ctx, name);
+    
+    if (unit == NULL || name == NULL) {
+        return SYSERR;
+    }
+    
+    *calls = unit->calls;
+    *ns = unit->ns;
+    return OK;
+}
+
+/*
+ * Times a line of a function, or of the top level for a NULL name, was
+ * started and the time spent in it. Function lines count from its body.
+ */
+int script_profile_line(script_context_t *ctx, const char *name,
+                        int32_t line, uint64_t *hits, uint64_t *ns) {
+    prof_unit_t *unit = prof_find_unit(ctx, name);
+    
+    if (unit == NULL || line <= 0) {
+        return SYSERR;
+    }
+    
+    *hits = line < unit->line_cap ? unit->hits[line] : 0;
+    *ns = line < unit->line_cap ? unit->line_ns[line] : 0;
+    return OK;
+}
+
+/*
+ * Write the profile as folded stacks, "main;f;g 1200" per distinct call
+ * stack with its self time in microseconds, as flamegraph.pl reads it.
+ * Returns the length of the whole text, which like snprintf may be more
+ * than fits in buf; SYSERR when ctx is not being profiled.
+ */
+int32_t script_profile_dump(script_context_t *ctx, char *buf, uint32_t size) {
+    script_profile_t *p = ctx != NULL ? ctx->profile : NULL;
+    int32_t path[SCRIPT_MAX_STACK + 1];
+    uint32_t len = 0;
+    int32_t i, n, j;
+    
+    if (p == NULL) {
+        return SYSERR;
+    }
+    if (buf != NULL && size > 0) {
+        buf[0] = '\0';
+    }
+    
+    for (i = 0; i < p->node_count; i++) {
+        if (p->nodes[i].ns < 1000) {
+            continue;
+        }
+        
+        /* Root first; a stack deeper than calls can nest is cut */
+        n = 0;
+        for (j = i; j >= 0 && n <= SCRIPT_MAX_STACK; j = p->nodes[j].parent) {
+            path[n++] = p->nodes[j].unit;
+        }
+        while (n-- > 0) {
+            len += snprintf(len < size ? buf + len : NULL,
+                            len < size ? size - len : 0, "%s%s",
+                            p->units[path[n]].name, n > 0 ? ";" : "");
+        }
+        len += snprintf(len < size ? buf + len : NULL,
+                        len < size ? size - len : 0, " %lu\n",
+                        (unsigned long)(p->nodes[i].ns / 1000));
+    }
+    
+    return (int32_t)len;
+}
+
+/* Run a function body in the frame pushed for it; a return ends the call */
+static int invoke_func(script_context_t *ctx, script_func_t *func) {
+    bool was_running = ctx->running;
+    bool profiled = ctx->profile != NULL;
+    prof_frame_t frame = { 0, 0, 0 };
+    int result;
+    
+    /* Falling off the end returns 0 */
+    val_release(ctx, &ctx->ret);
+    val_int(&ctx->ret, 0);
+    
+    if (profiled) {
+        prof_enter(ctx, func, &frame);
+    }
+    
+    ctx->running = true;
+    result = exec_code(ctx, func->code);
+    ctx->running = was_running;
+    
+    if (profiled) {
+        prof_leave(ctx, func, &frame);
+    }
+    
+    pop_frame(ctx);
+    
+    return result;
+}
+
+/* Bind argument i to its parameter slot; extra arguments are dropped */
+static int bind_arg(script_context_t *ctx, script_func_t *func, int i,
+                    script_value_t *v) {
+    if (i >= func->num_params) {
+        return OK;
+    }
+    
+    return set_local(ctx, i, v);
+}
+
+int script_call_func(script_context_t *ctx, const char *name,
+                     int argc, char **argv) {
+    script_func_t *func;
+    script_value_t v;
+    int i;
+    
+    if (ctx == NULL || name == NULL) {
+        return SYSERR;
+    }
+    
+    func = find_func(ctx, name);
+    if (func == NULL || push_frame(ctx, func->code) != OK) {
+        return SYSERR;
+    }
+    
+    /* Numeric arguments arrive as numbers, the rest as strings */
+    for (i = 0; i < argc; i++) {
+        val_parse(argv[i], &v);
+        if (bind_arg(ctx, func, i, &v) != OK) {
+            pop_frame(ctx);
+            return SYSERR;
+        }
+    }
+    
+    invoke_func(ctx, func);
+    
+    return ctx->exit_code;
+}
+
+/*
+ * Call from an expression with typed arguments. The return value moves
+ * into result, which the caller then owns. The function's return is a
+ * value here, not the script's status, so exit_code is left as it was.
+ */
+static int call_func_values(script_context_t *ctx, script_func_t *func,
+                            int argc, script_value_t *args,
+                            script_value_t *result) {
+    int32_t exit_code = ctx->exit_code;
+    int i, status;
+    
+    if (push_frame(ctx, func->code) != OK) {
+        return SYSERR;
+    }
+    
+    for (i = 0; i < argc; i++) {
+        if (bind_arg(ctx, func, i, &args[i]) != OK) {
+            pop_frame(ctx);
+            return SYSERR;
+        }
+    }
+    
+    status = invoke_func(ctx, func);
+    ctx->exit_code = exit_code;
+    if (status != OK) {
+        return SYSERR;
+    }
+    
+    *result = ctx->ret;
+    val_int(&ctx->ret, 0);
+    return OK;
+}
+
+
+/*
+ * Open if/while/for block. Jumps whose destination is not known yet are
+ * chained through their target fields and patched when the block closes.
+ */
+typedef struct code_block {
+    uint8_t     kind;           /* OP_IF, OP_WHILE, or OP_NOP for a for */
+    bool        has_else;
+    int32_t     test;           /* Pending conditional jump, or -1 */
+    int32_t     head;           /* Loop: pc of the condition test */
+    int32_t     ends;           /* If: jumps to the end of the chain */
+    int32_t     breaks;         /* Loop: jumps past the loop */
+    int32_t     continues;      /* For: jumps to the step statement */
+    char        *step;          /* For: step statement, or NULL */
+} code_block_t;
+
+/* Scratch state while compiling; copied into a compact script_code_t */
+typedef struct code_builder {
+    script_arena_t  *arena;
+    script_insn_t   *insns;
+    int32_t         insn_count;
+    script_eop_t    *ops;
+    int32_t         op_count;
+    int32_t         op_cap;
+    bool            ops_owned;      /* ops came from scratch_alloc() */
+    char            *pool;
+    uint32_t        pool_used;
+    uint32_t        pool_cap;
+    int32_t         depth;
+    int32_t         max_depth;
+    int32_t         nest;
+    bool            failed;         /* Out of memory, too deep or unbalanced */
+    script_code_label_t *labels;
+    int32_t         label_count;
+    code_block_t    blocks[SCRIPT_MAX_NEST];
+    int32_t         block_count;
+    
+    /* Function bodies: arg0.. are slots 0.., then locals as declared */
+    bool            func;
+    int32_t         params;
+    int32_t         local_names[SCRIPT_MAX_LOCALS];
+    int32_t         local_count;
+} code_builder_t;
+
+#define EXPR_MAX_NEST   64
+
+static void* scratch_alloc(script_arena_t *arena, uint32_t size) {
+    return arena != NULL ? arena_alloc(arena, size) : getmem(size);
+}
+
+static void scratch_free(script_arena_t *arena, void *block, uint32_t size) {
+    if (block == NULL) {
+        return;
+    }
+    
+    if (arena != NULL) {
+        arena_free(arena, block, size);
+    } else {
+        freemem(block, size);
+    }
+}
+
+static char* skip_ws(const char *p) {
+    while (*p == ' ' || *p == '\t') p++;
+    return (char*)p;
+}
+
+static int32_t pool_add(code_builder_t *b, const char *s, uint32_t len) {
+    int32_t off = b->pool_used;
+    
+    if (b->pool_used + len + 1 > b->pool_cap) {
+        b->failed = true;
+        return -1;
+    }
+    
+    memcpy(b->pool + off, s, len);
+    b->pool[off + len] = '\0';
+    b->pool_used += len + 1;
+    
+    return off;
+}
+
+/* Net stack effect of each expression op */
+static int32_t eop_effect(uint8_t op, int32_t imm) {
+    switch (op) {
+        case EOP_PUSH:
+        case EOP_PUSHF:
+        case EOP_PUSHS:
+        case EOP_LOAD:
+        case EOP_LOCAL:
+        case EOP_LIST:
+        case EOP_MAP:
+            return 1;
+        case EOP_INSERT:
+            return -2;
+        case EOP_CALL:
+            return 1 - imm;
+        case EOP_END:
+        case EOP_NEG:
+        case EOP_NOT:
+        case EOP_BNOT:
+        case EOP_BOOL:
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+static script_eop_t* emit_op(code_builder_t *b, uint8_t op, int32_t imm) {
+    script_eop_t *eop;
+    
+    if (b->failed) {
+        return NULL;
+    }
+    
+    if (b->op_count == b->op_cap) {
+        int32_t cap = b->op_cap < 16 ? 16 : b->op_cap * 2;
+        script_eop_t *ops = (script_eop_t*)scratch_alloc(b->arena,
+                                cap * sizeof(script_eop_t));
+        if (ops == NULL) {
+            b->failed = true;
+            return NULL;
+        }
+        if (b->op_count > 0) {
+            memcpy(ops, b->ops, b->op_count * sizeof(script_eop_t));
+        }
+        if (b->ops_owned) {
+            scratch_free(b->arena, b->ops, b->op_cap * sizeof(script_eop_t));
+        }
+        b->ops = ops;
+        b->op_cap = cap;
+        b->ops_owned = true;
+    }
+    
+    b->depth += eop_effect(op, imm);
+    if (b->depth > b->max_depth) {
+        b->max_depth = b->depth;
+        if (b->max_depth > SCRIPT_EXPR_STACK) {
+            b->failed = true;
+            return NULL;
+        }
+    }
+    
+    eop = &b->ops[b->op_count++];
+    eop->op = op;
+    eop->imm = imm;
+    eop->name = -1;
+    eop->ref.hash = 0;
+    eop->ref.cache = 0;
+    
+    return eop;
+}
+
+static int32_t parse_number(const char **pp) {
+    const char *p = *pp;
+    uint32_t result = 0;
+    
+    if (*p == '0' && (*(p + 1) == 'x' || *(p + 1) == 'X')) {
+        /* Hexadecimal */
+        p += 2;
+        while (isxdigit((unsigned char)*p)) {
+            result = result * 16;
+            if (*p >= '0' && *p <= '9') {
+                result += *p - '0';
+            } else if (*p >= 'a' && *p <= 'f') {
+                result += *p - 'a' + 10;
+            } else if (*p >= 'A' && *p <= 'F') {
+                result += *p - 'A' + 10;
+            }
+            p++;
+        }
+    } else if (*p == '0' && *(p + 1) >= '0' && *(p + 1) <= '7') {
+        /* Octal */
+        p++;
+        while (*p >= '0' && *p <= '7') {
+            result = result * 8 + (*p - '0');
+            p++;
+        }
+    } else {
+        /* Decimal */
+        while (*p >= '0' && *p <= '9') {
+            result = result * 10 + (*p - '0');
+            p++;
+        }
+    }
+    
+    *pp = p;
+    return (int32_t)result;
+}
+
+/* Shared by constant folding and evaluation; false on division by 0 */
+static bool apply_binary(uint8_t op, int32_t x, int32_t y, int32_t *out) {
+    uint32_t ux = (uint32_t)x;
+    uint32_t uy = (uint32_t)y;
+    
+    switch (op) {
+        case EOP_MUL:  *out = (int32_t)(ux * uy); break;
+        case EOP_ADD:  *out = (int32_t)(ux + uy); break;
+        case EOP_SUB:  *out = (int32_t)(ux - uy); break;
+        case EOP_SHL:  *out = (int32_t)(ux << (uy & 31)); break;
+        case EOP_SHR:  *out = x >> (uy & 31); break;
+        case EOP_LT:   *out = x < y; break;
+        case EOP_LE:   *out = x <= y; break;
+        case EOP_GT:   *out = x > y; break;
+        case EOP_GE:   *out = x >= y; break;
+        case EOP_EQ:   *out = x == y; break;
+        case EOP_NE:   *out = x != y; break;
+        case EOP_BAND: *out = x & y; break;
+        case EOP_BXOR: *out = x ^ y; break;
+        case EOP_BOR:  *out = x | y; break;
+        case EOP_DIV:
+        case EOP_MOD:
+            if (y == 0) {
+                return false;
+            }
+            if (y == -1) {
+                /* Avoid the INT32_MIN / -1 trap */
+                *out = op == EOP_DIV ? (int32_t)(0u - ux) : 0;
+            } else {
+                *out = op == EOP_DIV ? x / y : x % y;
+            }
+            break;
+        default:
+            return false;
+    }
+    
+    return true;
+}
+
+static int32_t apply_unary(uint8_t op, int32_t x) {
+    switch (op) {
+        case EOP_NEG:  return (int32_t)(0u - (uint32_t)x);
+        case EOP_NOT:  return !x;
+        case EOP_BNOT: return ~x;
+        default:       return x != 0;
+    }
+}
+
+/* Binary operator at p; returns the opcode or -1 */
+static int binary_op(const char *p, int *prec, int *len) {
+    *len = 2;
+    
+    if (p[0] == '|' && p[1] == '|') { *prec = 1; return EOP_OR; }
+    if (p[0] == '&' && p[1] == '&') { *prec = 2; return EOP_AND; }
+    if (p[0] == '=' && p[1] == '=') { *prec = 6; return EOP_EQ; }
+    if (p[0] == '!' && p[1] == '=') { *prec = 6; return EOP_NE; }
+    if (p[0] == '<' && p[1] == '=') { *prec = 7; return EOP_LE; }
+    if (p[0] == '>' && p[1] == '=') { *prec = 7; return EOP_GE; }
+    if (p[0] == '<' && p[1] == '<') { *prec = 8; return EOP_SHL; }
+    if (p[0] == '>' && p[1] == '>') { *prec = 8; return EOP_SHR; }
+    
+    *len = 1;
+    
+    switch (*p) {
+        case '|': *prec = 3; return EOP_BOR;
+        case '^': *prec = 4; return EOP_BXOR;
+        case '&': *prec = 5; return EOP_BAND;
+        case '<': *prec = 7; return EOP_LT;
+        case '>': *prec = 7; return EOP_GT;
+        case '+': *prec = 9; return EOP_ADD;
+        case '-': *prec = 9; return EOP_SUB;
+        case '*': *prec = 10; return EOP_MUL;
+        case '/': *prec = 10; return EOP_DIV;
+        case '%': *prec = 10; return EOP_MOD;
+        default:  return -1;
+    }
+}
+
+/* Frame slot of a name in a function body, or -1 for a global */
+static int32_t find_local(const code_builder_t *b, const char *name,
+                          int32_t len) {
+    int32_t i, n = 0;
+    
+    if (!b->func) {
+        return -1;
+    }
+    
+    /* argN, spelled as the old globals were */
+    if (len > 3 && len <= 5 && strncmp(name, "arg", 3) == 0 &&
+        (len == 4 || name[3] != '0')) {
+        for (i = 3; i < len && isdigit((unsigned char)name[i]); i++) {
+            n = n * 10 + (name[i] - '0');
+        }
+        if (i == len && n < b->params) {
+            return n;
+        }
+    }
+    
+    for (i = b->params; i < b->local_count; i++) {
+        const char *local = b->pool + b->local_names[i];
+        
+        if (strncmp(local, name, len) == 0 && local[len] == '\0') {
+            return i;
+        }
+    }
+    
+    return -1;
+}
+
+static bool is_const(const code_builder_t *b, int32_t start) {
+    return b->op_count == start + 1 && b->ops[start].op == EOP_PUSH;
+}
+
+static bool parse_expr(code_builder_t *b, const char **pp, int min_prec);
+
+static double eop_float(const script_eop_t *eop) {
+    uint64_t bits = (uint32_t)eop->imm | (uint64_t)(uint32_t)eop->name << 32;
+    double d;
+    
+    memcpy(&d, &bits, sizeof(d));
+    return d;
+}
+
+/* Decimal with a fraction or exponent; hex and octal stay integers */
+static bool is_float_literal(const char *p) {
+    if (*p == '0' && (p[1] == 'x' || p[1] == 'X')) {
+        return false;
+    }
+    
+    while (isdigit((unsigned char)*p)) p++;
+    
+    if (*p == '.') {
+        return true;
+    }
+    if (*p == 'e' || *p == 'E') {
+        p++;
+        if (*p == '+' || *p == '-') p++;
+        return isdigit((unsigned char)*p);
+    }
+    
+    return false;
+}
+
+/* Quoted string with \n, \t and backslash escapes, unescaped into the pool */
+static bool parse_string(code_builder_t *b, const char **pp) {
+    const char *p = *pp + 1;
+    int32_t off = b->pool_used;
+    uint32_t len = 0;
+    script_eop_t *eop;
+    char c;
+    
+    for (; *p != '"'; p++) {
+        c = *p;
+        if (c == '\0') {
+            return false;
+        }
+        if (c == '\\') {
+            switch (*++p) {
+                case 'n':  c = '\n'; break;
+                case 't':  c = '\t'; break;
+                case '\0': return false;
+                default:   c = *p; break;
+            }
+        }
+        if (off + len + 1 >= b->pool_cap) {
+            b->failed = true;
+            return false;
+        }
+        b->pool[off + len++] = c;
+    }
+    b->pool[off + len] = '\0';
+    b->pool_used += len + 1;
+    
+    eop = emit_op(b, EOP_PUSHS, len);
+    if (eop == NULL) {
+        return false;
+    }
+    eop->name = off;
+    *pp = p + 1;
+    
+    return true;
+}
+
+/* [a, b, ...] or {key: value, ...}; bare identifiers as keys are strings */
+static bool parse_literal(code_builder_t *b, const char **pp) {
+    const char *p = *pp;
+    const char *key;
+    bool map = *p == '{';
+    char close = map ? '}' : ']';
+    
+    if (emit_op(b, map ? EOP_MAP : EOP_LIST, 0) == NULL) {
+        return false;
+    }
+    
+    p = skip_ws(p + 1);
+    while (*p != close) {
+        if (map) {
+            for (key = p; isalnum((unsigned char)*p) || *p == '_'; p++) {
+                ;
+            }
+            if (p > key && !isdigit((unsigned char)*key) &&
+                *skip_ws(p) == ':') {
+                script_eop_t *eop = emit_op(b, EOP_PUSHS, p - key);
+                if (eop == NULL || (eop->name = pool_add(b, key, p - key)) < 0) {
+                    return false;
+                }
+            } else {
+                p = key;
+                if (!parse_expr(b, &p, 0)) {
+                    return false;
+                }
+            }
+            p = skip_ws(p);
+            if (*p++ != ':') {
+                return false;
+            }
+        }
+        
+        if (!parse_expr(b, &p, 0) ||
+            emit_op(b, map ? EOP_INSERT : EOP_APPEND, 0) == NULL) {
+            return false;
+        }
+        
+        p = skip_ws(p);
+        if (*p == ',') {
+            p = skip_ws(p + 1);
+        } else if (*p != close) {
+            return false;
+        }
+    }
+    
+    *pp = p + 1;
+    return true;
+}
+
+static bool parse_atom(code_builder_t *b, const char **pp) {
+    const char *p = skip_ws(*pp);
+    const char *name;
+    script_eop_t *eop;
+    int32_t len, slot, argc = 0;
+    
+    if (*p == '[' || *p == '{') {
+        *pp = p;
+        return parse_literal(b, pp);
+    }
+    
+    if (*p == '(') {
+        p++;
+        if (!parse_expr(b, &p, 0)) {
+            return false;
+        }
+        p = skip_ws(p);
+        if (*p != ')') {
+            return false;
+        }
+        *pp = p + 1;
+        return true;
+    }
+    
+    if ((*p >= '0' && *p <= '9') ||
+        (*p == '.' && isdigit((unsigned char)p[1]))) {
+        if (is_float_literal(p)) {
+            char *end;
+            double d = strtod(p, &end);
+            
+            uint64_t bits;
+            
+            eop = emit_op(b, EOP_PUSHF, 0);
+            if (eop == NULL) {
+                return false;
+            }
+            memcpy(&bits, &d, sizeof(bits));
+            eop->imm = (int32_t)(uint32_t)bits;
+            eop->name = (int32_t)(uint32_t)(bits >> 32);
+            *pp = end;
+            return true;
+        }
+        
+        int32_t val = parse_number(&p);
+        *pp = p;
+        return emit_op(b, EOP_PUSH, val) != NULL;
+    }
+    
+    if (*p == '"') {
+        *pp = p;
+        return parse_string(b, pp);
+    }
+    
+    if (*p == '$') {
+        bool braces = *++p == '{';
+        
+        if (braces) {
+            p++;
+        }
+        for (name = p; isalnum((unsigned char)*p) || *p == '_'; p++) {
+            ;
+        }
+        len = p - name;
+        if (len == 0 || len >= SCRIPT_VAR_NAME_LEN) {
+            return false;
+        }
+        if (braces && *p++ != '}') {
+            return false;
+        }
+        
+        *pp = p;
+        if ((slot = find_local(b, name, len)) >= 0) {
+            return emit_op(b, EOP_LOCAL, slot) != NULL;
+        }
+        
+        eop = emit_op(b, EOP_LOAD, 0);
+        if (eop == NULL || (eop->name = pool_add(b, name, len)) < 0) {
+            return false;
+        }
+        eop->ref.hash = name_hash(b->pool + eop->name);
+        return true;
+    }
+    
+    if (!isalpha((unsigned char)*p) && *p != '_') {
+        return false;
+    }
+    
+    for (name = p; isalnum((unsigned char)*p) || *p == '_'; p++) {
+        ;
+    }
+    len = p - name;
+    
+    if ((len == 4 && (strncmp(name, "true", 4) == 0 ||
+                      strncmp(name, "TRUE", 4) == 0)) ||
+        (len == 5 && (strncmp(name, "false", 5) == 0 ||
+                      strncmp(name, "FALSE", 5) == 0))) {
+        *pp = p;
+        return emit_op(b, EOP_PUSH, len == 4) != NULL;
+    }
+    
+    /* Anything else must be a function call */
+    p = skip_ws(p);
+    if (*p != '(' || len >= SCRIPT_VAR_NAME_LEN) {
+        return false;
+    }
+    
+    p = skip_ws(p + 1);
+    if (*p != ')') {
+        for (;;) {
+            if (!parse_expr(b, &p, 0)) {
+                return false;
+            }
+            argc++;
+            p = skip_ws(p);
+            if (*p == ')') {
+                break;
+            }
+            if (*p++ != ',') {
+                return false;
+            }
+        }
+    }
+    
+    eop = emit_op(b, EOP_CALL, argc);
+    if (eop == NULL || (eop->name = pool_add(b, name, len)) < 0) {
+        return false;
+    }
+    eop->ref.hash = name_hash(b->pool + eop->name);
+    *pp = p + 1;
+    
+    return true;
+}
+
+/* Atom followed by any number of [key] */
+static bool parse_primary(code_builder_t *b, const char **pp) {
+    const char *p;
+    
+    if (!parse_atom(b, pp)) {
+        return false;
+    }
+    
+    for (p = skip_ws(*pp); *p == '['; p = skip_ws(p)) {
+        p++;
+        if (!parse_expr(b, &p, 0)) {
+            return false;
+        }
+        p = skip_ws(p);
+        if (*p++ != ']' || emit_op(b, EOP_INDEX, 0) == NULL) {
+            return false;
+        }
+        *pp = p;
+    }
+    
+    return true;
+}
+
+static bool parse_unary(code_builder_t *b, const char **pp) {
+    const char *p = skip_ws(*pp);
+    int32_t start;
+    uint8_t op;
+    
+    switch (*p) {
+        case '-': op = EOP_NEG; break;
+        case '!': op = EOP_NOT; break;
+        case '~': op = EOP_BNOT; break;
+        case '+':
+            p++;
+            *pp = p;
+            return parse_unary(b, pp);
+        default:
+            return parse_primary(b, pp);
+    }
+    
+    p++;
+    start = b->op_count;
+    if (!parse_unary(b, &p)) {
+        return false;
+    }
+    *pp = p;
+    
+    if (is_const(b, start)) {
+        b->ops[start].imm = apply_unary(op, b->ops[start].imm);
+        return true;
+    }
+    
+    return emit_op(b, op, 0) != NULL;
+}
+
+/* Normalize the value of the ops from start on to 0 or 1 */
+static void emit_bool(code_builder_t *b, int32_t start) {
+    uint8_t last = b->ops[b->op_count - 1].op;
+    
+    if (is_const(b, start)) {
+        b->ops[start].imm = b->ops[start].imm != 0;
+    } else if (!(last >= EOP_LT && last <= EOP_NE) && last != EOP_NOT &&
+               last != EOP_BOOL) {
+        emit_op(b, EOP_BOOL, 0);
+    }
+}
+
+/* Precedence climbing; folds operators whose operands are constant */
+static bool parse_expr(code_builder_t *b, const char **pp, int min_prec) {
+    int32_t left = b->op_count;
+    int32_t base = b->depth;
+    int32_t jump, right;
+    const char *p;
+    int op, prec, len;
+    bool ok = false;
+    
+    if (++b->nest > EXPR_MAX_NEST) {
+        b->failed = true;
+        goto out;
+    }
+    
+    if (!parse_unary(b, pp)) {
+        goto out;
+    }
+    
+    for (;;) {
+        p = skip_ws(*pp);
+        op = binary_op(p, &prec, &len);
+        if (op < 0 || prec < min_prec) {
+            break;
+        }
+        p += len;
+        
+        jump = -1;
+        if (op == EOP_AND || op == EOP_OR) {
+            jump = b->op_count;
+            if (emit_op(b, op, 0) == NULL) {
+                goto out;
+            }
+        }
+        
+        right = b->op_count;
+        if (!parse_expr(b, &p, prec + 1)) {
+            goto out;
+        }
+        *pp = p;
+        
+        if (jump < 0) {
+            int32_t val;
+            
+            if (right == left + 1 && b->ops[left].op == EOP_PUSH &&
+                is_const(b, right) &&
+                apply_binary(op, b->ops[left].imm, b->ops[right].imm, &val)) {
+                b->ops[left].imm = val;
+                b->op_count = left + 1;
+            } else if (emit_op(b, op, 0) == NULL) {
+                goto out;
+            }
+        } else if (jump == left + 1 && b->ops[left].op == EOP_PUSH) {
+            bool lhs = b->ops[left].imm != 0;
+            
+            if (lhs == (op == EOP_OR)) {
+                /* Short-circuits at compile time */
+                b->ops[left].imm = lhs;
+                b->op_count = left + 1;
+            } else {
+                /* Result is the right operand; jumps in it are relative */
+                memmove(&b->ops[left], &b->ops[right],
+                        (b->op_count - right) * sizeof(script_eop_t));
+                b->op_count -= right - left;
+                emit_bool(b, left);
+            }
+        } else if (is_const(b, right) &&
+                   (b->ops[right].imm != 0) == (op == EOP_AND)) {
+            /* x && true and x || false are just the truth of x */
+            b->op_count = jump;
+            emit_bool(b, left);
+        } else {
+            emit_bool(b, right);
+            b->ops[jump].imm = b->op_count - (jump + 1);
+        }
+        
+        b->depth = base + 1;
+    }
+    
+    ok = true;
+    
+out:
+    b->nest--;
+    return ok && !b->failed;
+}
+
+/*
+ * Compile the whole of text as one expression terminated by EOP_END.
+ * Returns the first op, or -1 if text is not an expression.
+ */
+static int32_t compile_expr(code_builder_t *b, const char *text) {
+    int32_t start = b->op_count;
+    uint32_t pool_used = b->pool_used;
+    const char *p = text;
+    
+    b->depth = 0;
+    b->nest = 0;
+    
+    if (!parse_expr(b, &p, 0) || *skip_ws(p) != '\0' ||
+        emit_op(b, EOP_END, 0) == NULL) {
+        b->op_count = start;
+        b->pool_used = pool_used;
+        return -1;
+    }
+    
+    return start;
+}
+
+static int call_func_values(script_context_t *ctx, script_func_t *func,
+                            int argc, script_value_t *args,
+                            script_value_t *result);
+
+/* Functions every context has; script definitions take precedence */
+static int call_builtin(script_context_t *ctx, const char *name, int argc,
+                        const script_value_t *args, script_value_t *result) {
+    const script_value_t *a = &args[0];
+    script_array_t *arr, *keys;
+    script_value_t k;
+    char text[32], pattern[32];
+    int32_t i;
+    
+    /* Regex search: match(text, pattern) is 1 if any part matches */
+    if (strcmp(name, "match") == 0 && argc == 2) {
+        if (a->type != VAR_TYPE_STRING) {
+            val_format(a, text, sizeof(text));
+        }
+        if (args[1].type != VAR_TYPE_STRING) {
+            val_format(&args[1], pattern, sizeof(pattern));
+        }
+        val_int(result, expr_match_regex(
+            args[1].type == VAR_TYPE_STRING ? args[1].v.str_val : pattern,
+            a->type == VAR_TYPE_STRING ? a->v.str_val : text));
+        return OK;
+    }
+    
+    if (argc != 1) {
+        return SYSERR;
+    }
+    
+    if (strcmp(name, "len") == 0) {
+        if (a->type == VAR_TYPE_STRING) {
+            val_int(result, a->len);
+        } else if (a->type == VAR_TYPE_ARRAY) {
+            val_int(result, a->v.array_val->count);
+        } else {
+            val_int(result, 0);
+        }
+        return OK;
+    }
+    
+    /* Map keys in insertion order, or the indexes of a list */
+    if (strcmp(name, "keys") == 0) {
+        keys = arr_new(ctx, false);
+        if (keys == NULL) {
+            return SYSERR;
+        }
+        if (a->type == VAR_TYPE_ARRAY) {
+            arr = a->v.array_val;
+            if (arr_reserve(ctx, keys, arr->count) != OK) {
+                arr_free(ctx, keys);
+                return SYSERR;
+            }
+            for (i = 0; i < arr->count; i++) {
+                if (arr->map) {
+                    k = arr->keys[i];
+                    k.owned = false;
+                } else {
+                    val_int(&k, i);
+                }
+                if (arr_set(ctx, keys, i, &k) != OK) {
+                    arr_free(ctx, keys);
+                    return SYSERR;
+                }
+            }
+        }
+        val_array(result, keys, true);
+        return OK;
+    }
+    
+    return SYSERR;
+}
+
+/* Float counterpart of apply_binary(); bit operators work on integers */
+static bool apply_float(uint8_t op, double x, double y, script_value_t *out) {
+    int32_t i;
+    
+    switch (op) {
+        case EOP_MUL: val_float(out, x * y); return true;
+        case EOP_DIV: val_float(out, x / y); return true;
+        case EOP_ADD: val_float(out, x + y); return true;
+        case EOP_SUB: val_float(out, x - y); return true;
+        case EOP_LT:  val_int(out, x < y); return true;
+        case EOP_LE:  val_int(out, x <= y); return true;
+        case EOP_GT:  val_int(out, x > y); return true;
+        case EOP_GE:  val_int(out, x >= y); return true;
+        case EOP_EQ:  val_int(out, x == y); return true;
+        case EOP_NE:  val_int(out, x != y); return true;
+        case EOP_MOD:
+            if (y == 0.0) {
+                return false;
+            }
+            x /= y;
+            val_float(out, x > -9e18 && x < 9e18 ?
+                      (x - (double)(int64_t)x) * y : 0.0);
+            return true;
+        default:
+            if (!apply_binary(op, float_to_int(x), float_to_int(y), &i)) {
+                return false;
+            }
+            val_int(out, i);
+            return true;
+    }
+}
+
+/*
+ * Binary operator on typed values, leaving the result in x. Two strings
+ * concatenate with + and compare with strcmp(); otherwise strings read
+ * as numbers and ints widen to float when either side is a float.
+ */
+static bool eval_binary(script_context_t *ctx, uint8_t op, script_value_t *x,
+                        script_value_t *y) {
+    script_value_t r, a, c;
+    char *buf;
+    int32_t i;
+    bool ok = true;
+    
+    if (x->type == VAR_TYPE_STRING && y->type == VAR_TYPE_STRING &&
+        (op == EOP_ADD || (op >= EOP_LT && op <= EOP_NE))) {
+        if (op == EOP_ADD) {
+            buf = val_alloc(ctx, &r, x->len + y->len);
+            if (buf == NULL) {
+                return false;
+            }
+            memcpy(buf, x->v.str_val, x->len);
+            memcpy(buf + x->len, y->v.str_val, y->len + 1);
+        } else {
+            apply_binary(op, strcmp(x->v.str_val, y->v.str_val), 0, &i);
+            val_int(&r, i);
+        }
+    } else {
+        val_number(x, &a);
+        val_number(y, &c);
+        if (a.type == VAR_TYPE_INT && c.type == VAR_TYPE_INT) {
+            ok = apply_binary(op, a.v.int_val, c.v.int_val, &i);
+            val_int(&r, i);
+        } else {
+            ok = apply_float(op, val_to_float(&a), val_to_float(&c), &r);
+        }
+    }
+    
+    val_release(ctx, x);
+    val_release(ctx, y);
+    *x = r;
+    
+    return ok;
+}
+
+static void eval_unary(script_context_t *ctx, uint8_t op, script_value_t *x) {
+    script_value_t n;
+    
+    switch (op) {
+        case EOP_NEG:
+            val_number(x, &n);
+            if (n.type == VAR_TYPE_FLOAT) {
+                n.v.float_val = -n.v.float_val;
+            } else {
+                n.v.int_val = apply_unary(op, n.v.int_val);
+            }
+            break;
+        case EOP_BNOT:
+            val_int(&n, ~val_to_int(x));
+            break;
+        case EOP_NOT:
+            val_int(&n, !val_truth(x));
+            break;
+        default:
+            val_int(&n, val_truth(x));
+            break;
+    }
+    
+    val_release(ctx, x);
+    *x = n;
+}
+
+/* Room for one expression's values above the current top */
+static int stack_reserve(script_context_t *ctx) {
+    script_value_t *stack;
+    int32_t cap;
+    
+    if (ctx->stack_sp + SCRIPT_EXPR_STACK <= ctx->stack_cap) {
+        return OK;
+    }
+    
+    cap = ctx->stack_cap == 0 ? 2 * SCRIPT_EXPR_STACK : 2 * ctx->stack_cap;
+    stack = (script_value_t*)arena_alloc(&ctx->arena,
+                                         cap * sizeof(script_value_t));
+    if (stack == NULL) {
+        return SYSERR;
+    }
+    
+    if (ctx->stack_sp > 0) {
+        memcpy(stack, ctx->stack, ctx->stack_sp * sizeof(script_value_t));
+    }
+    if (ctx->stack != NULL) {
+        arena_free(&ctx->arena, ctx->stack,
+                   ctx->stack_cap * sizeof(script_value_t));
+    }
+    ctx->stack = stack;
+    ctx->stack_cap = cap;
+    
+    return OK;
+}
+
+/*
+ * Evaluate ops produced by compile_expr(). Values live on the context
+ * stack so nested calls cost no C stack; result may own its string and
+ * must be released by the caller.
+ */
+static int eval_ops(script_context_t *ctx, script_eop_t *ops,
+                    const char *pool, script_value_t *result) {
+    script_value_t local[SCRIPT_EXPR_STACK];
+    script_value_t *stack = local;
+    script_value_t ret;
+    script_array_t *arr;
+    script_func_t *func;
+    script_eop_t *eop;
+    int32_t base = 0, sp = 0, i;
+    int status = OK;
+    
+    if (ctx != NULL) {
+        if (stack_reserve(ctx) != OK) {
+            return SYSERR;
+        }
+        base = ctx->stack_sp;
+        ctx->stack_sp += SCRIPT_EXPR_STACK;
+        stack = ctx->stack + base;
+    }
+    
+    for (eop = ops; eop->op != EOP_END; eop++) {
+        switch (eop->op) {
+            case EOP_PUSH:
+                val_int(&stack[sp++], eop->imm);
+                break;
+                
+            case EOP_PUSHF:
+                val_float(&stack[sp++], eop_float(eop));
+                break;
+                
+            case EOP_PUSHS:
+                val_str(&stack[sp++], pool + eop->name, eop->imm);
+                break;
+                
+            case EOP_LOAD:
+                if (ctx == NULL) {
+                    val_int(&stack[sp++], 0);
+                } else {
+                    ref_value(ctx, &eop->ref, pool + eop->name, &stack[sp++]);
+                }
+                break;
+                
+            case EOP_LOCAL:
+                stack[sp] = *frame_slot(ctx, eop->imm);
+                stack[sp++].owned = false;
+                break;
+                
+            case EOP_LIST:
+            case EOP_MAP:
+                if ((arr = arr_new(ctx, eop->op == EOP_MAP)) == NULL) {
+                    status = SYSERR;
+                    goto out;
+                }
+                val_array(&stack[sp++], arr, true);
+                break;
+                
+            case EOP_APPEND:
+                if (stack[sp - 2].type != VAR_TYPE_ARRAY) {
+                    status = SYSERR;
+                    goto out;
+                }
+                arr = stack[sp - 2].v.array_val;
+                status = arr_set(ctx, arr, arr->count, &stack[sp - 1]);
+                val_release(ctx, &stack[--sp]);
+                if (status != OK) {
+                    goto out;
+                }
+                break;
+                
+            case EOP_INSERT:
+                if (stack[sp - 3].type != VAR_TYPE_ARRAY) {
+                    status = SYSERR;
+                    goto out;
+                }
+                status = index_store(ctx, stack[sp - 3].v.array_val,
+                                     &stack[sp - 2], &stack[sp - 1]);
+                val_release(ctx, &stack[--sp]);
+                val_release(ctx, &stack[--sp]);
+                if (status != OK) {
+                    goto out;
+                }
+                break;
+                
+            case EOP_INDEX:
+                status = index_value(ctx, &stack[sp - 2], &stack[sp - 1],
+                                     &ret);
+                val_release(ctx, &stack[--sp]);
+                val_release(ctx, &stack[sp - 1]);
+                if (status != OK) {
+                    goto out;
+                }
+                stack[sp - 1] = ret;
+                break;
+                
+            case EOP_CALL:
+                func = ctx == NULL ? NULL :
+                       find_func_hashed(ctx, pool + eop->name, eop->ref.hash,
+                                        NULL);
+                
+                /* Builtins run no script code, so borrowed values hold */
+                if (func == NULL) {
+                    sp -= eop->imm;
+                    status = call_builtin(ctx, pool + eop->name, eop->imm,
+                                          &stack[sp], &ret);
+                } else {
+                    /* The callee may change any variable we borrowed from */
+                    for (i = 0; i < sp; i++) {
+                        if (val_own(ctx, &stack[i]) != OK) {
+                            status = SYSERR;
+                            goto out;
+                        }
+                    }
+                    
+                    sp -= eop->imm;
+                    status = call_func_values(ctx, func, eop->imm, &stack[sp],
+                                              &ret);
+                    
+                    /* The call may have moved the stack */
+                    stack = ctx->stack + base;
+                }
+                
+                for (i = sp; i < sp + eop->imm; i++) {
+                    val_release(ctx, &stack[i]);
+                }
+                if (status != OK) {
+                    goto out;
+                }
+                stack[sp++] = ret;
+                break;
+                
+            case EOP_NEG:
+            case EOP_NOT:
+            case EOP_BNOT:
+            case EOP_BOOL:
+                eval_unary(ctx, eop->op, &stack[sp - 1]);
+                break;
+                
+            case EOP_AND:
+                if (!val_truth(&stack[sp - 1])) {
+                    val_release(ctx, &stack[sp - 1]);
+                    val_int(&stack[sp - 1], 0);
+                    eop += eop->imm;
+                } else {
+                    val_release(ctx, &stack[--sp]);
+                }
+                break;
+                
+            case EOP_OR:
+                if (val_truth(&stack[sp - 1])) {
+                    val_release(ctx, &stack[sp - 1]);
+                    val_int(&stack[sp - 1], 1);
+                    eop += eop->imm;
+                } else {
+                    val_release(ctx, &stack[--sp]);
+                }
+                break;
+                
+            default:
+                sp--;
+                if (!eval_binary(ctx, eop->op, &stack[sp - 1], &stack[sp])) {
+                    status = SYSERR;
+                    goto out;
+                }
+                break;
+        }
+    }
+    
+    /* The top value becomes the result */
+    if (sp > 0) {
+        *result = stack[--sp];
+    } else {
+        val_int(result, 0);
+    }
+    
+out:
+    while (sp > 0) {
+        val_release(ctx, &stack[--sp]);
+    }
+    if (ctx != NULL) {
+        ctx->stack_sp = base;
+    }
+    
+    return status;
+}
+
+/* Compile and evaluate a standalone expression; false if it won't parse */
+static bool eval_text(script_context_t *ctx, const char *expr,
+                      script_value_t *result) {
+    script_eop_t ops[16];
+    char pool[SCRIPT_MAX_LINE];
+    code_builder_t b;
+    uint32_t len = strlen(expr) + 1;
+    bool ok;
+    
+    memset(&b, 0, sizeof(b));
+    b.arena = ctx != NULL ? &ctx->arena : NULL;
+    b.ops = ops;
+    b.op_cap = 16;
+    b.pool = pool;
+    b.pool_cap = sizeof(pool);
+    
+    /* Names and strings copied to the pool never exceed the text */
+    if (len > sizeof(pool)) {
+        b.pool = (char*)scratch_alloc(b.arena, len);
+        b.pool_cap = len;
+        if (b.pool == NULL) {
+            return false;
+        }
+    }
+    
+    ok = compile_expr(&b, expr) == 0 &&
+         eval_ops(ctx, b.ops, b.pool, result) == OK;
+    
+    /* Strings borrowed from the pool must not outlive it */
+    if (ok && val_own(ctx, result) != OK) {
+        ok = false;
+    }
+    
+    if (b.ops_owned) {
+        scratch_free(b.arena, b.ops, b.op_cap * sizeof(script_eop_t));
+    }
+    if (b.pool != pool) {
+        scratch_free(b.arena, b.pool, len);
+    }
+    
+    return ok;
+}
+
+int32_t script_eval_int(script_context_t *ctx, const char *expr) {
+    script_value_t v;
+    int32_t result;
+    
+    if (expr == NULL || !eval_text(ctx, expr, &v)) {
+        return 0;
+    }
+    
+    result = val_to_int(&v);
+    val_release(ctx, &v);
+    
+    return result;
+}
+
+double script_eval_float(script_context_t *ctx, const char *expr) {
+    script_value_t v;
+    double result;
+    
+    if (expr == NULL) {
+        return 0.0;
+    }
+    
+    /* Text that is not an expression keeps its old atof() reading */
+    if (!eval_text(ctx, expr, &v)) {
+        return atof(expr);
+    }
+    
+    result = val_to_float(&v);
+    val_release(ctx, &v);
+    
+    return result;
+}
+
+/* The result is written to buf, cut to size bytes; buf is returned */
+char* script_eval_string(script_context_t *ctx, const char *expr, char *buf,
+                         uint32_t size) {
+    script_value_t v;
+    
+    if (buf == NULL || size == 0) {
+        return NULL;
+    }
+    
+    if (expr == NULL) {
+        buf[0] = '\0';
+        return buf;
+    }
+    
+    /* Text that is not an expression is returned as is */
+    if (!eval_text(ctx, expr, &v)) {
+        snprintf(buf, size, "%s", expr);
+        return buf;
+    }
+    
+    val_format(&v, buf, size);
+    val_release(ctx, &v);
+    
+    return buf;
+}
+
+bool script_eval_bool(script_context_t *ctx, const char *expr) {
+    script_value_t v;
+    bool result;
+    
+    /* Empty or unparsable text is false; true and false are literals */
+    if (expr == NULL || !eval_text(ctx, expr, &v)) {
+        return false;
+    }
+    
+    result = val_truth(&v);
+    val_release(ctx, &v);
+    
+    return result;
+}
+
+
+static script_label_t* find_label_hashed(script_context_t *ctx,
+                                         const char *name, uint32_t hash) {
+    uint32_t mask = SCRIPT_LABEL_BUCKETS - 1;
+    uint32_t b = hash & mask;
+    uint32_t n;
+    
+    for (n = 0; n <= mask; n++, b = (b + 1) & mask) {
+        int16_t slot = ctx->label_index[b];
+        
+        if (slot == INDEX_EMPTY) {
+            break;
+        }
+        if (slot >= 0 && ctx->labels[slot].hash == hash &&
+            strcmp(ctx->labels[slot].name, name) == 0) {
+            return &ctx->labels[slot];
+        }
+    }
+    
+    return NULL;
+}
+
+static script_label_t* find_label(script_context_t *ctx, const char *name) {
+    return find_label_hashed(ctx, name, name_hash(name));
+}
+
+static int create_label(script_context_t *ctx, const char *name,
+                        uint32_t hash, int line_num) {
+    script_label_t *label;
+    
+    /* Check if already exists */
+    label = find_label_hashed(ctx, name, hash);
+    if (label != NULL) {
+        label->line_num = line_num;
+        return OK;
+    }
+    
+    /* Labels are only dropped by a reset, so slots fill in order */
+    if (ctx->label_count >= SCRIPT_MAX_LABELS) {
+        return SYSERR;
+    }
+    
+    label = &ctx->labels[ctx->label_count];
+    label->defined = true;
+    strncpy(label->name, name, SCRIPT_VAR_NAME_LEN - 1);
+    label->name[SCRIPT_VAR_NAME_LEN - 1] = '\0';
+    label->hash = hash;
+    label->line_num = line_num;
+    index_insert(ctx->label_index, SCRIPT_LABEL_BUCKETS - 1, hash,
+                 ctx->label_count);
+    ctx->label_count++;
+    
+    return OK;
+}
+
+int script_goto_label(script_context_t *ctx, const char *label) {
+    script_label_t *lbl;
+    
+    if (ctx == NULL || label == NULL) {
+        return SYSERR;
+    }
+    
+    lbl = find_label(ctx, label);
+    if (lbl == NULL) {
+        return SYSERR;
+    }
+    
+    ctx->line_num = lbl->line_num;
+    return OK;
+}
+
+int script_break(script_context_t *ctx) {
+    if (ctx == NULL || ctx->loop_sp == 0) {
+        return SYSERR;
+    }
+    
+    /* Jump to end of current loop */
+    ctx->line_num = ctx->loop_stack[ctx->loop_sp - 1];
+    
+    return OK;
+}
+
+int script_continue(script_context_t *ctx) {
+    if (ctx == NULL || ctx->loop_sp == 0) {
+        return SYSERR;
+    }
+    
+    /* Jump to beginning of current loop */
+    ctx->line_num = ctx->loop_stack[ctx->loop_sp - 1] - 1;
+    
+    return OK;
+}
+
+int script_return(script_context_t *ctx, int value) {
+    if (ctx == NULL) {
+        return SYSERR;
+    }
+    
+    ctx->exit_code = value;
+    ctx->running = false;
+    val_release(ctx, &ctx->ret);
+    val_int(&ctx->ret, value);
+    
+    return OK;
+}
+
+
+static bool is_ident(const char *s, int len) {
+    int i;
+    
+    if (len <= 0 || len >= SCRIPT_VAR_NAME_LEN) {
+        return false;
+    }
+    
+    for (i = 0; i < len; i++) {
+        if (!isalnum((unsigned char)s[i]) && s[i] != '_') {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+static script_insn_t* emit(code_builder_t *b, uint8_t op, int32_t line_num) {
+    script_insn_t *insn = &b->insns[b->insn_count++];
+    
+    insn->op = op;
+    insn->line_num = line_num;
+    insn->a = -1;
+    insn->b = -1;
+    insn->expr = -1;
+    insn->imm = 0;
+    insn->target = -1;
+    insn->dst.hash = 0;
+    insn->dst.cache = 0;
+    
+    return insn;
+}
+
+/*
+ * Attach an expression operand. Constants fold into imm and leave expr
+ * unset; text that is not an expression folds to 0.
+ */
+static void compile_operand(code_builder_t *b, script_insn_t *insn,
+                            const char *text) {
+    int32_t start = compile_expr(b, text);
+    
+    if (start < 0) {
+        return;
+    }
+    
+    if (b->ops[start].op == EOP_PUSH && b->ops[start + 1].op == EOP_END) {
+        insn->imm = b->ops[start].imm;
+        b->op_count = start;
+        return;
+    }
+    
+    insn->expr = start;
+}
+
+/* Values starting like a number, string, variable or call are expressions */
+static bool is_expr_start(const char *p) {
+    if ((*p >= '0' && *p <= '9') || *p == '-' || *p == '+' || *p == '"' ||
+        *p == '$' || *p == '(' || *p == '!' || *p == '~' || *p == '[' ||
+        *p == '{') {
+        return true;
+    }
+    
+    while (isalnum((unsigned char)*p) || *p == '_') p++;
+    
+    return *skip_ws(p) == '(';
+}
+
+/* Match a keyword followed by whitespace or the end of the line */
+static char* match_keyword(char *p, const char *kw) {
+    size_t n = strlen(kw);
+    
+    if (strncmp(p, kw, n) != 0 ||
+        (p[n] != '\0' && p[n] != ' ' && p[n] != '\t')) {
+        return NULL;
+    }
+    
+    return skip_ws(p + n);
+}
+
+/* Match a keyword that stands alone on its line */
+static bool match_word(char *p, const char *kw) {
+    char *rest = match_keyword(p, kw);
+    
+    return rest != NULL && *rest == '\0';
+}
+
+/* Point every jump on a chain at dest */
+static void patch_chain(code_builder_t *b, int32_t chain, int32_t dest) {
+    while (chain >= 0) {
+        int32_t next = b->insns[chain].target;
+        b->insns[chain].target = dest;
+        chain = next;
+    }
+}
+
+/* Emit a jump and link it onto a chain to be patched later */
+static void emit_chained(code_builder_t *b, int32_t *chain, int32_t line_num) {
+    script_insn_t *insn = emit(b, OP_JUMP, line_num);
+    
+    insn->target = *chain;
+    *chain = b->insn_count - 1;
+}
+
+static code_block_t* push_block(code_builder_t *b, uint8_t kind) {
+    code_block_t *blk;
+    
+    if (b->block_count >= SCRIPT_MAX_NEST) {
+        b->failed = true;
+        return NULL;
+    }
+    
+    blk = &b->blocks[b->block_count++];
+    memset(blk, 0, sizeof(*blk));
+    blk->kind = kind;
+    blk->test = -1;
+    blk->head = b->insn_count;
+    blk->ends = -1;
+    blk->breaks = -1;
+    blk->continues = -1;
+    
+    return blk;
+}
+
+/* Innermost enclosing loop, or NULL */
+static code_block_t* loop_block(code_builder_t *b) {
+    int32_t i;
+    
+    for (i = b->block_count - 1; i >= 0; i--) {
+        if (b->blocks[i].kind != OP_IF) {
+            return &b->blocks[i];
+        }
+    }
+    
+    return NULL;
+}
+
+/* Conditional jump on text, false branch pending in blk->test */
+static void emit_test(code_builder_t *b, code_block_t *blk, uint8_t op,
+                      const char *text, int32_t line_num) {
+    script_insn_t *insn = emit(b, op, line_num);
+    
+    compile_operand(b, insn, text);
+    blk->test = b->insn_count - 1;
+}
+
+/* Value of name[key] = value; anything but an expression is a string */
+static int32_t compile_value(code_builder_t *b, char *val) {
+    int32_t start = compile_expr(b, val);
+    script_eop_t *eop;
+    
+    if (start >= 0) {
+        return start;
+    }
+    
+    start = b->op_count;
+    b->depth = 0;
+    eop = emit_op(b, EOP_PUSHS, strlen(val));
+    if (eop == NULL || emit_op(b, EOP_END, 0) == NULL) {
+        return -1;
+    }
+    eop->name = val - b->pool;
+    
+    return start;
+}
+
+/* name[key] = value; false if the statement has another form */
+static bool compile_store(code_builder_t *b, char *p, int32_t line_num) {
+    char *name_end, *open, *close, *val;
+    script_insn_t *insn;
+    bool quote = false;
+    int depth = 0;
+    
+    for (name_end = p; isalnum((unsigned char)*name_end) || *name_end == '_';
+         name_end++) {
+        ;
+    }
+    open = skip_ws(name_end);
+    if (*open != '[' || !is_ident(p, name_end - p)) {
+        return false;
+    }
+    
+    /* Matching bracket, skipping over strings */
+    for (close = open; *close != '\0'; close++) {
+        if (quote) {
+            if (*close == '\\' && close[1] != '\0') {
+                close++;
+            } else if (*close == '"') {
+                quote = false;
+            }
+        } else if (*close == '"') {
+            quote = true;
+        } else if (*close == '[') {
+            depth++;
+        } else if (*close == ']' && --depth == 0) {
+            break;
+        }
+    }
+    if (*close != ']') {
+        return false;
+    }
+    val = skip_ws(close + 1);
+    if (val[0] != '=' || val[1] == '=') {
+        return false;
+    }
+    *name_end = '\0';
+    *close = '\0';
+    
+    insn = emit(b, OP_SET_INDEX, line_num);
+    insn->expr = compile_expr(b, open + 1);
+    insn->b = compile_value(b, skip_ws(val + 1));
+    if (insn->expr < 0 || insn->b < 0) {
+        b->failed = true;
+        return true;
+    }
+    
+    if ((insn->target = find_local(b, p, name_end - p)) < 0) {
+        insn->a = p - b->pool;
+        insn->dst.hash = name_hash(p);
+    }
+    
+    return true;
+}
+
+/* Assignment, or an expression evaluated for its side effects */
+static void compile_simple(code_builder_t *b, char *p, int32_t line_num) {
+    char *end;
+    script_insn_t *insn;
+    
+    p = skip_ws(p);
+    if (*p == '\0' || compile_store(b, p, line_num)) {
+        return;
+    }
+    
+    /* Check for assignment */
+    char *equals = strchr(p, '=');
+    if (equals != NULL && equals > p && *(equals - 1) != '!' && 
+        *(equals - 1) != '<' && *(equals - 1) != '>' &&
+        *(equals + 1) != '=') {
+        end = equals;
+        while (end > p && (end[-1] == ' ' || end[-1] == '\t')) end--;
+        
+        if (is_ident(p, end - p)) {
+            *end = '\0';
+            
+            /* Get value */
+            char *val = skip_ws(equals + 1);
+            
+            /* Expressions are compiled; anything else is a string */
+            insn = emit(b, OP_SET_STR, line_num);
+            if (is_expr_start(val) && (insn->expr = compile_expr(b, val)) >= 0) {
+                insn->op = OP_SET_EXPR;
+                if (b->ops[insn->expr].op == EOP_PUSH &&
+                    b->ops[insn->expr + 1].op == EOP_END) {
+                    insn->op = OP_SET_INT;
+                    insn->imm = b->ops[insn->expr].imm;
+                    b->op_count = insn->expr;
+                    insn->expr = -1;
+                }
+            } else {
+                insn->b = val - b->pool;
+            }
+            
+            if ((insn->target = find_local(b, p, end - p)) >= 0) {
+                insn->op = OP_SET_LOCAL;
+                return;
+            }
+            insn->a = p - b->pool;
+            insn->dst.hash = name_hash(p);
+            return;
+        }
+    }
+    
+    /* Otherwise evaluate for side effects; constants have none */
+    insn = emit(b, OP_EVAL, line_num);
+    compile_operand(b, insn, p);
+    if (insn->expr < 0) {
+        insn->op = OP_NOP;
+    }
+}
+
+/* local name [= value]; outside a function it is a plain assignment */
+static void compile_local(code_builder_t *b, char *p, int32_t line_num) {
+    char *end;
+    int32_t slot;
+    
+    for (end = p; isalnum((unsigned char)*end) || *end == '_'; end++) {
+        ;
+    }
+    
+    if (!b->func) {
+        compile_simple(b, p, line_num);
+        return;
+    }
+    if (!is_ident(p, end - p) || (*skip_ws(end) != '\0' &&
+                                  *skip_ws(end) != '=')) {
+        b->failed = true;
+        return;
+    }
+    
+    if ((slot = find_local(b, p, end - p)) < 0) {
+        if (b->local_count >= SCRIPT_MAX_LOCALS ||
+            (b->local_names[b->local_count] = pool_add(b, p, end - p)) < 0) {
+            b->failed = true;
+            return;
+        }
+        slot = b->local_count++;
+    }
+    
+    /* A bare declaration starts the slot again from 0 */
+    if (*skip_ws(end) == '\0') {
+        emit(b, OP_SET_LOCAL, line_num)->target = slot;
+    } else {
+        compile_simple(b, p, line_num);
+    }
+}
+
+/* for init; condition; step */
+static void compile_for(code_builder_t *b, char *p, int32_t line_num) {
+    code_block_t *blk;
+    char *cond, *step, *init;
+    
+    cond = strchr(p, ';');
+    step = cond != NULL ? strchr(cond + 1, ';') : NULL;
+    if (step == NULL) {
+        b->failed = true;
+        return;
+    }
+    *cond++ = '\0';
+    *step++ = '\0';
+    
+    p = skip_ws(p);
+    if ((init = match_keyword(p, "local")) != NULL && *init != '=') {
+        compile_local(b, init, line_num);
+    } else {
+        compile_simple(b, p, line_num);
+    }
+    
+    blk = push_block(b, OP_NOP);
+    if (blk == NULL) {
+        return;
+    }
+    blk->step = step;
+    /* An empty condition loops until break */
+    cond = skip_ws(cond);
+    emit_test(b, blk, OP_WHILE, *cond != '\0' ? cond : "1", line_num);
+}
+
+/* else, elif or else if: close the current branch of an if chain */
+static void compile_else(code_builder_t *b, char *cond, int32_t line_num) {
+    code_block_t *blk = b->block_count > 0 ?
+                        &b->blocks[b->block_count - 1] : NULL;
+    
+    if (blk == NULL || blk->kind != OP_IF || blk->has_else) {
+        b->failed = true;
+        return;
+    }
+    
+    emit_chained(b, &blk->ends, line_num);
+    patch_chain(b, blk->test, b->insn_count);
+    blk->test = -1;
+    
+    if (cond != NULL) {
+        emit_test(b, blk, OP_IF, cond, line_num);
+    } else {
+        blk->has_else = true;
+    }
+}
+
+static void compile_end(code_builder_t *b, int32_t line_num) {
+    code_block_t *blk;
+    int32_t exit_pc;
+    
+    if (b->block_count == 0) {
+        b->failed = true;
+        return;
+    }
+    blk = &b->blocks[b->block_count - 1];
+    
+    if (blk->kind != OP_IF) {
+        /* Continues land on the step, which runs on the end line */
+        patch_chain(b, blk->continues, b->insn_count);
+        if (blk->step != NULL) {
+            compile_simple(b, blk->step, line_num);
+        }
+        emit(b, OP_JUMP, line_num)->target = blk->head;
+    }
+    
+    exit_pc = b->insn_count;
+    patch_chain(b, blk->test, exit_pc);
+    patch_chain(b, blk->ends, exit_pc);
+    patch_chain(b, blk->breaks, exit_pc);
+    b->block_count--;
+}
+
+static void define_label(code_builder_t *b, char *name, int32_t line_num) {
+    script_code_label_t *label = &b->labels[b->label_count++];
+    
+    label->name = name - b->pool;
+    label->hash = name_hash(name);
+    label->pc = b->insn_count;
+    label->line_num = line_num;
+}
+
+/*
+ * Compile one line in place. The line lives inside b->pool and is
+ * NUL-split so that operands become pool offsets; nothing is copied.
+ */
+static void compile_line(code_builder_t *b, char *line, int32_t line_num) {
+    char *p = skip_ws(line);
+    char *rest;
+    code_block_t *blk;
+    script_insn_t *insn;
+    
+    /* Skip empty lines and comments */
+    if (*p == '\0' || *p == '#') {
+        return;
+    }
+    
+    /* Check for label definition */
+    char *colon = strchr(p, ':');
+    if (colon != NULL && is_ident(p, colon - p)) {
+        *colon = '\0';
+        define_label(b, p, line_num);
+        p = skip_ws(colon + 1);
+        if (*p == '\0') {
+            return;
+        }
+    }
+    
+    /* Check for control flow keywords */
+    if ((rest = match_keyword(p, "if")) != NULL) {
+        blk = push_block(b, OP_IF);
+        if (blk != NULL) {
+            emit_test(b, blk, OP_IF, rest, line_num);
+        }
+    } else if ((rest = match_keyword(p, "elif")) != NULL) {
+        compile_else(b, rest, line_num);
+    } else if ((rest = match_keyword(p, "else")) != NULL) {
+        if (*rest == '\0') {
+            compile_else(b, NULL, line_num);
+        } else if ((rest = match_keyword(rest, "if")) != NULL) {
+            compile_else(b, rest, line_num);
+        } else {
+            b->failed = true;
+        }
+    } else if (match_word(p, "end")) {
+        compile_end(b, line_num);
+    } else if ((rest = match_keyword(p, "while")) != NULL) {
+        blk = push_block(b, OP_WHILE);
+        if (blk != NULL) {
+            emit_test(b, blk, OP_WHILE, rest, line_num);
+        }
+    } else if ((rest = match_keyword(p, "for")) != NULL) {
+        compile_for(b, rest, line_num);
+    } else if (match_word(p, "break")) {
+        blk = loop_block(b);
+        if (blk != NULL) {
+            emit_chained(b, &blk->breaks, line_num);
+        } else {
+            emit(b, OP_BREAK, line_num);
+        }
+    } else if (match_word(p, "continue")) {
+        blk = loop_block(b);
+        if (blk == NULL) {
+            emit(b, OP_CONTINUE, line_num);
+        } else if (blk->step != NULL) {
+            emit_chained(b, &blk->continues, line_num);
+        } else {
+            emit(b, OP_JUMP, line_num)->target = blk->head;
+        }
+    } else if ((rest = match_keyword(p, "local")) != NULL &&
+               *rest != '=') {
+        compile_local(b, rest, line_num);
+    } else if ((rest = match_keyword(p, "return")) != NULL) {
+        insn = emit(b, OP_RETURN, line_num);
+        compile_operand(b, insn, rest);
+    } else if (strncmp(p, "goto ", 5) == 0) {
+        insn = emit(b, OP_GOTO, line_num);
+        insn->a = skip_ws(p + 5) - b->pool;
+    } else {
+        compile_simple(b, p, line_num);
+    }
+}
+
+/* Resolve goto targets against labels defined in the same code */
+static void resolve_jumps(code_builder_t *b) {
+    int32_t i, j;
+    
+    for (i = 0; i < b->insn_count; i++) {
+        script_insn_t *insn = &b->insns[i];
+        uint32_t hash;
+        
+        if (insn->op != OP_GOTO) {
+            continue;
+        }
+        
+        hash = name_hash(b->pool + insn->a);
+        for (j = 0; j < b->label_count; j++) {
+            if (b->labels[j].hash == hash &&
+                strcmp(b->pool + b->labels[j].name, b->pool + insn->a) == 0) {
+                insn->target = b->labels[j].pc;
+                break;
+            }
+        }
+    }
+}
+
+/* Offset of the pool within a compact code block */
+static uint32_t pool_offset(int32_t insn_count, int32_t op_count,
+                            int32_t label_count, int32_t line_count) {
+    return sizeof(script_code_t) + insn_count * sizeof(script_insn_t) +
+           op_count * sizeof(script_eop_t) +
+           label_count * sizeof(script_code_label_t) +
+           (line_count + 1) * sizeof(int32_t);
+}
+
+/* Point each section of a compact block at its place after the header */
+static void code_layout(script_code_t *code) {
+    code->insns = (script_insn_t*)(code + 1);
+    code->ops = (script_eop_t*)(code->insns + code->insn_count);
+    code->labels = (script_code_label_t*)(code->ops + code->op_count);
+    code->lines = (int32_t*)(code->labels + code->label_count);
+    code->pool = (char*)(code->lines + code->line_count + 1);
+}
+
+/*
+ * Compile len bytes of text, which need not be NUL-terminated, numbering
+ * lines from first_line. A function body gives its parameter count in
+ * params, top-level code -1. Memory comes from the arena, or from getmem
+ * when arena is NULL.
+ */
+static script_code_t* compile_text(script_arena_t *arena, const char *text,
+                                   uint32_t len, int32_t first_line,
+                                   int32_t params) {
+    code_builder_t b;
+    script_code_t *code = NULL;
+    const char *s;
+    char *line, *next, *eol, *end;
+    int32_t nlines = 1;
+    int32_t line_num = first_line - 1;
+    uint32_t insns_size, labels_size, size;
+    int32_t pc, i;
+    
+    for (s = text; (s = memchr(s, '\n', text + len - s)) != NULL; s++) {
+        nlines++;
+    }
+    
+    /*
+     * A line yields at most two instructions (a jump plus a statement)
+     * and one label, and names and strings copied into the pool by the
+     * expression compiler never exceed the text.
+     */
+    memset(&b, 0, sizeof(b));
+    b.arena = arena;
+    b.func = params >= 0;
+    b.params = b.func ? params : 0;
+    b.local_count = b.params;
+    insns_size = 2 * nlines * sizeof(script_insn_t);
+    b.insns = (script_insn_t*)scratch_alloc(arena, insns_size);
+    labels_size = nlines * sizeof(script_code_label_t);
+    b.labels = (script_code_label_t*)scratch_alloc(arena, labels_size);
+    b.pool_cap = 2 * (len + 1);
+    b.pool = (char*)scratch_alloc(arena, b.pool_cap);
+    if (b.insns == NULL || b.labels == NULL || b.pool == NULL) {
+        goto out;
+    }
+    memcpy(b.pool, text, len);
+    b.pool[len] = '\0';
+    b.pool_used = len + 1;
+    end = b.pool + len;
+    
+    for (line = b.pool; line != NULL; line = next) {
+        eol = memchr(line, '\n', end - line);
+        next = eol != NULL ? eol + 1 : NULL;
+        if (eol == NULL) {
+            eol = end;
+        }
+        if (eol > line && eol[-1] == '\r') {
+            eol--;
+        }
+        *eol = '\0';
+        line_num++;
+        
+        compile_line(&b, line, line_num);
+    }
+    
+    /* Unclosed blocks fail the whole compile */
+    if (b.failed || b.block_count > 0) {
+        goto out;
+    }
+    
+    resolve_jumps(&b);
+    
+    /* Copy into one compact block */
+    size = pool_offset(b.insn_count, b.op_count, b.label_count, nlines) +
+           b.pool_used;
+    code = (script_code_t*)scratch_alloc(arena, size);
+    if (code == NULL) {
+        goto out;
+    }
+    
+    code->size = size;
+    code->arena = arena;
+    code->insn_count = b.insn_count;
+    code->op_count = b.op_count;
+    code->label_count = b.label_count;
+    code->line_count = nlines;
+    code->first_line = first_line;
+    code->local_count = b.local_count;
+    code_layout(code);
+    memcpy(code->insns, b.insns, b.insn_count * sizeof(script_insn_t));
+    if (b.op_count > 0) {
+        memcpy(code->ops, b.ops, b.op_count * sizeof(script_eop_t));
+    }
+    memcpy(code->labels, b.labels,
+           b.label_count * sizeof(script_code_label_t));
+    
+    /* Line numbers never decrease along the instruction stream */
+    pc = 0;
+    for (i = 0; i <= nlines; i++) {
+        while (pc < b.insn_count &&
+               b.insns[pc].line_num < first_line + i - 1) pc++;
+        code->lines[i] = pc;
+    }
+    memcpy(code->pool, b.pool, b.pool_used);
+    
+out:
+    scratch_free(arena, b.insns, insns_size);
+    scratch_free(arena, b.labels, labels_size);
+    scratch_free(arena, b.pool, b.pool_cap);
+    if (b.ops_owned) {
+        scratch_free(arena, b.ops, b.op_cap * sizeof(script_eop_t));
+    }
+    
+    return code;
+}
+
+static script_code_t* compile_code(script_arena_t *arena, const char *script) {
+    if (script == NULL) {
+        return NULL;
+    }
+    
+    return compile_text(arena, script, strlen(script), 1, -1);
+}
+
+static script_code_t* compile_func(script_arena_t *arena, const char *body,
+                                   int32_t params) {
+    return compile_text(arena, body, strlen(body), 1, params);
+}
+
+script_code_t* script_compile(const char *script) {
+    return compile_code(NULL, script);
+}
+
+void script_free_code(script_code_t *code) {
+    if (code == NULL) {
+        return;
+    }
+    
+    scratch_free(code->arena, code, code->size);
+}
+
+/*
+ * First instruction at or after line_num; past the end ends the run and
+ * lines before the code cannot be reached from it.
+ */
+static int32_t pc_for_line(const script_code_t *code, int32_t line_num) {
+    line_num -= code->first_line - 1;
+    
+    if (line_num <= 0) {
+        return SYSERR;
+    }
+    if (line_num > code->line_count) {
+        return code->insn_count;
+    }
+    
+    return code->lines[line_num];
+}
+
+/* Return a typed value; the exit code is its integer reading */
+static int set_return(script_context_t *ctx, script_value_t *val) {
+    int result;
+    
+    if (val_own(ctx, val) != OK) {
+        val_release(ctx, val);
+        return SYSERR;
+    }
+    
+    result = script_return(ctx, val_to_int(val));
+    val_release(ctx, &ctx->ret);
+    ctx->ret = *val;
+    
+    return result;
+}
+
+/* name[key] = value; a variable that holds no container becomes one */
+static int exec_store(script_context_t *ctx, script_code_t *code,
+                      script_insn_t *insn) {
+    script_value_t key, val;
+    script_value_t *slot = NULL;
+    script_var_t *var = NULL;
+    script_array_t *arr;
+    int result = OK;
+    
+    if (eval_ops(ctx, &code->ops[insn->expr], code->pool, &key) != OK) {
+        return SYSERR;
+    }
+    if (eval_ops(ctx, &code->ops[insn->b], code->pool, &val) != OK) {
+        val_release(ctx, &key);
+        return SYSERR;
+    }
+    
+    /* Both may borrow from the value about to be replaced */
+    if (val_own(ctx, &key) != OK || val_own(ctx, &val) != OK) {
+        result = SYSERR;
+        goto out;
+    }
+    
+    /* Calls in the operands may have moved the frame slots */
+    if (insn->a < 0) {
+        slot = frame_slot(ctx, insn->target);
+    } else {
+        var = ref_var(ctx, &insn->dst, code->pool + insn->a, true);
+        if (var == NULL || var->readonly) {
+            goto out;
+        }
+    }
+    
+    if (slot != NULL ? slot->type == VAR_TYPE_ARRAY :
+                       var->type == VAR_TYPE_ARRAY) {
+        arr = slot != NULL ? slot->v.array_val : var->value.array_val;
+    } else {
+        /* String keys make a map, anything else a list */
+        arr = arr_new(ctx, key.type == VAR_TYPE_STRING);
+        if (arr == NULL) {
+            result = SYSERR;
+            goto out;
+        }
+        if (slot != NULL) {
+            val_release(ctx, slot);
+            val_array(slot, arr, true);
+        } else {
+            clear_value(ctx, var);
+            var->type = VAR_TYPE_ARRAY;
+            var->value.array_val = arr;
+        }
+    }
+    
+    result = index_store(ctx, arr, &key, &val);
+    
+out:
+    val_release(ctx, &key);
+    val_release(ctx, &val);
+    
+    return result;
+}
+
+/* Value of an instruction's expression operand, or its folded constant */
+static int eval_operand(script_context_t *ctx, script_code_t *code,
+                        script_insn_t *insn, script_value_t *val) {
+    if (insn->expr < 0) {
+        val_int(val, insn->imm);
+        return OK;
+    }
+    
+    return eval_ops(ctx, &code->ops[insn->expr], code->pool, val);
+}
+
+static int exec_insn(script_context_t *ctx, script_code_t *code,
+                     script_insn_t *insn, int32_t *pc) {
+    const char *pool = code->pool;
+    script_var_t *var;
+    script_value_t val;
+    bool truth;
+    
+    switch (insn->op) {
+        case OP_NOP:
+            return OK;
+            
+        case OP_SET_INT:
+            var = ref_var(ctx, &insn->dst, pool + insn->a, true);
+            if (var != NULL) {
+                set_value(ctx, var, VAR_TYPE_INT, &insn->imm);
+            }
+            return OK;
+            
+        case OP_SET_EXPR:
+            if (eval_operand(ctx, code, insn, &val) != OK) {
+                return SYSERR;
+            }
+            var = ref_var(ctx, &insn->dst, pool + insn->a, true);
+            if (var != NULL) {
+                assign_value(ctx, var, &val);
+            }
+            val_release(ctx, &val);
+            return OK;
+            
+        case OP_SET_STR:
+            var = ref_var(ctx, &insn->dst, pool + insn->a, true);
+            if (var != NULL) {
+                set_value(ctx, var, VAR_TYPE_STRING,
+                          (void*)(pool + insn->b));
+            }
+            return OK;
+            
+        case OP_SET_LOCAL:
+            if (insn->b >= 0) {
+                val_str(&val, pool + insn->b, strlen(pool + insn->b));
+            } else if (eval_operand(ctx, code, insn, &val) != OK) {
+                return SYSERR;
+            }
+            if (set_local(ctx, insn->target, &val) != OK) {
+                val_release(ctx, &val);
+                return SYSERR;
+            }
+            val_release(ctx, &val);
+            return OK;
+            
+        case OP_SET_INDEX:
+            return exec_store(ctx, code, insn);
+            
+        case OP_IF:
+        case OP_WHILE:
+            if (eval_operand(ctx, code, insn, &val) != OK) {
+                return SYSERR;
+            }
+            truth = val_truth(&val);
+            val_release(ctx, &val);
+            if (!truth) {
+                *pc = insn->target;
+            }
+            return OK;
+            
+        case OP_JUMP:
+            *pc = insn->target;
+            return OK;
+            
+        case OP_BREAK:
+            return script_break(ctx);
+            
+        case OP_CONTINUE:
+            return script_continue(ctx);
+            
+        case OP_RETURN:
+            if (eval_operand(ctx, code, insn, &val) != OK) {
+                return SYSERR;
+            }
+            return set_return(ctx, &val);
+            
+        case OP_GOTO:
+            if (insn->target >= 0) {
+                *pc = insn->target;
+                return OK;
+            }
+            /* Label defined outside this code; dispatch follows line_num */
+            return script_goto_label(ctx, pool + insn->a);
+            
+        case OP_EVAL:
+            if (eval_operand(ctx, code, insn, &val) != OK) {
+                return SYSERR;
+            }
+            val_release(ctx, &val);
+            return OK;
+            
+        default:
+            return SYSERR;
+    }
+}
+
+/* First pc of line_num, or -1 when it has no instructions of its own */
+static int32_t line_start(const script_code_t *code, int32_t line_num) {
+    line_num -= code->first_line - 1;
+    
+    if (line_num <= 0 || line_num > code->line_count) {
+        return -1;
+    }
+    return code->lines[line_num];
+}
+
+/* Dispatch loop; leaves ctx->running untouched so callers can nest */
+static int exec_code(script_context_t *ctx, script_code_t *code) {
+    int32_t pc = 0;
+    int result = OK;
+    
+    while (pc < code->insn_count && ctx->running) {
+        script_insn_t *insn = &code->insns[pc++];
+        
+        if (ctx->profile != NULL) {
+            prof_line(ctx->profile, insn->line_num,
+                      pc - 1 == line_start(code, insn->line_num));
+        }
+        
+        ctx->line_num = insn->line_num;
+        result = exec_insn(ctx, code, insn, &pc);
+        
+        if (result != OK) {
+            break;
+        }
+        
+        /* Honor jumps made through ctx->line_num, e.g. script_goto_label() */
+        if (ctx->line_num != insn->line_num) {
+            pc = pc_for_line(code, ctx->line_num);
+            if (pc == SYSERR) {
+                result = SYSERR;
+                break;
+            }
+        }
+    }
+    
+    return result;
+}
+
+/* Index every label up front so forward gotos resolve */
+static void index_labels(script_context_t *ctx, script_code_t *code) {
+    int32_t i;
+    
+    for (i = 0; i < code->label_count; i++) {
+        create_label(ctx, code->pool + code->labels[i].name,
+                     code->labels[i].hash, code->labels[i].line_num);
+    }
+}
+
+int script_run(script_context_t *ctx, script_code_t *code) {
+    if (ctx == NULL || code == NULL) {
+        return SYSERR;
+    }
+    
+    index_labels(ctx, code);
+    
+    ctx->running = true;
+    ctx->line_num = 0;
+    
+    /* Time between runs is nobody's */
+    if (ctx->profile != NULL) {
+        ctx->profile->mark = prof_clock();
+        ctx->profile->line = 0;
+    }
+    
+    exec_code(ctx, code);
+    
+    if (ctx->profile != NULL) {
+        prof_charge(ctx->profile, prof_clock());
+    }
+    ctx->running = false;
+    
+    return ctx->exit_code;
+}
+
+int script_execute_line(script_context_t *ctx, const char *line) {
+    script_code_t *code;
+    int32_t i, pc = 0;
+    int result = OK;
+    
+    if (ctx == NULL || line == NULL) {
+        return SYSERR;
+    }
+    
+    code = compile_code(&ctx->arena, line);
+    if (code == NULL) {
+        return SYSERR;
+    }
+    
+    /* Runs at the caller's line number rather than the line's own */
+    for (i = 0; i < code->insn_count && result == OK; i++) {
+        result = exec_insn(ctx, code, &code->insns[i], &pc);
+    }
+    
+    script_free_code(code);
+    
+    return result;
+}
+
+int script_execute(script_context_t *ctx, const char *script) {
+    script_code_t *code;
+    int result;
+    
+    if (ctx == NULL || script == NULL) {
+        return SYSERR;
+    }
+    
+    /* Transient code is recycled through the arena by the free below */
+    code = compile_code(&ctx->arena, script);
+    if (code == NULL) {
+        return SYSERR;
+    }
+    
+    result = script_run(ctx, code);
+    script_free_code(code);
+    
+    return result;
+}
+
+#ifdef SCRIPT_STREAM_FILES
+
+#ifdef XINU_KERNEL
+typedef did32 file_handle_t;
+#define FILE_INVALID        ((did32)SYSERR)
+#define file_open(name)     open(NAMESPACE, (char*)(name), "r")
+#define file_read(f, b, n)  read((f), (b), (n))
+#define file_close(f)       close(f)
+#else
+typedef FILE *file_handle_t;
+#define FILE_INVALID        NULL
+#define file_open(name)     fopen((name), "rb")
+#define file_read(f, b, n)  (int32_t)fread((b), 1, (n), (f))
+#define file_close(f)       fclose(f)
+#endif
+
+/* Block depth change of one line, for finding statement boundaries */
+static int line_depth(char *line) {
+    char *p = skip_ws(line);
+    char *colon = strchr(p, ':');
+    size_t n;
+    
+    if (colon != NULL && is_ident(p, colon - p)) {
+        p = skip_ws(colon + 1);
+    }
+    
+    n = strlen(p);
+    if (n > 0 && p[n - 1] == '\r') {
+        n--;
+    }
+    
+    if (match_keyword(p, "if") != NULL || match_keyword(p, "while") != NULL ||
+        match_keyword(p, "for") != NULL) {
+        return 1;
+    }
+    if (n == 3 && strncmp(p, "end", 3) == 0) {
+        return -1;
+    }
+    
+    return 0;
+}
+
+static int run_segment(script_context_t *ctx, const char *text, uint32_t len,
+                       int32_t first_line) {
+    script_code_t *code;
+    
+    code = compile_text(&ctx->arena, text, len, first_line, -1);
+    if (code == NULL) {
+        return SYSERR;
+    }
+    
+    /* Runtime errors end the script like script_run(), not the read */
+    index_labels(ctx, code);
+    if (exec_code(ctx, code) != OK) {
+        ctx->running = false;
+    }
+    script_free_code(code);
+    
+    return OK;
+}
+
+/*
+ * Read SCRIPT_FILE_CHUNK bytes at a time and run each run of complete
+ * top-level statements as soon as it is in, so the buffer only ever
+ * holds the block being read. A goto only reaches labels within its
+ * own segment.
+ */
+static int stream_file(script_context_t *ctx, file_handle_t file) {
+    char *buf, *nl, *grown;
+    uint32_t cap = 2 * SCRIPT_FILE_CHUNK;
+    uint32_t used = 0, scan = 0, cut = 0;
+    int32_t lines = 0, cut_lines = 0, first_line = 1, n;
+    int depth = 0;
+    bool eof = false;
+    int result = OK;
+    
+    buf = (char*)getmem(cap);
+    if (buf == NULL) {
+        return SYSERR;
+    }
+    
+    while (result == OK && ctx->running) {
+        if (cap - used < SCRIPT_FILE_CHUNK) {
+            grown = (char*)getmem(2 * cap);
+            if (grown == NULL) {
+                result = SYSERR;
+                break;
+            }
+            memcpy(grown, buf, used);
+            freemem(buf, cap);
+            buf = grown;
+            cap *= 2;
+        }
+        
+        n = file_read(file, buf + used, SCRIPT_FILE_CHUNK);
+        if (n <= 0) {
+            eof = true;
+        } else {
+            used += n;
+        }
+        
+        /* Cut after the last complete line that closes every block */
+        while ((nl = memchr(buf + scan, '\n', used - scan)) != NULL) {
+            *nl = '\0';
+            depth += line_depth(buf + scan);
+            *nl = '\n';
+            scan = nl - buf + 1;
+            lines++;
+            if (depth <= 0) {
+                depth = 0;
+                cut = scan;
+                cut_lines = lines;
+            }
+        }
+        if (eof) {
+            cut = used;
+            cut_lines = lines;
+        }
+        
+        if (cut > 0) {
+            result = run_segment(ctx, buf, cut, first_line);
+            first_line += cut_lines;
+            memmove(buf, buf + cut, used - cut);
+            used -= cut;
+            scan -= cut;
+            lines -= cut_lines;
+            cut = 0;
+            cut_lines = 0;
+        }
+        
+        if (eof) {
+            break;
+        }
+    }
+    
+    freemem(buf, cap);
+    
+    return result;
+}
+
+#endif
+
+/*
+ * Compiled file cache, one per thread so concurrent interpreters never
+ * share code; their slot caches are written while running. A thread frees
+ * its entries with script_cache_clear().
+ */
+typedef struct cache_entry {
+    char            *path;
+    uint32_t        path_size;
+    uint64_t        hash;           /* Of the file contents */
+    uint32_t        len;
+    script_code_t   *code;
+    uint32_t        stamp;          /* Last use, for LRU eviction */
+    int32_t         refs;           /* Runs in progress */
+} cache_entry_t;
+
+static SCRIPT_THREAD_LOCAL cache_entry_t script_cache[SCRIPT_CACHE_SIZE];
+static uint32_t cache_flags = SCRIPT_CACHE_MEMORY;
+
+static void cache_drop(cache_entry_t *entry) {
+    script_free_code(entry->code);
+    freemem(entry->path, entry->path_size);
+    memset(entry, 0, sizeof(*entry));
+}
+
+void script_cache_clear(void) {
+    int i;
+    
+    /* Entries still running are left for their callers */
+    for (i = 0; i < SCRIPT_CACHE_SIZE; i++) {
+        if (script_cache[i].code != NULL && script_cache[i].refs == 0) {
+            cache_drop(&script_cache[i]);
+        }
+    }
+    
+    pattern_cache_clear();
+}
+
+void script_cache_set_flags(uint32_t flags) {
+    cache_flags = flags;
+    
+    if (!(flags & SCRIPT_CACHE_MEMORY)) {
+        script_cache_clear();
+    }
+}
+
+#ifndef SCRIPT_STREAM_FILES
+
+#define CACHE_MAGIC     0x31435358u     /* "XSC1" */
+
+static SCRIPT_THREAD_LOCAL uint32_t cache_clock = 0;
+
+/* Header of an on-disk image; the code block minus its header follows */
+typedef struct cache_header {
+    uint32_t    magic;
+    uint16_t    version;
+    uint16_t    insn_size;              /* Layout of the writing build */
+    uint16_t    eop_size;
+    uint16_t    label_size;
+    uint32_t    len;
+    uint64_t    hash;
+    int32_t     insn_count;
+    int32_t     op_count;
+    int32_t     label_count;
+    int32_t     line_count;
+    uint32_t    size;
+} cache_header_t;
+
+/* FNV-1a, 64-bit, over the file contents */
+static uint64_t content_hash(const char *text, uint32_t len) {
+    uint64_t h = 14695981039346656037ull;
+    uint32_t i;
+    
+    for (i = 0; i < len; i++) {
+        h ^= (uint8_t)text[i];
+        h *= 1099511628211ull;
+    }
+    
+    return h;
+}
+
+static cache_entry_t* cache_find(const char *path, uint64_t hash,
+                                 uint32_t len) {
+    int i;
+    
+    for (i = 0; i < SCRIPT_CACHE_SIZE; i++) {
+        cache_entry_t *entry = &script_cache[i];
+        
+        if (entry->code == NULL || strcmp(entry->path, path) != 0) {
+            continue;
+        }
+        
+        if (entry->hash == hash && entry->len == len) {
+            entry->stamp = ++cache_clock;
+            return entry;
+        }
+        
+        /* The file changed since it was cached */
+        if (entry->refs == 0) {
+            cache_drop(entry);
+        }
+    }
+    
+    return NULL;
+}
+
+static cache_entry_t* cache_insert(const char *path, uint64_t hash,
+                                   uint32_t len, script_code_t *code) {
+    cache_entry_t *entry = NULL;
+    int i;
+    
+    for (i = 0; i < SCRIPT_CACHE_SIZE; i++) {
+        cache_entry_t *e = &script_cache[i];
+        
+        if (e->code == NULL) {
+            entry = e;
+            break;
+        }
+        if (e->refs == 0 && (entry == NULL || e->stamp < entry->stamp)) {
+            entry = e;
+        }
+    }
+    if (entry == NULL) {
+        return NULL;
+    }
+    if (entry->code != NULL) {
+        cache_drop(entry);
+    }
+    
+    entry->path_size = strlen(path) + 1;
+    entry->path = (char*)getmem(entry->path_size);
+    if (entry->path == NULL) {
+        entry->path_size = 0;
+        return NULL;
+    }
+    memcpy(entry->path, path, entry->path_size);
+    entry->hash = hash;
+    entry->len = len;
+    entry->code = code;
+    entry->stamp = ++cache_clock;
+    
+    return entry;
+}
+
+/* path with suffix appended, from getmem */
+static char* cache_name(const char *path, const char *suffix, uint32_t *size) {
+    char *name;
+    
+    *size = strlen(path) + strlen(suffix) + 1;
+    name = (char*)getmem(*size);
+    if (name != NULL) {
+        strcpy(name, path);
+        strcat(name, suffix);
+    }
+    
+    return name;
+}
+
+/*
+ * Whether off starts a string in the pool. The pool ends in a NUL, so
+ * one is always found; a string whose length is stored (len >= 0) must
+ * also have its NUL at off + len, or copies made by length would run
+ * past it.
+ */
+static bool pool_str(const script_code_t *code, int32_t off, int32_t len,
+                     uint32_t pool_size) {
+    if (off < 0 || (uint32_t)off >= pool_size) {
+        return false;
+    }
+    if (len < 0) {
+        return true;
+    }
+    
+    return (uint32_t)len < pool_size - (uint32_t)off &&
+           code->pool[off + len] == '\0';
+}
+
+/* Check that an expression stays on the stack and inside the block */
+static bool expr_valid(const script_code_t *code, int32_t start,
+                       uint32_t pool_size) {
+    int32_t i, need, depth = 0, reach = start;
+    
+    for (i = start; i < code->op_count; i++) {
+        const script_eop_t *eop = &code->ops[i];
+        
+        switch (eop->op) {
+            case EOP_END:
+                return reach <= i;
+            case EOP_PUSH:
+            case EOP_PUSHF:
+            case EOP_LOAD:
+                need = 0;
+                break;
+            case EOP_LOCAL:
+                if (eop->imm < 0 || eop->imm >= code->local_count) {
+                    return false;
+                }
+                need = 0;
+                break;
+            case EOP_LIST:
+            case EOP_MAP:
+                need = 0;
+                break;
+            case EOP_INSERT:
+                need = 3;
+                break;
+            case EOP_PUSHS:
+                if (eop->imm < 0 ||
+                    !pool_str(code, eop->name, eop->imm, pool_size)) {
+                    return false;
+                }
+                need = 0;
+                break;
+            case EOP_CALL:
+                need = eop->imm;
+                break;
+            case EOP_NEG:
+            case EOP_NOT:
+            case EOP_BNOT:
+            case EOP_BOOL:
+            case EOP_AND:
+            case EOP_OR:
+                need = 1;
+                break;
+            default:
+                if (eop->op > EOP_BOOL) {
+                    return false;
+                }
+                need = 2;
+                break;
+        }
+        
+        if (need < 0 || depth < need) {
+            return false;
+        }
+        if ((eop->op == EOP_LOAD || eop->op == EOP_CALL) &&
+            !pool_str(code, eop->name, -1, pool_size)) {
+            return false;
+        }
+        if (eop->op == EOP_AND || eop->op == EOP_OR) {
+            if (eop->imm < 0) {
+                return false;
+            }
+            if (i + eop->imm + 1 > reach) {
+                reach = i + eop->imm + 1;
+            }
+        }
+        
+        depth += eop_effect(eop->op, eop->imm);
+        if (depth > SCRIPT_EXPR_STACK) {
+            return false;
+        }
+    }
+    
+    return false;
+}
+
+/* Reject images whose indexes would leave the block */
+static bool code_valid(const script_code_t *code) {
+    uint32_t pool_size = code->size - pool_offset(code->insn_count,
+                             code->op_count, code->label_count,
+                             code->line_count);
+    int32_t i;
+    
+    if (pool_size == 0 || code->pool[pool_size - 1] != '\0') {
+        return false;
+    }
+    
+    for (i = 0; i < code->insn_count; i++) {
+        const script_insn_t *insn = &code->insns[i];
+        
+        if (insn->op > OP_EVAL ||
+            (insn->expr >= 0 && !expr_valid(code, insn->expr, pool_size))) {
+            return false;
+        }
+        
+        switch (insn->op) {
+            case OP_SET_STR:
+                if (!pool_str(code, insn->b, -1, pool_size)) {
+                    return false;
+                }
+                /* Fall through */
+            case OP_SET_INT:
+            case OP_SET_EXPR:
+                if (!pool_str(code, insn->a, -1, pool_size)) {
+                    return false;
+                }
+                break;
+            case OP_SET_LOCAL:
+                if ((insn->b >= 0 && !pool_str(code, insn->b, -1, pool_size)) ||
+                    insn->target < 0 || insn->target >= code->local_count) {
+                    return false;
+                }
+                break;
+            case OP_SET_INDEX:
+                if (insn->expr < 0 || insn->b < 0 ||
+                    !expr_valid(code, insn->b, pool_size) ||
+                    (insn->a >= 0 ? !pool_str(code, insn->a, -1, pool_size) :
+                     insn->target < 0 || insn->target >= code->local_count)) {
+                    return false;
+                }
+                break;
+            case OP_GOTO:
+                if (!pool_str(code, insn->a, -1, pool_size) ||
+                    insn->target < -1 || insn->target > code->insn_count) {
+                    return false;
+                }
+                break;
+            case OP_IF:
+            case OP_WHILE:
+            case OP_JUMP:
+                if (insn->target < 0 || insn->target > code->insn_count) {
+                    return false;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    
+    for (i = 0; i < code->label_count; i++) {
+        if (!pool_str(code, code->labels[i].name, -1, pool_size) ||
+            code->labels[i].pc < 0 ||
+            code->labels[i].pc > code->insn_count) {
+            return false;
+        }
+    }
+    
+    for (i = 0; i <= code->line_count; i++) {
+        if (code->lines[i] < 0 || code->lines[i] > code->insn_count) {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+/* Saved reference slots belong to another process */
+static void forget_refs(script_code_t *code) {
+    int32_t i;
+    
+    for (i = 0; i < code->insn_count; i++) {
+        code->insns[i].dst.cache = 0;
+    }
+    for (i = 0; i < code->op_count; i++) {
+        code->ops[i].ref.cache = 0;
+    }
+}
+
+static script_code_t* cache_load(const char *path, uint64_t hash,
+                                 uint32_t len) {
+    cache_header_t hdr;
+    script_code_t *code = NULL;
+    char *name;
+    uint32_t name_size;
+    FILE *file;
+    
+    name = cache_name(path, SCRIPT_CACHE_SUFFIX, &name_size);
+    if (name == NULL) {
+        return NULL;
+    }
+    file = fopen(name, "rb");
+    freemem(name, name_size);
+    if (file == NULL) {
+        return NULL;
+    }
+    
+    if (fread(&hdr, sizeof(hdr), 1, file) != 1 ||
+        hdr.magic != CACHE_MAGIC || hdr.version != SCRIPT_CODE_VERSION ||
+        hdr.insn_size != sizeof(script_insn_t) ||
+        hdr.eop_size != sizeof(script_eop_t) ||
+        hdr.label_size != sizeof(script_code_label_t) ||
+        hdr.hash != hash || hdr.len != len ||
+        hdr.size > UINT32_MAX / 8 || hdr.insn_count < 0 ||
+        (uint32_t)hdr.insn_count > hdr.size / sizeof(script_insn_t) ||
+        hdr.op_count < 0 ||
+        (uint32_t)hdr.op_count > hdr.size / sizeof(script_eop_t) ||
+        hdr.label_count < 0 ||
+        (uint32_t)hdr.label_count > hdr.size / sizeof(script_code_label_t) ||
+        hdr.line_count < 0 ||
+        (uint32_t)hdr.line_count > hdr.size / sizeof(int32_t) ||
+        pool_offset(hdr.insn_count, hdr.op_count, hdr.label_count,
+                    hdr.line_count) >= sizeof(script_code_t) + hdr.size) {
+        fclose(file);
+        return NULL;
+    }
+    
+    code = (script_code_t*)getmem(sizeof(script_code_t) + hdr.size);
+    if (code == NULL) {
+        fclose(file);
+        return NULL;
+    }
+    
+    code->size = sizeof(script_code_t) + hdr.size;
+    code->arena = NULL;
+    code->insn_count = hdr.insn_count;
+    code->op_count = hdr.op_count;
+    code->label_count = hdr.label_count;
+    code->line_count = hdr.line_count;
+    code->first_line = 1;
+    code->local_count = 0;
+    code_layout(code);
+    
+    if (fread(code + 1, 1, hdr.size, file) != hdr.size || !code_valid(code)) {
+        script_free_code(code);
+        code = NULL;
+    } else {
+        forget_refs(code);
+    }
+    fclose(file);
+    
+    return code;
+}
+
+/* Write through a temporary so concurrent readers never see half a file */
+static void cache_store(const char *path, const script_code_t *code,
+                        uint64_t hash, uint32_t len) {
+    cache_header_t hdr;
+    char *name, *tmp;
+    uint32_t name_size, tmp_size;
+    FILE *file;
+    bool ok;
+    
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = CACHE_MAGIC;
+    hdr.version = SCRIPT_CODE_VERSION;
+    hdr.insn_size = sizeof(script_insn_t);
+    hdr.eop_size = sizeof(script_eop_t);
+    hdr.label_size = sizeof(script_code_label_t);
+    hdr.len = len;
+    hdr.hash = hash;
+    hdr.insn_count = code->insn_count;
+    hdr.op_count = code->op_count;
+    hdr.label_count = code->label_count;
+    hdr.line_count = code->line_count;
+    hdr.size = code->size - sizeof(script_code_t);
+    
+    name = cache_name(path, SCRIPT_CACHE_SUFFIX, &name_size);
+    tmp = cache_name(path, SCRIPT_CACHE_SUFFIX ".tmp", &tmp_size);
+    if (name != NULL && tmp != NULL && (file = fopen(tmp, "wb")) != NULL) {
+        ok = fwrite(&hdr, sizeof(hdr), 1, file) == 1 &&
+             fwrite(code + 1, 1, hdr.size, file) == hdr.size;
+        ok = fclose(file) == 0 && ok;
+        if (!ok || rename(tmp, name) != 0) {
+            remove(tmp);
+        }
+    }
+    
+    if (name != NULL) {
+        freemem(name, name_size);
+    }
+    if (tmp != NULL) {
+        freemem(tmp, tmp_size);
+    }
+}
+
+#endif
+
+int script_execute_file(script_context_t *ctx, const char *filename) {
+    int result;
+    
+    if (ctx == NULL || filename == NULL) {
+        return SYSERR;
+    }
+    
+#ifdef SCRIPT_STREAM_FILES
+    file_handle_t file = file_open(filename);
+    if (file == FILE_INVALID) {
+        return SYSERR;
+    }
+    
+    ctx->running = true;
+    ctx->line_num = 0;
+    result = stream_file(ctx, file);
+    ctx->running = false;
+    file_close(file);
+    
+    return result == OK ? ctx->exit_code : SYSERR;
+#else
+    script_code_t *code = NULL;
+    cache_entry_t *entry = NULL;
+    struct stat st;
+    FILE *file;
+    void *text = (void*)"";
+    uint32_t len;
+    uint64_t hash;
+    
+    /* Compile straight from the mapping; nothing is read into a buffer */
+    file = fopen(filename, "rb");
+    if (file == NULL) {
+        return SYSERR;
+    }
+    if (fstat(fileno(file), &st) != 0 || st.st_size > UINT32_MAX / 4) {
+        fclose(file);
+        return SYSERR;
+    }
+    if (st.st_size > 0) {
+        text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    }
+    fclose(file);
+    if (text == MAP_FAILED) {
+        return SYSERR;
+    }
+    
+    len = (uint32_t)st.st_size;
+    if (len > 0) {
+        posix_madvise(text, len, POSIX_MADV_SEQUENTIAL);
+    }
+    
+    /* Reuse an image compiled from identical contents */
+    hash = content_hash((const char*)text, len);
+    entry = cache_find(filename, hash, len);
+    if (entry != NULL) {
+        code = entry->code;
+    } else if (cache_flags & SCRIPT_CACHE_DISK) {
+        code = cache_load(filename, hash, len);
+    }
+    if (code == NULL) {
+        code = compile_text(NULL, (const char*)text, len, 1, -1);
+        if (code != NULL && (cache_flags & SCRIPT_CACHE_DISK)) {
+            cache_store(filename, code, hash, len);
+        }
+    }
+    if (len > 0) {
+        munmap(text, len);
+    }
+    if (code == NULL) {
+        return SYSERR;
+    }
+    
+    if (entry == NULL && (cache_flags & SCRIPT_CACHE_MEMORY)) {
+        entry = cache_insert(filename, hash, len, code);
+    }
+    
+    if (entry != NULL) {
+        entry->refs++;
+    }
+    result = script_run(ctx, code);
+    if (entry != NULL) {
+        entry->refs--;
+    } else {
+        script_free_code(code);
+    }
+    
+    return result;
+#endif
+}
+
+
+int32_t expr_eval_arithmetic(const char *expr) {
+    /* No context, so variables read as 0 and only builtins can be called */
+    return script_eval_int(NULL, expr);
+}
+
+double expr_eval_float(const char *expr) {
+    return script_eval_float(NULL, expr);
+}
+
+char* expr_eval_string_expr(const char *expr, char *buf, uint32_t size) {
+    return script_eval_string(NULL, expr, buf, size);
+}
+
+bool expr_eval_condition(const char *expr) {
+    script_value_t val;
+    bool result;
+    
+    if (expr == NULL) {
+        return false;
+    }
+    
+    if (eval_text(NULL, expr, &val)) {
+        result = val_truth(&val);
+        val_release(NULL, &val);
+        return result;
+    }
+    
+    /* Not an expression: any text other than "0" is true */
+    return *expr != '\0' && strcmp(expr, "0") != 0;
+}
+
+/*
+ * Does the glob token at p accept c? Sets *next past the token. Tokens
+ * are ?, [set], [!set] or [^set] with ranges, \x, or a plain character;
+ * a [ without its ] is literal.
+ */
+static bool glob_token(const char *p, unsigned char c, const char **next) {
+    const char *q = p + 1;
+    unsigned char lo, hi;
+    bool neg, match = false;
+    
+    if (*p == '?') {
+        *next = p + 1;
+        return true;
+    }
+    
+    if (*p == '\\' && p[1] != '\0') {
+        *next = p + 2;
+        return c == (unsigned char)p[1];
+    }
+    
+    if (*p == '[') {
+        neg = *q == '!' || *q == '^';
+        if (neg) {
+            q++;
+        }
+        
+        /* A ] right after the opening bracket is part of the set */
+        for (; *q != '\0' && (*q != ']' || q == p + 1 + neg); q++) {
+            if (*q == '\\' && q[1] != '\0') {
+                q++;
+            }
+            lo = hi = (unsigned char)*q;
+            if (q[1] == '-' && q[2] != '\0' && q[2] != ']') {
+                q += 2;
+                if (*q == '\\' && q[1] != '\0') {
+                    q++;
+                }
+                hi = (unsigned char)*q;
+            }
+            if (c >= lo && c <= hi) {
+                match = true;
+            }
+        }
+        
+        if (*q == ']') {
+            *next = q + 1;
+            return match != neg;
+        }
+    }
+    
+    *next = p + 1;
+    return c == (unsigned char)*p;
+}
+
+/* Compile to masks; NULL if there are more than SCRIPT_GLOB_MAX tokens */
+script_glob_t* expr_glob_compile(const char *pattern) {
+    script_glob_t *glob;
+    const char *p, *next = NULL;
+    int32_t seg = 0;
+    int c;
+    
+    if (pattern == NULL) {
+        return NULL;
+    }
+    
+    glob = (script_glob_t*)getmem(sizeof(script_glob_t));
+    if (glob == NULL) {
+        return NULL;
+    }
+    memset(glob, 0, sizeof(script_glob_t));
+    
+    for (p = pattern; *p != '\0'; p = next) {
+        if (*p == '*') {
+            /* Runs of stars are one star */
+            while (*p == '*') p++;
+            next = p;
+            seg++;
+            glob->seg_start[seg] = glob->count;
+            continue;
+        }
+        
+        if (glob->count == SCRIPT_GLOB_MAX) {
+            freemem(glob, sizeof(script_glob_t));
+            return NULL;
+        }
+        for (c = 0; c < 256; c++) {
+            if (glob_token(p, (unsigned char)c, &next)) {
+                glob->masks[c] |= (uint64_t)1 << glob->count;
+            }
+        }
+        glob->count++;
+        glob->seg_len[seg]++;
+    }
+    glob->seg_count = seg + 1;
+    
+    return glob;
+}
+
+void expr_glob_free(script_glob_t *glob) {
+    if (glob != NULL) {
+        freemem(glob, sizeof(script_glob_t));
+    }
+}
+
+/* Segment seg matches the text at s exactly */
+static bool glob_at(const script_glob_t *glob, int32_t seg, const char *s) {
+    int32_t i, bit = glob->seg_start[seg];
+    
+    for (i = 0; i < glob->seg_len[seg]; i++, bit++) {
+        if (!(glob->masks[(unsigned char)s[i]] >> bit & 1)) {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+/*
+ * End of the leftmost match of segment seg in s[from, to), or -1. Shift-And:
+ * bit i of state is set while the last i + 1 characters match the
+ * segment's first i + 1 tokens, so each character is looked at once.
+ */
+static int32_t glob_find(const script_glob_t *glob, int32_t seg,
+                         const char *s, int32_t from, int32_t to) {
+    int32_t first = glob->seg_start[seg];
+    int32_t last = first + glob->seg_len[seg] - 1;
+    uint64_t start = (uint64_t)1 << first;
+    uint64_t final = (uint64_t)1 << last;
+    uint64_t state = 0;
+    int32_t i;
+    
+    for (i = from; i < to; i++) {
+        state = ((state << 1) | start) & glob->masks[(unsigned char)s[i]];
+        if (state & final) {
+            return i + 1;
+        }
+    }
+    
+    return -1;
+}
+
+/*
+ * The first segment is anchored at the start and the last at the end;
+ * taking the leftmost match of each segment in between is never wrong,
+ * so matching is linear in the length of the string.
+ */
+bool expr_glob_match(const script_glob_t *glob, const char *string) {
+    int32_t len, pos, end, seg, last;
+    
+    if (glob == NULL || string == NULL) {
+        return false;
+    }
+    
+    len = strlen(string);
+    last = glob->seg_count - 1;
+    
+    if (last == 0) {
+        return len == glob->seg_len[0] && glob_at(glob, 0, string);
+    }
+    
+    end = len - glob->seg_len[last];
+    if (end < glob->seg_len[0] || !glob_at(glob, 0, string)) {
+        return false;
+    }
+    
+    pos = glob->seg_len[0];
+    for (seg = 1; seg < last; seg++) {
+        pos = glob_find(glob, seg, string, pos, end);
+        if (pos < 0) {
+            return false;
+        }
+    }
+    
+    return glob_at(glob, last, string + end);
+}
+
+/* Patterns too long to compile; the single star to retry is the last */
+static bool glob_slow(const char *p, const char *s) {
+    const char *star = NULL, *retry = NULL, *next;
+    
+    while (*s != '\0') {
+        if (*p == '*') {
+            while (*p == '*') p++;
+            star = p;
+            retry = s;
+        } else if (*p != '\0' && glob_token(p, (unsigned char)*s, &next)) {
+            p = next;
+            s++;
+        } else if (star != NULL) {
+            p = star;
+            s = ++retry;
+        } else {
+            return false;
+        }
+    }
+    
+    while (*p == '*') p++;
+    
+    return *p == '\0';
+}
+
+typedef struct pattern_entry {
+    char            *pattern;
+    uint32_t        size;
+    uint32_t        hash;
+    uint32_t        stamp;
+    void            *compiled;
+} pattern_entry_t;
+
+typedef void* (*pattern_compile_t)(const char *pattern);
+typedef void (*pattern_free_t)(void *compiled);
+
+/* Recently used patterns per thread, so matching in a loop compiles once */
+static SCRIPT_THREAD_LOCAL pattern_entry_t glob_cache[SCRIPT_GLOB_CACHE];
+static SCRIPT_THREAD_LOCAL pattern_entry_t regex_cache[SCRIPT_REGEX_CACHE];
+static SCRIPT_THREAD_LOCAL uint32_t pattern_clock = 0;
+
+/* Compiled pattern; *temp is set when it could not be cached */
+static void* pattern_cached(pattern_entry_t *cache, int size_entries,
+                            const char *pattern, pattern_compile_t compile,
+                            pattern_free_t release, bool *temp) {
+    pattern_entry_t *entry, *victim = &cache[0];
+    uint32_t hash = name_hash(pattern);
+    void *compiled;
+    char *copy;
+    uint32_t size;
+    int i;
+    
+    *temp = false;
+    for (i = 0; i < size_entries; i++) {
+        entry = &cache[i];
+        if (entry->compiled != NULL && entry->hash == hash &&
+            strcmp(entry->pattern, pattern) == 0) {
+            entry->stamp = ++pattern_clock;
+            return entry->compiled;
+        }
+        if (entry->compiled == NULL ||
+            (victim->compiled != NULL && entry->stamp < victim->stamp)) {
+            victim = entry;
+        }
+    }
+    
+    compiled = compile(pattern);
+    if (compiled == NULL) {
+        return NULL;
+    }
+    
+    size = strlen(pattern) + 1;
+    copy = (char*)getmem(size);
+    if (copy == NULL) {
+        *temp = true;
+        return compiled;
+    }
+    memcpy(copy, pattern, size);
+    
+    if (victim->compiled != NULL) {
+        release(victim->compiled);
+        freemem(victim->pattern, victim->size);
+    }
+    victim->pattern = copy;
+    victim->size = size;
+    victim->hash = hash;
+    victim->stamp = ++pattern_clock;
+    victim->compiled = compiled;
+    
+    return compiled;
+}
+
+static void pattern_clear(pattern_entry_t *cache, int size_entries,
+                          pattern_free_t release) {
+    int i;
+    
+    for (i = 0; i < size_entries; i++) {
+        if (cache[i].compiled != NULL) {
+            release(cache[i].compiled);
+            freemem(cache[i].pattern, cache[i].size);
+        }
+    }
+    memset(cache, 0, size_entries * sizeof(pattern_entry_t));
+}
+
+static void* glob_compile(const char *pattern) {
+    return expr_glob_compile(pattern);
+}
+
+static void glob_release(void *glob) {
+    expr_glob_free((script_glob_t*)glob);
+}
+
+bool expr_match_glob(const char *pattern, const char *string) {
+    script_glob_t *glob;
+    bool match, temp;
+    
+    if (pattern == NULL || string == NULL) {
+        return false;
+    }
+    
+    glob = (script_glob_t*)pattern_cached(glob_cache, SCRIPT_GLOB_CACHE,
+                                          pattern, glob_compile, glob_release,
+                                          &temp);
+    if (glob == NULL) {
+        return glob_slow(pattern, string);
+    }
+    
+    match = expr_glob_match(glob, string);
+    if (temp) {
+        expr_glob_free(glob);
+    }
+    
+    return match;
+}
+
+/* NFA state kinds */
+#define RX_CHAR     0       /* Consume a byte in bits, then out */
+#define RX_SPLIT    1       /* Try out and out1 */
+#define RX_EMPTY    2       /* Go on to out */
+#define RX_BOL      3       /* Only at the start of the text */
+#define RX_EOL      4       /* Only at the end of the text */
+#define RX_MATCH    5
+
+#define RX_MAX_NEST 64
+#define RX_NONE     (-1)
+
+typedef struct regex_state {
+    uint8_t     op;
+    int16_t     out;
+    int16_t     out1;
+    uint8_t     bits[32];       /* RX_CHAR: accepted bytes */
+} regex_state_t;
+
+/* Lazily built DFA state: a sorted set of NFA states */
+typedef struct regex_dfa {
+    uint32_t    hash;
+    int32_t     set;            /* Offset into sets */
+    int16_t     count;
+    bool        at_start;       /* ^ may still match */
+    bool        match;          /* A match ends before the next byte */
+    bool        match_end;      /* A match ends if the text ends here */
+} regex_dfa_t;
+
+/*
+ * Thompson NFA plus a cache of DFA states built from it on demand. Bytes
+ * that every state treats alike share a class, which keeps the
+ * transition table narrow.
+ */
+struct script_regex {
+    regex_state_t   *states;
+    int16_t         state_count;
+    int16_t         start;
+    uint8_t         cls[256];
+    uint8_t         rep[256];       /* A byte of each class */
+    int16_t         cls_count;
+    
+    regex_dfa_t     *dfa;
+    int16_t         dfa_count;
+    int16_t         *next;          /* dfa * cls_count, RX_NONE if unknown */
+    uint16_t        *sets;          /* dfa * state_count */
+    int16_t         *index;         /* 2 * SCRIPT_REGEX_DFA buckets */
+    int16_t         start_dfa[2];   /* Mid-text and at-start entry states */
+    uint32_t        flushes;
+    
+    /* Scratch for building states */
+    uint32_t        *mark;
+    uint32_t        gen;
+    int16_t         *stack;
+    uint16_t        *work;
+    uint32_t        size;           /* Bytes in the block after the header */
+};
+
+typedef struct regex_frag {
+    int16_t     start;
+    int16_t     dangling;       /* Unset outs, linked through themselves */
+} regex_frag_t;
+
+typedef struct regex_parser {
+    const char      *p;
+    regex_state_t   *states;
+    int16_t         count;
+    int             nest;
+    bool            failed;
+} regex_parser_t;
+
+static int16_t rx_state(regex_parser_t *ps, uint8_t op) {
+    regex_state_t *st;
+    
+    if (ps->count >= SCRIPT_REGEX_STATES) {
+        ps->failed = true;
+        return RX_NONE;
+    }
+    
+    st = &ps->states[ps->count];
+    memset(st, 0, sizeof(regex_state_t));
+    st->op = op;
+    st->out = RX_NONE;
+    st->out1 = RX_NONE;
+    
+    return ps->count++;
+}
+
+/* Out field named by a dangling link: state * 2, plus 1 for out1 */
+static int16_t* rx_slot(regex_parser_t *ps, int16_t link) {
+    regex_state_t *st = &ps->states[link >> 1];
+    
+    return link & 1 ? &st->out1 : &st->out;
+}
+
+static void rx_patch(regex_parser_t *ps, int16_t list, int16_t target) {
+    int16_t next;
+    
+    while (list != RX_NONE) {
+        next = *rx_slot(ps, list);
+        *rx_slot(ps, list) = target;
+        list = next;
+    }
+}
+
+static int16_t rx_append(regex_parser_t *ps, int16_t l1, int16_t l2) {
+    int16_t list = l1;
+    
+    if (l1 == RX_NONE) {
+        return l2;
+    }
+    while (*rx_slot(ps, list) != RX_NONE) {
+        list = *rx_slot(ps, list);
+    }
+    *rx_slot(ps, list) = l2;
+    
+    return l1;
+}
+
+static regex_frag_t rx_single(regex_parser_t *ps, uint8_t op) {
+    regex_frag_t f;
+    
+    f.start = rx_state(ps, op);
+    f.dangling = f.start == RX_NONE ? RX_NONE : (int16_t)(f.start * 2);
+    
+    return f;
+}
+
+static void rx_set(uint8_t *bits, unsigned char c) {
+    bits[c >> 3] |= 1 << (c & 7);
+}
+
+static bool rx_test(const uint8_t *bits, unsigned char c) {
+    return (bits[c >> 3] >> (c & 7)) & 1;
+}
+
+/* \d, \w, \s and their negations; false for any other letter */
+static bool rx_perl_class(char e, uint8_t *bits) {
+    uint8_t set[32];
+    bool neg = isupper((unsigned char)e);
+    int c, i;
+    
+    memset(set, 0, sizeof(set));
+    for (c = 0; c < 256; c++) {
+        switch (tolower((unsigned char)e)) {
+            case 'd':
+                if (isdigit(c)) rx_set(set, c);
+                break;
+            case 'w':
+                if (isalnum(c) || c == '_') rx_set(set, c);
+                break;
+            case 's':
+                if (isspace(c)) rx_set(set, c);
+                break;
+            default:
+                return false;
+        }
+    }
+    
+    for (i = 0; i < 32; i++) {
+        bits[i] |= neg ? (uint8_t)~set[i] : set[i];
+    }
+    
+    return true;
+}
+
+/* Byte named by an escape that is not a class; -1 if unknown */
+static int rx_escape(char e) {
+    switch (e) {
+        case 'n': return '\n';
+        case 't': return '\t';
+        case 'r': return '\r';
+        case 'f': return '\f';
+        case 'v': return '\v';
+        case '0': return '\0';
+        default:
+            return isalnum((unsigned char)e) ? -1 : (unsigned char)e;
+    }
+}
+
+/* [set] with ranges, a leading ^, and escapes; p is past the [ */
+static bool rx_bracket(regex_parser_t *ps, uint8_t *bits) {
+    const char *p = ps->p;
+    uint8_t set[32];
+    bool neg = *p == '^';
+    int lo, hi, c, i;
+    
+    memset(set, 0, sizeof(set));
+    if (neg) {
+        p++;
+    }
+    
+    /* A ] right after the opening bracket is part of the set */
+    for (i = 0; *p != '\0' && (*p != ']' || i == 0); i++) {
+        if (*p == '\\' && p[1] != '\0' && rx_perl_class(p[1], set)) {
+            p += 2;
+            continue;
+        }
+        if (*p == '\\' && p[1] != '\0') {
+            lo = rx_escape(p[1]);
+            p += 2;
+        } else {
+            lo = (unsigned char)*p++;
+        }
+        hi = lo;
+        if (*p == '-' && p[1] != ']' && p[1] != '\0') {
+            if (p[1] == '\\' && p[2] != '\0') {
+                hi = rx_escape(p[2]);
+                p += 3;
+            } else {
+                hi = (unsigned char)p[1];
+                p += 2;
+            }
+        }
+        if (lo < 0 || hi < 0) {
+            return false;
+        }
+        for (c = lo; c <= hi; c++) {
+            rx_set(set, (unsigned char)c);
+        }
+    }
+    
+    if (*p != ']') {
+        return false;
+    }
+    ps->p = p + 1;
+    
+    for (i = 0; i < 32; i++) {
+        bits[i] = neg ? (uint8_t)~set[i] : set[i];
+    }
+    
+    return true;
+}
+
+static regex_frag_t rx_alt(regex_parser_t *ps);
+
+static regex_frag_t rx_atom(regex_parser_t *ps) {
+    regex_frag_t f = { RX_NONE, RX_NONE };
+    regex_state_t *st;
+    char c = *ps->p;
+    int e, i;
+    
+    switch (c) {
+        case '(':
+            ps->p++;
+            if (ps->p[0] == '?' && ps->p[1] == ':') {
+                ps->p += 2;
+            }
+            if (++ps->nest > RX_MAX_NEST) {
+                ps->failed = true;
+                return f;
+            }
+            f = rx_alt(ps);
+            ps->nest--;
+            if (*ps->p != ')') {
+                ps->failed = true;
+                return f;
+            }
+            ps->p++;
+            return f;
+            
+        case '^':
+        case '$':
+            ps->p++;
+            return rx_single(ps, c == '^' ? RX_BOL : RX_EOL);
+            
+        case '*':
+        case '+':
+        case '?':
+        case ')':
+        case '|':
+        case '\0':
+            ps->failed = true;
+            return f;
+            
+        default:
+            break;
+    }
+    
+    f = rx_single(ps, RX_CHAR);
+    if (f.start == RX_NONE) {
+        return f;
+    }
+    st = &ps->states[f.start];
+    
+    if (c == '.') {
+        /* Any byte but a newline */
+        for (i = 0; i < 256; i++) {
+            if (i != '\n') rx_set(st->bits, (unsigned char)i);
+        }
+        ps->p++;
+    } else if (c == '[') {
+        ps->p++;
+        if (!rx_bracket(ps, st->bits)) {
+            ps->failed = true;
+        }
+    } else if (c == '\\') {
+        ps->p++;
+        if (*ps->p == '\0') {
+            ps->failed = true;
+        } else if (rx_perl_class(*ps->p, st->bits)) {
+            ps->p++;
+        } else if ((e = rx_escape(*ps->p)) >= 0) {
+            rx_set(st->bits, (unsigned char)e);
+            ps->p++;
+        } else {
+            ps->failed = true;
+        }
+    } else {
+        rx_set(st->bits, (unsigned char)c);
+        ps->p++;
+    }
+    
+    return f;
+}
+
+static regex_frag_t rx_concat2(regex_parser_t *ps, regex_frag_t a,
+                               regex_frag_t b) {
+    regex_frag_t f;
+    
+    if (a.start == RX_NONE) {
+        return b;
+    }
+    rx_patch(ps, a.dangling, b.start);
+    f.start = a.start;
+    f.dangling = b.dangling;
+    
+    return f;
+}
+
+/* e*, e+ or e? */
+static regex_frag_t rx_quantify(regex_parser_t *ps, regex_frag_t e, char q) {
+    regex_frag_t f;
+    int16_t s = rx_state(ps, RX_SPLIT);
+    
+    if (s == RX_NONE || e.start == RX_NONE) {
+        ps->failed = true;
+        return e;
+    }
+    ps->states[s].out = e.start;
+    
+    switch (q) {
+        case '*':
+            rx_patch(ps, e.dangling, s);
+            f.start = s;
+            f.dangling = s * 2 + 1;
+            break;
+        case '+':
+            rx_patch(ps, e.dangling, s);
+            f.start = e.start;
+            f.dangling = s * 2 + 1;
+            break;
+        default:
+            f.start = s;
+            f.dangling = rx_append(ps, e.dangling, s * 2 + 1);
+            break;
+    }
+    
+    return f;
+}
+
+/* {m}, {m,} or {m,n}; -1 in *max for no limit */
+static bool rx_counts(const char **pp, int *min, int *max) {
+    const char *p = *pp + 1;
+    char *end;
+    long m, n;
+    
+    if (!isdigit((unsigned char)*p)) {
+        return false;
+    }
+    m = strtol(p, &end, 10);
+    p = end;
+    n = m;
+    if (*p == ',') {
+        p++;
+        if (isdigit((unsigned char)*p)) {
+            n = strtol(p, &end, 10);
+            p = end;
+        } else {
+            n = -1;
+        }
+    }
+    if (*p != '}' || m > SCRIPT_REGEX_STATES || n > SCRIPT_REGEX_STATES ||
+        (n >= 0 && n < m)) {
+        return false;
+    }
+    
+    *min = (int)m;
+    *max = (int)n;
+    *pp = p + 1;
+    
+    return true;
+}
+
+/*
+ * A ? straight after a quantifier asks for the shortest match. Whether
+ * the text matches is the same either way, so it is taken and ignored.
+ */
+static void rx_lazy(regex_parser_t *ps) {
+    if (*ps->p == '?') {
+        ps->p++;
+    }
+}
+
+/* Counted repeats copy the atom by parsing its text again */
+static regex_frag_t rx_repeat(regex_parser_t *ps) {
+    const char *atom = ps->p;
+    const char *after;
+    regex_frag_t f = rx_atom(ps), r, copy;
+    bool quantified = false;
+    int min, max, i, copies;
+    
+    for (;; quantified = true) {
+        if (ps->failed) {
+            return f;
+        }
+        if (*ps->p == '*' || *ps->p == '+' || *ps->p == '?') {
+            f = rx_quantify(ps, f, *ps->p++);
+            rx_lazy(ps);
+            continue;
+        }
+        if (*ps->p != '{' || !rx_counts(&ps->p, &min, &max)) {
+            return f;
+        }
+        if (quantified) {
+            /* Only the atom itself can be copied */
+            ps->failed = true;
+            return f;
+        }
+        
+        after = ps->p;
+        copies = max < 0 ? (min > 0 ? min : 1) : max;
+        r.start = RX_NONE;
+        r.dangling = RX_NONE;
+        for (i = 0; i < copies && !ps->failed; i++) {
+            if (i == 0) {
+                copy = f;
+            } else {
+                ps->p = atom;
+                copy = rx_atom(ps);
+            }
+            if (max < 0 && i == copies - 1) {
+                copy = rx_quantify(ps, copy, min > 0 ? '+' : '*');
+            } else if (i >= min) {
+                copy = rx_quantify(ps, copy, '?');
+            }
+            r = rx_concat2(ps, r, copy);
+        }
+        ps->p = after;
+        rx_lazy(ps);
+        
+        /* x{0} matches the empty string */
+        f = copies == 0 ? rx_single(ps, RX_EMPTY) : r;
+    }
+}
+
+static regex_frag_t rx_concat(regex_parser_t *ps) {
+    regex_frag_t f = { RX_NONE, RX_NONE };
+    
+    while (!ps->failed && *ps->p != '\0' && *ps->p != '|' && *ps->p != ')') {
+        f = rx_concat2(ps, f, rx_repeat(ps));
+    }
+    
+    return f.start == RX_NONE ? rx_single(ps, RX_EMPTY) : f;
+}
+
+static regex_frag_t rx_alt(regex_parser_t *ps) {
+    regex_frag_t f = rx_concat(ps), g;
+    int16_t s;
+    
+    while (!ps->failed && *ps->p == '|') {
+        ps->p++;
+        g = rx_concat(ps);
+        s = rx_state(ps, RX_SPLIT);
+        if (s == RX_NONE) {
+            break;
+        }
+        ps->states[s].out = f.start;
+        ps->states[s].out1 = g.start;
+        f.start = s;
+        f.dangling = rx_append(ps, f.dangling, g.dangling);
+    }
+    
+    return f;
+}
+
+/* Split bytes into classes that no state tells apart */
+static void rx_classes(script_regex_t *re) {
+    int16_t map[512];
+    uint8_t cls[256];
+    int16_t n;
+    int i, c;
+    
+    memset(re->cls, 0, sizeof(re->cls));
+    re->cls_count = 1;
+    
+    for (i = 0; i < re->state_count; i++) {
+        const regex_state_t *st = &re->states[i];
+        
+        if (st->op != RX_CHAR) {
+            continue;
+        }
+        for (c = 0; c < 512; c++) {
+            map[c] = RX_NONE;
+        }
+        n = 0;
+        for (c = 0; c < 256; c++) {
+            int key = re->cls[c] * 2 + rx_test(st->bits, (unsigned char)c);
+            if (map[key] == RX_NONE) {
+                map[key] = n++;
+            }
+            cls[c] = (uint8_t)map[key];
+        }
+        memcpy(re->cls, cls, sizeof(cls));
+        re->cls_count = n;
+    }
+    
+    for (c = 255; c >= 0; c--) {
+        re->rep[re->cls[c]] = (uint8_t)c;
+    }
+}
+
+/* Forget every DFA state; they are rebuilt as the text needs them */
+static void rx_flush(script_regex_t *re) {
+    int32_t i;
+    
+    re->dfa_count = 0;
+    re->flushes++;
+    re->start_dfa[0] = RX_NONE;
+    re->start_dfa[1] = RX_NONE;
+    for (i = 0; i < 2 * SCRIPT_REGEX_DFA; i++) {
+        re->index[i] = RX_NONE;
+    }
+}
+
+/*
+ * Compile to an NFA; NULL on a syntax error or more than
+ * SCRIPT_REGEX_STATES states. Everything the matcher needs, including its
+ * DFA cache, is allocated here in one block.
+ */
+script_regex_t* expr_regex_compile(const char *pattern) {
+    regex_state_t *states;
+    regex_parser_t ps;
+    regex_frag_t f;
+    script_regex_t *re;
+    int16_t match;
+    uint32_t size, n, cls;
+    char *block;
+    
+    if (pattern == NULL) {
+        return NULL;
+    }
+    
+    states = (regex_state_t*)getmem(SCRIPT_REGEX_STATES *
+                                    sizeof(regex_state_t));
+    if (states == NULL) {
+        return NULL;
+    }
+    
+    memset(&ps, 0, sizeof(ps));
+    ps.p = pattern;
+    ps.states = states;
+    f = rx_alt(&ps);
+    match = rx_state(&ps, RX_MATCH);
+    if (ps.failed || *ps.p != '\0' || match == RX_NONE) {
+        freemem(states, SCRIPT_REGEX_STATES * sizeof(regex_state_t));
+        return NULL;
+    }
+    rx_patch(&ps, f.dangling, match);
+    
+    /* Classes are known only after parsing, so size with the worst case */
+    n = ps.count;
+    cls = 256;
+    size = n * sizeof(regex_state_t) +
+           SCRIPT_REGEX_DFA * sizeof(regex_dfa_t) +
+           SCRIPT_REGEX_DFA * cls * sizeof(int16_t) +
+           2 * SCRIPT_REGEX_DFA * sizeof(int16_t) +
+           n * sizeof(uint32_t) + (2 * n + 1) * sizeof(int16_t) +
+           SCRIPT_REGEX_DFA * n * sizeof(uint16_t) + n * sizeof(uint16_t);
+    re = (script_regex_t*)getmem(sizeof(script_regex_t) + size);
+    if (re == NULL) {
+        freemem(states, SCRIPT_REGEX_STATES * sizeof(regex_state_t));
+        return NULL;
+    }
+    memset(re, 0, sizeof(script_regex_t) + size);
+    re->size = size;
+    
+    /* Widest members first so every array stays aligned */
+    block = (char*)(re + 1);
+    re->dfa = (regex_dfa_t*)block;
+    block += SCRIPT_REGEX_DFA * sizeof(regex_dfa_t);
+    re->mark = (uint32_t*)block;
+    block += n * sizeof(uint32_t);
+    re->states = (regex_state_t*)block;
+    block += n * sizeof(regex_state_t);
+    re->next = (int16_t*)block;
+    block += SCRIPT_REGEX_DFA * cls * sizeof(int16_t);
+    re->index = (int16_t*)block;
+    block += 2 * SCRIPT_REGEX_DFA * sizeof(int16_t);
+    re->stack = (int16_t*)block;
+    block += (2 * n + 1) * sizeof(int16_t);
+    re->sets = (uint16_t*)block;
+    block += SCRIPT_REGEX_DFA * n * sizeof(uint16_t);
+    re->work = (uint16_t*)block;
+    
+    memcpy(re->states, states, n * sizeof(regex_state_t));
+    freemem(states, SCRIPT_REGEX_STATES * sizeof(regex_state_t));
+    re->state_count = n;
+    re->start = f.start;
+    rx_classes(re);
+    rx_flush(re);
+    
+    return re;
+}
+
+void expr_regex_free(script_regex_t *re) {
+    if (re != NULL) {
+        freemem(re, sizeof(script_regex_t) + re->size);
+    }
+}
+
+/*
+ * Mark every state reachable from s without consuming a byte. ^ is
+ * followed only at the start, $ only at the end; states past an
+ * unsatisfied $ stay in the set so the end of the text can resume them.
+ */
+static void rx_closure(script_regex_t *re, int16_t s, bool at_start,
+                       bool at_end) {
+    int32_t sp = 0;
+    regex_state_t *st;
+    
+    re->stack[sp++] = s;
+    while (sp > 0) {
+        s = re->stack[--sp];
+        if (s == RX_NONE || re->mark[s] == re->gen) {
+            continue;
+        }
+        re->mark[s] = re->gen;
+        st = &re->states[s];
+        
+        switch (st->op) {
+            case RX_SPLIT:
+                re->stack[sp++] = st->out1;
+                /* Fall through */
+            case RX_EMPTY:
+                re->stack[sp++] = st->out;
+                break;
+            case RX_BOL:
+                if (at_start) {
+                    re->stack[sp++] = st->out;
+                }
+                break;
+            case RX_EOL:
+                if (at_end) {
+                    re->stack[sp++] = st->out;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+static void rx_next_gen(script_regex_t *re) {
+    if (++re->gen == 0) {
+        memset(re->mark, 0, re->state_count * sizeof(uint32_t));
+        re->gen = 1;
+    }
+}
+
+/* Marked states as a sorted list in work; count returned */
+static int16_t rx_collect(script_regex_t *re, bool *match) {
+    int16_t i, n = 0;
+    
+    *match = false;
+    for (i = 0; i < re->state_count; i++) {
+        if (re->mark[i] != re->gen) {
+            continue;
+        }
+        switch (re->states[i].op) {
+            case RX_MATCH:
+                *match = true;
+                /* Fall through */
+            case RX_CHAR:
+            case RX_EOL:
+                re->work[n++] = i;
+                break;
+            default:
+                break;
+        }
+    }
+    
+    return n;
+}
+
+/* Entry for the set in work, adding it (and flushing if full) as needed */
+static int16_t rx_dfa(script_regex_t *re, int16_t count, bool at_start,
+                      bool match) {
+    uint32_t mask = 2 * SCRIPT_REGEX_DFA - 1;
+    uint32_t hash = 2166136261u ^ at_start;
+    regex_dfa_t *d;
+    uint32_t b;
+    int16_t i, id;
+    bool end_match;
+    
+    for (i = 0; i < count; i++) {
+        hash = (hash ^ re->work[i]) * 16777619u;
+    }
+    
+    for (b = hash & mask; (id = re->index[b]) != RX_NONE; b = (b + 1) & mask) {
+        d = &re->dfa[id];
+        if (d->hash == hash && d->count == count && d->at_start == at_start &&
+            memcmp(&re->sets[d->set], re->work,
+                   count * sizeof(uint16_t)) == 0) {
+            return id;
+        }
+    }
+    
+    if (re->dfa_count == SCRIPT_REGEX_DFA) {
+        rx_flush(re);
+        for (b = hash & mask; re->index[b] != RX_NONE; b = (b + 1) & mask) {
+            ;
+        }
+    }
+    
+    /* Whether the text may end here: resume past each $ */
+    rx_next_gen(re);
+    for (i = 0; i < count; i++) {
+        rx_closure(re, re->work[i], at_start, true);
+    }
+    end_match = false;
+    for (i = 0; i < re->state_count && !end_match; i++) {
+        end_match = re->mark[i] == re->gen && re->states[i].op == RX_MATCH;
+    }
+    
+    id = re->dfa_count++;
+    d = &re->dfa[id];
+    d->hash = hash;
+    d->set = id * re->state_count;
+    d->count = count;
+    d->at_start = at_start;
+    d->match = match;
+    d->match_end = end_match;
+    memcpy(&re->sets[d->set], re->work, count * sizeof(uint16_t));
+    for (i = 0; i < re->cls_count; i++) {
+        re->next[id * re->cls_count + i] = RX_NONE;
+    }
+    re->index[b] = id;
+    
+    return id;
+}
+
+/* The state a search starts in, where any position may begin a match */
+static int16_t rx_start(script_regex_t *re, bool at_start) {
+    int16_t count;
+    bool match;
+    
+    if (re->start_dfa[at_start] != RX_NONE) {
+        return re->start_dfa[at_start];
     }
     
-    /* Push call frame */
-    if (ctx->call_sp >= SCRIPT_MAX_STACK) {
-        return SYSERR;  /* Stack overflow */
-    }
-    ctx->call_stack[ctx->call_sp++] = ctx->line_num;
+    rx_next_gen(re);
+    rx_closure(re, re->start, at_start, false);
+    count = rx_collect(re, &match);
+    re->start_dfa[at_start] = rx_dfa(re, count, at_start, match);
+    
+    return re->start_dfa[at_start];
+}
+
+/* Build the transition of DFA state id on byte class k */
+static int16_t rx_step(script_regex_t *re, int16_t id, uint8_t k) {
+    unsigned char c = re->rep[k];
+    regex_dfa_t *d = &re->dfa[id];
+    uint32_t flushes = re->flushes;
+    int16_t i, count, next;
+    bool match;
     
-    /* Set parameters as variables */
-    for (i = 0; i < func->num_params && i < argc; i++) {
-        snprintf(param_name, sizeof(param_name), "arg%d", i);
-        script_set_var(ctx, param_name, VAR_TYPE_STRING, argv[i]);
+    rx_next_gen(re);
+    for (i = 0; i < d->count; i++) {
+        const regex_state_t *st = &re->states[re->sets[d->set + i]];
+        
+        if (st->op == RX_CHAR && rx_test(st->bits, c)) {
+            rx_closure(re, st->out, false, false);
+        }
     }
     
-    /* Execute function body */
-    int result = script_execute(ctx, func->body);
+    /* Unanchored: a match may also start after this byte */
+    rx_closure(re, re->start, false, false);
+    count = rx_collect(re, &match);
     
-    /* Pop call frame */
-    if (ctx->call_sp > 0) {
-        ctx->line_num = ctx->call_stack[--ctx->call_sp];
+    next = rx_dfa(re, count, false, match);
+    
+    /* A flush invalidates id; the transition is then simply not saved */
+    if (re->flushes == flushes) {
+        re->next[id * re->cls_count + k] = next;
     }
     
-    return result;
+    return next;
 }
 
-
-/* Simple integer expression evaluator */
-int32_t script_eval_int(script_context_t *ctx, const char *expr) {
-    const char *p = expr;
-    int32_t result = 0;
-    bool negative = false;
-    
-    /* Skip whitespace */
-    while (*p == ' ' || *p == '\t') p++;
+/* True if any part of the len bytes at text matches */
+bool expr_regex_search(script_regex_t *re, const char *text, uint32_t len) {
+    int16_t id, next;
+    uint32_t i;
+    uint8_t k;
     
-    /* Check for negative */
-    if (*p == '-') {
-        negative = true;
-        p++;
-    } else if (*p == '+') {
-        p++;
+    if (re == NULL || text == NULL) {
+        return false;
     }
     
-    /* Check for variable reference */
-    if (*p == '$') {
-        p++;
-        char var_name[64];
-        int i = 0;
-        
-        while (*p != '\0' && (isalnum(*p) || *p == '_') && i < 63) {
-            var_name[i++] = *p++;
+    id = rx_start(re, true);
+    for (i = 0; i < len; i++) {
+        if (re->dfa[id].match) {
+            return true;
         }
-        var_name[i] = '\0';
-        
-        var_type_t type;
-        if (script_get_var(ctx, var_name, &type, &result) == OK) {
-            if (type == VAR_TYPE_INT) {
-                return negative ? -result : result;
-            }
+        k = re->cls[(unsigned char)text[i]];
+        next = re->next[id * re->cls_count + k];
+        if (next == RX_NONE) {
+            next = rx_step(re, id, k);
         }
-        return 0;
+        id = next;
     }
     
-    /* Parse number */
-    if (*p == '0' && (*(p + 1) == 'x' || *(p + 1) == 'X')) {
-        /* Hexadecimal */
-        p += 2;
-        while (isxdigit(*p)) {
-            result = result * 16;
-            if (*p >= '0' && *p <= '9') {
-                result += *p - '0';
-            } else if (*p >= 'a' && *p <= 'f') {
-                result += *p - 'a' + 10;
-            } else if (*p >= 'A' && *p <= 'F') {
-                result += *p - 'A' + 10;
-            }
-            p++;
-        }
-    } else if (*p == '0' && *(p + 1) >= '0' && *(p + 1) <= '7') {
-        /* Octal */
-        p++;
-        while (*p >= '0' && *p <= '7') {
-            result = result * 8 + (*p - '0');
-            p++;
-        }
-    } else {
-        /* Decimal */
-        while (*p >= '0' && *p <= '9') {
-            result = result * 10 + (*p - '0');
-            p++;
-        }
+    return re->dfa[id].match || re->dfa[id].match_end;
+}
+
+bool expr_regex_match(script_regex_t *re, const char *string) {
+    if (string == NULL) {
+        return false;
     }
     
-    return negative ? -result : result;
+    return expr_regex_search(re, string, strlen(string));
 }
 
-double script_eval_float(script_context_t *ctx, const char *expr) {
-    return (double)atof(expr);
+static void* regex_compile(const char *pattern) {
+    return expr_regex_compile(pattern);
 }
 
-char* script_eval_string(script_context_t *ctx, const char *expr) {
-    static char result[SCRIPT_VAR_VAL_LEN];
-    
-    /* Simple string evaluation - would need expansion for variables */
-    strncpy(result, expr, SCRIPT_VAR_VAL_LEN - 1);
-    result[SCRIPT_VAR_VAL_LEN - 1] = '\0';
-    
-    return result;
+static void regex_release(void *re) {
+    expr_regex_free((script_regex_t*)re);
 }
 
-bool script_eval_bool(script_context_t *ctx, const char *expr) {
-    const char *p = expr;
-    
-    /* Skip whitespace */
-    while (*p == ' ' || *p == '\t') p++;
+/* Search semantics: true if the pattern matches anywhere in string */
+bool expr_match_regex(const char *pattern, const char *string) {
+    script_regex_t *re;
+    bool match, temp;
     
-    /* Empty string is false */
-    if (*p == '\0') {
+    if (pattern == NULL || string == NULL) {
         return false;
     }
     
-    /* Check for boolean keywords */
-    if (strcmp(p, "true") == 0 || strcmp(p, "TRUE") == 0 || 
-        strcmp(p, "1") == 0) {
-        return true;
+    re = (script_regex_t*)pattern_cached(regex_cache, SCRIPT_REGEX_CACHE,
+                                         pattern, regex_compile,
+                                         regex_release, &temp);
+    if (re == NULL) {
+        return false;
     }
     
-    if (strcmp(p, "false") == 0 || strcmp(p, "FALSE") == 0 || 
-        strcmp(p, "0") == 0) {
-        return false;
+    match = expr_regex_match(re, string);
+    if (temp) {
+        expr_regex_free(re);
     }
     
-    /* Numeric comparison */
-    int32_t val = script_eval_int(ctx, expr);
-    return val != 0;
+    return match;
 }
 
+/* Drop this thread's compiled globs and regexes */
+static void pattern_cache_clear(void) {
+    pattern_clear(glob_cache, SCRIPT_GLOB_CACHE, glob_release);
+    pattern_clear(regex_cache, SCRIPT_REGEX_CACHE, regex_release);
+}
 
-static script_label_t* find_label(script_context_t *ctx, const char *name) {
-    int i;
+
+#ifdef SCRIPT_POOL_THREADS
+
+/* Job kinds */
+#define POOL_SCRIPT     0
+#define POOL_CALL       1
+
+struct script_future {
+    struct script_pool  *pool;
+    int32_t         kind;
+    int32_t         result;
+    uint32_t        done;           /* Set once result is final */
+    uint32_t        size;           /* Bytes in this block */
+    char            *text;          /* Script, or function name */
+    int32_t         argc;
+    char            **argv;
+};
+
+/* Queue cell; seq says whose turn it is, as in Vyukov's bounded queue */
+typedef struct pool_cell {
+    uint32_t        seq;
+    script_future_t *job;
+} pool_cell_t;
+
+typedef struct pool_worker {
+    pthread_t           thread;
+    script_context_t    *ctx;
+    struct script_pool  *pool;
+} pool_worker_t;
+
+/*
+ * Submitting and taking jobs never locks. The mutex is only for parking
+ * idle workers, submitters facing a full queue, and waiters on futures.
+ */
+struct script_pool {
+    pool_cell_t     cells[SCRIPT_POOL_QUEUE];
+    uint32_t        head;           /* Next cell to take */
+    uint32_t        tail;           /* Next cell to fill */
+    uint32_t        pending;        /* Jobs published but not taken */
+    uint32_t        sleepers;
+    uint32_t        submitters;     /* Threads waiting for a free cell */
+    uint32_t        waiters;        /* Threads blocked on futures */
+    bool            closing;
     
-    for (i = 0; i < SCRIPT_MAX_LABELS; i++) {
-        if (ctx->labels[i].defined && 
-            strcmp(ctx->labels[i].name, name) == 0) {
-            return &ctx->labels[i];
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;           /* Work arrived, a cell freed, or closing */
+    pthread_cond_t  finished;       /* Some future completed */
+    
+    script_snapshot_t *warm;        /* State every job starts from */
+    int32_t         worker_count;
+    pool_worker_t   workers[SCRIPT_POOL_MAX];
+};
+
+static bool pool_push(script_pool_t *pool, script_future_t *job) {
+    uint32_t pos = __atomic_load_n(&pool->tail, __ATOMIC_RELAXED);
+    pool_cell_t *cell;
+    int32_t diff;
+    
+    for (;;) {
+        cell = &pool->cells[pos & (SCRIPT_POOL_QUEUE - 1)];
+        diff = (int32_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&pool->tail, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;       /* Full */
+        } else {
+            pos = __atomic_load_n(&pool->tail, __ATOMIC_RELAXED);
         }
     }
     
-    return NULL;
+    cell->job = job;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    
+    return true;
 }
 
-static int create_label(script_context_t *ctx, const char *name, int line_num) {
-    int i;
-    
-    /* Check if already exists */
-    script_label_t *label = find_label(ctx, name);
-    if (label != NULL) {
-        label->line_num = line_num;
-        return OK;
-    }
+static script_future_t* pool_pop(script_pool_t *pool) {
+    uint32_t pos = __atomic_load_n(&pool->head, __ATOMIC_RELAXED);
+    script_future_t *job;
+    pool_cell_t *cell;
+    int32_t diff;
     
-    /* Find empty slot */
-    for (i = 0; i < SCRIPT_MAX_LABELS; i++) {
-        if (!ctx->labels[i].defined) {
-            ctx->labels[i].defined = true;
-            strncpy(ctx->labels[i].name, name, SCRIPT_VAR_NAME_LEN - 1);
-            ctx->labels[i].name[SCRIPT_VAR_NAME_LEN - 1] = '\0';
-            ctx->labels[i].line_num = line_num;
-            ctx->label_count++;
-            return OK;
+    for (;;) {
+        cell = &pool->cells[pos & (SCRIPT_POOL_QUEUE - 1)];
+        diff = (int32_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) -
+                         (pos + 1));
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&pool->head, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return NULL;        /* Empty, or the next cell is still filling */
+        } else {
+            pos = __atomic_load_n(&pool->head, __ATOMIC_RELAXED);
         }
     }
     
-    return SYSERR;
+    job = cell->job;
+    __atomic_store_n(&cell->seq, pos + SCRIPT_POOL_QUEUE, __ATOMIC_RELEASE);
+    
+    return job;
 }
 
-int script_goto_label(script_context_t *ctx, const char *label) {
-    script_label_t *lbl;
+static void pool_finish(script_pool_t *pool, script_future_t *job,
+                        int32_t result) {
+    job->result = result;
+    __atomic_store_n(&job->done, 1, __ATOMIC_SEQ_CST);
     
-    if (ctx == NULL || label == NULL) {
-        return SYSERR;
+    if (__atomic_load_n(&pool->waiters, __ATOMIC_SEQ_CST) != 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->finished);
+        pthread_mutex_unlock(&pool->lock);
     }
+}
+
+/* Park until there is work; false once the pool is closing and drained */
+static bool pool_idle(script_pool_t *pool) {
+    bool more;
     
-    lbl = find_label(ctx, label);
-    if (lbl == NULL) {
-        return SYSERR;
+    pthread_mutex_lock(&pool->lock);
+    __atomic_add_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == 0 &&
+           !pool->closing) {
+        pthread_cond_wait(&pool->wake, &pool->lock);
     }
+    __atomic_sub_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+    more = __atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) != 0;
+    pthread_mutex_unlock(&pool->lock);
     
-    ctx->line_num = lbl->line_num;
-    return OK;
+    return more;
 }
 
-int script_break(script_context_t *ctx) {
-    if (ctx == NULL || ctx->loop_sp == 0) {
-        return SYSERR;
+static void* pool_main(void *arg) {
+    pool_worker_t *worker = (pool_worker_t*)arg;
+    script_pool_t *pool = worker->pool;
+    script_future_t *job;
+    int32_t result;
+    
+    for (;;) {
+        job = pool_pop(pool);
+        if (job == NULL) {
+            /* A cell still being filled is counted, so this only spins */
+            if (!pool_idle(pool)) {
+                break;
+            }
+            continue;
+        }
+        __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+        
+        /* Idle workers share wake, so every sleeper must hear it */
+        if (__atomic_load_n(&pool->submitters, __ATOMIC_SEQ_CST) != 0) {
+            pthread_mutex_lock(&pool->lock);
+            pthread_cond_broadcast(&pool->wake);
+            pthread_mutex_unlock(&pool->lock);
+        }
+        
+        if (script_restore_context(worker->ctx, pool->warm) != OK) {
+            result = SYSERR;
+        } else if (job->kind == POOL_CALL) {
+            result = script_call_func(worker->ctx, job->text, job->argc,
+                                      job->argv);
+        } else {
+            result = script_execute(worker->ctx, job->text);
+        }
+        pool_finish(pool, job, result);
     }
     
-    /* Jump to end of current loop */
-    ctx->line_num = ctx->loop_stack[ctx->loop_sp - 1];
+    /* This thread's code and pattern caches die with it */
+    script_cache_clear();
     
-    return OK;
+    return NULL;
 }
 
-int script_continue(script_context_t *ctx) {
-    if (ctx == NULL || ctx->loop_sp == 0) {
-        return SYSERR;
-    }
+static void pool_stop(script_pool_t *pool, int32_t started) {
+    int32_t i;
     
-    /* Jump to beginning of current loop */
-    ctx->line_num = ctx->loop_stack[ctx->loop_sp - 1] - 1;
+    pthread_mutex_lock(&pool->lock);
+    pool->closing = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
     
-    return OK;
+    for (i = 0; i < started; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    for (i = 0; i < pool->worker_count; i++) {
+        script_destroy_context(pool->workers[i].ctx);
+    }
+    script_snapshot_free(pool->warm);
+    
+    pthread_cond_destroy(&pool->finished);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    freemem(pool, sizeof(script_pool_t));
 }
 
-int script_return(script_context_t *ctx, int value) {
-    if (ctx == NULL) {
-        return SYSERR;
+/*
+ * Start workers whose contexts are clones of one that init (may be NULL)
+ * prepared. Every job starts from that state, whatever ran before it.
+ */
+script_pool_t* script_pool_create(int workers, script_init_func init,
+                                  void *arg) {
+    script_pool_t *pool;
+    script_context_t *ctx;
+    int32_t i;
+    
+    if (workers <= 0 || workers > SCRIPT_POOL_MAX) {
+        return NULL;
     }
     
-    ctx->exit_code = value;
-    ctx->running = false;
+    pool = (script_pool_t*)getmem(sizeof(script_pool_t));
+    if (pool == NULL) {
+        return NULL;
+    }
+    memset(pool, 0, sizeof(script_pool_t));
+    for (i = 0; i < SCRIPT_POOL_QUEUE; i++) {
+        pool->cells[i].seq = i;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->finished, NULL);
     
-    return OK;
+    /* Run init once; the workers start from a snapshot of the result */
+    ctx = script_create_context();
+    if (ctx != NULL && (init == NULL || init(ctx, arg) == OK)) {
+        pool->warm = script_snapshot_create(ctx);
+    }
+    script_destroy_context(ctx);
+    if (pool->warm == NULL) {
+        pool_stop(pool, 0);
+        return NULL;
+    }
+    
+    for (i = 0; i < workers; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].ctx = script_clone_context(pool->warm);
+        pool->worker_count = i + 1;
+        if (pool->workers[i].ctx == NULL) {
+            pool_stop(pool, 0);
+            return NULL;
+        }
+    }
+    
+    for (i = 0; i < workers; i++) {
+        if (pthread_create(&pool->workers[i].thread, NULL, pool_main,
+                           &pool->workers[i]) != 0) {
+            pool_stop(pool, i);
+            return NULL;
+        }
+    }
+    
+    return pool;
 }
 
+/* Runs every job still queued, then stops the workers */
+void script_pool_destroy(script_pool_t *pool) {
+    if (pool != NULL) {
+        pool_stop(pool, pool->worker_count);
+    }
+}
 
-static int execute_line(script_context_t *ctx, const char *line) {
-    char *p = (char*)line;
-    char *token;
-    
-    while (*p == ' ' || *p == '\t') p++;
+/* Wait for a free cell when the queue is full; NULL once closing */
+static script_future_t* pool_submit(script_pool_t *pool,
+                                    script_future_t *job) {
+    bool queued = pool_push(pool, job);
     
-    /* Skip empty lines and comments */
-    if (*p == '\0' || *p == '#') {
-        return OK;
+    if (!queued) {
+        pthread_mutex_lock(&pool->lock);
+        __atomic_add_fetch(&pool->submitters, 1, __ATOMIC_SEQ_CST);
+        while (!pool->closing && !(queued = pool_push(pool, job))) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        __atomic_sub_fetch(&pool->submitters, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    if (!queued) {
+        freemem(job, job->size);
+        return NULL;
     }
     
-    /* Check for label definition */
-    char *colon = strchr(p, ':');
-    if (colon != NULL && colon > p) {
-        char label[SCRIPT_VAR_NAME_LEN];
-        int len = colon - p;
-        if (len < SCRIPT_VAR_NAME_LEN) {
-            strncpy(label, p, len);
-            label[len] = '\0';
-            create_label(ctx, label, ctx->line_num);
-        }
-        p = colon + 1;
-        while (*p == ' ' || *p == '\t') p++;
-        if (*p == '\0') {
-            return OK;
-        }
+    __atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->sleepers, __ATOMIC_SEQ_CST) != 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
     }
     
-    /* Check for assignment */
-    char *equals = strchr(p, '=');
-    if (equals != NULL && equals > p && *(equals - 1) != '!' && 
-        *(equals - 1) != '<' && *(equals - 1) != '>') {
-        char var_name[SCRIPT_VAR_NAME_LEN];
-        int len = equals - p;
-        
-        /* Get variable name */
-        while (len > 0 && (p[len - 1] == ' ' || p[len - 1] == '\t')) len--;
-        if (len < SCRIPT_VAR_NAME_LEN) {
-            strncpy(var_name, p, len);
-            var_name[len] = '\0';
-            
-            /* Get value */
-            p = equals + 1;
-            while (*p == ' ' || *p == '\t') p++;
-            
-            /* Determine type and set variable */
-            if ((*p >= '0' && *p <= '9') || *p == '-' || *p == '+') {
-                /* Numeric */
-                int32_t val = script_eval_int(ctx, p);
-                script_set_var(ctx, var_name, VAR_TYPE_INT, &val);
-            } else {
-                /* String */
-                script_set_var(ctx, var_name, VAR_TYPE_STRING, p);
-            }
-            
-            return OK;
-        }
+    return job;
+}
+
+/* One block: the future, argv, then the strings */
+static script_future_t* job_alloc(script_pool_t *pool, int32_t kind,
+                                  const char *text, int32_t argc,
+                                  char **argv) {
+    script_future_t *job;
+    uint32_t size, len;
+    char *p;
+    int32_t i;
+    
+    size = sizeof(script_future_t) + argc * sizeof(char*) + strlen(text) + 1;
+    for (i = 0; i < argc; i++) {
+        size += strlen(argv[i]) + 1;
     }
     
-    /* Check for control flow keywords */
-    if (strncmp(p, "if ", 3) == 0) {
-        /* if statement - simplified */
-        p += 3;
-        bool condition = script_eval_bool(ctx, p);
-        /* Would need to track if/else blocks */
-        return OK;
-    } else if (strncmp(p, "while ", 6) == 0) {
-        /* while loop - simplified */
-        p += 6;
-        bool condition = script_eval_bool(ctx, p);
-        /* Would need to track loop */
-        return OK;
-    } else if (strncmp(p, "for ", 4) == 0) {
-        /* for loop - simplified */
-        return OK;
-    } else if (strcmp(p, "break") == 0) {
-        return script_break(ctx);
-    } else if (strcmp(p, "continue") == 0) {
-        return script_continue(ctx);
-    } else if (strncmp(p, "return", 6) == 0) {
-        p += 6;
-        while (*p == ' ' || *p == '\t') p++;
-        int val = *p != '\0' ? script_eval_int(ctx, p) : 0;
-        return script_return(ctx, val);
-    } else if (strncmp(p, "goto ", 5) == 0) {
-        p += 5;
-        while (*p == ' ' || *p == '\t') p++;
-        return script_goto_label(ctx, p);
+    job = (script_future_t*)getmem(size);
+    if (job == NULL) {
+        return NULL;
     }
+    memset(job, 0, sizeof(script_future_t));
+    job->pool = pool;
+    job->kind = kind;
+    job->size = size;
+    job->argc = argc;
+    job->argv = (char**)(job + 1);
     
-    /* Otherwise treat as expression evaluation */
-    script_eval_int(ctx, p);
+    p = (char*)(job->argv + argc);
+    for (i = 0; i < argc; i++) {
+        len = strlen(argv[i]) + 1;
+        job->argv[i] = memcpy(p, argv[i], len);
+        p += len;
+    }
+    job->text = strcpy(p, text);
     
-    return OK;
+    return job;
 }
 
-int script_execute_line(script_context_t *ctx, const char *line) {
-    if (ctx == NULL || line == NULL) {
-        return SYSERR;
+/* Queue a script, waiting while the queue is full */
+script_future_t* script_pool_submit(script_pool_t *pool, const char *script) {
+    script_future_t *job;
+    
+    if (pool == NULL || script == NULL) {
+        return NULL;
     }
     
-    return execute_line(ctx, line);
+    job = job_alloc(pool, POOL_SCRIPT, script, 0, NULL);
+    
+    return job != NULL ? pool_submit(pool, job) : NULL;
 }
 
-int script_execute(script_context_t *ctx, const char *script) {
-    char *line;
-    char *script_copy;
-    char *saveptr;
-    int result = OK;
+/* Queue a call of a function the prelude defined; arguments are copied */
+script_future_t* script_pool_call(script_pool_t *pool, const char *name,
+                                  int argc, char **argv) {
+    script_future_t *job;
     
-    if (ctx == NULL || script == NULL) {
-        return SYSERR;
+    if (pool == NULL || name == NULL || argc < 0 ||
+        (argc > 0 && argv == NULL)) {
+        return NULL;
     }
     
-    /* Make a copy of the script */
-    size_t len = strlen(script) + 1;
-    script_copy = (char*)getmem((uint32_t)len);
-    if (script_copy == NULL) {
+    job = job_alloc(pool, POOL_CALL, name, argc, argv);
+    
+    return job != NULL ? pool_submit(pool, job) : NULL;
+}
+
+bool script_future_done(script_future_t *future) {
+    return future != NULL &&
+           __atomic_load_n(&future->done, __ATOMIC_ACQUIRE) != 0;
+}
+
+/* Block until the job has run; its exit code, or SYSERR */
+int script_future_wait(script_future_t *future) {
+    script_pool_t *pool;
+    
+    if (future == NULL) {
         return SYSERR;
     }
-    strcpy(script_copy, script);
-    
-    ctx->running = true;
-    ctx->line_num = 0;
     
-    /* Execute line by line */
-    line = strtok_r(script_copy, "\n", &saveptr);
-    while (line != NULL && ctx->running) {
-        ctx->line_num++;
-        result = execute_line(ctx, line);
-        
-        if (result != OK) {
-            break;
+    if (!script_future_done(future)) {
+        pool = future->pool;
+        pthread_mutex_lock(&pool->lock);
+        __atomic_add_fetch(&pool->waiters, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&future->done, __ATOMIC_SEQ_CST) == 0) {
+            pthread_cond_wait(&pool->finished, &pool->lock);
         }
-        
-        line = strtok_r(NULL, "\n", &saveptr);
+        __atomic_sub_fetch(&pool->waiters, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&pool->lock);
     }
     
-    freemem(script_copy, (uint32_t)len);
-    ctx->running = false;
-    
-    return ctx->exit_code;
+    return future->result;
 }
 
-int script_execute_file(script_context_t *ctx, const char *filename) {
-
-    return SYSERR;
+/* Waits for the job first, so a future may be freed at any time */
+void script_future_free(script_future_t *future) {
+    if (future != NULL) {
+        script_future_wait(future);
+        freemem(future, future->size);
+    }
 }
 
+#else
 
-int32_t expr_eval_arithmetic(const char *expr) {
-    /* Simple arithmetic evaluator */
-    return atoi(expr);
+/* No threads to run on */
+script_pool_t* script_pool_create(int workers, script_init_func init,
+                                  void *arg) {
+    return NULL;
 }
 
-double expr_eval_float(const char *expr) {
-    return atof(expr);
+void script_pool_destroy(script_pool_t *pool) {
 }
 
-char* expr_eval_string_expr(const char *expr) {
-    static char result[256];
-    strncpy(result, expr, 255);
-    result[255] = '\0';
-    return result;
+script_future_t* script_pool_submit(script_pool_t *pool, const char *script) {
+    return NULL;
 }
 
-bool expr_eval_condition(const char *expr) {
-    /* Simple condition evaluator */
-    return expr != NULL && *expr != '\0' && strcmp(expr, "0") != 0;
+script_future_t* script_pool_call(script_pool_t *pool, const char *name,
+                                  int argc, char **argv) {
+    return NULL;
 }
 
-bool expr_match_glob(const char *pattern, const char *string) {
-    /* Simple glob pattern matching */
-    const char *p = pattern;
-    const char *s = string;
-    
-    while (*p != '\0' && *s != '\0') {
-        if (*p == '*') {
-            /* Match zero or more characters */
-            p++;
-            if (*p == '\0') {
-                return true;  /* * at end matches rest */
-            }
-            while (*s != '\0') {
-                if (expr_match_glob(p, s)) {
-                    return true;
-                }
-                s++;
-            }
-            return false;
-        } else if (*p == '?') {
-            /* Match any single character */
-            p++;
-            s++;
-        } else if (*p == *s) {
-            p++;
-            s++;
-        } else {
-            return false;
-        }
-    }
-    
-    while (*p == '*') p++;
-    
-    return *p == '\0' && *s == '\0';
+bool script_future_done(script_future_t *future) {
+    return false;
 }
 
-bool expr_match_regex(const char *pattern, const char *string) {
-    return expr_match_glob(pattern, string);
+int script_future_wait(script_future_t *future) {
+    return SYSERR;
+}
+
+void script_future_free(script_future_t *future) {
 }
 
+#endif
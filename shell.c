@@ -1,3 +1,7 @@
+#if !defined(_POSIX_C_SOURCE) && !defined(_WIN32)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include "shell.h"
 #include "interpreter.h"
 
@@ -6,6 +10,7 @@
 #include "../include/process.h"
 #include "../include/memory.h"
 #include "../include/types.h"
+#include "../include/clock.h"
 #else
 
 /* Standalone mode */
@@ -30,8 +35,21 @@ static pid32 currpid = 0;
 static pid32 getpid(void) { return currpid; }
 static int kill(pid32 pid) { (void)pid; return OK; }
 static void resume(pid32 pid) { (void)pid; }
-static void yield(void) { }
+#ifdef _WIN32
 static void sleep(uint32_t ms) { (void)ms; }
+#else
+#include <time.h>
+static void sleep(uint32_t ms) {
+    struct timespec ts;
+    
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+    nanosleep(&ts, NULL);
+}
+#endif
+
+#define getmem(size)        malloc(size)
+#define freemem(ptr, size)  free(ptr)
 #endif
 
 #include <string.h>
@@ -40,645 +58,4113 @@ static void sleep(uint32_t ms) { (void)ms; }
 #include <stdio.h>
 #include <ctype.h>
 
+/* Hosted builds map script files; the rest stream them in chunks */
+#if defined(XINU_KERNEL) || defined(_WIN32)
+#define SHELL_STREAM_FILES
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
-static shell_state_t shell_state;
-static shell_command_t shell_commands[128];
-static int shell_command_count = 0;
-static shell_job_t shell_jobs[32];
-static int shell_job_count = 0;
+/* Hosted builds time with the C library; all but Win32 have rusage */
+#ifndef XINU_KERNEL
+#include <time.h>
+#ifndef _WIN32
+#define SHELL_CPU_TIMES
+#include <sys/resource.h>
+#endif
+#endif
 
+/*
+ * Pipeline stages run concurrently on POSIX threads, or Xinu processes.
+ * Elsewhere they run one after another and pipes grow to hold it all.
+ */
+#if defined(XINU_KERNEL)
+#define SHELL_PIPE_PROCS
+#elif !defined(_WIN32)
+#define SHELL_PIPE_THREADS
+#include <pthread.h>
+#endif
 
-static int cmd_help(int argc, char **argv);
-static int cmd_exit(int argc, char **argv);
-static int cmd_cd(int argc, char **argv);
-static int cmd_pwd(int argc, char **argv);
-static int cmd_echo(int argc, char **argv);
-static int cmd_set(int argc, char **argv);
-static int cmd_unset(int argc, char **argv);
-static int cmd_export(int argc, char **argv);
-static int cmd_env(int argc, char **argv);
-static int cmd_alias(int argc, char **argv);
-static int cmd_unalias(int argc, char **argv);
-static int cmd_history(int argc, char **argv);
-static int cmd_ps(int argc, char **argv);
-static int cmd_kill(int argc, char **argv);
-static int cmd_jobs(int argc, char **argv);
-static int cmd_fg(int argc, char **argv);
-static int cmd_bg(int argc, char **argv);
-static int cmd_mem(int argc, char **argv);
-static int cmd_clear(int argc, char **argv);
-static int cmd_sleep(int argc, char **argv);
-static int cmd_time(int argc, char **argv);
-static int cmd_true(int argc, char **argv);
-static int cmd_false(int argc, char **argv);
-static int cmd_test(int argc, char **argv);
 
-static void shell_printf(const char *fmt, ...) {
-    va_list args;
-    
-    va_start(args, fmt);
 #ifdef XINU_KERNEL
-    char buffer[512];
-    vsnprintf(buffer, sizeof(buffer), fmt, args);
-    printf("%s", buffer);
+typedef did32 file_handle_t;
+#define FILE_INVALID        ((did32)SYSERR)
+#define file_open(name)     open(NAMESPACE, (char*)(name), "r")
+/* The namespace has no append mode, so >> fails to open under Xinu */
+#define file_create(name, append) \
+    open(NAMESPACE, (char*)(name), (append) ? "a" : "w")
+#define file_read(f, b, n)  read((f), (b), (n))
+#define file_write(f, b, n) write((f), (char*)(b), (n))
+#define file_close(f)       close(f)
+#define file_flush(f)       ((void)0)
+#define FILE_STDIN          CONSOLE
 #else
-    vprintf(fmt, args);
+typedef FILE *file_handle_t;
+#define FILE_INVALID        NULL
+#define file_open(name)     fopen((name), "rb")
+#define file_create(name, append) fopen((name), (append) ? "ab" : "wb")
+#define file_read(f, b, n)  (int32_t)fread((b), 1, (n), (f))
+#define file_write(f, b, n) fwrite((b), 1, (n), (f))
+#define file_close(f)       fclose(f)
+#define file_flush(f)       fflush(f)
+#define FILE_STDIN          stdin
 #endif
-    va_end(args);
-}
 
-static void shell_error(const char *fmt, ...) {
-    va_list args;
-    
-    va_start(args, fmt);
+#define SHELL_JOBS_MIN      8
+#define SHELL_TABLE_MIN     16
+#define SHELL_MAX_STAGES    16
+#define SHELL_PIPE_SIZE     4096        /* Ring bytes; a power of two */
+#define SHELL_STAGE_STACK   16384       /* Xinu stack per stage process */
+#define SHELL_IO_CHUNK      512
+#define SHELL_BATCH_CHUNK   16384       /* Script bytes read at a time */
+#define SHELL_OUT_BUFFER    8192        /* Batch output held before writing */
+#define SHELL_REDIR_BUFFER  65536       /* Redirected output held per file */
+#define SHELL_MAX_NEST      8           /* $( ) run inside one another */
+
+#define TABLE_EMPTY     (-1)
+#define TABLE_DELETED   (-2)
+
+/*
+ * Entries by name, in definition order. Each entry is its own block that
+ * starts with its name, so pointers handed out survive growth; removed
+ * ones leave a NULL until the next compaction.
+ */
+typedef struct shell_table {
+    void        **items;
+    uint32_t    *hashes;
+    int32_t     *index;         /* 2 * cap buckets of item slots */
+    int32_t     count;          /* Slots used, removed ones included */
+    int32_t     live;
+    int32_t     cap;
+    uint32_t    entry_size;
+} shell_table_t;
+
+/* Everything one shell owns; see shell_create_context() */
+struct shell_context {
+    shell_state_t   state;
+    shell_table_t   commands;
+    shell_table_t   aliases;
+    script_env_t    *env;           /* Variables, made when first set */
+    struct shell_history *history;  /* Made when first added to or opened */
+    struct shell_slot **jobs;       /* By id - 1, NULL when free */
+    int             job_cap;
+    int             job_count;      /* Jobs not yet reaped */
+    int             job_last;       /* Newest id, for fg and bg alone */
+    struct shell_slot *jobs_done;   /* Finished, waiting for the reaper */
+    pid32           job_pid;        /* Next pid to give a hosted job */
+    bool            jobs_ready;     /* Lock below is set up */
+#if defined(SHELL_PIPE_THREADS)
+    pthread_mutex_t jobs_lock;
+    pthread_cond_t  jobs_changed;   /* A job finished or was killed */
+#elif defined(SHELL_PIPE_PROCS)
+    sid32           jobs_lock;
+#endif
+    uint32_t        options;        /* SHELL_OPT_* */
+    char            *outbuf;        /* Terminal output held by shell_batch() */
+    uint32_t        out_used;
+    struct shell_sink *out_file;    /* shell_redirect_output() */
+    file_handle_t   in_file;        /* shell_redirect_input() */
+};
+
+/*
+ * The shell each thread (each process under Xinu) is running. Commands
+ * keep their argc/argv signature and find their shell through this.
+ */
 #ifdef XINU_KERNEL
-    char buffer[512];
-    vsnprintf(buffer, sizeof(buffer), fmt, args);
-    fprintf(stderr, "%s", buffer);
+static shell_context_t *shell_bound[NPROC];
+#define shell_binding   shell_bound[getpid()]
 #else
-    vfprintf(stderr, fmt, args);
+static SCRIPT_THREAD_LOCAL shell_context_t *shell_binding;
 #endif
-    va_end(args);
+
+/* Used until a context is bound, which keeps single-shell callers as is */
+static shell_context_t shell_default = { .in_file = FILE_INVALID };
+
+static shell_context_t* shell_self(void) {
+    return shell_binding != NULL ? shell_binding : &shell_default;
 }
 
-void shell_init(void) {
-    int i;
-    
-    /* Initialize shell state */
-    memset(&shell_state, 0, sizeof(shell_state));
-    strcpy(shell_state.cwd, "/");
-    shell_state.interactive = true;
-    shell_state.running = true;
-    shell_state.pid = getpid();
-    
-    shell_state.history_count = 0;
-    shell_state.history_index = 0;
+/*
+ * Bytes between two pipeline stages, with one writer and one reader.
+ * head and tail run freely and are masked on use.
+ */
+typedef struct shell_pipe {
+    char        *buf;
+    uint32_t    size;
+    uint32_t    head;           /* Next byte to read */
+    uint32_t    tail;           /* Next byte to write */
+    bool        closed;         /* Writer is done */
+    bool        broken;         /* Reader is done; writes are dropped */
+#if defined(SHELL_PIPE_THREADS)
+    pthread_mutex_t lock;
+    pthread_cond_t  changed;
+#elif defined(SHELL_PIPE_PROCS)
+    sid32       lock;
+    sid32       changed;
+    int32_t     waiting;
+#endif
+} shell_pipe_t;
+
+/* A file output is redirected to, written in large blocks */
+typedef struct shell_sink {
+    file_handle_t   file;
+    uint32_t        used;
+    char            buf[SHELL_REDIR_BUFFER];
+} shell_sink_t;
+
+/*
+ * Bytes built up a piece at a time and kept NUL-terminated. They start
+ * in storage the caller lends and move to the heap once that is full.
+ * If the heap runs out, what fit is kept and failed is set.
+ */
+typedef struct shell_buf {
+    char        *data;
+    uint32_t    len;
+    uint32_t    cap;            /* Bytes data has room for, NUL included */
+    bool        heap;           /* data is ours to free */
+    bool        failed;
+} shell_buf_t;
+
+static void buf_init(shell_buf_t *buf, char *local, uint32_t size) {
+    buf->data = local;
+    buf->len = 0;
+    buf->cap = size;
+    buf->heap = false;
+    buf->failed = false;
+    local[0] = '\0';
+}
+
+/* Make room for extra more bytes; false if there is none */
+static bool buf_reserve(shell_buf_t *buf, uint32_t extra) {
+    uint32_t cap = buf->cap;
+    char *data;
     
-    shell_state.alias_count = 0;
-    for (i = 0; i < SHELL_MAX_ALIAS; i++) {
-        shell_state.aliases[i].defined = false;
+    if (buf->failed) {
+        return false;
+    }
+    if (extra < cap - buf->len) {
+        return true;
     }
     
-    shell_command_count = 0;
-    memset(shell_commands, 0, sizeof(shell_commands));
+    while (extra >= cap - buf->len) {
+        if (cap > UINT32_MAX / 2) {
+            buf->failed = true;
+            return false;
+        }
+        cap *= 2;
+    }
+    data = (char*)getmem(cap);
+    if (data == NULL) {
+        buf->failed = true;
+        return false;
+    }
+    memcpy(data, buf->data, buf->len + 1);
+    if (buf->heap) {
+        freemem(buf->data, buf->cap);
+    }
+    buf->data = data;
+    buf->cap = cap;
+    buf->heap = true;
     
-    shell_job_count = 0;
-    memset(shell_jobs, 0, sizeof(shell_jobs));
-    shell_builtin_init();
+    return true;
 }
 
-
-void shell_builtin_init(void) {
-    shell_register_command("help", "Display help information", cmd_help);
-    shell_register_command("exit", "Exit the shell", cmd_exit);
-    shell_register_command("quit", "Exit the shell", cmd_exit);
-    shell_register_command("cd", "Change directory", cmd_cd);
-    shell_register_command("pwd", "Print working directory", cmd_pwd);
-    shell_register_command("echo", "Display text", cmd_echo);
-    shell_register_command("clear", "Clear screen", cmd_clear);
-    shell_register_command("set", "Set shell variable", cmd_set);
-    shell_register_command("unset", "Unset shell variable", cmd_unset);
-    shell_register_command("export", "Export variable", cmd_export);
-    shell_register_command("env", "Display environment", cmd_env);
-    shell_register_command("alias", "Create alias", cmd_alias);
-    shell_register_command("unalias", "Remove alias", cmd_unalias);
-    shell_register_command("history", "Show command history", cmd_history);
-    shell_register_command("ps", "List processes", cmd_ps);
-    shell_register_command("kill", "Kill process", cmd_kill);
-    shell_register_command("jobs", "List background jobs", cmd_jobs);
-    shell_register_command("fg", "Bring job to foreground", cmd_fg);
-    shell_register_command("bg", "Send job to background", cmd_bg);
-    shell_register_command("mem", "Display memory statistics", cmd_mem);
-    shell_register_command("sleep", "Sleep for seconds", cmd_sleep);
-    shell_register_command("time", "Time a command", cmd_time);
-    shell_register_command("test", "Evaluate expression", cmd_test);
-    shell_register_command("[", "Test (alternate form)", cmd_test);
-    shell_register_command("true", "Return success", cmd_true);
-    shell_register_command("false", "Return failure", cmd_false);
+static void buf_put(shell_buf_t *buf, const char *data, uint32_t len) {
+    if (buf_reserve(buf, len)) {
+        memcpy(buf->data + buf->len, data, len);
+        buf->len += len;
+        buf->data[buf->len] = '\0';
+    }
 }
 
-int shell_register_command(const char *name, const char *desc, 
-                           shell_cmd_func func) {
-    if (shell_command_count >= 128) {
-        return SYSERR;
+static void buf_free(shell_buf_t *buf) {
+    if (buf->heap) {
+        freemem(buf->data, buf->cap);
+        buf->heap = false;
     }
-    
-    strncpy(shell_commands[shell_command_count].name, name, SHELL_MAX_CMD - 1);
-    strncpy(shell_commands[shell_command_count].description, desc, 127);
-    shell_commands[shell_command_count].func = func;
-    shell_commands[shell_command_count].builtin = true;
-    shell_command_count++;
-    
-    return OK;
 }
 
-shell_command_t* shell_find_command(const char *name) {
-    int i;
+/*
+ * One command of a pipeline. A file redirection wins over the pipe. With
+ * neither, I/O falls through to the stage this one runs inside, then to
+ * the shell's redirections, then to the terminal.
+ */
+typedef struct shell_stage {
+    shell_context_t     *sh;
+    shell_command_t     *cmd;
+    struct shell_stage  *outer;
+    shell_pipe_t        *in;
+    shell_pipe_t        *out;
+    file_handle_t       in_file;        /* < */
+    shell_sink_t        *out_file;      /* > or >> */
+    shell_sink_t        *err_file;      /* 2> */
+    bool                err_to_out;     /* 2>&1 */
+    shell_buf_t         *capture;       /* $( ) collecting output */
+    int                 argc;
+    char                **argv;
+    int                 status;
+    bool                started;        /* On a thread of its own */
+    struct shell_slot   *job;           /* Set on a background job's root */
+#if defined(SHELL_PIPE_THREADS)
+    pthread_t           thread;
+#elif defined(SHELL_PIPE_PROCS)
+    sid32               done;
+#endif
+} shell_stage_t;
+
+/* The stage each thread (or process) is running, NULL outside pipelines */
+#ifdef XINU_KERNEL
+static shell_stage_t *shell_stage_bound[NPROC];
+#define shell_stage     shell_stage_bound[getpid()]
+#else
+static SCRIPT_THREAD_LOCAL shell_stage_t *shell_stage;
+#endif
+
+/* Phases a running time is charged for, the rest being execution */
+#define PHASE_EXPAND    0
+#define PHASE_PARSE     1
+#define PHASE_LOOKUP    2
+#define SHELL_PHASES    3
+
+/* Per-phase nanoseconds of the innermost time on this thread, or NULL */
+#ifdef XINU_KERNEL
+static uint64_t *shell_phases_bound[NPROC];
+#define shell_phases    shell_phases_bound[getpid()]
+#else
+static SCRIPT_THREAD_LOCAL uint64_t *shell_phases;
+#endif
+
+/*
+ * A job and what runs it. job comes first, so the shell_job_t pointers
+ * handed out are slots. Jobs started here carry their own copy of the
+ * tokens and the words they point at.
+ */
+typedef struct shell_slot {
+    shell_job_t         job;
+    shell_context_t     *sh;
+    shell_context_t     *sub;           /* The copy of sh the job runs in */
+    struct shell_slot   *next_done;
+    shell_stage_t       root;           /* Outermost stage on the job's thread */
+    bool                runs;           /* Started by shell_job_spawn() */
+    bool                finished;
+    bool                cancel;         /* Stop at the next command */
+    bool                killed;         /* By kill, not exit */
+    bool                exited;         /* job.status is exit's */
+    int                 count;
+    shell_token_t       *tokens;        /* One block with the words after */
+    uint32_t            bytes;          /* Size of that block */
+#if defined(SHELL_PIPE_THREADS)
+    pthread_t           thread;
+#elif defined(SHELL_PIPE_PROCS)
+    sid32               done;
+#endif
+} shell_slot_t;
+
+#if defined(SHELL_PIPE_THREADS)
+#define jobs_lock(sh)       pthread_mutex_lock(&(sh)->jobs_lock)
+#define jobs_unlock(sh)     pthread_mutex_unlock(&(sh)->jobs_lock)
+#elif defined(SHELL_PIPE_PROCS)
+#define jobs_lock(sh)       wait((sh)->jobs_lock)
+#define jobs_unlock(sh)     signal((sh)->jobs_lock)
+#else
+#define jobs_lock(sh)
+#define jobs_unlock(sh)
+#endif
+
+/* The background job this thread is running, if any */
+static shell_slot_t* shell_current_job(void) {
+    shell_stage_t *st;
     
-    for (i = 0; i < shell_command_count; i++) {
-        if (strcmp(shell_commands[i].name, name) == 0) {
-            return &shell_commands[i];
+    for (st = shell_stage; st != NULL; st = st->outer) {
+        if (st->job != NULL) {
+            return st->job;
         }
     }
     
     return NULL;
 }
 
-bool shell_is_builtin(const char *name) {
-    return shell_find_command(name) != NULL;
+/* Whether kill has asked this thread's job to stop */
+static bool job_cancelled(void) {
+    shell_slot_t *slot = shell_current_job();
+    bool cancel;
+    
+    if (slot == NULL) {
+        return false;
+    }
+    jobs_lock(slot->sh);
+    cancel = slot->cancel;
+    jobs_unlock(slot->sh);
+    
+    return cancel;
 }
 
-char* shell_readline(char *buffer, int size) {
-    int i = 0;
-    int ch;
+static int shell_job_spawn(shell_token_t *tokens, int count);
+static void hist_free(struct shell_history *h);
+
+/* FNV-1a over the name */
+static uint32_t shell_hash(const char *name) {
+    uint32_t h = 2166136261u;
     
-    /* Read characters until newline or buffer full */
-    while (i < size - 1) {
-        ch = getchar();
-        
-        if (ch == EOF || ch == '\n' || ch == '\r') {
-            break;
-        }
-        
-        if (ch == '\b' || ch == 127) { 
-            if (i > 0) {
-                i--;
-            }
-            continue;
-        }
-        
-        if (ch == 0x03) { 
-            buffer[0] = '\0';
-            return buffer;
-        }
-        
-        if (ch == 0x04) { 
-            if (i == 0) {
-                return NULL;
-            }
-            break;
-        }
-        
-        buffer[i++] = (char)ch;
+    while (*name != '\0') {
+        h ^= (uint8_t)*name++;
+        h *= 16777619u;
     }
     
-    buffer[i] = '\0';
-    return buffer;
+    return h;
 }
 
-int shell_parse_line(char *line, char **argv, int max_args) {
-    int argc = 0;
-    char *p = line;
-    bool in_quote = false;
-    char quote_char = '\0';
-    
-    while (*p != '\0' && argc < max_args - 1) {
-        while (*p == ' ' || *p == '\t') {
-            p++;
-        }
-        
-        if (*p == '\0') {
-            break;
-        }
+static void table_init(shell_table_t *t, uint32_t entry_size) {
+    memset(t, 0, sizeof(shell_table_t));
+    t->entry_size = entry_size;
+}
 
-        if (*p == '#' && !in_quote) {
-            break;
+static void table_free(shell_table_t *t) {
+    int32_t i;
+    
+    for (i = 0; i < t->count; i++) {
+        if (t->items[i] != NULL) {
+            freemem(t->items[i], t->entry_size);
         }
-        
-        argv[argc++] = p;
-        
-        while (*p != '\0') {
-            if (*p == '\\' && *(p + 1) != '\0') {
+    }
+    if (t->cap > 0) {
+        freemem(t->items, t->cap * sizeof(void*));
+        freemem(t->hashes, t->cap * sizeof(uint32_t));
+        freemem(t->index, 2 * t->cap * sizeof(int32_t));
+    }
+    table_init(t, t->entry_size);
+}
 
-                memmove(p, p + 1, strlen(p));
-                p++;
-                continue;
-            }
-            
-            if (*p == '"' || *p == '\'') {
-                if (!in_quote) {
-                    in_quote = true;
-                    quote_char = *p;
-                    memmove(p, p + 1, strlen(p));
-                    continue;
-                } else if (*p == quote_char) {
-                    in_quote = false;
-                    memmove(p, p + 1, strlen(p));
-                    continue;
-                }
-            }
-            
-            if (!in_quote && (*p == ' ' || *p == '\t')) {
-                break;
-            }
-            
-            p++;
-        }
-        
-        if (*p != '\0') {
-            *p++ = '\0';
+static void table_rehash(shell_table_t *t) {
+    uint32_t mask = 2 * t->cap - 1;
+    uint32_t b;
+    int32_t i;
+    
+    for (i = 0; i < 2 * t->cap; i++) {
+        t->index[i] = TABLE_EMPTY;
+    }
+    for (i = 0; i < t->count; i++) {
+        for (b = t->hashes[i] & mask; t->index[b] != TABLE_EMPTY;
+             b = (b + 1) & mask) {
+            ;
         }
+        t->index[b] = i;
     }
-    
-    argv[argc] = NULL;
-    return argc;
 }
 
-int shell_expand(const char *input, char *output, int size) {
-    const char *p = input;
-    int i = 0;
+/* Room for one more slot: squeeze out removed entries, or double */
+static int table_reserve(shell_table_t *t) {
+    void **items;
+    uint32_t *hashes;
+    int32_t *index;
+    int32_t cap, i, n;
     
-    while (*p != '\0' && i < size - 1) {
-        if (*p == '$') {
-            p++;
-            
-            if (*p == '?') {
-                char num[16];
-                snprintf(num, sizeof(num), "%d", shell_state.last_exit);
-                int len = strlen(num);
-                if (i + len < size - 1) {
-                    strcpy(output + i, num);
-                    i += len;
-                }
-                p++;
-                continue;
-            } else if (*p == '$') {
-                char num[16];
-                snprintf(num, sizeof(num), "%d", shell_state.pid);
-                int len = strlen(num);
-                if (i + len < size - 1) {
-                    strcpy(output + i, num);
-                    i += len;
-                }
-                p++;
-                continue;
-            }
-            
-            char var_name[64];
-            int j = 0;
-            bool in_braces = false;
-            
-            if (*p == '{') {
-                in_braces = true;
-                p++;
-            }
-            
-            while (*p != '\0' && j < 63) {
-                if (in_braces && *p == '}') {
-                    p++;
-                    break;
-                }
-                if (!in_braces && !isalnum(*p) && *p != '_') {
-                    break;
-                }
-                var_name[j++] = *p++;
-            }
-            var_name[j] = '\0';
-            
-            char *value = shell_getenv(var_name);
-            if (value != NULL) {
-                int len = strlen(value);
-                if (i + len < size - 1) {
-                    strcpy(output + i, value);
-                    i += len;
-                }
-            }
-        } else if (*p == '~' && (p == input || *(p - 1) == ' ' || *(p - 1) == ':')) {
-            char *home = shell_getenv("HOME");
-            if (home == NULL) {
-                home = "/";
-            }
-            int len = strlen(home);
-            if (i + len < size - 1) {
-                strcpy(output + i, home);
-                i += len;
+    if (t->count < t->cap) {
+        return OK;
+    }
+    
+    if (t->live < t->cap / 2) {
+        for (i = 0, n = 0; i < t->count; i++) {
+            if (t->items[i] != NULL) {
+                t->items[n] = t->items[i];
+                t->hashes[n++] = t->hashes[i];
             }
-            p++;
-        } else {
-            output[i++] = *p++;
         }
+        t->count = n;
+        table_rehash(t);
+        return OK;
+    }
+    
+    cap = t->cap > 0 ? 2 * t->cap : SHELL_TABLE_MIN;
+    items = (void**)getmem(cap * sizeof(void*));
+    hashes = (uint32_t*)getmem(cap * sizeof(uint32_t));
+    index = (int32_t*)getmem(2 * cap * sizeof(int32_t));
+    if (items == NULL || hashes == NULL || index == NULL) {
+        if (items != NULL) freemem(items, cap * sizeof(void*));
+        if (hashes != NULL) freemem(hashes, cap * sizeof(uint32_t));
+        if (index != NULL) freemem(index, 2 * cap * sizeof(int32_t));
+        return SYSERR;
+    }
+    
+    if (t->cap > 0) {
+        memcpy(items, t->items, t->count * sizeof(void*));
+        memcpy(hashes, t->hashes, t->count * sizeof(uint32_t));
+        freemem(t->items, t->cap * sizeof(void*));
+        freemem(t->hashes, t->cap * sizeof(uint32_t));
+        freemem(t->index, 2 * t->cap * sizeof(int32_t));
     }
+    t->items = items;
+    t->hashes = hashes;
+    t->index = index;
+    t->cap = cap;
+    table_rehash(t);
     
-    output[i] = '\0';
     return OK;
 }
 
-
-int shell_execute(const char *line) {
-    char expanded[SHELL_MAX_LINE];
-    char *argv[SHELL_MAX_ARGS];
-    int argc;
-    char line_copy[SHELL_MAX_LINE];
+/* Bucket holding name, or TABLE_EMPTY */
+static int32_t table_bucket(const shell_table_t *t, const char *name,
+                            uint32_t hash) {
+    uint32_t mask = 2 * t->cap - 1;
+    uint32_t b;
+    int32_t slot;
     
-    const char *p = line;
-    while (*p == ' ' || *p == '\t') p++;
-    if (*p == '\0' || *p == '#') {
-        return SHELL_OK;
+    if (t->cap == 0) {
+        return TABLE_EMPTY;
     }
     
-    if (shell_state.interactive) {
-        shell_history_add(line);
+    for (b = hash & mask; (slot = t->index[b]) != TABLE_EMPTY;
+         b = (b + 1) & mask) {
+        if (slot >= 0 && t->hashes[slot] == hash &&
+            strcmp((const char*)t->items[slot], name) == 0) {
+            return b;
+        }
     }
     
-    strncpy(line_copy, line, SHELL_MAX_LINE - 1);
-    line_copy[SHELL_MAX_LINE - 1] = '\0';
+    return TABLE_EMPTY;
+}
+
+static void* table_find(const shell_table_t *t, const char *name) {
+    int32_t b = table_bucket(t, name, shell_hash(name));
+    
+    return b == TABLE_EMPTY ? NULL : t->items[t->index[b]];
+}
+
+/* The entry for name, added zeroed (but for the name) if new */
+static void* table_add(shell_table_t *t, const char *name) {
+    char key[SHELL_MAX_CMD];
+    uint32_t hash, mask, b;
+    int32_t found;
+    char *entry;
+    
+    /* Names are stored cut to fit, and looked up as stored */
+    strncpy(key, name, SHELL_MAX_CMD - 1);
+    key[SHELL_MAX_CMD - 1] = '\0';
+    hash = shell_hash(key);
     
-    shell_expand(line_copy, expanded, SHELL_MAX_LINE);
+    found = table_bucket(t, key, hash);
+    if (found != TABLE_EMPTY) {
+        return t->items[t->index[found]];
+    }
     
-    /* Parse command line */
-    argc = shell_parse_line(expanded, argv, SHELL_MAX_ARGS);
-    if (argc == 0) {
-        return SHELL_OK;
+    if (table_reserve(t) != OK) {
+        return NULL;
+    }
+    entry = (char*)getmem(t->entry_size);
+    if (entry == NULL) {
+        return NULL;
     }
+    memset(entry, 0, t->entry_size);
+    strcpy(entry, key);
     
-    /* Look for built-in command */
-    shell_command_t *cmd = shell_find_command(argv[0]);
-    if (cmd != NULL) {
-        shell_state.last_exit = cmd->func(argc, argv);
-        return shell_state.last_exit;
+    mask = 2 * t->cap - 1;
+    for (b = hash & mask; t->index[b] >= 0; b = (b + 1) & mask) {
+        ;
     }
+    t->index[b] = t->count;
+    t->items[t->count] = entry;
+    t->hashes[t->count] = hash;
+    t->count++;
+    t->live++;
     
-    /* Try to execute as external program */
-    shell_error("%s: command not found\n", argv[0]);
-    shell_state.last_exit = SHELL_NOT_FOUND;
-    return SHELL_NOT_FOUND;
-}
-
-int shell_execute_file(const char *filename) {
-    /* Would read and execute script file */
-    return SHELL_OK;
+    return entry;
 }
 
-void shell_run(void) {
-    char line[SHELL_MAX_LINE];
+static int table_remove(shell_table_t *t, const char *name) {
+    int32_t b = table_bucket(t, name, shell_hash(name));
+    int32_t slot;
     
-    shell_init();
+    if (b == TABLE_EMPTY) {
+        return SYSERR;
+    }
+    
+    slot = t->index[b];
+    freemem(t->items[slot], t->entry_size);
+    t->items[slot] = NULL;
+    t->index[b] = TABLE_DELETED;
+    t->live--;
+    
+    return OK;
+}
+
+/* Add a copy of each of src's entries to dst, which has the same size */
+static int table_copy(shell_table_t *dst, const shell_table_t *src) {
+    void *entry;
+    int32_t i;
+    
+    for (i = 0; i < src->count; i++) {
+        if (src->items[i] == NULL) {
+            continue;
+        }
+        entry = table_add(dst, (const char*)src->items[i]);
+        if (entry == NULL) {
+            return SYSERR;
+        }
+        memcpy(entry, src->items[i], src->entry_size);
+    }
+    
+    return OK;
+}
+
+
+static int cmd_help(int argc, char **argv);
+static int cmd_exit(int argc, char **argv);
+static int cmd_cd(int argc, char **argv);
+static int cmd_pwd(int argc, char **argv);
+static int cmd_echo(int argc, char **argv);
+static int cmd_set(int argc, char **argv);
+static int cmd_unset(int argc, char **argv);
+static int cmd_export(int argc, char **argv);
+static int cmd_env(int argc, char **argv);
+static int cmd_alias(int argc, char **argv);
+static int cmd_unalias(int argc, char **argv);
+static int cmd_history(int argc, char **argv);
+static int cmd_ps(int argc, char **argv);
+static int cmd_kill(int argc, char **argv);
+static int cmd_jobs(int argc, char **argv);
+static int cmd_fg(int argc, char **argv);
+static int cmd_bg(int argc, char **argv);
+static int cmd_wait(int argc, char **argv);
+static int cmd_mem(int argc, char **argv);
+static int cmd_clear(int argc, char **argv);
+static int cmd_sleep(int argc, char **argv);
+static int cmd_time(int argc, char **argv);
+static int cmd_true(int argc, char **argv);
+static int cmd_false(int argc, char **argv);
+static int cmd_test(int argc, char **argv);
+static int cmd_cat(int argc, char **argv);
+static int cmd_grep(int argc, char **argv);
+static int cmd_wc(int argc, char **argv);
+
+#if defined(SHELL_PIPE_THREADS)
+#define pipe_lock(p)    pthread_mutex_lock(&(p)->lock)
+#define pipe_unlock(p)  pthread_mutex_unlock(&(p)->lock)
+#define pipe_wait(p)    pthread_cond_wait(&(p)->changed, &(p)->lock)
+#define pipe_wake(p)    pthread_cond_signal(&(p)->changed)
+#elif defined(SHELL_PIPE_PROCS)
+#define pipe_lock(p)    wait((p)->lock)
+#define pipe_unlock(p)  signal((p)->lock)
+
+/* Either end can only be waiting on the other, so one waiter at most */
+static void pipe_wait(shell_pipe_t *p) {
+    p->waiting++;
+    signal(p->lock);
+    wait(p->changed);
+    wait(p->lock);
+}
+
+static void pipe_wake(shell_pipe_t *p) {
+    if (p->waiting > 0) {
+        p->waiting--;
+        signal(p->changed);
+    }
+}
+#else
+#define pipe_lock(p)
+#define pipe_unlock(p)
+#define pipe_wait(p)
+#define pipe_wake(p)
+#endif
+
+static shell_pipe_t* pipe_create(void) {
+    shell_pipe_t *p = (shell_pipe_t*)getmem(sizeof(shell_pipe_t));
+    
+    if (p == NULL) {
+        return NULL;
+    }
+    memset(p, 0, sizeof(shell_pipe_t));
+    
+    p->size = SHELL_PIPE_SIZE;
+    p->buf = (char*)getmem(p->size);
+    if (p->buf == NULL) {
+        freemem(p, sizeof(shell_pipe_t));
+        return NULL;
+    }
+    
+#if defined(SHELL_PIPE_THREADS)
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->changed, NULL);
+#elif defined(SHELL_PIPE_PROCS)
+    p->lock = semcreate(1);
+    p->changed = semcreate(0);
+    if (p->lock == SYSERR || p->changed == SYSERR) {
+        if (p->lock != SYSERR) semdelete(p->lock);
+        if (p->changed != SYSERR) semdelete(p->changed);
+        freemem(p->buf, p->size);
+        freemem(p, sizeof(shell_pipe_t));
+        return NULL;
+    }
+#endif
+    
+    return p;
+}
+
+static void pipe_destroy(shell_pipe_t *p) {
+    if (p == NULL) {
+        return;
+    }
+    
+#if defined(SHELL_PIPE_THREADS)
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->changed);
+#elif defined(SHELL_PIPE_PROCS)
+    semdelete(p->lock);
+    semdelete(p->changed);
+#endif
+    freemem(p->buf, p->size);
+    freemem(p, sizeof(shell_pipe_t));
+}
+
+#if !defined(SHELL_PIPE_THREADS) && !defined(SHELL_PIPE_PROCS)
+/* Stages run in turn, so the reader cannot drain a full pipe: grow it */
+static int pipe_grow(shell_pipe_t *p, uint32_t need) {
+    uint32_t used = p->tail - p->head;
+    uint32_t size = p->size;
+    uint32_t off = p->head & (p->size - 1);
+    uint32_t first = used < p->size - off ? used : p->size - off;
+    char *buf;
+    
+    while (size - used < need) {
+        size *= 2;
+    }
+    buf = (char*)getmem(size);
+    if (buf == NULL) {
+        return SYSERR;
+    }
+    
+    memcpy(buf, p->buf + off, first);
+    memcpy(buf + first, p->buf, used - first);
+    freemem(p->buf, p->size);
+    p->buf = buf;
+    p->size = size;
+    p->head = 0;
+    p->tail = used;
+    
+    return OK;
+}
+#endif
+
+/* Copy data into the ring, waiting for room; dropped once nobody reads */
+static void pipe_write(shell_pipe_t *p, const char *data, uint32_t len) {
+    uint32_t room, n, off, first;
+    
+    pipe_lock(p);
+#if !defined(SHELL_PIPE_THREADS) && !defined(SHELL_PIPE_PROCS)
+    if (p->size - (p->tail - p->head) < len && pipe_grow(p, len) != OK) {
+        len = p->size - (p->tail - p->head);
+    }
+#endif
+    while (len > 0 && !p->broken) {
+        room = p->size - (p->tail - p->head);
+        if (room == 0) {
+            pipe_wait(p);
+            continue;
+        }
+        
+        n = len < room ? len : room;
+        off = p->tail & (p->size - 1);
+        first = n < p->size - off ? n : p->size - off;
+        memcpy(p->buf + off, data, first);
+        memcpy(p->buf, data + first, n - first);
+        p->tail += n;
+        data += n;
+        len -= n;
+        pipe_wake(p);
+    }
+    pipe_unlock(p);
+}
+
+/* Up to size bytes as soon as there are any; 0 once the writer is done */
+static int32_t pipe_read(shell_pipe_t *p, char *buf, uint32_t size) {
+    uint32_t avail, n, off, first;
+    
+    pipe_lock(p);
+    while ((avail = p->tail - p->head) == 0 && !p->closed) {
+        pipe_wait(p);
+    }
+    
+    n = avail < size ? avail : size;
+    off = p->head & (p->size - 1);
+    first = n < p->size - off ? n : p->size - off;
+    memcpy(buf, p->buf + off, first);
+    memcpy(buf + first, p->buf, n - first);
+    p->head += n;
+    if (n > 0) {
+        pipe_wake(p);
+    }
+    pipe_unlock(p);
+    
+    return (int32_t)n;
+}
+
+/* The writer's end: readers see end of input once drained */
+static void pipe_close(shell_pipe_t *p) {
+    pipe_lock(p);
+    p->closed = true;
+    pipe_wake(p);
+    pipe_unlock(p);
+}
+
+/* The reader's end: a writer blocked on a full ring gives up */
+static void pipe_break(shell_pipe_t *p) {
+    pipe_lock(p);
+    p->broken = true;
+    pipe_wake(p);
+    pipe_unlock(p);
+}
+
+static void terminal_write(const char *data, uint32_t len) {
+#ifdef XINU_KERNEL
+    write(CONSOLE, (char*)data, len);
+#else
+    fwrite(data, 1, len, stdout);
+#endif
+}
+
+static shell_sink_t* sink_open(const char *name, bool append) {
+    shell_sink_t *s = (shell_sink_t*)getmem(sizeof(shell_sink_t));
+    
+    if (s == NULL) {
+        return NULL;
+    }
+    
+    s->file = file_create(name, append);
+    if (s->file == FILE_INVALID) {
+        freemem(s, sizeof(shell_sink_t));
+        return NULL;
+    }
+    s->used = 0;
+#ifndef XINU_KERNEL
+    /* The sink is the buffer; stdio would only copy again */
+    setvbuf(s->file, NULL, _IONBF, 0);
+#endif
+    
+    return s;
+}
+
+static void sink_flush(shell_sink_t *s) {
+    if (s->used > 0) {
+        file_write(s->file, s->buf, s->used);
+        s->used = 0;
+    }
+}
+
+/* Writes as large as the buffer go straight to the file */
+static void sink_write(shell_sink_t *s, const char *data, uint32_t len) {
+    if (s->used + len > SHELL_REDIR_BUFFER) {
+        sink_flush(s);
+    }
+    if (len >= SHELL_REDIR_BUFFER) {
+        file_write(s->file, data, len);
+        return;
+    }
+    memcpy(s->buf + s->used, data, len);
+    s->used += len;
+}
+
+static void sink_close(shell_sink_t *s) {
+    if (s != NULL) {
+        sink_flush(s);
+        file_close(s->file);
+        freemem(s, sizeof(shell_sink_t));
+    }
+}
+
+/* Write out whatever output is being held */
+void shell_flush(void) {
+    shell_context_t *sh = shell_self();
+    
+    if (sh->out_file != NULL) {
+        sink_flush(sh->out_file);
+    }
+    if (sh->out_used > 0) {
+        terminal_write(sh->outbuf, sh->out_used);
+        sh->out_used = 0;
+    }
+#ifndef XINU_KERNEL
+    fflush(stdout);
+#endif
+}
+
+/* Command output: the innermost redirection or pipe, else the terminal */
+static void shell_write(const char *data, uint32_t len) {
+    shell_context_t *sh;
+    shell_stage_t *st;
+    
+    for (st = shell_stage; st != NULL; st = st->outer) {
+        if (st->out_file != NULL) {
+            sink_write(st->out_file, data, len);
+            return;
+        }
+        if (st->capture != NULL) {
+            buf_put(st->capture, data, len);
+            return;
+        }
+        if (st->out != NULL) {
+            pipe_write(st->out, data, len);
+            return;
+        }
+    }
+    
+    /* What the shell holds or redirects is for its own thread only */
+    for (st = shell_stage; st != NULL && !st->started; st = st->outer) {
+        ;
+    }
+    sh = shell_self();
+    if (st == NULL && sh->out_file != NULL) {
+        sink_write(sh->out_file, data, len);
+        return;
+    }
+    if (st == NULL && sh->outbuf != NULL) {
+        if (sh->out_used + len > SHELL_OUT_BUFFER) {
+            shell_flush();
+        }
+        if (len < SHELL_OUT_BUFFER) {
+            memcpy(sh->outbuf + sh->out_used, data, len);
+            sh->out_used += len;
+            return;
+        }
+    }
+    terminal_write(data, len);
+}
+
+/* Diagnostics: 2> or 2>&1 if given, else standard error */
+static void shell_write_error(const char *data, uint32_t len) {
+    shell_stage_t *st;
+    
+    for (st = shell_stage; st != NULL; st = st->outer) {
+        if (st->err_to_out) {
+            shell_write(data, len);
+            return;
+        }
+        if (st->err_file != NULL) {
+            sink_write(st->err_file, data, len);
+            return;
+        }
+    }
+    
+    /* Output that came first goes first, held by the shell or by stdio */
+    for (st = shell_stage; st != NULL && !st->started; st = st->outer) {
+        ;
+    }
+    if (st == NULL) {
+        shell_flush();
+    } else {
+        file_flush(stdout);
+    }
+    
+#ifdef XINU_KERNEL
+    write(CONSOLE, (char*)data, len);
+#else
+    fwrite(data, 1, len, stderr);
+#endif
+}
+
+/* Command input: the innermost redirection or pipe, else the terminal */
+static int32_t shell_read(char *buf, uint32_t size) {
+    shell_context_t *sh = shell_self();
+    shell_stage_t *st;
+    file_handle_t file = sh->in_file;
+    uint32_t i = 0;
+    int32_t n;
+    int ch;
+    
+    for (st = shell_stage; st != NULL; st = st->outer) {
+        if (st->in_file != FILE_INVALID) {
+            file = st->in_file;
+            break;
+        }
+        if (st->in != NULL) {
+            return pipe_read(st->in, buf, size);
+        }
+    }
+    if (file != FILE_INVALID) {
+        n = file_read(file, buf, size);
+        return n > 0 ? n : 0;
+    }
+    
+    /* Show what came before the question, unless another thread owns it */
+    for (st = shell_stage; st != NULL && !st->started; st = st->outer) {
+        ;
+    }
+    if (st == NULL) {
+        shell_flush();
+    }
+    while (i < size) {
+        ch = getchar();
+        if (ch == EOF || ch == 0x04) {
+            break;
+        }
+        buf[i++] = (char)ch;
+        if (ch == '\n') {
+            break;
+        }
+    }
+    
+    return (int32_t)i;
+}
+
+/* Format on the stack, or the heap when that is too small, and write */
+static void shell_vformat(void (*out)(const char*, uint32_t),
+                          const char *fmt, va_list args) {
+    char buffer[SHELL_IO_CHUNK];
+    char *big;
+    va_list again;
+    int n;
+    
+    va_copy(again, args);
+    n = vsnprintf(buffer, sizeof(buffer), fmt, args);
+    if (n < 0) {
+        va_end(again);
+        return;
+    }
+    if (n < (int)sizeof(buffer)) {
+        out(buffer, n);
+        va_end(again);
+        return;
+    }
+    
+    big = (char*)getmem(n + 1);
+    if (big == NULL) {
+        out(buffer, sizeof(buffer) - 1);
+        va_end(again);
+        return;
+    }
+    vsnprintf(big, n + 1, fmt, again);
+    va_end(again);
+    out(big, n);
+    freemem(big, n + 1);
+}
+
+static void shell_printf(const char *fmt, ...) {
+    va_list args;
+    
+    va_start(args, fmt);
+    shell_vformat(shell_write, fmt, args);
+    va_end(args);
+}
+
+static void shell_error(const char *fmt, ...) {
+    va_list args;
+    
+    va_start(args, fmt);
+    shell_vformat(shell_write_error, fmt, args);
+    va_end(args);
+}
+
+static void jobs_init(shell_context_t *sh);
+static void shell_subshell_free(shell_context_t *sub);
+static void shell_jobs_release(shell_context_t *sh);
+
+/* Drop held output and redirections; sh need not be the bound shell */
+static void shell_release_io(shell_context_t *sh) {
+    if (sh->out_used > 0) {
+        terminal_write(sh->outbuf, sh->out_used);
+    }
+    if (sh->outbuf != NULL) {
+        freemem(sh->outbuf, SHELL_OUT_BUFFER);
+    }
+    sink_close(sh->out_file);
+    if (sh->in_file != FILE_INVALID) {
+        file_close(sh->in_file);
+    }
+    sh->outbuf = NULL;
+    sh->out_used = 0;
+    sh->out_file = NULL;
+    sh->in_file = FILE_INVALID;
+}
+
+void shell_init(void) {
+    shell_context_t *sh = shell_self();
+    
+    /* Initialize shell state */
+    shell_jobs_release(sh);
+    shell_release_io(sh);
+    table_free(&sh->commands);
+    table_free(&sh->aliases);
+    script_env_destroy(sh->env);
+    hist_free(sh->history);
+    memset(sh, 0, sizeof(shell_context_t));
+    sh->in_file = FILE_INVALID;
+    strcpy(sh->state.cwd, "/");
+    sh->state.interactive = true;
+    sh->state.running = true;
+    sh->state.pid = getpid();
+    
+    table_init(&sh->commands, sizeof(shell_command_t));
+    table_init(&sh->aliases, sizeof(shell_alias_t));
+    
+    jobs_init(sh);
+    shell_builtin_init();
+}
+
+/* A fresh shell with the builtins registered; bind it to run it */
+shell_context_t* shell_create_context(void) {
+    shell_context_t *sh, *prev;
+    
+    sh = (shell_context_t*)getmem(sizeof(shell_context_t));
+    if (sh == NULL) {
+        return NULL;
+    }
+    memset(sh, 0, sizeof(shell_context_t));
+    sh->in_file = FILE_INVALID;
+    
+    prev = shell_bind_context(sh);
+    shell_init();
+    shell_bind_context(prev);
+    
+    return sh;
+}
+
+void shell_destroy_context(shell_context_t *sh) {
+    if (sh == NULL || sh == &shell_default) {
+        return;
+    }
+    
+    if (shell_binding == sh) {
+        shell_binding = NULL;
+    }
+    shell_jobs_release(sh);
+    table_free(&sh->commands);
+    table_free(&sh->aliases);
+    script_env_destroy(sh->env);
+    hist_free(sh->history);
+    shell_release_io(sh);
+    freemem(sh, sizeof(shell_context_t));
+}
+
+/*
+ * A copy of sh's state, variables, aliases and commands for what runs
+ * alongside it, as sh runs a pipeline stage or a & job in a subshell.
+ * Changes stay in the copy. Input is borrowed from sh, output is not.
+ */
+static shell_context_t* shell_subshell(shell_context_t *sh) {
+    shell_context_t *sub;
+    
+    sub = (shell_context_t*)getmem(sizeof(shell_context_t));
+    if (sub == NULL) {
+        return NULL;
+    }
+    memset(sub, 0, sizeof(shell_context_t));
+    sub->state = sh->state;
+    sub->options = sh->options;
+    sub->in_file = sh->in_file;
+    table_init(&sub->commands, sizeof(shell_command_t));
+    table_init(&sub->aliases, sizeof(shell_alias_t));
+    jobs_init(sub);
+    
+    if (table_copy(&sub->commands, &sh->commands) != OK ||
+        table_copy(&sub->aliases, &sh->aliases) != OK ||
+        (sh->env != NULL && (sub->env = script_env_copy(sh->env)) == NULL)) {
+        shell_subshell_free(sub);
+        return NULL;
+    }
+    
+    return sub;
+}
+
+static void shell_subshell_free(shell_context_t *sub) {
+    /* The input is still sh's */
+    sub->in_file = FILE_INVALID;
+    shell_destroy_context(sub);
+}
+
+/* Run sh on this thread, or the default for NULL; returns the old one */
+shell_context_t* shell_bind_context(shell_context_t *sh) {
+    shell_context_t *prev = shell_binding;
+    
+    shell_binding = sh;
+    
+    return prev;
+}
+
+
+void shell_builtin_init(void) {
+    shell_register_command("help", "Display help information", cmd_help);
+    shell_register_command("exit", "Exit the shell", cmd_exit);
+    shell_register_command("quit", "Exit the shell", cmd_exit);
+    shell_register_command("cd", "Change directory", cmd_cd);
+    shell_register_command("pwd", "Print working directory", cmd_pwd);
+    shell_register_command("echo", "Display text", cmd_echo);
+    shell_register_command("clear", "Clear screen", cmd_clear);
+    shell_register_command("set", "Set shell variable", cmd_set);
+    shell_register_command("unset", "Unset shell variable", cmd_unset);
+    shell_register_command("export", "Export variable", cmd_export);
+    shell_register_command("env", "Display environment", cmd_env);
+    shell_register_command("alias", "Create alias", cmd_alias);
+    shell_register_command("unalias", "Remove alias", cmd_unalias);
+    shell_register_command("history", "Show command history", cmd_history);
+    shell_register_command("ps", "List processes", cmd_ps);
+    shell_register_command("kill", "Kill process", cmd_kill);
+    shell_register_command("jobs", "List background jobs", cmd_jobs);
+    shell_register_command("fg", "Bring job to foreground", cmd_fg);
+    shell_register_command("bg", "Send job to background", cmd_bg);
+    shell_register_command("wait", "Wait for background jobs", cmd_wait);
+    shell_register_command("mem", "Display memory statistics", cmd_mem);
+    shell_register_command("sleep", "Sleep for seconds", cmd_sleep);
+    shell_register_command("time", "Time a command", cmd_time);
+    shell_register_command("test", "Evaluate expression", cmd_test);
+    shell_register_command("[", "Test (alternate form)", cmd_test);
+    shell_register_command("true", "Return success", cmd_true);
+    shell_register_command("false", "Return failure", cmd_false);
+    shell_register_command("cat", "Copy files or input to output", cmd_cat);
+    shell_register_command("grep", "Print lines matching a pattern", cmd_grep);
+    shell_register_command("wc", "Count lines, words and bytes", cmd_wc);
+}
+
+/* Registering a name again replaces its handler */
+int shell_register_command(const char *name, const char *desc, 
+                           shell_cmd_func func) {
+    shell_command_t *cmd = (shell_command_t*)table_add(&shell_self()->commands,
+                                                       name);
+    
+    if (cmd == NULL) {
+        return SYSERR;
+    }
+    
+    strncpy(cmd->description, desc, 127);
+    cmd->func = func;
+    cmd->builtin = true;
+    
+    return OK;
+}
+
+int shell_unregister_command(const char *name) {
+    return table_remove(&shell_self()->commands, name);
+}
+
+shell_command_t* shell_find_command(const char *name) {
+    return (shell_command_t*)table_find(&shell_self()->commands, name);
+}
+
+bool shell_is_builtin(const char *name) {
+    return shell_find_command(name) != NULL;
+}
+
+/*
+ * Put the newest match for query older than *at in buffer, moving *at
+ * to it, and show the search on the line.
+ */
+static void readline_search(char *buffer, int size, int *len,
+                            const char *query, int *at) {
+    int found = shell_history_search(query, *at, false);
+    const char *cmd;
+    int n;
+    
+    if (found != SYSERR) {
+        cmd = shell_history_get(found);
+        n = (int)strlen(cmd);
+        if (n > size - 1) {
+            n = size - 1;
+        }
+        memcpy(buffer, cmd, n);
+        *len = n;
+        *at = found;
+    }
+    shell_printf("\r%s`%s': %.*s\033[K", found != SYSERR ?
+                 "(reverse-i-search)" : "(failed reverse-i-search)",
+                 query, *len, buffer);
+}
+
+char* shell_readline(char *buffer, int size) {
+    char query[SHELL_MAX_LINE];
+    int i = 0, qlen = 0, at = 0;
+    bool searching = false;
+    int ch;
+    
+    /* Read characters until newline or buffer full */
+    while (i < size - 1) {
+        ch = getchar();
+        
+        if (ch == EOF || ch == '\n' || ch == '\r') {
+            break;
+        }
+        
+        /* ^R looks back for the text typed so far, again for older */
+        if (ch == 0x12) {
+            if (!searching) {
+                qlen = i < SHELL_MAX_LINE - 1 ? i : SHELL_MAX_LINE - 1;
+                memcpy(query, buffer, qlen);
+                query[qlen] = '\0';
+                at = shell_history_count();
+                searching = true;
+            }
+            readline_search(buffer, size, &i, query, &at);
+            continue;
+        }
+        if (searching) {
+            if ((ch == '\b' || ch == 127) && qlen > 0) {
+                query[--qlen] = '\0';
+                at = shell_history_count();
+                readline_search(buffer, size, &i, query, &at);
+                continue;
+            }
+            if (ch >= ' ' && ch < 127 && qlen < SHELL_MAX_LINE - 1) {
+                query[qlen++] = (char)ch;
+                query[qlen] = '\0';
+                at++;
+                readline_search(buffer, size, &i, query, &at);
+                continue;
+            }
+            searching = false;
+        }
+        
+        if (ch == '\b' || ch == 127) { 
+            if (i > 0) {
+                i--;
+            }
+            continue;
+        }
+        
+        if (ch == 0x03) { 
+            buffer[0] = '\0';
+            return buffer;
+        }
+        
+        if (ch == 0x04) { 
+            if (i == 0) {
+                return NULL;
+            }
+            break;
+        }
+        
+        buffer[i++] = (char)ch;
+    }
+    
+    buffer[i] = '\0';
+    return buffer;
+}
+
+/*
+ * Recognize an operator at p, storing its type when requested.
+ * Returns its length, or 0 when p does not start an operator.
+ */
+static int shell_operator(const char *p, shell_token_type_t *type) {
+    shell_token_type_t t;
+    int len = 1;
+    
+    switch (*p) {
+        case '|':
+            t = TOK_PIPE;
+            if (p[1] == '|') { t = TOK_OR; len = 2; }
+            break;
+        case '&':
+            t = TOK_BACKGROUND;
+            if (p[1] == '&') { t = TOK_AND; len = 2; }
+            break;
+        case '>':
+            t = TOK_REDIR_OUT;
+            if (p[1] == '>') { t = TOK_REDIR_APPEND; len = 2; }
+            break;
+        case '<':
+            t = TOK_REDIR_IN;
+            break;
+        case ';':
+            t = TOK_SEMICOLON;
+            break;
+        case '2':
+            if (p[1] != '>') {
+                return 0;
+            }
+            t = TOK_REDIR_ERR;
+            len = 2;
+            break;
+        default:
+            return 0;
+    }
+    
+    if (type != NULL) {
+        *type = t;
+    }
+    return len;
+}
+
+/*
+ * Split line into tokens in one pass. Quotes and backslashes are
+ * stripped in place: word text only ever moves left, so each token
+ * points into line and is NUL-terminated there. A # at the start of a
+ * token ends the line. The list always ends with TOK_EOF. Returns the
+ * token count, or SYSERR if tokens cannot hold them all.
+ */
+int shell_tokenize(char *line, shell_token_t *tokens, int max_tokens) {
+    shell_token_t *tok;
+    char *r = line;
+    char *w;
+    char quote;
+    bool done = false;
+    int count = 0;
+    int i;
+    
+    if (line == NULL || tokens == NULL) {
+        return SYSERR;
+    }
+    
+    while (!done) {
+        while (*r == ' ' || *r == '\t' || *r == '\r') {
+            r++;
+        }
+        
+        if (count == max_tokens) {
+            return SYSERR;
+        }
+        
+        tok = &tokens[count++];
+        tok->value = NULL;
+        tok->length = 0;
+        tok->position = (int)(r - line);
+        
+        if (*r == '\0' || *r == '#') {
+            tok->type = TOK_EOF;
+            done = true;
+            continue;
+        }
+        
+        if (*r == '\n') {
+            tok->type = TOK_NEWLINE;
+            r++;
+            continue;
+        }
+        
+        i = shell_operator(r, &tok->type);
+        if (i > 0) {
+            r += i;
+            continue;
+        }
+        
+        tok->type = TOK_WORD;
+        tok->value = w = r;
+        quote = '\0';
+        
+        while (*r != '\0') {
+            if (*r == '\\' && r[1] != '\0') {
+                *w++ = r[1];
+                r += 2;
+            } else if (quote != '\0') {
+                if (*r == quote) {
+                    quote = '\0';
+                    r++;
+                } else {
+                    *w++ = *r++;
+                }
+            } else if (*r == '"' || *r == '\'') {
+                quote = *r++;
+            } else if (strchr(" \t\r\n|&;<>", *r) != NULL) {
+                break;
+            } else {
+                *w++ = *r++;
+            }
+        }
+        
+        tok->length = (int)(w - tok->value);
+    }
+    
+    /*
+     * Terminate words last: a word's end lies at or before its
+     * delimiter, which may be an operator that had still to be read.
+     */
+    for (i = 0; i < count; i++) {
+        if (tokens[i].type == TOK_WORD) {
+            tokens[i].value[tokens[i].length] = '\0';
+        }
+    }
+    
+    return count;
+}
+
+/*
+ * Room for the tokens of len bytes of text, whose worst case is one-byte
+ * words: local, which holds SHELL_MAX_TOKENS, if that is enough, else
+ * the heap. *max is set to the room given. NULL if there is none.
+ */
+static shell_token_t* tokens_get(shell_token_t *local, uint32_t len,
+                                 int *max) {
+    if (len / 2 + 2 <= SHELL_MAX_TOKENS) {
+        *max = SHELL_MAX_TOKENS;
+        return local;
+    }
+    
+    *max = (int)(len / 2 + 2);
+    return (shell_token_t*)getmem(*max * sizeof(shell_token_t));
+}
+
+static void tokens_put(shell_token_t *tokens, shell_token_t *local,
+                       int max) {
+    if (tokens != local) {
+        freemem(tokens, max * sizeof(shell_token_t));
+    }
+}
+
+int shell_parse_line(char *line, char **argv, int max_args) {
+    shell_token_t local[SHELL_MAX_TOKENS];
+    shell_token_t *tokens;
+    int count, max;
+    int argc = 0;
+    int i;
+    
+    tokens = tokens_get(local, (uint32_t)strlen(line), &max);
+    count = tokens != NULL ? shell_tokenize(line, tokens, max) : SYSERR;
+    
+    for (i = 0; i < count && argc < max_args - 1; i++) {
+        if (tokens[i].type != TOK_WORD) {
+            break;
+        }
+        argv[argc++] = tokens[i].value;
+    }
+    
+    if (tokens != NULL) {
+        tokens_put(tokens, local, max);
+    }
+    argv[argc] = NULL;
+    return argc;
+}
+
+/* Bytes of the parameter name at p: one for $? and $$, else a word */
+static uint32_t expand_name(const char *p, const char *end) {
+    const char *q = p;
+    
+    if (q < end && (*q == '?' || *q == '$')) {
+        return 1;
+    }
+    while (q < end && (isalnum((unsigned char)*q) || *q == '_')) {
+        q++;
+    }
+    
+    return (uint32_t)(q - p);
+}
+
+/* The value of the n-byte name at p, or NULL if unset; num holds numbers */
+static const char* expand_value(const char *p, uint32_t n, char *num) {
+    shell_context_t *sh = shell_self();
+    char name[SHELL_MAX_CMD];
+    
+    if (n == 1 && (*p == '?' || *p == '$')) {
+        snprintf(num, 16, "%d", *p == '?' ? sh->state.last_exit :
+                                            sh->state.pid);
+        return num;
+    }
+    if (n == 0 || n >= sizeof(name)) {
+        return NULL;
+    }
+    memcpy(name, p, n);
+    name[n] = '\0';
+    
+    return shell_getenv(name);
+}
+
+/* Where the $( or ${ body starting at p closes, or end if it never does */
+static const char* expand_close(const char *p, const char *end, char close) {
+    char open = close == ')' ? '(' : '{';
+    char quote = '\0';
+    int level = 0;
+    
+    for (; p < end; p++) {
+        if (*p == '\\' && p + 1 < end) {
+            p++;
+        } else if (quote != '\0') {
+            if (*p == quote) {
+                quote = '\0';
+            }
+        } else if (*p == '"' || *p == '\'') {
+            quote = *p;
+        } else if (*p == open) {
+            level++;
+        } else if (*p == close && level-- == 0) {
+            return p;
+        }
+    }
+    
+    return end;
+}
+
+static void expand_into(shell_buf_t *out, const char *p, const char *end,
+                        bool dquote);
+
+/*
+ * Put the len bytes of a substituted value on out, escaped so that the
+ * tokenizer reads them as word text and never as quotes or operators.
+ * Outside double quotes its blanks and newlines split words, as spaces
+ * typed there do.
+ */
+static void expand_put(shell_buf_t *out, const char *value, uint32_t len,
+                       bool dquote) {
+    const char *end = value + len;
+    const char *run = value;
+    
+    for (; value < end; value++) {
+        if (*value == '\0' ||
+            strchr("\\\"'|&;<>#\n\t\r", *value) == NULL) {
+            continue;
+        }
+        buf_put(out, run, (uint32_t)(value - run));
+        if (!dquote && (*value == '\n' || *value == '\t' || *value == '\r')) {
+            buf_put(out, " ", 1);
+        } else {
+            buf_put(out, "\\", 1);
+            buf_put(out, value, 1);
+        }
+        run = value + 1;
+    }
+    buf_put(out, run, (uint32_t)(end - run));
+}
+
+/* Strip quotes and backslashes from s in place, as the tokenizer does */
+static void expand_unquote(char *s) {
+    char *w = s;
+    char quote = '\0';
+    
+    for (; *s != '\0'; s++) {
+        if (*s == '\\' && s[1] != '\0') {
+            *w++ = *++s;
+        } else if (quote != '\0') {
+            if (*s == quote) {
+                quote = '\0';
+            } else {
+                *w++ = *s;
+            }
+        } else if (*s == '"' || *s == '\'') {
+            quote = *s;
+        } else {
+            *w++ = *s;
+        }
+    }
+    *w = '\0';
+}
+
+/*
+ * ${name}, ${#name}, and with word expanded only when it is used:
+ * ${name-word} word if unset, ${name=word} also sets it, ${name+word}
+ * word if set. The : forms treat an empty value as unset.
+ */
+static void expand_param(shell_buf_t *out, const char *p, const char *end,
+                         bool dquote) {
+    shell_buf_t word;
+    const char *value;
+    const char *q;
+    char local[SHELL_MAX_LINE];
+    char num[16];
+    char name[SHELL_MAX_CMD];
+    bool colon, set;
+    uint32_t n;
+    
+    if (p + 1 < end && *p == '#') {
+        n = expand_name(p + 1, end);
+        if (p + 1 + n == end) {
+            value = expand_value(p + 1, n, num);
+            snprintf(num, sizeof(num), "%u",
+                     value != NULL ? (unsigned)strlen(value) : 0);
+            buf_put(out, num, (uint32_t)strlen(num));
+            return;
+        }
+    }
+    
+    n = expand_name(p, end);
+    q = p + n;
+    colon = q < end && *q == ':';
+    q += colon;
+    if (n == 0 || (q < end && *q != '-' && *q != '=' && *q != '+') ||
+        (q == end && colon)) {
+        shell_error("${%.*s}: bad substitution\n", (int)(end - p), p);
+        return;
+    }
+    
+    value = expand_value(p, n, num);
+    set = value != NULL && (!colon || value[0] != '\0');
+    if (q == end || (set && *q != '+')) {
+        if (value != NULL) {
+            expand_put(out, value, (uint32_t)strlen(value), dquote);
+        }
+    } else if (*q == '=') {
+        if (n >= sizeof(name) || *p == '?' || *p == '$') {
+            shell_error("${%.*s}: cannot assign\n", (int)n, p);
+            return;
+        }
+        buf_init(&word, local, sizeof(local));
+        expand_into(&word, q + 1, end, dquote);
+        expand_unquote(word.data);
+        memcpy(name, p, n);
+        name[n] = '\0';
+        shell_setenv(name, word.data);
+        expand_put(out, word.data, (uint32_t)strlen(word.data), dquote);
+        buf_free(&word);
+    } else if (*q == '-' || set) {
+        expand_into(out, q + 1, end, dquote);
+    }
+}
+
+/*
+ * $(command): run it as a line of its own in a subshell, with standard
+ * output collected, then drop the newlines it ends with and put the
+ * rest on out as a value. Input and errors are the enclosing command's.
+ */
+static void expand_command(shell_buf_t *out, const char *p, const char *end,
+                           bool dquote) {
+    shell_stage_t *outer = shell_stage;
+    shell_context_t *sub, *prev;
+    shell_stage_t st;
+    shell_buf_t line, result;
+    char local[SHELL_MAX_LINE];
+    char held[SHELL_MAX_LINE];
+    int nest = 0;
+    
+    for (; outer != NULL; outer = outer->outer) {
+        nest += outer->capture != NULL;
+    }
+    if (nest == SHELL_MAX_NEST) {
+        shell_error("$( ) nested too deeply\n");
+        return;
+    }
+    
+    buf_init(&line, local, sizeof(local));
+    buf_put(&line, p, (uint32_t)(end - p));
+    sub = line.failed ? NULL : shell_subshell(shell_self());
+    if (sub == NULL) {
+        buf_free(&line);
+        shell_error("out of memory\n");
+        return;
+    }
+    
+    buf_init(&result, held, sizeof(held));
+    memset(&st, 0, sizeof(st));
+    st.sh = sub;
+    st.outer = shell_stage;
+    st.in_file = FILE_INVALID;
+    st.capture = &result;
+    shell_stage = &st;
+    prev = shell_bind_context(sub);
+    shell_execute(line.data);
+    shell_bind_context(prev);
+    shell_stage = st.outer;
+    shell_subshell_free(sub);
+    buf_free(&line);
+    
+    while (result.len > 0 && (result.data[result.len - 1] == '\n' ||
+                              result.data[result.len - 1] == '\r')) {
+        result.len--;
+    }
+    expand_put(out, result.data, result.len, dquote);
+    buf_free(&result);
+}
+
+/* $ at p and what follows it; returns where the rest of the text starts */
+static const char* expand_dollar(shell_buf_t *out, const char *p,
+                                 const char *end, bool dquote) {
+    const char *value;
+    const char *close;
+    char num[16];
+    uint32_t n;
+    
+    p++;
+    if (p < end && (*p == '(' || *p == '{')) {
+        close = expand_close(p + 1, end, *p == '(' ? ')' : '}');
+        if (*p == '(') {
+            expand_command(out, p + 1, close, dquote);
+        } else {
+            expand_param(out, p + 1, close, dquote);
+        }
+        return close < end ? close + 1 : end;
+    }
+    
+    n = expand_name(p, end);
+    if (n == 0) {
+        /* A lone $ is just a dollar */
+        buf_put(out, "$", 1);
+        return p;
+    }
+    value = expand_value(p, n, num);
+    if (value != NULL) {
+        expand_put(out, value, (uint32_t)strlen(value), dquote);
+    }
+    
+    return p + n;
+}
+
+/*
+ * Expand the text from p to end onto out: $name, ${...} and $(...), and
+ * ~ at the start of a word. Nothing is expanded inside single quotes or
+ * after a backslash, and quotes and backslashes are kept for the
+ * tokenizer; what is substituted is escaped for it. dquote is whether
+ * the text starts inside double quotes. Text between expansions is
+ * copied a run at a time.
+ */
+static void expand_into(shell_buf_t *out, const char *p, const char *end,
+                        bool dquote) {
+    const char *start = p;
+    const char *run = p;
+    const char *home;
+    
+    /* The usual line has neither, and goes across in one copy */
+    if (memchr(p, '$', end - p) == NULL && memchr(p, '~', end - p) == NULL) {
+        buf_put(out, p, (uint32_t)(end - p));
+        return;
+    }
+    
+    while (p < end) {
+        if (*p == '\\') {
+            p += p + 1 < end ? 2 : 1;
+        } else if (*p == '"') {
+            dquote = !dquote;
+            p++;
+        } else if (*p == '\'' && !dquote) {
+            for (p++; p < end && *p != '\''; p++) {
+                if (*p == '\\' && p + 1 < end) {
+                    p++;
+                }
+            }
+            p += p < end;
+        } else if (*p == '$') {
+            buf_put(out, run, (uint32_t)(p - run));
+            run = p = expand_dollar(out, p, end, dquote);
+        } else if (*p == '~' && !dquote &&
+                   (p == start || p[-1] == ' ' || p[-1] == ':')) {
+            buf_put(out, run, (uint32_t)(p - run));
+            home = shell_getenv("HOME");
+            if (home == NULL) {
+                home = "/";
+            }
+            expand_put(out, home, (uint32_t)strlen(home), false);
+            run = ++p;
+        } else {
+            p++;
+        }
+    }
+    
+    buf_put(out, run, (uint32_t)(end - run));
+}
+
+/*
+ * Expand input into output, cut to fit size. Returns the length of the
+ * whole expansion, so a result of size or more means it was cut.
+ */
+int shell_expand(const char *input, char *output, int size) {
+    shell_buf_t buf;
+    
+    if (input == NULL || output == NULL || size <= 0) {
+        return SYSERR;
+    }
+    
+    buf_init(&buf, output, (uint32_t)size);
+    expand_into(&buf, input, input + strlen(input), false);
+    if (buf.heap) {
+        memcpy(output, buf.data, size - 1);
+        output[size - 1] = '\0';
+        buf_free(&buf);
+    }
+    
+    return (int)buf.len;
+}
+
+
+/*
+ * Run st on this thread, then release its pipe ends. A command that was
+ * not found says so on the stage's own standard error, pipe included,
+ * and the rest of the pipeline runs as usual.
+ */
+static void stage_call(shell_stage_t *st) {
+    shell_stage_t *saved = shell_stage;
+    
+    shell_stage = st;
+    if (st->cmd != NULL) {
+        st->status = st->cmd->func(st->argc, st->argv);
+    } else {
+        shell_error("%s: command not found\n", st->argv[0]);
+        st->status = SHELL_NOT_FOUND;
+    }
+    shell_stage = saved;
+    
+    if (st->out != NULL) {
+        pipe_close(st->out);
+    }
+    if (st->in != NULL) {
+        pipe_break(st->in);
+    }
+}
+
+#if defined(SHELL_PIPE_THREADS)
+static void* stage_main(void *arg) {
+    shell_stage_t *st = (shell_stage_t*)arg;
+    
+    shell_bind_context(st->sh);
+    stage_call(st);
+    return NULL;
+}
+
+static int stage_start(shell_stage_t *st) {
+    return pthread_create(&st->thread, NULL, stage_main, st) == 0 ? OK : SYSERR;
+}
+
+static void stage_join(shell_stage_t *st) {
+    pthread_join(st->thread, NULL);
+}
+#elif defined(SHELL_PIPE_PROCS)
+static process stage_main(shell_stage_t *st) {
+    sid32 done = st->done;
+    
+    shell_bind_context(st->sh);
+    stage_call(st);
+    shell_bind_context(NULL);
+    signal(done);
+    return OK;
+}
+
+static int stage_start(shell_stage_t *st) {
+    pid32 pid;
+    
+    st->done = semcreate(0);
+    if (st->done == SYSERR) {
+        return SYSERR;
+    }
+    pid = create((void*)stage_main, SHELL_STAGE_STACK, getprio(getpid()),
+                 "pipe", 1, st);
+    if (pid == SYSERR) {
+        semdelete(st->done);
+        return SYSERR;
+    }
+    resume(pid);
+    return OK;
+}
+
+static void stage_join(shell_stage_t *st) {
+    wait(st->done);
+    semdelete(st->done);
+}
+#endif
+
+/*
+ * Run stages[0..count) with a pipe between each pair. All but the last
+ * run concurrently on their own thread or process, each in a subshell,
+ * and the last runs here. Returns the status of the last stage.
+ */
+static int shell_run_stages(shell_stage_t *stages, int count) {
+    shell_context_t *sh = shell_self();
+    shell_stage_t *st;
+    int status;
+    int i;
+    
+    for (i = 0; i < count; i++) {
+        st = &stages[i];
+        st->sh = sh;
+        st->outer = shell_stage;
+        st->job = NULL;
+        st->in = NULL;
+        st->out = NULL;
+        st->status = SHELL_ERROR;
+        st->started = false;
+        if (i > 0) {
+            st->in = stages[i - 1].out = pipe_create();
+            if (st->in == NULL) {
+                while (--i > 0) {
+                    pipe_destroy(stages[i].in);
+                }
+                shell_error("cannot create pipe\n");
+                return SHELL_ERROR;
+            }
+        }
+    }
+    
+#if defined(SHELL_PIPE_THREADS) || defined(SHELL_PIPE_PROCS)
+    for (i = 0; i < count - 1; i++) {
+        st = &stages[i];
+        st->sh = shell_subshell(sh);
+        st->started = st->sh != NULL;
+        if (!st->started || stage_start(st) != OK) {
+            if (st->sh != NULL) {
+                shell_subshell_free(st->sh);
+            }
+            st->sh = sh;
+            st->started = false;
+            shell_error("%s: cannot start\n", st->argv[0]);
+            pipe_close(st->out);
+            if (st->in != NULL) {
+                pipe_break(st->in);
+            }
+        }
+    }
+    stage_call(&stages[count - 1]);
+    for (i = 0; i < count - 1; i++) {
+        if (stages[i].started) {
+            stage_join(&stages[i]);
+            shell_subshell_free(stages[i].sh);
+            stages[i].sh = sh;
+        }
+    }
+#else
+    for (i = 0; i < count; i++) {
+        stage_call(&stages[i]);
+    }
+#endif
+    
+    status = stages[count - 1].status;
+    for (i = 1; i < count; i++) {
+        pipe_destroy(stages[i].in);
+    }
+    
+    return status;
+}
+
+static const char *const shell_token_names[] = {
+    [TOK_PIPE] = "|", [TOK_REDIR_IN] = "<", [TOK_REDIR_OUT] = ">",
+    [TOK_REDIR_APPEND] = ">>", [TOK_REDIR_ERR] = "2>",
+    [TOK_BACKGROUND] = "&", [TOK_SEMICOLON] = ";", [TOK_AND] = "&&",
+    [TOK_OR] = "||", [TOK_LPAREN] = "(", [TOK_RPAREN] = ")",
+    [TOK_NEWLINE] = "newline", [TOK_EOF] = "end of line"
+};
+
+/*
+ * Whether the & at tokens[i] is the middle of 2>&1, which arrives as
+ * 2>, & and a word, all adjacent, and so separates nothing.
+ */
+static bool token_dups_err(const shell_token_t *tokens, int i, int count) {
+    return i > 0 && i + 1 < count &&
+           tokens[i].type == TOK_BACKGROUND &&
+           tokens[i - 1].type == TOK_REDIR_ERR &&
+           tokens[i].position == tokens[i - 1].position + 2 &&
+           tokens[i + 1].type == TOK_WORD &&
+           tokens[i + 1].position == tokens[i].position + 1 &&
+           strcmp(tokens[i + 1].value, "1") == 0;
+}
+
+/*
+ * Apply the redirection at tokens[*i] to st, opening its file now; a
+ * later one of the same kind replaces it. Advances *i past the target.
+ */
+static int stage_redirect(shell_stage_t *st, shell_token_t *tokens,
+                          int *i, int count) {
+    shell_token_t *op = &tokens[*i];
+    const char *name;
+    
+    if (op->type == TOK_REDIR_ERR && *i + 1 < count &&
+        token_dups_err(tokens, *i + 1, count)) {
+        sink_close(st->err_file);
+        st->err_file = NULL;
+        st->err_to_out = true;
+        *i += 2;
+        return SHELL_OK;
+    }
+    
+    if (*i + 1 >= count || tokens[*i + 1].type != TOK_WORD) {
+        shell_error("syntax error near '%s'\n", shell_token_names[op->type]);
+        return SHELL_ERROR;
+    }
+    name = tokens[++*i].value;
+    
+    switch (op->type) {
+        case TOK_REDIR_IN:
+            if (st->in_file != FILE_INVALID) {
+                file_close(st->in_file);
+            }
+            st->in_file = file_open(name);
+            if (st->in_file == FILE_INVALID) {
+                break;
+            }
+            return SHELL_OK;
+        case TOK_REDIR_OUT:
+        case TOK_REDIR_APPEND:
+            sink_close(st->out_file);
+            st->out_file = sink_open(name, op->type == TOK_REDIR_APPEND);
+            if (st->out_file == NULL) {
+                break;
+            }
+            return SHELL_OK;
+        default:
+            sink_close(st->err_file);
+            st->err_to_out = false;
+            st->err_file = sink_open(name, false);
+            if (st->err_file == NULL) {
+                break;
+            }
+            return SHELL_OK;
+    }
+    
+    shell_error("%s: cannot open\n", name);
+    return SHELL_ERROR;
+}
+
+/* Close what stage_redirect() opened, flushing output */
+static void stage_release(shell_stage_t *st) {
+    if (st->in_file != FILE_INVALID) {
+        file_close(st->in_file);
+    }
+    sink_close(st->out_file);
+    sink_close(st->err_file);
+}
+
+/* Nanoseconds on a clock that never steps back */
+static uint64_t shell_clock(void) {
+#if defined(XINU_KERNEL)
+    return (uint64_t)ctr1000 * 1000000ULL;
+#elif defined(_WIN32)
+    return (uint64_t)clock() * (1000000000ULL / CLOCKS_PER_SEC);
+#else
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/* User and system time of the whole process, jobs and stages included */
+static bool shell_cpu_times(uint64_t *user, uint64_t *sys) {
+#ifdef SHELL_CPU_TIMES
+    struct rusage ru;
+    
+    if (getrusage(RUSAGE_SELF, &ru) != 0) {
+        return false;
+    }
+    *user = (uint64_t)ru.ru_utime.tv_sec * 1000000000ULL +
+            (uint64_t)ru.ru_utime.tv_usec * 1000ULL;
+    *sys = (uint64_t)ru.ru_stime.tv_sec * 1000000000ULL +
+           (uint64_t)ru.ru_stime.tv_usec * 1000ULL;
+    return true;
+#else
+    *user = *sys = 0;
+    return false;
+#endif
+}
+
+/* Start of a phase; the clock is only read while something is timed */
+static uint64_t phase_begin(void) {
+    return shell_phases != NULL ? shell_clock() : 0;
+}
+
+static void phase_end(int phase, uint64_t start) {
+    if (shell_phases != NULL) {
+        shell_phases[phase] += shell_clock() - start;
+    }
+}
+
+static int shell_time_tokens(shell_token_t *tokens, int count);
+
+/*
+ * Run the pipeline in tokens[0..count). Stage argv point into the
+ * tokens, and redirections are opened before any stage starts.
+ */
+static int shell_execute_tokens(shell_token_t *tokens, int count) {
+    shell_stage_t stages[SHELL_MAX_STAGES];
+    shell_stage_t *st = NULL;
+    shell_token_type_t type;
+    char *args[SHELL_MAX_TOKENS + 1];
+    int status = SHELL_OK;
+    int nstages = 0;
+    uint64_t start;
+    int argc = 0;
+    int used = 0;
+    int i;
+    
+    /* time is a keyword at the head of a pipeline, so it times it all */
+    if (count > 0 && tokens[0].type == TOK_WORD &&
+        strcmp(tokens[0].value, "time") == 0) {
+        return shell_time_tokens(tokens + 1, count - 1);
+    }
+    
+    for (i = 0; i <= count && status == SHELL_OK; i++) {
+        type = i < count ? tokens[i].type : TOK_EOF;
+        
+        if (st == NULL) {
+            if (nstages == SHELL_MAX_STAGES) {
+                shell_error("pipeline too long\n");
+                status = SHELL_ERROR;
+                break;
+            }
+            st = &stages[nstages];
+            st->in_file = FILE_INVALID;
+            st->out_file = NULL;
+            st->err_file = NULL;
+            st->err_to_out = false;
+            st->capture = NULL;
+        }
+        
+        switch (type) {
+            case TOK_WORD:
+                if (argc == SHELL_MAX_ARGS - 1 ||
+                    used + argc == SHELL_MAX_TOKENS) {
+                    shell_error("too many arguments\n");
+                    status = SHELL_ERROR;
+                    break;
+                }
+                args[used + argc++] = tokens[i].value;
+                break;
+            case TOK_REDIR_IN:
+            case TOK_REDIR_OUT:
+            case TOK_REDIR_APPEND:
+            case TOK_REDIR_ERR:
+                status = stage_redirect(st, tokens, &i, count);
+                break;
+            case TOK_PIPE:
+            case TOK_EOF:
+                if (argc == 0) {
+                    shell_error("syntax error near '%s'\n",
+                                shell_token_names[type]);
+                    status = SHELL_ERROR;
+                    break;
+                }
+                st->argc = argc;
+                st->argv = &args[used];
+                args[used + argc] = NULL;
+                used += argc + 1;
+                argc = 0;
+                nstages++;
+                
+                /* Look for built-in command */
+                start = phase_begin();
+                st->cmd = shell_find_command(st->argv[0]);
+                phase_end(PHASE_LOOKUP, start);
+                st = NULL;
+                break;
+            default:
+                shell_error("'%s' is not supported\n", shell_token_names[type]);
+                status = SHELL_ERROR;
+                break;
+        }
+    }
+    
+    if (status == SHELL_OK) {
+        status = shell_run_stages(stages, nstages);
+    }
+    
+    if (st != NULL) {
+        stage_release(st);
+    }
+    for (i = 0; i < nstages; i++) {
+        stage_release(&stages[i]);
+    }
+    
+    return status;
+}
+
+/* One line of time's report, as sh prints it or in microseconds */
+static void time_report(const char *name, uint64_t ns, bool fine) {
+    uint32_t sec = (uint32_t)(ns / 1000000000ULL);
+    
+    if (fine) {
+        shell_error("%s\t%u.%06us\n", name, sec,
+                    (uint32_t)(ns % 1000000000ULL / 1000ULL));
+    } else {
+        shell_error("%s\t%um%u.%03us\n", name, sec / 60, sec % 60,
+                    (uint32_t)(ns % 1000000000ULL / 1000000ULL));
+    }
+}
+
+/*
+ * time [-v] pipeline: run it and report real, user and sys time on
+ * stderr. -v adds how much of real went on expanding, tokenizing and
+ * finding commands on this thread; the rest is execution. Phases of
+ * lines the pipeline runs itself, such as a script's, count too.
+ */
+static int shell_time_tokens(shell_token_t *tokens, int count) {
+    static const char *names[SHELL_PHASES] = { "expand", "parse", "lookup" };
+    uint64_t phases[SHELL_PHASES] = { 0 };
+    uint64_t *outer = shell_phases;
+    uint64_t real, user, sys, user0, sys0, spent = 0;
+    bool verbose = false, cpu;
+    int status;
+    int i;
+    
+    if (count > 0 && tokens[0].type == TOK_WORD &&
+        strcmp(tokens[0].value, "-v") == 0) {
+        verbose = true;
+        tokens++;
+        count--;
+    }
+    if (count == 0 || tokens[0].type != TOK_WORD) {
+        shell_error("usage: time [-v] command\n");
+        return SHELL_ERROR;
+    }
+    
+    cpu = shell_cpu_times(&user0, &sys0);
+    shell_phases = phases;
+    real = shell_clock();
+    status = shell_execute_tokens(tokens, count);
+    real = shell_clock() - real;
+    shell_phases = outer;
+    cpu = cpu && shell_cpu_times(&user, &sys);
+    
+    time_report("real", real, false);
+    if (cpu) {
+        time_report("user", user - user0, false);
+        time_report("sys", sys - sys0, false);
+    }
+    for (i = 0; i < SHELL_PHASES; i++) {
+        if (verbose) {
+            time_report(names[i], phases[i], true);
+        }
+        spent += phases[i];
+        /* An enclosing time is charged for these as well */
+        if (outer != NULL) {
+            outer[i] += phases[i];
+        }
+    }
+    if (verbose) {
+        time_report("exec", real > spent ? real - spent : 0, true);
+    }
+    
+    return status;
+}
+
+/*
+ * Split line at each unquoted | into pipeline->commands, all held in one
+ * block that shell_free_pipeline() releases. A trailing & sets
+ * background. Redirections stay in the command text.
+ */
+int shell_parse_pipeline(const char *line, shell_pipeline_t *pipeline) {
+    shell_token_t local[SHELL_MAX_TOKENS];
+    shell_token_t *tokens;
+    char *text;
+    uint32_t len;
+    int count, max;
+    int status = OK;
+    int i;
+    
+    if (line == NULL || pipeline == NULL) {
+        return SYSERR;
+    }
+    memset(pipeline, 0, sizeof(shell_pipeline_t));
+    
+    len = (uint32_t)strlen(line);
+    pipeline->size = SHELL_MAX_STAGES * sizeof(char*) + 2 * (len + 1);
+    pipeline->commands = (char**)getmem(pipeline->size);
+    tokens = tokens_get(local, len, &max);
+    if (pipeline->commands == NULL || tokens == NULL) {
+        if (tokens != NULL) {
+            tokens_put(tokens, local, max);
+        }
+        shell_free_pipeline(pipeline);
+        return SYSERR;
+    }
+    
+    /* Token positions are offsets into the line as given */
+    text = (char*)(pipeline->commands + SHELL_MAX_STAGES);
+    memcpy(text, line, len + 1);
+    memcpy(text + len + 1, line, len + 1);
+    count = shell_tokenize(text + len + 1, tokens, max);
+    if (count == SYSERR) {
+        status = SYSERR;
+    } else {
+        pipeline->commands[pipeline->num_commands++] = text;
+    }
+    
+    for (i = 0; i < count && status == OK; i++) {
+        switch (tokens[i].type) {
+            case TOK_PIPE:
+                if (pipeline->num_commands == SHELL_MAX_STAGES) {
+                    status = SYSERR;
+                    break;
+                }
+                text[tokens[i].position] = '\0';
+                pipeline->commands[pipeline->num_commands++] =
+                    text + tokens[i].position + 1;
+                break;
+            case TOK_BACKGROUND:
+                if (token_dups_err(tokens, i, count)) {
+                    break;
+                }
+                if (tokens[i + 1].type != TOK_EOF) {
+                    status = SYSERR;
+                    break;
+                }
+                text[tokens[i].position] = '\0';
+                pipeline->background = true;
+                break;
+            case TOK_SEMICOLON:
+            case TOK_AND:
+            case TOK_OR:
+            case TOK_NEWLINE:
+                /* A list, not a pipeline */
+                status = SYSERR;
+                break;
+            default:
+                break;
+        }
+    }
+    
+    tokens_put(tokens, local, max);
+    if (status != OK) {
+        shell_free_pipeline(pipeline);
+    }
+    return status;
+}
+
+void shell_free_pipeline(shell_pipeline_t *pipeline) {
+    if (pipeline != NULL && pipeline->commands != NULL) {
+        freemem(pipeline->commands, pipeline->size);
+        pipeline->commands = NULL;
+        pipeline->num_commands = 0;
+    }
+}
+
+/* Put type and file ahead of the | that ends tokens[0..count) */
+static int pipeline_redirect(shell_token_t *tokens, int count, int max,
+                             shell_token_type_t type, char *file) {
+    if (count == SYSERR || count + 2 > max) {
+        return SYSERR;
+    }
+    
+    tokens[count - 1].type = type;
+    tokens[count].type = TOK_WORD;
+    tokens[count].value = file;
+    tokens[count].length = (int)strlen(file);
+    tokens[count].position = tokens[count - 1].position;
+    tokens[count + 1] = tokens[count - 1];
+    tokens[count + 1].type = TOK_PIPE;
+    
+    return count + 2;
+}
+
+/*
+ * Expand and run each command, piped together as by |. All are expanded
+ * before any is tokenized, as the buffer may move while it grows.
+ */
+int shell_execute_pipeline(shell_pipeline_t *pipeline) {
+    shell_context_t *sh = shell_self();
+    shell_token_t local_tokens[SHELL_MAX_TOKENS];
+    shell_token_t *tokens;
+    shell_buf_t expanded;
+    char local[SHELL_MAX_LINE];
+    uint32_t starts[SHELL_MAX_STAGES];
+    const char *command;
+    int count = 0, max;
+    int status;
+    int n;
+    int i;
+    
+    if (pipeline == NULL || pipeline->num_commands <= 0 ||
+        pipeline->num_commands > SHELL_MAX_STAGES) {
+        return SHELL_ERROR;
+    }
+    
+    buf_init(&expanded, local, sizeof(local));
+    for (i = 0; i < pipeline->num_commands; i++) {
+        command = pipeline->commands[i];
+        starts[i] = expanded.len;
+        expand_into(&expanded, command, command + strlen(command), false);
+        buf_put(&expanded, "", 1);
+    }
+    
+    /* Each command's TOK_EOF becomes a |, and each file adds two more */
+    tokens = tokens_get(local_tokens, expanded.len + 2 *
+                        (pipeline->num_commands + 4), &max);
+    if (expanded.failed || tokens == NULL) {
+        if (tokens != NULL) {
+            tokens_put(tokens, local_tokens, max);
+        }
+        buf_free(&expanded);
+        shell_error("out of memory\n");
+        return sh->state.last_exit = SHELL_ERROR;
+    }
+    
+    /* Tokenize every command into one list, joined by TOK_PIPE */
+    for (i = 0; i < pipeline->num_commands && count != SYSERR; i++) {
+        n = shell_tokenize(expanded.data + starts[i], tokens + count,
+                           max - count);
+        if (n == SYSERR) {
+            count = SYSERR;
+            break;
+        }
+        
+        /* Each command ends in TOK_EOF, which becomes the | */
+        count += n;
+        tokens[count - 1].type = TOK_PIPE;
+        
+        /* The pipeline's own files go with the first and last commands */
+        if (i == 0 && pipeline->input_file != NULL) {
+            count = pipeline_redirect(tokens, count, max, TOK_REDIR_IN,
+                                      pipeline->input_file);
+        }
+        if (i == pipeline->num_commands - 1 && pipeline->output_file != NULL) {
+            count = pipeline_redirect(tokens, count, max,
+                                      pipeline->append_output ?
+                                      TOK_REDIR_APPEND : TOK_REDIR_OUT,
+                                      pipeline->output_file);
+        }
+    }
+    
+    if (count == SYSERR) {
+        shell_error("too many tokens\n");
+        status = SHELL_ERROR;
+    } else if (pipeline->background) {
+        status = SHELL_OK;
+        if (shell_job_spawn(tokens, count - 1) == SYSERR) {
+            shell_error("cannot start job\n");
+            status = SHELL_ERROR;
+        }
+    } else {
+        status = shell_execute_tokens(tokens, count - 1);
+    }
+    
+    tokens_put(tokens, local_tokens, max);
+    buf_free(&expanded);
+    return sh->state.last_exit = status;
+}
+
+/* cmd1 | cmd2 */
+int shell_pipe(const char *cmd1, const char *cmd2) {
+    shell_pipeline_t pipeline;
+    char *commands[2];
+    
+    if (cmd1 == NULL || cmd2 == NULL) {
+        return SHELL_ERROR;
+    }
+    
+    memset(&pipeline, 0, sizeof(pipeline));
+    commands[0] = (char*)cmd1;
+    commands[1] = (char*)cmd2;
+    pipeline.commands = commands;
+    pipeline.num_commands = 2;
+    
+    return shell_execute_pipeline(&pipeline);
+}
+
+/*
+ * Read commands' input from filename until called again; NULL goes
+ * back to the terminal. A command's own < still wins.
+ */
+int shell_redirect_input(const char *filename) {
+    shell_context_t *sh = shell_self();
+    file_handle_t file = FILE_INVALID;
+    
+    if (filename != NULL) {
+        file = file_open(filename);
+        if (file == FILE_INVALID) {
+            return SYSERR;
+        }
+    }
+    
+    if (sh->in_file != FILE_INVALID) {
+        file_close(sh->in_file);
+    }
+    sh->in_file = file;
+    
+    return OK;
+}
+
+/* As shell_redirect_input(), for output; append keeps what is there */
+int shell_redirect_output(const char *filename, bool append) {
+    shell_context_t *sh = shell_self();
+    shell_sink_t *sink = NULL;
+    
+    if (filename != NULL) {
+        sink = sink_open(filename, append);
+        if (sink == NULL) {
+            return SYSERR;
+        }
+    }
+    
+    sink_close(sh->out_file);
+    sh->out_file = sink;
+    
+    return OK;
+}
+
+/*
+ * Run the list in tokens[0..count): and-or lists split by ;, newlines
+ * and &, and pipelines split by && and ||, which are gated on the last
+ * status. An and-or list ending in & goes to the background whole.
+ */
+static int shell_execute_list(shell_token_t *tokens, int count) {
+    shell_context_t *sh = shell_self();
+    shell_slot_t *job = shell_current_job();
+    shell_token_type_t type;
+    bool skip = false;
+    int status = SHELL_OK;
+    int start = 0;
+    int id;
+    int i, j;
+    
+    for (i = 0; i < count && sh->state.running && !job_cancelled(); i++) {
+        /* At the head of an and-or list, see whether it ends in & */
+        if (i == start && (i == 0 || tokens[i - 1].type != TOK_AND) &&
+            (i == 0 || tokens[i - 1].type != TOK_OR)) {
+            for (j = i; j < count && tokens[j].type != TOK_SEMICOLON &&
+                 tokens[j].type != TOK_NEWLINE && tokens[j].type != TOK_EOF &&
+                 (tokens[j].type != TOK_BACKGROUND ||
+                  token_dups_err(tokens, j, count)); j++) {
+                ;
+            }
+            if (j < count && tokens[j].type == TOK_BACKGROUND && j > i) {
+                id = shell_job_spawn(&tokens[i], j - i);
+                if (id == SYSERR) {
+                    shell_error("cannot start job\n");
+                    status = SHELL_ERROR;
+                } else {
+                    if (sh->state.interactive && job == NULL) {
+                        shell_printf("[%d] %d\n", id,
+                                     (int)shell_job_find(id)->pid);
+                    }
+                    status = SHELL_OK;
+                }
+                skip = false;
+                start = i = j;
+                start++;
+                continue;
+            }
+        }
+        
+        type = tokens[i].type;
+        if (type != TOK_SEMICOLON && type != TOK_AND && type != TOK_OR &&
+            type != TOK_NEWLINE && type != TOK_EOF &&
+            (type != TOK_BACKGROUND || token_dups_err(tokens, i, count))) {
+            continue;
+        }
+        
+        if (i > start && !skip) {
+            status = shell_execute_tokens(&tokens[start], i - start);
+            if (job == NULL) {
+                sh->state.last_exit = status;
+            }
+            
+            /* As in sh, failures that && or || are testing do not count */
+            if (status != SHELL_OK && (sh->options & SHELL_OPT_ERREXIT) &&
+                type != TOK_AND && type != TOK_OR) {
+                shell_exit(status);
+            }
+        } else if (i == start && type != TOK_NEWLINE && type != TOK_EOF) {
+            shell_error("syntax error near '%s'\n", shell_token_names[type]);
+            status = SHELL_ERROR;
+            if (job == NULL) {
+                sh->state.last_exit = status;
+            }
+            break;
+        }
+        
+        if (type == TOK_AND) {
+            skip = (status != SHELL_OK);
+        } else if (type == TOK_OR) {
+            skip = (status == SHELL_OK);
+        } else {
+            skip = false;
+        }
+        start = i + 1;
+    }
+    
+    return status;
+}
+
+/*
+ * Expand, tokenize and run the len bytes at text as one line. The
+ * expansion is the only copy made; the tokens point into it.
+ */
+static int shell_execute_text(const char *text, uint32_t len) {
+    shell_context_t *sh = shell_self();
+    shell_token_t local_tokens[SHELL_MAX_TOKENS];
+    shell_token_t *tokens;
+    shell_buf_t expanded;
+    char local[SHELL_MAX_LINE];
+    const char *end = text + len;
+    uint64_t start;
+    int count, max;
+    int status;
+    
+    while (text < end && (*text == ' ' || *text == '\t')) {
+        text++;
+    }
+    if (text == end || *text == '#') {
+        return SHELL_OK;
+    }
+    
+    if (!sh->state.interactive && shell_stage == NULL) {
+        /* Scripts have no prompt to report at, so reap quietly */
+        shell_jobs_reap(false);
+    }
+    
+    start = phase_begin();
+    buf_init(&expanded, local, sizeof(local));
+    expand_into(&expanded, text, end, false);
+    phase_end(PHASE_EXPAND, start);
+    
+    tokens = tokens_get(local_tokens, expanded.len, &max);
+    if (expanded.failed || tokens == NULL) {
+        buf_free(&expanded);
+        shell_error("out of memory\n");
+        return sh->state.last_exit = SHELL_ERROR;
+    }
+    
+    start = phase_begin();
+    count = shell_tokenize(expanded.data, tokens, max);
+    phase_end(PHASE_PARSE, start);
+    if (count == SYSERR) {
+        shell_error("too many tokens\n");
+        status = sh->state.last_exit = SHELL_ERROR;
+    } else {
+        status = shell_execute_list(tokens, count);
+    }
+    
+    tokens_put(tokens, local_tokens, max);
+    buf_free(&expanded);
+    return status;
+}
+
+int shell_execute(const char *line) {
+    shell_context_t *sh = shell_self();
+    const char *p = line;
+    
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p == '\0' || *p == '#') {
+        return SHELL_OK;
+    }
+    
+    /* Lines run for $( ) are not the user's to recall */
+    if (sh->state.interactive && shell_stage == NULL) {
+        shell_history_add(line);
+    }
+    
+    return shell_execute_text(p, (uint32_t)strlen(p));
+}
+
+/*
+ * Execute the complete lines in text, plus a trailing partial line when
+ * final is set. Each is expanded straight from text. Returns the bytes
+ * consumed.
+ */
+static uint32_t shell_execute_lines(const char *text, uint32_t len,
+                                    bool final) {
+    const char *nl;
+    shell_context_t *sh = shell_self();
+    uint32_t pos = 0, n, next;
+    
+    while (pos < len && sh->state.running) {
+        nl = memchr(text + pos, '\n', len - pos);
+        if (nl == NULL && !final) {
+            break;
+        }
+        
+        n = nl != NULL ? (uint32_t)(nl - text) - pos : len - pos;
+        next = pos + n + (nl != NULL);
+        if (n > 0 && text[pos + n - 1] == '\r') {
+            n--;
+        }
+        
+        shell_execute_text(text + pos, n);
+        pos = next;
+    }
+    
+    return pos;
+}
+
+/*
+ * Run lines as each chunk arrives; only a partial line is carried over.
+ * A line longer than the buffer doubles it.
+ */
+static int shell_stream_file(file_handle_t file) {
+    shell_context_t *sh = shell_self();
+    uint32_t size = SHELL_MAX_LINE + SHELL_BATCH_CHUNK;
+    char *buf;
+    char *grown;
+    uint32_t used = 0, done;
+    int32_t n;
+    bool eof = false;
+    int status = SHELL_OK;
+    
+    buf = (char*)getmem(size);
+    if (buf == NULL) {
+        shell_error("out of memory\n");
+        return SHELL_ERROR;
+    }
+    
+    while (!eof && sh->state.running) {
+        if (used == size) {
+            grown = size <= UINT32_MAX / 2 ? (char*)getmem(2 * size) : NULL;
+            if (grown == NULL) {
+                shell_error("line too long\n");
+                status = SHELL_ERROR;
+                break;
+            }
+            memcpy(grown, buf, used);
+            freemem(buf, size);
+            buf = grown;
+            size *= 2;
+        }
+        
+        n = file_read(file, buf + used, size - used);
+        if (n <= 0) {
+            eof = true;
+        } else {
+            used += n;
+        }
+        
+        done = shell_execute_lines(buf, used, eof);
+        memmove(buf, buf + done, used - done);
+        used -= done;
+    }
+    
+    freemem(buf, size);
+    return status;
+}
+
+int shell_execute_file(const char *filename) {
+    shell_context_t *sh = shell_self();
+    bool interactive = sh->state.interactive;
+#ifdef SHELL_STREAM_FILES
+    int status;
+#endif
+    
+    if (filename == NULL) {
+        return SHELL_ERROR;
+    }
+    
+#ifdef SHELL_STREAM_FILES
+    file_handle_t file = file_open(filename);
+    if (file == FILE_INVALID) {
+        shell_error("%s: cannot open\n", filename);
+        return SHELL_ERROR;
+    }
+    
+    /* Script lines stay out of the history */
+    sh->state.interactive = false;
+    status = shell_stream_file(file);
+    sh->state.interactive = interactive;
+    file_close(file);
+    if (status != SHELL_OK) {
+        return status;
+    }
+#else
+    struct stat st;
+    FILE *file;
+    void *text = MAP_FAILED;
+    
+    file = fopen(filename, "rb");
+    if (file == NULL) {
+        shell_error("%s: cannot open\n", filename);
+        return SHELL_ERROR;
+    }
+    if (fstat(fileno(file), &st) == 0 && st.st_size > 0) {
+        text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    }
+    fclose(file);
+    if (text == MAP_FAILED) {
+        /* Nothing to run in an empty file */
+        if (st.st_size == 0) {
+            return SHELL_OK;
+        }
+        shell_error("%s: cannot read\n", filename);
+        return SHELL_ERROR;
+    }
+    
+    /* Script lines stay out of the history */
+    posix_madvise(text, st.st_size, POSIX_MADV_SEQUENTIAL);
+    sh->state.interactive = false;
+    shell_execute_lines((const char*)text, (uint32_t)st.st_size, true);
+    sh->state.interactive = interactive;
+    munmap(text, st.st_size);
+#endif
+    
+    return sh->state.last_exit;
+}
+
+/*
+ * Run a script start to finish without the interactive trimmings: no
+ * banner, prompt or history, input read in large blocks and terminal
+ * output held until the buffer fills, input is wanted, or the end.
+ * NULL or "-" reads standard input. exit and set -e end the script
+ * only, and set -e lasts only as long as it. Returns the last exit
+ * status.
+ */
+int shell_batch(const char *filename) {
+    shell_context_t *sh = shell_self();
+    bool interactive = sh->state.interactive;
+    bool running = sh->state.running;
+    uint32_t options = sh->options;
+    bool owned = false;
+    int status;
+    
+    /* Unbuffered, rather than not at all, if this fails */
+    if (sh->outbuf == NULL) {
+        sh->outbuf = (char*)getmem(SHELL_OUT_BUFFER);
+        sh->out_used = 0;
+        owned = sh->outbuf != NULL;
+    }
+    
+    sh->state.interactive = false;
+    sh->state.running = true;
+    if (filename == NULL || strcmp(filename, "-") == 0) {
+        status = shell_stream_file(FILE_STDIN);
+        if (status == SHELL_OK) {
+            status = sh->state.last_exit;
+        }
+    } else {
+        status = shell_execute_file(filename);
+    }
+    sh->state.interactive = interactive;
+    sh->state.running = running;
+    sh->options = options;
+    
+    if (owned) {
+        shell_flush();
+        freemem(sh->outbuf, SHELL_OUT_BUFFER);
+        sh->outbuf = NULL;
+    }
+    
+    return status;
+}
+
+uint32_t shell_get_options(void) {
+    return shell_self()->options;
+}
+
+void shell_set_options(uint32_t options) {
+    shell_self()->options = options;
+}
+
+void shell_run(void) {
+    shell_context_t *sh = shell_self();
+    char line[SHELL_MAX_LINE];
+    
+    shell_init();
+    
+    /* Commands from earlier sessions */
+    if (SHELL_HISTORY_FILE[0] != '\0') {
+        shell_history_open(SHELL_HISTORY_FILE);
+    }
     
     shell_printf("Xinu Shell\n");
     shell_printf("Type 'help' for commands\n\n");
     
-    while (shell_state.running) {
-        /* Print prompt */
-        shell_printf("%s", SHELL_PROMPT);
-        
-        /* Read command line */
-        if (shell_readline(line, SHELL_MAX_LINE) == NULL) {
-            shell_printf("\n");
+    while (sh->state.running) {
+        /* Report jobs that finished since the last prompt */
+        shell_jobs_reap(true);
+        
+        /* Print prompt */
+        shell_printf("%s", SHELL_PROMPT);
+        
+        /* Read command line */
+        if (shell_readline(line, SHELL_MAX_LINE) == NULL) {
+            shell_printf("\n");
+            break;
+        }
+        
+        /* Execute command */
+        shell_execute(line);
+    }
+}
+
+void shell_start(void) {
+    shell_run();
+}
+
+void shell_process(void) {
+    shell_run();
+}
+
+void shell_exit(int status) {
+    shell_context_t *sh = shell_self();
+    shell_slot_t *job = NULL;
+    shell_stage_t *st;
+    
+    /* In a background job, only the job ends; in $( ), only that */
+    for (st = shell_stage; st != NULL && st->capture == NULL;
+         st = st->outer) {
+        if (st->job != NULL) {
+            job = st->job;
+            break;
+        }
+    }
+    if (job != NULL) {
+        jobs_lock(job->sh);
+        job->job.status = status;
+        job->exited = true;
+        job->cancel = true;
+        jobs_unlock(job->sh);
+        return;
+    }
+    
+    sh->state.running = false;
+    sh->state.last_exit = status;
+}
+
+
+/*
+ * History log: HIST_MAGIC, then for each command its hash, time, length
+ * and character pairs (native order), its text and a NUL. Records are
+ * only appended; a command run again gets a new one that supersedes
+ * the old.
+ */
+#define HIST_MAGIC      "XSHHIST1"
+#define HIST_MAGIC_LEN  8
+#define HIST_HEADER     20
+#define HIST_DEAD       UINT32_MAX      /* len of a superseded entry */
+
+/* A command in the history; its text is NUL-terminated in the log */
+typedef struct shell_hist {
+    uint32_t    off;            /* Into the map, then into added */
+    uint32_t    len;
+    uint32_t    hash;
+    uint32_t    time;           /* Seconds, since 1970 or under Xinu boot */
+    uint32_t    seq;            /* Order added, which the index holds */
+} shell_hist_t;
+
+typedef struct shell_hist_slot {
+    uint32_t    hash;
+    uint32_t    seq;            /* 0 when empty */
+} shell_hist_slot_t;
+
+/*
+ * Every distinct command run, oldest first; running one again moves it
+ * to the end. The log read at startup stays where it was mapped (read
+ * whole where files are not mapped) and commands run since go in added,
+ * so entries point at their text instead of holding a copy. sigs hold
+ * the character pairs of each, which searches test before the text.
+ */
+typedef struct shell_history {
+    shell_hist_t        *items;
+    uint64_t            *sigs;
+    shell_hist_slot_t   *index;         /* 2 * cap buckets by hash */
+    int32_t             count;          /* Superseded items included */
+    int32_t             cap;
+    int32_t             dead;           /* Superseded, until hist_compact() */
+    int32_t             first_dead;
+    int32_t             hint;           /* Room to start with, a power of two */
+    uint32_t            seq;
+    const char          *map;
+    uint32_t            map_len;
+    shell_buf_t         added;
+    char                added_local[SHELL_MAX_LINE];
+    file_handle_t       file;           /* Appended to while logging */
+    bool                logging;
+    char                path[SHELL_MAX_PATH];
+} shell_history_t;
+
+static uint32_t hist_now(void) {
+#ifdef XINU_KERNEL
+    return (uint32_t)clktime;
+#else
+    return (uint32_t)time(NULL);
+#endif
+}
+
+/* This shell's history, made on first use; NULL if out of memory */
+static shell_history_t* hist_self(void) {
+    shell_context_t *sh = shell_self();
+    shell_history_t *h = sh->history;
+    
+    if (h == NULL) {
+        h = (shell_history_t*)getmem(sizeof(shell_history_t));
+        if (h == NULL) {
+            return NULL;
+        }
+        memset(h, 0, sizeof(shell_history_t));
+        buf_init(&h->added, h->added_local, sizeof(h->added_local));
+        h->hint = SHELL_HISTORY_SIZE;
+        sh->history = h;
+    }
+    
+    return h;
+}
+
+static void hist_free(shell_history_t *h) {
+    if (h == NULL) {
+        return;
+    }
+    if (h->logging) {
+        file_close(h->file);
+    }
+#ifndef SHELL_STREAM_FILES
+    if (h->map != NULL) {
+        munmap((void*)h->map, h->map_len);
+    }
+#endif
+    if (h->cap > 0) {
+        freemem(h->items, (uint32_t)h->cap * sizeof(shell_hist_t));
+        freemem(h->sigs, (uint32_t)h->cap * sizeof(uint64_t));
+        freemem(h->index, 2 * (uint32_t)h->cap * sizeof(shell_hist_slot_t));
+    }
+    buf_free(&h->added);
+    freemem(h, sizeof(shell_history_t));
+}
+
+static const char* hist_text(const shell_history_t *h, const shell_hist_t *e) {
+    if (e->off < h->map_len) {
+        return h->map + e->off;
+    }
+    return h->added.data + (e->off - h->map_len);
+}
+
+/* One bit for each pair of characters in text */
+static uint64_t hist_sig(const char *text, uint32_t len) {
+    uint64_t sig = 0;
+    uint32_t i, pair;
+    
+    for (i = 1; i < len; i++) {
+        pair = (uint32_t)(uint8_t)text[i - 1] << 8 | (uint8_t)text[i];
+        sig |= 1ULL << ((pair * 2654435761u) >> 26);
+    }
+    
+    return sig;
+}
+
+/* Where the entry added as seq is now; items stay in seq order */
+static int32_t hist_position(const shell_history_t *h, uint32_t seq) {
+    int32_t lo = 0, hi = h->count - 1, mid;
+    
+    while (lo <= hi) {
+        mid = lo + (hi - lo) / 2;
+        if (h->items[mid].seq == seq) {
+            return mid;
+        }
+        if (h->items[mid].seq < seq) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    
+    return SYSERR;
+}
+
+/*
+ * The bucket holding text, or the empty one it would go in. A command
+ * run again takes over its bucket, so buckets are never removed.
+ */
+static shell_hist_slot_t* hist_bucket(shell_history_t *h, const char *text,
+                                      uint32_t len, uint32_t hash) {
+    uint32_t mask = 2 * (uint32_t)h->cap - 1;
+    uint32_t b;
+    shell_hist_slot_t *slot;
+    const shell_hist_t *e;
+    
+    for (b = hash & mask; ; b = (b + 1) & mask) {
+        slot = &h->index[b];
+        if (slot->seq == 0) {
+            return slot;
+        }
+        if (slot->hash != hash) {
+            continue;
+        }
+        e = &h->items[hist_position(h, slot->seq)];
+        if (e->len == len && memcmp(hist_text(h, e), text, len) == 0) {
+            return slot;
+        }
+    }
+}
+
+/* Drop superseded items; seq order, and so the index, is unchanged */
+static void hist_compact(shell_history_t *h) {
+    int32_t i, j;
+    
+    if (h->dead == 0) {
+        return;
+    }
+    for (i = j = h->first_dead; i < h->count; i++) {
+        if (h->items[i].len != HIST_DEAD) {
+            h->items[j] = h->items[i];
+            h->sigs[j] = h->sigs[i];
+            j++;
+        }
+    }
+    h->count = j;
+    h->dead = 0;
+}
+
+/*
+ * Room for one more item. Dropping superseded ones makes it when they
+ * are at least half; otherwise the room doubles and the index is built
+ * again at twice its size.
+ */
+static bool hist_reserve(shell_history_t *h) {
+    shell_hist_t *items;
+    uint64_t *sigs;
+    shell_hist_slot_t *index;
+    int32_t cap = h->cap, i;
+    uint32_t mask, b;
+    
+    if (h->count < cap) {
+        return true;
+    }
+    hist_compact(h);
+    if (cap > 0 && h->count < cap / 2) {
+        return true;
+    }
+    if (cap > INT32_MAX / 2) {
+        return false;
+    }
+    cap = cap == 0 ? h->hint : 2 * cap;
+    
+    items = (shell_hist_t*)getmem((uint32_t)cap * sizeof(shell_hist_t));
+    sigs = (uint64_t*)getmem((uint32_t)cap * sizeof(uint64_t));
+    index = (shell_hist_slot_t*)getmem(2 * (uint32_t)cap *
+                                       sizeof(shell_hist_slot_t));
+    if (items == NULL || sigs == NULL || index == NULL) {
+        if (items != NULL) {
+            freemem(items, (uint32_t)cap * sizeof(shell_hist_t));
+        }
+        if (sigs != NULL) {
+            freemem(sigs, (uint32_t)cap * sizeof(uint64_t));
+        }
+        if (index != NULL) {
+            freemem(index, 2 * (uint32_t)cap * sizeof(shell_hist_slot_t));
+        }
+        return false;
+    }
+    
+    /* Every item is live and distinct, so each takes the first free bucket */
+    memset(index, 0, 2 * (uint32_t)cap * sizeof(shell_hist_slot_t));
+    mask = 2 * (uint32_t)cap - 1;
+    for (i = 0; i < h->count; i++) {
+        for (b = h->items[i].hash & mask; index[b].seq != 0; b = (b + 1) & mask)
+            ;
+        index[b].hash = h->items[i].hash;
+        index[b].seq = h->items[i].seq;
+    }
+    
+    if (h->cap > 0) {
+        memcpy(items, h->items, (uint32_t)h->count * sizeof(shell_hist_t));
+        memcpy(sigs, h->sigs, (uint32_t)h->count * sizeof(uint64_t));
+        freemem(h->items, (uint32_t)h->cap * sizeof(shell_hist_t));
+        freemem(h->sigs, (uint32_t)h->cap * sizeof(uint64_t));
+        freemem(h->index, 2 * (uint32_t)h->cap * sizeof(shell_hist_slot_t));
+    }
+    h->items = items;
+    h->sigs = sigs;
+    h->index = index;
+    h->cap = cap;
+    
+    return true;
+}
+
+/* Add text at off as the newest entry, superseding an equal one */
+static bool hist_insert(shell_history_t *h, const char *text, uint32_t off,
+                        uint32_t len, uint32_t hash, uint32_t time,
+                        uint64_t sig) {
+    shell_hist_slot_t *slot;
+    shell_hist_t *e;
+    int32_t pos;
+    
+    if (!hist_reserve(h)) {
+        return false;
+    }
+    
+    slot = hist_bucket(h, text, len, hash);
+    if (slot->seq != 0) {
+        pos = hist_position(h, slot->seq);
+        h->items[pos].len = HIST_DEAD;
+        if (h->dead == 0 || pos < h->first_dead) {
+            h->first_dead = pos;
+        }
+        h->dead++;
+    }
+    
+    e = &h->items[h->count];
+    e->off = off;
+    e->len = len;
+    e->hash = hash;
+    e->time = time;
+    e->seq = ++h->seq;
+    h->sigs[h->count] = sig;
+    h->count++;
+    slot->hash = hash;
+    slot->seq = e->seq;
+    
+    return true;
+}
+
+/*
+ * Index the records of a log read into data. Only headers are read;
+ * text is looked at when hashes match. Returns the bytes holding whole
+ * records and counts them in records.
+ */
+static uint32_t hist_load(shell_history_t *h, const char *data, uint32_t size,
+                          int32_t *records) {
+    uint32_t p = HIST_MAGIC_LEN, hash, time, len;
+    uint64_t sig;
+    
+    *records = 0;
+    while (size - p >= HIST_HEADER) {
+        memcpy(&hash, data + p, 4);
+        memcpy(&time, data + p + 4, 4);
+        memcpy(&len, data + p + 8, 4);
+        memcpy(&sig, data + p + 12, 8);
+        if (len >= size - p - HIST_HEADER ||
+            data[p + HIST_HEADER + len] != '\0') {
             break;
         }
-        
-        /* Execute command */
-        shell_execute(line);
+        if (!hist_insert(h, data + p + HIST_HEADER, p + HIST_HEADER, len,
+                         hash, time, sig)) {
+            break;
+        }
+        (*records)++;
+        p += HIST_HEADER + len + 1;
     }
+    hist_compact(h);
+    
+    return p;
 }
 
-void shell_start(void) {
-    shell_run();
+static bool hist_write(file_handle_t file, const char *text, uint32_t len,
+                       uint32_t hash, uint32_t time, uint64_t sig) {
+    char header[HIST_HEADER];
+    
+    memcpy(header, &hash, 4);
+    memcpy(header + 4, &time, 4);
+    memcpy(header + 8, &len, 4);
+    memcpy(header + 12, &sig, 8);
+    return (uint32_t)file_write(file, header, HIST_HEADER) == HIST_HEADER &&
+           (uint32_t)file_write(file, text, len + 1) == len + 1;
 }
 
-void shell_process(void) {
-    shell_run();
+/* Write the log afresh, one record per entry */
+static bool hist_rewrite(shell_history_t *h) {
+    file_handle_t file;
+    const shell_hist_t *e;
+    int32_t i;
+    bool ok;
+#ifdef SHELL_STREAM_FILES
+    /* The old log was read whole, so it can be written over */
+    file = file_create(h->path, false);
+#else
+    char temp[SHELL_MAX_PATH + 8];
+    
+    /* The old log stays mapped; renaming over it leaves its pages be */
+    snprintf(temp, sizeof(temp), "%s.new", h->path);
+    file = file_create(temp, false);
+#endif
+    if (file == FILE_INVALID) {
+        return false;
+    }
+    
+    ok = (uint32_t)file_write(file, HIST_MAGIC, HIST_MAGIC_LEN) == HIST_MAGIC_LEN;
+    for (i = 0; ok && i < h->count; i++) {
+        e = &h->items[i];
+        ok = hist_write(file, hist_text(h, e), e->len, e->hash, e->time,
+                        h->sigs[i]);
+    }
+    file_close(file);
+#ifndef SHELL_STREAM_FILES
+    ok = ok && rename(temp, h->path) == 0;
+    if (!ok) {
+        remove(temp);
+    }
+#endif
+    
+    return ok;
 }
 
-void shell_exit(int status) {
-    shell_state.running = false;
-    shell_state.last_exit = status;
+/* Append to the log from here on, writing it afresh first if asked */
+static int hist_attach(shell_history_t *h, bool rewrite) {
+    if (rewrite && !hist_rewrite(h)) {
+        shell_error("%s: cannot write history\n", h->path);
+        return SYSERR;
+    }
+    
+    h->file = file_create(h->path, true);
+    if (h->file == FILE_INVALID) {
+        shell_error("%s: cannot append, history kept in memory\n", h->path);
+        return SYSERR;
+    }
+    h->logging = true;
+    
+    return OK;
 }
 
+/*
+ * Load the log at path and append commands to it from now on; NULL
+ * keeps the history in memory. Starting takes one pass over the record
+ * headers. A log half of whose records are superseded, or whose last
+ * record was cut short, is written afresh.
+ */
+int shell_history_open(const char *path) {
+    shell_context_t *sh = shell_self();
+    shell_history_t *h;
+    const char *data;
+    uint32_t size, valid = 0;
+    int32_t records = 0;
+#ifdef SHELL_STREAM_FILES
+    file_handle_t file;
+    int32_t n;
+#else
+    struct stat st;
+    FILE *file;
+    void *map;
+    bool unread = false;
+#endif
+    
+    hist_free(sh->history);
+    sh->history = NULL;
+    if (path == NULL) {
+        return OK;
+    }
+    if (strlen(path) >= SHELL_MAX_PATH) {
+        shell_error("%s: name too long\n", path);
+        return SYSERR;
+    }
+    h = hist_self();
+    if (h == NULL) {
+        shell_error("out of memory\n");
+        return SYSERR;
+    }
+    strcpy(h->path, path);
+    
+#ifdef SHELL_STREAM_FILES
+    file = file_open(path);
+    if (file != FILE_INVALID) {
+        while (buf_reserve(&h->added, SHELL_BATCH_CHUNK)) {
+            n = file_read(file, h->added.data + h->added.len,
+                          h->added.cap - h->added.len - 1);
+            if (n <= 0) {
+                break;
+            }
+            h->added.len += n;
+        }
+        h->added.data[h->added.len] = '\0';
+        file_close(file);
+    }
+    data = h->added.data;
+    size = h->added.len;
+    if (h->added.failed) {
+        shell_error("%s: cannot read\n", path);
+        hist_free(h);
+        sh->history = NULL;
+        return SYSERR;
+    }
+#else
+    file = fopen(path, "rb");
+    if (file != NULL) {
+        if (fstat(fileno(file), &st) != 0) {
+            unread = true;
+        } else if (st.st_size > 0) {
+            map = MAP_FAILED;
+            if ((uint64_t)st.st_size < UINT32_MAX) {
+                map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                           fileno(file), 0);
+            }
+            if (map != MAP_FAILED) {
+                h->map = (const char*)map;
+                h->map_len = (uint32_t)st.st_size;
+            } else {
+                unread = true;
+            }
+        }
+        fclose(file);
+    }
+    data = h->map;
+    size = h->map_len;
+    if (unread) {
+        shell_error("%s: cannot read\n", path);
+        hist_free(h);
+        sh->history = NULL;
+        return SYSERR;
+    }
+#endif
+    
+    /* Leave alone what cannot be read or was not written here */
+    if (size > 0 && (size < HIST_MAGIC_LEN ||
+                     memcmp(data, HIST_MAGIC, HIST_MAGIC_LEN) != 0)) {
+        shell_error("%s: not a history log\n", path);
+        hist_free(h);
+        sh->history = NULL;
+        return SYSERR;
+    }
+    
+    if (size > 0) {
+        /* Room for records of a typical length; more only if shorter */
+        while (h->hint < INT32_MAX / 2 &&
+               (uint32_t)h->hint < size / (HIST_HEADER + 32)) {
+            h->hint *= 2;
+        }
+        valid = hist_load(h, data, size, &records);
+    }
+    
+    return hist_attach(h, size == 0 || valid < size ||
+                       (records - h->count > h->count &&
+                        records - h->count >= SHELL_HISTORY_SIZE));
+}
 
 void shell_history_add(const char *cmd) {
-    if (cmd == NULL || *cmd == '\0') {
+    shell_history_t *h;
+    const shell_hist_t *last;
+    uint32_t len, hash, time, off;
+    uint64_t sig;
+    
+    if (cmd == NULL || *cmd == '\0' || (h = hist_self()) == NULL) {
         return;
     }
+    len = (uint32_t)strlen(cmd);
+    hash = shell_hash(cmd);
     
-    if (shell_state.history_count > 0) {
-        int last = (shell_state.history_index - 1 + SHELL_HISTORY_SIZE) % 
-                   SHELL_HISTORY_SIZE;
-        if (strcmp(shell_state.history[last].command, cmd) == 0) {
+    /* Running the newest again changes nothing; it is never superseded */
+    if (h->count > 0) {
+        last = &h->items[h->count - 1];
+        if (last->hash == hash && last->len == len &&
+            memcmp(hist_text(h, last), cmd, len) == 0) {
             return;
         }
     }
     
-    strncpy(shell_state.history[shell_state.history_index].command, 
-            cmd, SHELL_MAX_LINE - 1);
-    shell_state.history[shell_state.history_index].number = 
-        shell_state.history_count;
+    off = h->added.len;
+    buf_put(&h->added, cmd, len + 1);
+    if (h->added.failed || off > UINT32_MAX - h->map_len) {
+        return;
+    }
+    time = hist_now();
+    sig = hist_sig(cmd, len);
+    if (!hist_insert(h, h->added.data + off, h->map_len + off, len, hash,
+                     time, sig)) {
+        return;
+    }
+    
+    if (h->logging) {
+        hist_write(h->file, cmd, len, hash, time, sig);
+        file_flush(h->file);
+    }
+}
+
+/* The history with entries numbered from 0, or NULL if there is none */
+static shell_history_t* hist_view(void) {
+    shell_history_t *h = shell_self()->history;
     
-    shell_state.history_index = (shell_state.history_index + 1) % SHELL_HISTORY_SIZE;
-    if (shell_state.history_count < SHELL_HISTORY_SIZE) {
-        shell_state.history_count++;
+    if (h != NULL) {
+        hist_compact(h);
     }
+    
+    return h;
 }
 
 char* shell_history_get(int index) {
-    if (index < 0 || index >= shell_state.history_count) {
+    shell_history_t *h = hist_view();
+    
+    if (h == NULL || index < 0 || index >= h->count) {
         return NULL;
     }
     
-    int actual = (shell_state.history_index - shell_state.history_count + 
-                  index + SHELL_HISTORY_SIZE) % SHELL_HISTORY_SIZE;
-    return shell_state.history[actual].command;
+    return (char*)hist_text(h, &h->items[index]);
+}
+
+int shell_history_count(void) {
+    shell_history_t *h = hist_view();
+    
+    return h != NULL ? h->count : 0;
+}
+
+/* When the entry was last run, or 0 if there is none */
+uint32_t shell_history_time(int index) {
+    shell_history_t *h = hist_view();
+    
+    if (h == NULL || index < 0 || index >= h->count) {
+        return 0;
+    }
+    
+    return h->items[index].time;
+}
+
+/*
+ * The newest entry older than before that contains text, or starts with
+ * it when prefix is set; SYSERR if none does. Entries whose character
+ * pairs lack the pattern's are passed over without reading their text.
+ */
+int shell_history_search(const char *text, int before, bool prefix) {
+    shell_history_t *h = hist_view();
+    const shell_hist_t *e;
+    const char *s;
+    uint64_t want;
+    uint32_t len;
+    int32_t i;
+    
+    if (h == NULL || text == NULL) {
+        return SYSERR;
+    }
+    if (before < 0 || before > h->count) {
+        before = h->count;
+    }
+    len = (uint32_t)strlen(text);
+    want = hist_sig(text, len);
+    
+    for (i = before - 1; i >= 0; i--) {
+        if ((h->sigs[i] & want) != want) {
+            continue;
+        }
+        e = &h->items[i];
+        s = hist_text(h, e);
+        if (e->len < len) {
+            continue;
+        }
+        if (prefix ? memcmp(s, text, len) == 0 : strstr(s, text) != NULL) {
+            return i;
+        }
+    }
+    
+    return SYSERR;
 }
 
+/* Forget every entry, starting the log afresh if there is one */
 void shell_history_clear(void) {
-    shell_state.history_count = 0;
-    shell_state.history_index = 0;
+    shell_context_t *sh = shell_self();
+    shell_history_t *h = sh->history;
+    char path[SHELL_MAX_PATH];
+    bool logging;
+    
+    if (h == NULL) {
+        return;
+    }
+    logging = h->logging;
+    strcpy(path, h->path);
+    hist_free(h);
+    sh->history = NULL;
+    
+    if (logging && (h = hist_self()) != NULL) {
+        strcpy(h->path, path);
+        hist_attach(h, true);
+    }
+}
+
+/* Heap bytes the history holds, and the bytes of log mapped */
+static void hist_stats(const shell_history_t *h, uint32_t *bytes,
+                       uint32_t *mapped) {
+    *bytes = *mapped = 0;
+    if (h == NULL) {
+        return;
+    }
+    *bytes = (uint32_t)sizeof(shell_history_t) +
+             (uint32_t)h->cap * (sizeof(shell_hist_t) + sizeof(uint64_t) +
+                                 2 * sizeof(shell_hist_slot_t));
+    if (h->added.heap) {
+        *bytes += h->added.cap;
+    }
+    *mapped = h->map_len;
+}
+
+static void history_show(int index, bool times) {
+    char stamp[32];
+#ifndef XINU_KERNEL
+    time_t t = (time_t)shell_history_time(index);
+#endif
+    
+    if (!times) {
+        shell_printf("%5d  %s\n", index + 1, shell_history_get(index));
+        return;
+    }
+#ifdef XINU_KERNEL
+    snprintf(stamp, sizeof(stamp), "+%us", shell_history_time(index));
+#else
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&t));
+#endif
+    shell_printf("%5d  %s  %s\n", index + 1, stamp, shell_history_get(index));
 }
 
 void shell_history_list(void) {
-    int i;
-    for (i = 0; i < shell_state.history_count; i++) {
-        char *cmd = shell_history_get(i);
-        if (cmd != NULL) {
-            shell_printf("%5d  %s\n", i + 1, cmd);
-        }
+    int i, count = shell_history_count();
+    
+    for (i = 0; i < count; i++) {
+        history_show(i, false);
     }
 }
 
 
 int shell_alias_set(const char *name, const char *value) {
-    int i;
+    shell_alias_t *alias = (shell_alias_t*)table_add(&shell_self()->aliases,
+                                                     name);
+    
+    if (alias == NULL) {
+        return SYSERR;
+    }
+    
+    strncpy(alias->value, value, SHELL_MAX_LINE - 1);
+    alias->defined = true;
+    
+    return OK;
+}
+
+char* shell_alias_get(const char *name) {
+    shell_alias_t *alias = (shell_alias_t*)table_find(&shell_self()->aliases,
+                                                      name);
+    
+    return alias != NULL ? alias->value : NULL;
+}
+
+int shell_alias_remove(const char *name) {
+    return table_remove(&shell_self()->aliases, name);
+}
+
+void shell_alias_list(void) {
+    shell_table_t *t = &shell_self()->aliases;
+    shell_alias_t *alias;
+    int32_t i;
+    
+    for (i = 0; i < t->count; i++) {
+        if ((alias = (shell_alias_t*)t->items[i]) != NULL) {
+            shell_printf("alias %s='%s'\n", alias->name, alias->value);
+        }
+    }
+}
+
+
+/*
+ * Variables live in a shared store, so scripts attached to it read the
+ * exported ones where they are kept
+ */
+script_env_t* shell_env(void) {
+    shell_context_t *sh = shell_self();
+    
+    if (sh->env == NULL) {
+        sh->env = script_env_create();
+    }
+    
+    return sh->env;
+}
+
+char* shell_getenv(const char *name) {
+    return (char*)script_env_get(shell_self()->env, name);
+}
+
+int shell_setenv(const char *name, const char *value) {
+    return script_env_set(shell_env(), name, value);
+}
+
+int shell_unsetenv(const char *name) {
+    return script_env_unset(shell_self()->env, name);
+}
+
+/* Every variable, or the exported ones only */
+static void shell_env_list(bool exported) {
+    const char *name, *value;
+    bool flag;
+    int32_t i = 0;
     
-    for (i = 0; i < SHELL_MAX_ALIAS; i++) {
-        if (shell_state.aliases[i].defined &&
-            strcmp(shell_state.aliases[i].name, name) == 0) {
-            strncpy(shell_state.aliases[i].value, value, SHELL_MAX_LINE - 1);
-            return OK;
+    while ((i = script_env_next(shell_self()->env, i, &name, &value,
+                                &flag)) != SYSERR) {
+        if (flag || !exported) {
+            shell_printf("%s=%s\n", name, value);
         }
     }
+}
+
+static void jobs_init(shell_context_t *sh) {
+#if defined(SHELL_PIPE_THREADS)
+    pthread_mutex_init(&sh->jobs_lock, NULL);
+    pthread_cond_init(&sh->jobs_changed, NULL);
+#elif defined(SHELL_PIPE_PROCS)
+    sh->jobs_lock = semcreate(1);
+#endif
+    sh->job_pid = NPROC;
+    sh->jobs_ready = true;
+}
+
+/* A free id and its slot, growing the table when all are in use */
+static shell_slot_t* job_alloc(shell_context_t *sh) {
+    shell_slot_t **jobs;
+    shell_slot_t *slot;
+    int cap, i;
+    
+    slot = (shell_slot_t*)getmem(sizeof(shell_slot_t));
+    if (slot == NULL) {
+        return NULL;
+    }
+    memset(slot, 0, sizeof(shell_slot_t));
+    slot->sh = sh;
+#ifdef SHELL_PIPE_PROCS
+    slot->done = semcreate(0);
+    if (slot->done == SYSERR) {
+        freemem(slot, sizeof(shell_slot_t));
+        return NULL;
+    }
+#endif
     
-    for (i = 0; i < SHELL_MAX_ALIAS; i++) {
-        if (!shell_state.aliases[i].defined) {
-            shell_state.aliases[i].defined = true;
-            strncpy(shell_state.aliases[i].name, name, SHELL_MAX_CMD - 1);
-            strncpy(shell_state.aliases[i].value, value, SHELL_MAX_LINE - 1);
-            shell_state.alias_count++;
-            return OK;
+    jobs_lock(sh);
+    for (i = 0; i < sh->job_cap && sh->jobs[i] != NULL; i++) {
+        ;
+    }
+    if (i == sh->job_cap) {
+        cap = sh->job_cap > 0 ? 2 * sh->job_cap : SHELL_JOBS_MIN;
+        jobs = (shell_slot_t**)getmem(cap * sizeof(shell_slot_t*));
+        if (jobs == NULL) {
+            jobs_unlock(sh);
+#ifdef SHELL_PIPE_PROCS
+            semdelete(slot->done);
+#endif
+            freemem(slot, sizeof(shell_slot_t));
+            return NULL;
         }
+        memset(jobs, 0, cap * sizeof(shell_slot_t*));
+        if (sh->job_cap > 0) {
+            memcpy(jobs, sh->jobs, sh->job_cap * sizeof(shell_slot_t*));
+            freemem(sh->jobs, sh->job_cap * sizeof(shell_slot_t*));
+        }
+        sh->jobs = jobs;
+        sh->job_cap = cap;
     }
+    sh->jobs[i] = slot;
+    sh->job_count++;
+    sh->job_last = i + 1;
+    jobs_unlock(sh);
     
-    return SYSERR;
+    slot->job.id = i + 1;
+    slot->job.state = JOB_RUNNING;
+    
+    return slot;
 }
 
-char* shell_alias_get(const char *name) {
-    int i;
+static void job_free(shell_context_t *sh, shell_slot_t *slot) {
+    jobs_lock(sh);
+    sh->jobs[slot->job.id - 1] = NULL;
+    sh->job_count--;
+    jobs_unlock(sh);
+    
+#ifdef SHELL_PIPE_PROCS
+    semdelete(slot->done);
+#endif
+    if (slot->tokens != NULL) {
+        freemem(slot->tokens, slot->bytes);
+    }
+    freemem(slot, sizeof(shell_slot_t));
+}
+
+/* Record the outcome and hand the job to the reaper; wakes any waiter */
+static void job_finish(shell_slot_t *slot, job_state_t state, int status) {
+    shell_context_t *sh = slot->sh;
+    
+    jobs_lock(sh);
+    if (!slot->finished) {
+        slot->finished = true;
+        slot->job.state = state;
+        slot->job.status = status;
+        slot->next_done = sh->jobs_done;
+        sh->jobs_done = slot;
+    }
+#if defined(SHELL_PIPE_THREADS)
+    pthread_cond_broadcast(&sh->jobs_changed);
+#elif defined(SHELL_PIPE_PROCS)
+    signal(slot->done);
+#endif
+    jobs_unlock(sh);
+}
+
+static int shell_execute_list(shell_token_t *tokens, int count);
+
+/* Body of a background job, on its own thread or process */
+static void job_run(shell_slot_t *slot) {
+    shell_context_t *prev;
+    int status;
+    
+    prev = shell_bind_context(slot->sub);
+    slot->root.outer = NULL;
+    slot->root.in_file = FILE_INVALID;
+    slot->root.started = true;
+    slot->root.job = slot;
+    shell_stage = &slot->root;
+    
+    status = shell_execute_list(slot->tokens, slot->count);
+    if (slot->exited) {
+        status = slot->job.status;
+    }
+    
+    shell_stage = NULL;
+    shell_subshell_free(slot->sub);
+    slot->sub = NULL;
+    shell_bind_context(prev);
+    job_finish(slot, slot->killed ? JOB_KILLED : JOB_DONE, status);
+}
+
+#if defined(SHELL_PIPE_THREADS)
+static void* job_main(void *arg) {
+    job_run((shell_slot_t*)arg);
+    return NULL;
+}
+
+static int job_start(shell_slot_t *slot) {
+    slot->job.pid = slot->sh->job_pid++;
+    return pthread_create(&slot->thread, NULL, job_main, slot) == 0 ?
+           OK : SYSERR;
+}
+#elif defined(SHELL_PIPE_PROCS)
+static process job_main(shell_slot_t *slot) {
+    job_run(slot);
+    shell_bind_context(NULL);
+    return OK;
+}
+
+static int job_start(shell_slot_t *slot) {
+    pid32 pid = create((void*)job_main, SHELL_STAGE_STACK, getprio(getpid()),
+                       "job", 1, slot);
+    
+    if (pid == SYSERR) {
+        return SYSERR;
+    }
+    slot->job.pid = pid;
+    resume(pid);
+    return OK;
+}
+#else
+/* Nothing to run it alongside: the job is done before the prompt */
+static int job_start(shell_slot_t *slot) {
+    slot->job.pid = slot->sh->job_pid++;
+    job_run(slot);
+    return OK;
+}
+#endif
+
+/*
+ * Run tokens[0..count) in the background. The words are copied with
+ * the tokens, so the caller's buffers may go. Returns the job id.
+ */
+static int shell_job_spawn(shell_token_t *tokens, int count) {
+    shell_context_t *sh = shell_self();
+    shell_slot_t *slot;
+    uint32_t bytes = (count + 1) * sizeof(shell_token_t);
+    char *text;
+    int shown = 0;
+    int i, n;
+    
+    for (i = 0; i < count; i++) {
+        if (tokens[i].type == TOK_WORD) {
+            bytes += tokens[i].length + 1;
+        }
+    }
+    slot = job_alloc(sh);
+    if (slot == NULL) {
+        return SYSERR;
+    }
+    slot->tokens = (shell_token_t*)getmem(bytes);
+    if (slot->tokens == NULL) {
+        job_free(sh, slot);
+        return SYSERR;
+    }
+    slot->bytes = bytes;
+    text = (char*)(slot->tokens + count + 1);
     
-    for (i = 0; i < SHELL_MAX_ALIAS; i++) {
-        if (shell_state.aliases[i].defined &&
-            strcmp(shell_state.aliases[i].name, name) == 0) {
-            return shell_state.aliases[i].value;
+    for (i = 0; i < count; i++) {
+        slot->tokens[i] = tokens[i];
+        if (tokens[i].type == TOK_WORD) {
+            n = tokens[i].length + 1;
+            memcpy(text, tokens[i].value, n);
+            slot->tokens[i].value = text;
+            text += n;
+        }
+        
+        /* What jobs shows; near enough to what was typed */
+        if (shown < SHELL_MAX_LINE - 1) {
+            n = snprintf(slot->job.command + shown, SHELL_MAX_LINE - shown,
+                         "%s%s", i > 0 ? " " : "",
+                         tokens[i].type == TOK_WORD ? tokens[i].value :
+                         shell_token_names[tokens[i].type]);
+            shown = n < SHELL_MAX_LINE - shown ? shown + n :
+                                                 SHELL_MAX_LINE - 1;
         }
     }
+    memset(&slot->tokens[count], 0, sizeof(shell_token_t));
+    slot->tokens[count].type = TOK_EOF;
+    slot->count = count + 1;
+    slot->runs = true;
+    
+    /* A subshell, as for sh's &: what the job sets stays in the job */
+    slot->sub = shell_subshell(sh);
+    if (slot->sub == NULL) {
+        job_free(sh, slot);
+        return SYSERR;
+    }
+    if (job_start(slot) != OK) {
+        shell_subshell_free(slot->sub);
+        job_free(sh, slot);
+        return SYSERR;
+    }
     
-    return NULL;
+    return slot->job.id;
 }
 
-int shell_alias_remove(const char *name) {
-    int i;
+/* Track a process started elsewhere; shell_job_update() reports its end */
+int shell_job_create(pid32 pid, const char *command, bool foreground) {
+    shell_slot_t *slot = job_alloc(shell_self());
     
-    for (i = 0; i < SHELL_MAX_ALIAS; i++) {
-        if (shell_state.aliases[i].defined &&
-            strcmp(shell_state.aliases[i].name, name) == 0) {
-            shell_state.aliases[i].defined = false;
-            shell_state.alias_count--;
-            return OK;
-        }
+    if (slot == NULL) {
+        return SYSERR;
     }
     
-    return SYSERR;
+    slot->job.pid = pid;
+    slot->job.pgid = pid;
+    strncpy(slot->job.command, command, SHELL_MAX_LINE - 1);
+    slot->job.foreground = foreground;
+    
+    return slot->job.id;
 }
 
-void shell_alias_list(void) {
-    int i;
+void shell_job_update(int id, job_state_t state) {
+    shell_slot_t *slot = (shell_slot_t*)shell_job_find(id);
     
-    for (i = 0; i < SHELL_MAX_ALIAS; i++) {
-        if (shell_state.aliases[i].defined) {
-            shell_printf("alias %s='%s'\n", 
-                        shell_state.aliases[i].name,
-                        shell_state.aliases[i].value);
-        }
+    if (slot == NULL) {
+        return;
+    }
+    
+    if (state == JOB_DONE || state == JOB_KILLED) {
+        job_finish(slot, state, slot->job.status);
+    } else {
+        slot->job.state = state;
     }
 }
 
-
-static struct {
-    char name[64];
-    char value[256];
-    bool defined;
-} shell_env[64];
-
-char* shell_getenv(const char *name) {
-    int i;
+shell_job_t* shell_job_find(int id) {
+    shell_context_t *sh = shell_self();
+    shell_slot_t *slot = NULL;
     
-    for (i = 0; i < 64; i++) {
-        if (shell_env[i].defined && strcmp(shell_env[i].name, name) == 0) {
-            return shell_env[i].value;
-        }
+    jobs_lock(sh);
+    if (id > 0 && id <= sh->job_cap) {
+        slot = sh->jobs[id - 1];
     }
+    jobs_unlock(sh);
     
-    return NULL;
+    return slot != NULL ? &slot->job : NULL;
 }
 
-int shell_setenv(const char *name, const char *value) {
+shell_job_t* shell_job_find_by_pid(pid32 pid) {
+    shell_context_t *sh = shell_self();
+    shell_job_t *job = NULL;
     int i;
-
-    for (i = 0; i < 64; i++) {
-        if (shell_env[i].defined && strcmp(shell_env[i].name, name) == 0) {
-            strncpy(shell_env[i].value, value, 255);
-            return OK;
-        }
-    }
     
-    for (i = 0; i < 64; i++) {
-        if (!shell_env[i].defined) {
-            shell_env[i].defined = true;
-            strncpy(shell_env[i].name, name, 63);
-            strncpy(shell_env[i].value, value, 255);
-            return OK;
+    jobs_lock(sh);
+    for (i = 0; i < sh->job_cap && job == NULL; i++) {
+        if (sh->jobs[i] != NULL && sh->jobs[i]->job.pid == pid) {
+            job = &sh->jobs[i]->job;
         }
     }
+    jobs_unlock(sh);
     
-    return SYSERR;
+    return job;
 }
 
-int shell_unsetenv(const char *name) {
-    int i;
+/* Sleep until the job finishes; nothing runs on this thread meanwhile */
+int shell_wait_job(int id) {
+    shell_slot_t *slot = (shell_slot_t*)shell_job_find(id);
+    shell_context_t *sh = shell_self();
     
-    for (i = 0; i < 64; i++) {
-        if (shell_env[i].defined && strcmp(shell_env[i].name, name) == 0) {
-            shell_env[i].defined = false;
-            return OK;
-        }
+    if (slot == NULL) {
+        return SYSERR;
     }
     
-    return SYSERR;
+#if defined(SHELL_PIPE_THREADS)
+    jobs_lock(sh);
+    while (!slot->finished) {
+        pthread_cond_wait(&sh->jobs_changed, &sh->jobs_lock);
+    }
+    jobs_unlock(sh);
+#elif defined(SHELL_PIPE_PROCS)
+    /* Take the signal and put it back for any other waiter */
+    wait(slot->done);
+    signal(slot->done);
+#else
+    (void)sh;
+#endif
+    
+    return OK;
 }
 
-int shell_job_create(pid32 pid, const char *command, bool foreground) {
-    int i;
+/*
+ * Wait for, before freeing, every job that has finished since the last
+ * call, announcing each when report is set. Only the list of finished
+ * jobs is walked, never the whole table.
+ */
+void shell_jobs_reap(bool report) {
+    shell_context_t *sh = shell_self();
+    shell_slot_t *slot, *next;
     
-    for (i = 0; i < 32; i++) {
-        if (shell_jobs[i].state == JOB_DONE || shell_jobs[i].id == 0) {
-            shell_jobs[i].id = i + 1;
-            shell_jobs[i].pid = pid;
-            shell_jobs[i].pgid = pid;
-            shell_jobs[i].state = JOB_RUNNING;
-            strncpy(shell_jobs[i].command, command, SHELL_MAX_LINE - 1);
-            shell_jobs[i].foreground = foreground;
-            shell_job_count++;
-            return shell_jobs[i].id;
-        }
+    if (!sh->jobs_ready) {
+        return;
     }
     
-    return SYSERR;
-}
-
-void shell_job_update(int id, job_state_t state) {
-    int i;
+    jobs_lock(sh);
+    slot = sh->jobs_done;
+    sh->jobs_done = NULL;
+    jobs_unlock(sh);
     
-    for (i = 0; i < 32; i++) {
-        if (shell_jobs[i].id == id) {
-            shell_jobs[i].state = state;
-            return;
+    for (; slot != NULL; slot = next) {
+        next = slot->next_done;
+#ifdef SHELL_PIPE_THREADS
+        if (slot->runs) {
+            pthread_join(slot->thread, NULL);
+        }
+#endif
+        if (report) {
+            shell_printf("[%d]  %s\t\t%s\n", slot->job.id,
+                         slot->job.state == JOB_KILLED ? "Killed" : "Done",
+                         slot->job.command);
         }
+        job_free(sh, slot);
     }
 }
 
-shell_job_t* shell_job_find(int id) {
-    int i;
+/* Ask a job to stop; it does at its next command or sleep */
+static int shell_job_kill(shell_job_t *job) {
+    shell_slot_t *slot = (shell_slot_t*)job;
+    shell_context_t *sh = shell_self();
     
-    for (i = 0; i < 32; i++) {
-        if (shell_jobs[i].id == id) {
-            return &shell_jobs[i];
-        }
+    if (!slot->runs) {
+        return kill(job->pid);
     }
     
-    return NULL;
+    jobs_lock(sh);
+    slot->killed = true;
+    slot->cancel = true;
+#ifdef SHELL_PIPE_THREADS
+    pthread_cond_broadcast(&sh->jobs_changed);
+#endif
+    jobs_unlock(sh);
+    
+    return OK;
 }
 
-shell_job_t* shell_job_find_by_pid(pid32 pid) {
-    int i;
+/*
+ * Sleep ms. On threads a background job's sleep waits on the jobs
+ * condition, so kill ends it early.
+ */
+static void shell_pause(uint32_t ms) {
+#ifdef SHELL_PIPE_THREADS
+    shell_slot_t *slot = shell_current_job();
+    shell_context_t *sh;
+    struct timespec until;
     
-    for (i = 0; i < 32; i++) {
-        if (shell_jobs[i].pid == pid) {
-            return &shell_jobs[i];
+    if (slot != NULL) {
+        /* kill signals the shell that owns the job, not the copy it runs in */
+        sh = slot->sh;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += ms / 1000;
+        until.tv_nsec += (long)(ms % 1000) * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        
+        jobs_lock(sh);
+        while (!slot->cancel &&
+               pthread_cond_timedwait(&sh->jobs_changed, &sh->jobs_lock,
+                                      &until) == 0) {
+            ;
         }
+        jobs_unlock(sh);
+        return;
     }
-    
-    return NULL;
+#endif
+    sleep(ms);
 }
 
-int shell_wait_job(int id) {
-    shell_job_t *job = shell_job_find(id);
-    if (job == NULL) {
-        return SYSERR;
+/* Stop every job, wait for them all, and drop the table */
+static void shell_jobs_release(shell_context_t *sh) {
+    shell_context_t *prev;
+    int i;
+    
+    if (!sh->jobs_ready) {
+        return;
     }
     
-    while (job->state == JOB_RUNNING) {
-        yield();
+    prev = shell_bind_context(sh);
+    for (i = 0; i < sh->job_cap; i++) {
+        if (sh->jobs[i] != NULL && sh->jobs[i]->runs) {
+            shell_job_kill(&sh->jobs[i]->job);
+            shell_wait_job(i + 1);
+        }
+    }
+    shell_jobs_reap(false);
+    for (i = 0; i < sh->job_cap; i++) {
+        if (sh->jobs[i] != NULL) {
+            job_free(sh, sh->jobs[i]);
+        }
     }
+    shell_bind_context(prev);
     
-    return OK;
+    if (sh->job_cap > 0) {
+        freemem(sh->jobs, sh->job_cap * sizeof(shell_slot_t*));
+    }
+#if defined(SHELL_PIPE_THREADS)
+    pthread_mutex_destroy(&sh->jobs_lock);
+    pthread_cond_destroy(&sh->jobs_changed);
+#elif defined(SHELL_PIPE_PROCS)
+    semdelete(sh->jobs_lock);
+#endif
+    sh->jobs = NULL;
+    sh->job_cap = 0;
+    sh->jobs_ready = false;
 }
 
 int shell_bg(pid32 pid) {
@@ -715,35 +4201,48 @@ int shell_fg(pid32 pid) {
 }
 
 void shell_jobs_list(void) {
-    int i;
+    shell_context_t *sh = shell_self();
+    shell_job_t job;
     const char *state_str;
+    bool found;
+    int i;
     
-    for (i = 0; i < 32; i++) {
-        if (shell_jobs[i].id > 0 && shell_jobs[i].state != JOB_DONE) {
-            switch (shell_jobs[i].state) {
-                case JOB_RUNNING: state_str = "Running"; break;
-                case JOB_STOPPED: state_str = "Stopped"; break;
-                case JOB_DONE:    state_str = "Done"; break;
-                case JOB_KILLED:  state_str = "Killed"; break;
-                default:          state_str = "Unknown"; break;
-            }
-            shell_printf("[%d]  %s\t\t%s\n", shell_jobs[i].id, 
-                        state_str, shell_jobs[i].command);
+    /* Print from a copy: output may block, and jobs need the lock to end */
+    for (i = 0; i < sh->job_cap; i++) {
+        jobs_lock(sh);
+        found = i < sh->job_cap && sh->jobs[i] != NULL;
+        if (found) {
+            job = sh->jobs[i]->job;
+        }
+        jobs_unlock(sh);
+        if (!found) {
+            continue;
+        }
+        
+        switch (job.state) {
+            case JOB_RUNNING: state_str = "Running"; break;
+            case JOB_STOPPED: state_str = "Stopped"; break;
+            case JOB_DONE:    state_str = "Done"; break;
+            case JOB_KILLED:  state_str = "Killed"; break;
+            default:          state_str = "Unknown"; break;
         }
+        shell_printf("[%d]  %s\t\t%s\n", job.id, state_str, job.command);
     }
 }
 
 
 
 static int cmd_help(int argc, char **argv) {
+    shell_table_t *t = &shell_self()->commands;
+    shell_command_t *cmd;
     int i;
     
     shell_printf("Xinu Shell - Built-in Commands:\n\n");
     
-    for (i = 0; i < shell_command_count; i++) {
-        shell_printf("  %-12s - %s\n", 
-                    shell_commands[i].name,
-                    shell_commands[i].description);
+    for (i = 0; i < t->count; i++) {
+        if ((cmd = (shell_command_t*)t->items[i]) != NULL) {
+            shell_printf("  %-12s - %s\n", cmd->name, cmd->description);
+        }
     }
     
     shell_printf("\nFor more information, see shell documentation.\n");
@@ -762,6 +4261,7 @@ static int cmd_exit(int argc, char **argv) {
 }
 
 static int cmd_cd(int argc, char **argv) {
+    shell_context_t *sh = shell_self();
     const char *dir;
     
     if (argc < 2) {
@@ -773,14 +4273,16 @@ static int cmd_cd(int argc, char **argv) {
         dir = argv[1];
     }
     
-    strncpy(shell_state.cwd, dir, SHELL_MAX_PATH - 1);
-    shell_setenv("PWD", shell_state.cwd);
+    strncpy(sh->state.cwd, dir, SHELL_MAX_PATH - 1);
+    shell_setenv("PWD", sh->state.cwd);
     
     return SHELL_OK;
 }
 
 static int cmd_pwd(int argc, char **argv) {
-    shell_printf("%s\n", shell_state.cwd);
+    shell_context_t *sh = shell_self();
+    
+    shell_printf("%s\n", sh->state.cwd);
     return SHELL_OK;
 }
 
@@ -809,13 +4311,27 @@ static int cmd_echo(int argc, char **argv) {
 }
 
 static int cmd_set(int argc, char **argv) {
-    if (argc < 3) {
-        int i;
-        for (i = 0; i < 64; i++) {
-            if (shell_env[i].defined) {
-                shell_printf("%s=%s\n", shell_env[i].name, shell_env[i].value);
+    shell_context_t *sh = shell_self();
+    const char *p;
+    
+    /* set -e / set +e */
+    if (argc == 2 && (argv[1][0] == '-' || argv[1][0] == '+')) {
+        for (p = argv[1] + 1; *p != '\0'; p++) {
+            if (*p != 'e') {
+                shell_error("set: -%c: invalid option\n", *p);
+                return SHELL_ERROR;
             }
         }
+        if (argv[1][0] == '-') {
+            sh->options |= SHELL_OPT_ERREXIT;
+        } else {
+            sh->options &= ~SHELL_OPT_ERREXIT;
+        }
+        return SHELL_OK;
+    }
+    
+    if (argc < 3) {
+        shell_env_list(false);
         return SHELL_OK;
     }
     
@@ -831,29 +4347,38 @@ static int cmd_unset(int argc, char **argv) {
     return shell_unsetenv(argv[1]);
 }
 
+/* export name[=value]...: set and mark each; none lists the marked */
 static int cmd_export(int argc, char **argv) {
+    int status = SHELL_OK;
+    char *eq;
+    int i;
+    
     if (argc < 2) {
+        shell_env_list(true);
         return SHELL_OK;
     }
     
-    char *eq = strchr(argv[1], '=');
-    if (eq != NULL) {
-        *eq = '\0';
-        shell_setenv(argv[1], eq + 1);
+    for (i = 1; i < argc; i++) {
+        eq = strchr(argv[i], '=');
+        if (eq != NULL) {
+            *eq = '\0';
+            if (shell_setenv(argv[i], eq + 1) != OK) {
+                shell_error("export: %s: cannot set\n", argv[i]);
+                status = SHELL_ERROR;
+                continue;
+            }
+        }
+        if (script_env_export(shell_self()->env, argv[i], true) != OK) {
+            shell_error("export: %s: not set\n", argv[i]);
+            status = SHELL_ERROR;
+        }
     }
     
-    return SHELL_OK;
+    return status;
 }
 
 static int cmd_env(int argc, char **argv) {
-    int i;
-    
-    for (i = 0; i < 64; i++) {
-        if (shell_env[i].defined) {
-            shell_printf("%s=%s\n", shell_env[i].name, shell_env[i].value);
-        }
-    }
-    
+    shell_env_list(true);
     return SHELL_OK;
 }
 
@@ -883,13 +4408,54 @@ static int cmd_unalias(int argc, char **argv) {
     return shell_alias_remove(argv[1]);
 }
 
+/* history [-t] [n], history -c, history -s text, history -p prefix */
 static int cmd_history(int argc, char **argv) {
+    int count = shell_history_count();
+    int first = 0, i, n;
+    bool times = false, prefix;
+    
     if (argc > 1 && strcmp(argv[1], "-c") == 0) {
         shell_history_clear();
         return SHELL_OK;
     }
     
-    shell_history_list();
+    /* Matches newest first, numbered as listed */
+    if (argc > 1 && (strcmp(argv[1], "-s") == 0 ||
+                     strcmp(argv[1], "-p") == 0)) {
+        if (argc != 3) {
+            shell_error("usage: history -s text | -p prefix\n");
+            return SHELL_ERROR;
+        }
+        prefix = argv[1][1] == 'p';
+        i = shell_history_search(argv[2], count, prefix);
+        if (i == SYSERR) {
+            return SHELL_ERROR;
+        }
+        for (; i != SYSERR; i = shell_history_search(argv[2], i, prefix)) {
+            history_show(i, false);
+        }
+        return SHELL_OK;
+    }
+    
+    i = 1;
+    if (i < argc && strcmp(argv[i], "-t") == 0) {
+        times = true;
+        i++;
+    }
+    if (i < argc) {
+        n = atoi(argv[i]);
+        if (n <= 0 || i + 1 < argc) {
+            shell_error("usage: history [-t] [n]\n");
+            return SHELL_ERROR;
+        }
+        if (n < count) {
+            first = count - n;
+        }
+    }
+    
+    for (i = first; i < count; i++) {
+        history_show(i, times);
+    }
     return SHELL_OK;
 }
 
@@ -919,7 +4485,24 @@ static int cmd_ps(int argc, char **argv) {
     return SHELL_OK;
 }
 
+/* A job named as %n, or by its bare number when that is all there is */
+static shell_job_t* shell_job_arg(int argc, char **argv, const char *who) {
+    shell_job_t *job;
+    int id = shell_self()->job_last;
+    
+    if (argc > 1) {
+        id = atoi(argv[1][0] == '%' ? argv[1] + 1 : argv[1]);
+    }
+    
+    job = shell_job_find(id);
+    if (job == NULL) {
+        shell_error("%s: no such job\n", who);
+    }
+    return job;
+}
+
 static int cmd_kill(int argc, char **argv) {
+    shell_job_t *job;
     pid32 pid;
     
     if (argc < 2) {
@@ -927,7 +4510,17 @@ static int cmd_kill(int argc, char **argv) {
         return SHELL_ERROR;
     }
     
+    if (argv[1][0] == '%') {
+        job = shell_job_arg(argc, argv, "kill");
+        return job != NULL && shell_job_kill(job) == OK ?
+               SHELL_OK : SHELL_ERROR;
+    }
+    
     pid = atoi(argv[1]);
+    job = shell_job_find_by_pid(pid);
+    if (job != NULL) {
+        return shell_job_kill(job) == OK ? SHELL_OK : SHELL_ERROR;
+    }
     
     if (kill(pid) == SYSERR) {
         shell_error("kill: failed to kill process %d\n", pid);
@@ -943,36 +4536,24 @@ static int cmd_jobs(int argc, char **argv) {
 }
 
 static int cmd_fg(int argc, char **argv) {
-    int job_id;
+    shell_job_t *job = shell_job_arg(argc, argv, "fg");
+    int status;
     
-    if (argc < 2) {
-        job_id = shell_job_count;
-    } else {
-        job_id = atoi(argv[1]);
-    }
-    
-    shell_job_t *job = shell_job_find(job_id);
     if (job == NULL) {
-        shell_error("fg: no such job\n");
         return SHELL_ERROR;
     }
     
+    shell_printf("%s\n", job->command);
     shell_fg(job->pid);
-    return SHELL_OK;
+    status = job->status;
+    shell_jobs_reap(false);
+    return status;
 }
 
 static int cmd_bg(int argc, char **argv) {
-    int job_id;
-    
-    if (argc < 2) {
-        job_id = shell_job_count;
-    } else {
-        job_id = atoi(argv[1]);
-    }
+    shell_job_t *job = shell_job_arg(argc, argv, "bg");
     
-    shell_job_t *job = shell_job_find(job_id);
     if (job == NULL) {
-        shell_error("bg: no such job\n");
         return SHELL_ERROR;
     }
     
@@ -981,9 +4562,113 @@ static int cmd_bg(int argc, char **argv) {
     return SHELL_OK;
 }
 
+/* Block until the job, or every job, is done; no polling */
+static int cmd_wait(int argc, char **argv) {
+    shell_context_t *sh = shell_self();
+    shell_job_t *job;
+    int status = SHELL_OK;
+    int i;
+    
+    if (argc > 1) {
+        job = shell_job_arg(argc, argv, "wait");
+        if (job == NULL) {
+            return SHELL_NOT_FOUND;
+        }
+        shell_wait_job(job->id);
+        return job->status;
+    }
+    
+    for (i = 1; i <= sh->job_cap; i++) {
+        if ((job = shell_job_find(i)) != NULL) {
+            shell_wait_job(i);
+            status = job->status;
+        }
+    }
+    return status;
+}
+
+/* Bytes behind a table: its arrays, and one block per live entry */
+static uint32_t table_bytes(const shell_table_t *t) {
+    return (uint32_t)t->cap * (sizeof(void*) + sizeof(uint32_t) +
+                               2 * sizeof(int32_t)) +
+           (uint32_t)t->live * t->entry_size;
+}
+
+#ifdef XINU_KERNEL
+/* Walk the kernel free list with interrupts off, as getmem does */
+static void mem_kernel_heap(void) {
+    struct memblk *block;
+    uint32_t free = 0, largest = 0, blocks = 0;
+    uint32_t heap = (uint32_t)((char*)maxheap - (char*)minheap);
+    intmask mask = disable();
+    
+    for (block = memlist.mnext; block != NULL; block = block->mnext) {
+        free += block->mlength;
+        if (block->mlength > largest) {
+            largest = block->mlength;
+        }
+        blocks++;
+    }
+    restore(mask);
+    
+    shell_printf("Kernel heap:\n");
+    shell_printf("  size          %8u bytes\n", heap);
+    shell_printf("  in use        %8u bytes\n", heap - free);
+    shell_printf("  free          %8u bytes in %u blocks, largest %u\n",
+                 free, blocks, largest);
+}
+#endif
+
+/*
+ * What this shell holds, what every interpreter context in the process
+ * holds, and under Xinu the state of the kernel heap.
+ */
 static int cmd_mem(int argc, char **argv) {
-    shell_printf("Memory Statistics:\n");
-    shell_printf("  (memory statistics would go here)\n");
+    shell_context_t *sh = shell_self();
+    uint32_t bytes, mapped, jobs, buffers = 0;
+    int32_t contexts, vars;
+    
+    jobs = (uint32_t)sh->job_cap * sizeof(shell_slot_t*) +
+           (uint32_t)sh->job_count * sizeof(shell_slot_t);
+    if (sh->outbuf != NULL) {
+        buffers += SHELL_OUT_BUFFER;
+    }
+    if (sh->out_file != NULL) {
+        buffers += sizeof(shell_sink_t);
+    }
+    
+    shell_printf("Shell:\n");
+    shell_printf("  context       %8u bytes\n",
+                 (uint32_t)sizeof(shell_context_t));
+    hist_stats(sh->history, &bytes, &mapped);
+    shell_printf("  history       %8u bytes, %d entries",
+                 bytes, shell_history_count());
+    if (mapped > 0) {
+        shell_printf(", %u of log mapped", mapped);
+    }
+    shell_printf("\n");
+    shell_printf("  commands      %8u bytes, %d\n",
+                 table_bytes(&sh->commands), sh->commands.live);
+    shell_printf("  aliases       %8u bytes, %d\n",
+                 table_bytes(&sh->aliases), sh->aliases.live);
+    script_env_stats(sh->env, &vars, &bytes);
+    shell_printf("  variables     %8u bytes, %d\n", bytes, vars);
+    shell_printf("  jobs          %8u bytes, %d\n", jobs, sh->job_count);
+    shell_printf("  buffers       %8u bytes\n", buffers);
+    
+    script_mem_totals(&contexts, &bytes);
+    shell_printf("Interpreter:\n");
+    shell_printf("  contexts      %8d\n", contexts);
+    shell_printf("  held          %8u bytes", bytes);
+    if (contexts > 0) {
+        shell_printf(", %u per context", bytes / (uint32_t)contexts);
+    }
+    shell_printf("\n");
+    
+#ifdef XINU_KERNEL
+    mem_kernel_heap();
+#endif
+    
     return SHELL_OK;
 }
 
@@ -1001,29 +4686,24 @@ static int cmd_sleep(int argc, char **argv) {
     }
     
     seconds = atoi(argv[1]);
-    sleep(seconds * 1000);
+    shell_pause(seconds * 1000);
     
     return SHELL_OK;
 }
 
+/* Reached when time is not first in a pipeline; times just its command */
 static int cmd_time(int argc, char **argv) {
-    if (argc < 2) {
-        shell_error("time: missing command\n");
-        return SHELL_ERROR;
-    }
-    
-    char cmd_line[SHELL_MAX_LINE] = "";
+    shell_token_t tokens[SHELL_MAX_ARGS];
     int i;
+    
     for (i = 1; i < argc; i++) {
-        if (i > 1) strcat(cmd_line, " ");
-        strcat(cmd_line, argv[i]);
+        tokens[i - 1].type = TOK_WORD;
+        tokens[i - 1].value = argv[i];
+        tokens[i - 1].length = (int)strlen(argv[i]);
+        tokens[i - 1].position = 0;
     }
     
-    int result = shell_execute(cmd_line);
-    
-    shell_printf("\n(time statistics would go here)\n");
-    
-    return result;
+    return shell_time_tokens(tokens, argc - 1);
 }
 
 static int cmd_true(int argc, char **argv) {
@@ -1081,3 +4761,183 @@ static int cmd_test(int argc, char **argv) {
     
     return SHELL_ERROR;
 }
+
+static int cmd_cat(int argc, char **argv) {
+    char buf[SHELL_IO_CHUNK];
+    file_handle_t file;
+    int status = SHELL_OK;
+    int32_t n;
+    int i;
+    
+    if (argc < 2) {
+        while ((n = shell_read(buf, sizeof(buf))) > 0) {
+            shell_write(buf, n);
+        }
+        return SHELL_OK;
+    }
+    
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-") == 0) {
+            while ((n = shell_read(buf, sizeof(buf))) > 0) {
+                shell_write(buf, n);
+            }
+            continue;
+        }
+        
+        file = file_open(argv[i]);
+        if (file == FILE_INVALID) {
+            shell_error("cat: %s: cannot open\n", argv[i]);
+            status = SHELL_ERROR;
+            continue;
+        }
+        while ((n = file_read(file, buf, sizeof(buf))) > 0) {
+            shell_write(buf, n);
+        }
+        file_close(file);
+    }
+    
+    return status;
+}
+
+static int cmd_grep(int argc, char **argv) {
+    script_regex_t *re;
+    char buf[SHELL_IO_CHUNK];
+    char *line = NULL;
+    char *grown;
+    uint32_t len = 0, cap = 0, size, need, matches = 0;
+    bool invert = false, count = false;
+    bool more = true;
+    int32_t n = 0, pos = 0;
+    char *nl;
+    int i = 1;
+    
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        if (strcmp(argv[i], "-v") == 0) {
+            invert = true;
+        } else if (strcmp(argv[i], "-c") == 0) {
+            count = true;
+        } else {
+            break;
+        }
+    }
+    if (i != argc - 1) {
+        shell_error("usage: grep [-v] [-c] pattern\n");
+        return 2;
+    }
+    
+    re = expr_regex_compile(argv[i]);
+    if (re == NULL) {
+        shell_error("grep: %s: bad pattern\n", argv[i]);
+        return 2;
+    }
+    
+    /* Gather each line, then match it; a last line may lack its newline */
+    while (more) {
+        if (pos == n) {
+            n = shell_read(buf, sizeof(buf));
+            pos = 0;
+            if (n <= 0) {
+                more = false;
+                n = 0;
+                if (len == 0) {
+                    break;
+                }
+            }
+        }
+        
+        nl = more ? (char*)memchr(buf + pos, '\n', n - pos) : NULL;
+        need = (nl != NULL ? (uint32_t)(nl - buf) + 1 : (uint32_t)n) - pos;
+        if (len + need + 1 > cap) {
+            size = cap > 0 ? cap : SHELL_MAX_LINE;
+            while (len + need + 1 > size) {
+                size *= 2;
+            }
+            grown = (char*)getmem(size);
+            if (grown == NULL) {
+                shell_error("grep: out of memory\n");
+                break;
+            }
+            if (line != NULL) {
+                memcpy(grown, line, len);
+                freemem(line, cap);
+            }
+            line = grown;
+            cap = size;
+        }
+        memcpy(line + len, buf + pos, need);
+        len += need;
+        pos += need;
+        if (nl == NULL && more) {
+            continue;
+        }
+        
+        if (len > 0 && line[len - 1] == '\n') {
+            len--;
+        }
+        if (expr_regex_search(re, line, len) != invert) {
+            matches++;
+            if (!count) {
+                line[len++] = '\n';
+                shell_write(line, len);
+            }
+        }
+        len = 0;
+    }
+    
+    if (line != NULL) {
+        freemem(line, cap);
+    }
+    expr_regex_free(re);
+    
+    if (count) {
+        shell_printf("%u\n", matches);
+    }
+    return matches > 0 ? SHELL_OK : SHELL_ERROR;
+}
+
+static int cmd_wc(int argc, char **argv) {
+    char buf[SHELL_IO_CHUNK];
+    uint32_t lines = 0, words = 0, bytes = 0;
+    bool in_word = false;
+    bool show_lines = false, show_words = false, show_bytes = false;
+    int32_t n, j;
+    int i;
+    
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-l") == 0) {
+            show_lines = true;
+        } else if (strcmp(argv[i], "-w") == 0) {
+            show_words = true;
+        } else if (strcmp(argv[i], "-c") == 0) {
+            show_bytes = true;
+        } else {
+            shell_error("usage: wc [-l] [-w] [-c]\n");
+            return SHELL_ERROR;
+        }
+    }
+    if (!show_lines && !show_words && !show_bytes) {
+        show_lines = show_words = show_bytes = true;
+    }
+    
+    while ((n = shell_read(buf, sizeof(buf))) > 0) {
+        bytes += n;
+        for (j = 0; j < n; j++) {
+            if (buf[j] == '\n') {
+                lines++;
+            }
+            if (isspace((unsigned char)buf[j])) {
+                in_word = false;
+            } else if (!in_word) {
+                in_word = true;
+                words++;
+            }
+        }
+    }
+    
+    if (show_lines) shell_printf("%7u", lines);
+    if (show_words) shell_printf("%s%7u", show_lines ? " " : "", words);
+    if (show_bytes) shell_printf("%s%7u", show_lines || show_words ? " " : "", bytes);
+    shell_printf("\n");
+    
+    return SHELL_OK;
+}
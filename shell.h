@@ -5,6 +5,8 @@
 
 /* Shell Configuration */
 
+#define SHELL_MAX_TOKENS    (SHELL_MAX_LINE / 2 + 1)   /* Worst case: one-byte words */
+
 /* Shell options */
 #define SHELL_OPT_ECHO      0x01    /* Echo commands */
 #define SHELL_OPT_VERBOSE   0x02    /* Verbose output */
@@ -34,8 +36,9 @@ typedef enum {
 
 typedef struct shell_token {
     shell_token_type_t  type;
-    char                value[SHELL_MAX_LINE];
-    int                 position;
+    char                *value;     /* TOK_WORD text, unquoted in the line */
+    int                 length;     /* Length of value */
+    int                 position;   /* Offset of the token in the line */
 } shell_token_t;
 
 /* Command Pipeline */
@@ -47,6 +50,7 @@ typedef struct shell_pipeline {
     char    *output_file;   /* Output redirection file */
     bool    append_output;  /* Append to output file */
     bool    background;     /* Run in background */
+    uint32_t size;          /* Bytes held by commands */
 } shell_pipeline_t;
 
 /* Job State */
@@ -65,6 +69,7 @@ typedef struct shell_job {
     pid32       pid;            /* Process ID */
     pid32       pgid;           /* Process group ID */
     job_state_t state;          /* Job state */
+    int         status;         /* Exit status once done */
     char        command[SHELL_MAX_LINE];  /* Command string */
     bool        foreground;     /* Foreground job */
 } shell_job_t;
@@ -73,13 +78,17 @@ typedef struct shell_job {
 extern void shell_start(void);
 extern void shell_process(void);
 extern int shell_batch(const char *filename);
+extern void shell_flush(void);
+extern uint32_t shell_get_options(void);
+extern void shell_set_options(uint32_t options);
 
 /* Command Processing */
 extern char* shell_readline(char *buffer, int size);
-extern int shell_tokenize(const char *line, shell_token_t *tokens, int max_tokens);
+extern int shell_tokenize(char *line, shell_token_t *tokens, int max_tokens);
 extern int shell_expand(const char *input, char *output, int size);
 extern int shell_parse_pipeline(const char *line, shell_pipeline_t *pipeline);
 extern int shell_execute_pipeline(shell_pipeline_t *pipeline);
+extern void shell_free_pipeline(shell_pipeline_t *pipeline);
 
 /* Built-in Command Registration */
 extern void shell_builtin_init(void);
@@ -91,5 +100,6 @@ extern void shell_job_update(int id, job_state_t state);
 extern shell_job_t* shell_job_find(int id);
 extern shell_job_t* shell_job_find_by_pid(pid32 pid);
 extern int shell_wait_job(int id);
+extern void shell_jobs_reap(bool report);
 
 #endif
@@ -0,0 +1,29 @@
+/* set -e in a script does not outlast it */
+#include "shell.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char *script = "build/test_batch_options.sh";
+
+int main(void) {
+    uint32_t options;
+    FILE *f;
+    
+    f = fopen(script, "w");
+    assert(f != NULL);
+    fputs("set -e\ntrue\n", f);
+    fclose(f);
+    
+    shell_init();
+    options = shell_get_options();
+    shell_batch(script);
+    assert(shell_get_options() == options);
+    
+    /* A failing command after it leaves the shell running */
+    shell_execute("false; set AFTER 1");
+    assert(shell_getenv("AFTER") != NULL);
+    
+    printf("test_batch_options ok\n");
+    return 0;
+}
@@ -0,0 +1,75 @@
+/* A compiled image whose string lost its NUL is rejected, not run */
+#include "interpreter.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SCRIPT  "build/test_cache_corrupt.scr"
+#define IMAGE   SCRIPT SCRIPT_CACHE_SUFFIX
+
+static long image_read(char *buf, long size) {
+    FILE *f = fopen(IMAGE, "rb");
+    long n;
+    
+    assert(f != NULL);
+    n = (long)fread(buf, 1, size, f);
+    fclose(f);
+    return n;
+}
+
+static void image_write(const char *buf, long n) {
+    FILE *f = fopen(IMAGE, "wb");
+    
+    assert(f != NULL && (long)fwrite(buf, 1, n, f) == n);
+    fclose(f);
+}
+
+/* Offset of the NUL after the literal, which must appear once */
+static long literal_end(const char *buf, long n) {
+    const char *lit = "corrupt-me";
+    long i, at = -1;
+    
+    for (i = 0; i + 11 <= n; i++) {
+        if (memcmp(buf + i, lit, 11) == 0) {
+            assert(at < 0);
+            at = i + 10;
+        }
+    }
+    assert(at >= 0);
+    return at;
+}
+
+int main(void) {
+    static char buf[65536];
+    script_context_t *c;
+    FILE *f;
+    long n, end;
+    
+    f = fopen(SCRIPT, "w");
+    assert(f != NULL);
+    fputs("y = \"corrupt-me\" == \"x\"\nreturn 3\n", f);
+    fclose(f);
+    remove(IMAGE);
+    
+    script_cache_set_flags(SCRIPT_CACHE_DISK);
+    c = script_create_context();
+    assert(script_execute_file(c, SCRIPT) == 3);
+    
+    /* Run the string into whatever follows it */
+    n = image_read(buf, sizeof(buf));
+    end = literal_end(buf, n);
+    buf[end] = 'X';
+    image_write(buf, n);
+    
+    /* The image fails the check, so the script is compiled again */
+    assert(script_execute_file(c, SCRIPT) == 3);
+    assert(image_read(buf, sizeof(buf)) == n);
+    assert(buf[literal_end(buf, n)] == '\0');
+    
+    script_destroy_context(c);
+    remove(IMAGE);
+    remove(SCRIPT);
+    printf("test_cache_corrupt ok\n");
+    return 0;
+}
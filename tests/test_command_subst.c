@@ -0,0 +1,50 @@
+/* $( ) runs in a subshell and its output is split into words */
+#include "shell.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+static char args[8][64];
+static int nargs;
+
+static int cmd_args(int argc, char **argv) {
+    int i;
+    
+    nargs = argc - 1;
+    for (i = 1; i < argc && i <= 8; i++) {
+        snprintf(args[i - 1], sizeof(args[0]), "%s", argv[i]);
+    }
+    return SHELL_OK;
+}
+
+int main(void) {
+    shell_init();
+    shell_register_command("args", "Record its arguments", cmd_args);
+    
+    /* What the command changes stays in the subshell */
+    assert(shell_execute("args $(set LEAK 1)") == SHELL_OK);
+    assert(shell_getenv("LEAK") == NULL);
+    assert(shell_execute("args $(exit 3); args after") == SHELL_OK);
+    assert(nargs == 1 && strcmp(args[0], "after") == 0);
+    
+    /* Newlines split fields instead of ending the line */
+    assert(shell_execute("args [$(echo a; echo b)]") == SHELL_OK);
+    assert(nargs == 2);
+    assert(strcmp(args[0], "[a") == 0 && strcmp(args[1], "b]") == 0);
+    assert(shell_execute("args \"$(echo a; echo b)\"") == SHELL_OK);
+    assert(nargs == 1 && strcmp(args[0], "a\nb") == 0);
+    
+    /* Output is never syntax either */
+    assert(shell_execute("args $(echo \"x;args y\")") == SHELL_OK);
+    assert(nargs == 2 && strcmp(args[0], "x;args") == 0);
+    assert(shell_execute("args $(echo \"it's\")") == SHELL_OK);
+    assert(nargs == 1 && strcmp(args[0], "it's") == 0);
+    
+    /* Nested, and still seeing the shell's variables */
+    shell_setenv("V", "v");
+    assert(shell_execute("args $(echo $(echo $V)1)") == SHELL_OK);
+    assert(nargs == 1 && strcmp(args[0], "v1") == 0);
+    
+    printf("test_command_subst ok\n");
+    return 0;
+}
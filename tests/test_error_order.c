@@ -0,0 +1,50 @@
+/* In a batch, diagnostics come out after the output that came before */
+#define _POSIX_C_SOURCE 200809L
+#include "shell.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char *script = "build/test_error_order.sh";
+static const char *out = "build/test_error_order.txt";
+
+int main(void) {
+    char buf[128] = { 0 };
+    int fd, saved_out, saved_err;
+    FILE *f;
+    
+    f = fopen(script, "w");
+    assert(f != NULL);
+    fputs("echo one\nnocmd\necho two\n", f);
+    fclose(f);
+    
+    /* Both streams to one file, as with 2>&1 under a calling shell */
+    fflush(stdout);
+    fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    saved_out = dup(1);
+    saved_err = dup(2);
+    dup2(fd, 1);
+    dup2(fd, 2);
+    close(fd);
+    
+    shell_init();
+    shell_batch(script);
+    shell_flush();
+    
+    dup2(saved_out, 1);
+    dup2(saved_err, 2);
+    close(saved_out);
+    close(saved_err);
+    
+    f = fopen(out, "r");
+    assert(f != NULL);
+    fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    assert(strcmp(buf, "one\nnocmd: command not found\ntwo\n") == 0);
+    
+    printf("test_error_order ok\n");
+    return 0;
+}
@@ -0,0 +1,94 @@
+/* What a variable holds is word text after expansion, never syntax */
+#include "shell.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+static char args[8][64];
+static int nargs, runs;
+
+static int cmd_args(int argc, char **argv) {
+    int i;
+    
+    runs++;
+    nargs = argc - 1;
+    for (i = 1; i < argc && i <= 8; i++) {
+        snprintf(args[i - 1], sizeof(args[0]), "%s", argv[i]);
+    }
+    return SHELL_OK;
+}
+
+/* Words lose their quotes and backslashes; operators are typed */
+static void check_tokenize(void) {
+    shell_token_t tokens[16];
+    char line[] = "a 'b c'\\ d\\;e|f 2> g && h # i";
+    int count = shell_tokenize(line, tokens, 16);
+    
+    assert(count == 9);
+    assert(tokens[0].type == TOK_WORD && strcmp(tokens[0].value, "a") == 0);
+    assert(tokens[1].type == TOK_WORD &&
+           strcmp(tokens[1].value, "b c d;e") == 0);
+    assert(tokens[2].type == TOK_PIPE);
+    assert(tokens[3].type == TOK_WORD && strcmp(tokens[3].value, "f") == 0);
+    assert(tokens[4].type == TOK_REDIR_ERR);
+    assert(tokens[5].type == TOK_WORD && strcmp(tokens[5].value, "g") == 0);
+    assert(tokens[6].type == TOK_AND);
+    assert(tokens[7].type == TOK_WORD && strcmp(tokens[7].value, "h") == 0);
+    assert(tokens[8].type == TOK_EOF);
+}
+
+int main(void) {
+    char out[128];
+    FILE *f;
+    
+    check_tokenize();
+    shell_init();
+    shell_register_command("args", "Record its arguments", cmd_args);
+    
+    /* Operators and # in a value stay in the word */
+    shell_setenv("Y", "a;args INJECT");
+    assert(shell_execute("args $Y") == SHELL_OK);
+    assert(runs == 1 && nargs == 2);
+    assert(strcmp(args[0], "a;args") == 0 && strcmp(args[1], "INJECT") == 0);
+    
+    shell_setenv("R", "x>build/test_expand_quote.b");
+    assert(shell_execute("args $R") == SHELL_OK);
+    assert(nargs == 1 && strcmp(args[0], "x>build/test_expand_quote.b") == 0);
+    f = fopen("build/test_expand_quote.b", "r");
+    assert(f == NULL);
+    
+    shell_setenv("H", "a|b&&c #d");
+    assert(shell_execute("args \"$H\" ${H}") == SHELL_OK);
+    assert(runs == 3 && nargs == 3);
+    assert(strcmp(args[0], "a|b&&c #d") == 0);
+    assert(strcmp(args[1], "a|b&&c") == 0 && strcmp(args[2], "#d") == 0);
+    
+    /* Quotes and backslashes in a value are not quoting */
+    shell_setenv("Q", "it's");
+    assert(shell_execute("args $Q \"$Q\"") == SHELL_OK);
+    assert(nargs == 2);
+    assert(strcmp(args[0], "it's") == 0 && strcmp(args[1], "it's") == 0);
+    shell_setenv("B", "a\\b \"c\"");
+    assert(shell_execute("args $B") == SHELL_OK);
+    assert(nargs == 2);
+    assert(strcmp(args[0], "a\\b") == 0 && strcmp(args[1], "\"c\"") == 0);
+    
+    /* Unquoted, blanks split fields; quoted, the value is one word */
+    shell_setenv("W", "one  two\tthree");
+    assert(shell_execute("args $W") == SHELL_OK);
+    assert(nargs == 3 && strcmp(args[2], "three") == 0);
+    assert(shell_execute("args \"$W\"") == SHELL_OK);
+    assert(nargs == 1 && strcmp(args[0], "one  two\tthree") == 0);
+    
+    /* ${name=word} sets the word as the tokenizer would read it */
+    assert(shell_execute("args ${NEW=\"p q\"}") == SHELL_OK);
+    assert(strcmp(shell_getenv("NEW"), "p q") == 0);
+    assert(nargs == 2);
+    
+    /* The expansion is ready for the tokenizer */
+    assert(shell_expand("$Y", out, sizeof(out)) > 0);
+    assert(strcmp(out, "a\\;args INJECT") == 0);
+    
+    printf("test_expand_quote ok\n");
+    return 0;
+}
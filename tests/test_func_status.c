@@ -0,0 +1,25 @@
+/* A function called inside an expression leaves the script's status */
+#include "interpreter.h"
+#include <assert.h>
+#include <stdio.h>
+
+int main(void) {
+    script_context_t *c = script_create_context();
+    
+    assert(c != NULL);
+    assert(script_define_func(c, "sq", "return $arg0 * $arg0", 1) == OK);
+    
+    assert(script_execute(c, "y = sq(7)") == 0);
+    assert(script_eval_int(c, "$y") == 49);
+    assert(script_execute(c, "if sq(3) > 1\n z = 1\nend") == 0);
+    assert(script_eval_int(c, "$z") == 1);
+    assert(script_execute(c, "y = sq(2)\nreturn $y + 1") == 5);
+    assert(script_execute(c, "return sq(3)") == 9);
+    
+    /* A direct call still reports what the function returned */
+    assert(script_call_func(c, "sq", 1, (char*[]){ "6" }) == 36);
+    
+    script_destroy_context(c);
+    printf("test_func_status ok\n");
+    return 0;
+}
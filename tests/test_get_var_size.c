@@ -0,0 +1,54 @@
+/* Values copied out are cut to the caller's buffer */
+#include "interpreter.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+int main(void) {
+    script_context_t *c = script_create_context();
+    script_env_t *env = script_env_create();
+    char big[601], out[SCRIPT_VAR_VAL_LEN];
+    var_type_t type;
+    int32_t n = 0;
+    
+    assert(c != NULL && env != NULL);
+    memset(big, 'x', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+    
+    /* A long string is cut, and the return says how much it needs */
+    assert(script_set_var(c, "s", VAR_TYPE_STRING, big) == OK);
+    assert(script_get_var(c, "s", &type, out, sizeof(out)) == 601);
+    assert(type == VAR_TYPE_STRING && strlen(out) == sizeof(out) - 1);
+    assert(script_get_var(c, "s", NULL, NULL, 0) == 601);
+    assert(strcmp(script_get_str(c, "s"), big) == 0);
+    
+    assert(script_set_var(c, "t", VAR_TYPE_STRING, "short") == OK);
+    assert(script_get_var(c, "t", &type, out, sizeof(out)) == 6);
+    assert(strcmp(out, "short") == 0);
+    
+    assert(script_execute(c, "i = 41 + 1") == 0);
+    assert(script_get_var(c, "i", &type, &n, sizeof(n)) == sizeof(n));
+    assert(type == VAR_TYPE_INT && n == 42);
+    assert(script_get_var(c, "nope", &type, out, sizeof(out)) == SYSERR);
+    
+    /* Shared variables, and array and map elements, alike */
+    assert(script_env_set(env, "E", big) == OK);
+    assert(script_env_export(env, "E", true) == OK);
+    script_attach_env(c, env);
+    assert(script_get_var(c, "E", &type, out, sizeof(out)) == 601);
+    assert(strlen(out) == sizeof(out) - 1);
+    
+    assert(script_array_create(c, "a", false) == OK);
+    assert(script_array_set(c, "a", 0, VAR_TYPE_STRING, big) == OK);
+    assert(script_array_get(c, "a", 0, &type, out, 8) == 601);
+    assert(strcmp(out, "xxxxxxx") == 0);
+    assert(script_array_create(c, "m", true) == OK);
+    assert(script_map_set(c, "m", "k", VAR_TYPE_STRING, big) == OK);
+    assert(script_map_get(c, "m", "k", &type, out, sizeof(out)) == 601);
+    assert(strlen(out) == sizeof(out) - 1);
+    
+    script_destroy_context(c);
+    script_env_destroy(env);
+    printf("test_get_var_size ok\n");
+    return 0;
+}
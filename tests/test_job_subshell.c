@@ -0,0 +1,58 @@
+/*
+ * Background jobs run in a copy of the shell, so the shell can go on
+ * changing its tables while they run. Also meant to be run built with
+ * -fsanitize=thread.
+ */
+#include "shell.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char *script = "build/test_job_subshell.sh";
+static const char *out = "build/test_job_subshell.txt";
+
+int main(void) {
+    char name[16], buf[16] = { 0 };
+    FILE *f;
+    int i;
+    
+    f = fopen(script, "w");
+    assert(f != NULL);
+    
+    /* The job sees X as it was when it started, and keeps what it sets */
+    fprintf(f, "set X 1\necho $X > %s && set Y 2 &\nset X 2\nwait\n", out);
+    
+    /* Jobs and the shell writing their tables at once, past a rehash */
+    for (i = 0; i < 8; i++) {
+        fprintf(f, "set J%d 1 && alias j%d echo && unset X && "
+                   "echo $X > /dev/null &\n", i, i);
+    }
+    for (i = 0; i < 200; i++) {
+        fprintf(f, "set V%d %d\nalias v%d echo\n", i, i, i);
+    }
+    fprintf(f, "wait\n");
+    fclose(f);
+    
+    shell_init();
+    shell_batch(script);
+    
+    assert(shell_getenv("Y") == NULL);
+    f = fopen(out, "r");
+    assert(f != NULL);
+    fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    assert(strcmp(buf, "1\n") == 0);
+    
+    for (i = 0; i < 8; i++) {
+        snprintf(name, sizeof(name), "J%d", i);
+        assert(shell_getenv(name) == NULL);
+        snprintf(name, sizeof(name), "j%d", i);
+        assert(shell_alias_get(name) == NULL);
+    }
+    assert(strcmp(shell_getenv("X"), "2") == 0);
+    assert(strcmp(shell_getenv("V199"), "199") == 0);
+    assert(strcmp(shell_alias_get("v199"), "echo") == 0);
+    
+    printf("test_job_subshell ok\n");
+    return 0;
+}
@@ -0,0 +1,41 @@
+/* A command that is not found reports it where its stage sent stderr */
+#include "shell.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+static void expect(const char *name, const char *text) {
+    char buf[128] = { 0 };
+    FILE *f = fopen(name, "r");
+    
+    assert(f != NULL);
+    fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    assert(strcmp(buf, text) == 0);
+}
+
+int main(void) {
+    shell_init();
+    
+    assert(shell_execute("nocmd 2> build/test_not_found_redir.err") != 0);
+    expect("build/test_not_found_redir.err", "nocmd: command not found\n");
+    
+    assert(shell_execute("nocmd a > build/test_not_found_redir.out 2>&1") != 0);
+    expect("build/test_not_found_redir.out", "nocmd: command not found\n");
+    
+    assert(shell_execute("echo hi | nocmd 2> build/test_not_found_redir.err")
+           != 0);
+    expect("build/test_not_found_redir.err", "nocmd: command not found\n");
+    
+    /* The rest of the pipeline still runs, and 2>&1 feeds the pipe */
+    assert(shell_execute("nocmd 2>&1 | cat > build/test_not_found_redir.out")
+           == SHELL_OK);
+    expect("build/test_not_found_redir.out", "nocmd: command not found\n");
+    assert(shell_execute("echo hi > build/test_not_found_redir.out | "
+                         "nocmd 2> build/test_not_found_redir.err")
+           == SHELL_NOT_FOUND);
+    expect("build/test_not_found_redir.out", "hi\n");
+    
+    printf("test_not_found_redir ok\n");
+    return 0;
+}
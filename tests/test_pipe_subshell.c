@@ -0,0 +1,38 @@
+/* Each pipeline stage but the last runs in its own copy of the shell */
+#include "shell.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char *out = "build/test_pipe_subshell.txt";
+
+static void expect(const char *text) {
+    char buf[64] = { 0 };
+    FILE *f = fopen(out, "r");
+    
+    assert(f != NULL);
+    fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    assert(strcmp(buf, text) == 0);
+}
+
+int main(void) {
+    shell_init();
+    
+    shell_execute("set A 1 | set B 1 | set C 1");
+    assert(shell_getenv("A") == NULL);
+    assert(shell_getenv("B") == NULL);
+    assert(strcmp(shell_getenv("C"), "1") == 0);
+    
+    /* A stage sees what was there when it started, and changes only its copy */
+    shell_execute("alias say echo");
+    shell_execute("unset C | alias say pwd | set D 2");
+    assert(strcmp(shell_getenv("C"), "1") == 0);
+    assert(strcmp(shell_getenv("D"), "2") == 0);
+    assert(strcmp(shell_alias_get("say"), "echo") == 0);
+    assert(shell_execute("echo $C $D | cat > build/test_pipe_subshell.txt") == 0);
+    expect("1 2\n");
+    
+    printf("test_pipe_subshell ok\n");
+    return 0;
+}
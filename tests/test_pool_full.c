@@ -0,0 +1,39 @@
+/* Submits past a full queue wait for room rather than fail */
+#include "interpreter.h"
+#include <assert.h>
+#include <stdio.h>
+
+#define JOBS    (SCRIPT_POOL_QUEUE * 3)
+
+static int prelude(script_context_t *ctx, void *arg) {
+    return script_define_func(ctx, "dbl", "return $arg0 * 2", 1);
+}
+
+int main(void) {
+    static script_future_t *futures[JOBS];
+    script_pool_t *pool = script_pool_create(1, prelude, NULL);
+    char script[32], arg[16];
+    char *argv[1] = { arg };
+    int i;
+    
+    assert(pool != NULL);
+    for (i = 0; i < JOBS; i++) {
+        if (i % 2 == 0) {
+            snprintf(script, sizeof(script), "return %d + 1", i);
+            futures[i] = script_pool_submit(pool, script);
+        } else {
+            snprintf(arg, sizeof(arg), "%d", i);
+            futures[i] = script_pool_call(pool, "dbl", 1, argv);
+        }
+        assert(futures[i] != NULL);
+    }
+    
+    for (i = 0; i < JOBS; i++) {
+        assert(script_future_wait(futures[i]) == (i % 2 == 0 ? i + 1 : i * 2));
+        script_future_free(futures[i]);
+    }
+    script_pool_destroy(pool);
+    
+    printf("test_pool_full ok\n");
+    return 0;
+}
@@ -0,0 +1,21 @@
+/* A ? after a quantifier marks it lazy; it does not make it optional */
+#include "interpreter.h"
+#include <assert.h>
+#include <stdio.h>
+
+int main(void) {
+    assert(expr_match_regex("^c{2}?$", "cc"));
+    assert(!expr_match_regex("^c{2}?$", ""));
+    assert(!expr_match_regex("c{2}?", "xyz"));
+    assert(expr_match_regex("^c{1,}?d$", "cccd"));
+    assert(expr_match_regex("^a+?b$", "aab"));
+    assert(!expr_match_regex("^a+?b$", "b"));
+    assert(expr_match_regex("^a*?b$", "b"));
+    assert(expr_match_regex("^xa??b$", "xb") && expr_match_regex("^xa??b$", "xab"));
+    assert(!expr_match_regex("^xa??b$", "xaab"));
+    
+    /* A ? that follows an atom is still the optional quantifier */
+    assert(expr_match_regex("^ab?$", "a"));
+    printf("test_regex_lazy ok\n");
+    return 0;
+}
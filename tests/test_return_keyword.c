@@ -0,0 +1,18 @@
+/* return is a keyword only as a whole word */
+#include "interpreter.h"
+#include <assert.h>
+#include <stdio.h>
+
+int main(void) {
+    script_context_t *c = script_create_context();
+    
+    assert(c != NULL);
+    assert(script_execute(c, "returned = 4\nreturn $returned + 1") == 5);
+    assert(script_eval_int(c, "$returned") == 4);
+    assert(script_execute(c, "return_code = 2\nreturn\t$return_code") == 2);
+    assert(script_execute(c, "return 7") == 7);
+    
+    script_destroy_context(c);
+    printf("test_return_keyword ok\n");
+    return 0;
+}